@@ -672,6 +672,19 @@ typedef int sasl_canon_user_t(sasl_conn_t *conn,
  */  
 LIBSASL_API int sasl_set_path (int path_type, char * path);
 
+/* resolve the local host name again.  Server connections created without
+ * a serverFQDN, and all client connections, use the name resolved by
+ * sasl_server_init (or by the first connection), which is only looked up
+ * again once it gets older than the fqdn_cache_ttl option (seconds,
+ * default 3600, 0 means never) or when this function is called.
+ *
+ * returns:
+ *  SASL_OK      -- success
+ *  SASL_NOTINIT -- sasl_server_init/sasl_client_init not called
+ *  SASL_FAIL    -- no name found, the previous one is kept
+ */
+LIBSASL_API int sasl_refresh_fqdn(void);
+
 /* get sasl library version information
  * implementation is a vendor-defined string
  * version is a vender-defined representation of the version #.
@@ -1299,6 +1312,23 @@ LIBSASL_API int sasl_encodev(sasl_conn_t *conn,
 			     const struct iovec *invec, unsigned numiov,
 			     const char **output, unsigned *outputlen);
 
+/* encode a block of data for transmission using security layer,
+ *  returning one iovec per SASL packet instead of a single buffer, so
+ *  they can be passed to writev() without being concatenated first.
+ *  Without a security layer the output points to the input data.
+ *  output is only valid until next call to sasl_encode, sasl_encodev
+ *  or sasl_encodev_iov
+ * returns:
+ *  SASL_OK      -- success
+ *  SASL_NOTDONE -- security layer negotiation not finished
+ *  SASL_BADPARAM -- bad parameter
+ *  SASL_NOMEM   -- out of memory
+ */
+LIBSASL_API int sasl_encodev_iov(sasl_conn_t *conn,
+				 const struct iovec *invec, unsigned numiov,
+				 const struct iovec **output,
+				 unsigned *outputnum);
+
 /* decode a block of data received using security layer
  *  returning the input buffer if there is no security layer.
  *  output is only valid until next call to sasl_decode
@@ -197,7 +197,13 @@ typedef struct sasl_out_params {
     const void *gss_peer_name;
     const void *gss_local_name;
     const char *cbindingname;   /* channel binding name from packet */
-    int (*spare_fptr1)(void);
+    /* optional; like encode, but writes the packet into a buffer owned
+     * by the caller (*buf of *buflen bytes), growing it with
+     * utils->realloc if needed, so that no output buffer of the
+     * plugin is reused across packets */
+    int (*encode_packet)(void *context, const struct iovec *invec,
+			 unsigned numiov, char **buf, unsigned *buflen,
+			 unsigned *outputlen);
     int (*spare_fptr2)(void);
     unsigned int cbindingdisp;  /* channel binding disposition from client */
     int spare_int2;
@@ -111,13 +111,11 @@ static struct proppool *resize_proppool(struct proppool *pool, size_t size)
     return ret;
 }
 
-static int prop_init(struct propctx *ctx, unsigned estimate) 
+/* lay out an empty context in its (first and only) pool */
+static void prop_layout(struct propctx *ctx)
 {
     const unsigned VALUES_SIZE = PROP_DEFAULT * sizeof(struct propval);
 
-    ctx->mem_base = alloc_proppool(VALUES_SIZE + estimate);
-    if(!ctx->mem_base) return SASL_NOMEM;
-
     ctx->mem_cur = ctx->mem_base;
 
     ctx->values = (struct propval *)ctx->mem_base->data;
@@ -129,10 +127,38 @@ static int prop_init(struct propctx *ctx, unsigned estimate)
     ctx->list_end = (char **)(ctx->mem_base->data + VALUES_SIZE);
 
     ctx->prev_val = NULL;
+}
+
+static int prop_init(struct propctx *ctx, unsigned estimate) 
+{
+    const unsigned VALUES_SIZE = PROP_DEFAULT * sizeof(struct propval);
+
+    ctx->mem_base = alloc_proppool(VALUES_SIZE + estimate);
+    if(!ctx->mem_base) return SASL_NOMEM;
+
+    prop_layout(ctx);
 
     return SASL_OK;
 }
 
+/* empty a context for a new connection (unlike prop_clear, this keeps
+ * the first pool rather than allocating a bigger one) */
+void _sasl_prop_reset(struct propctx *ctx)
+{
+    struct proppool *tmp;
+
+    if(!ctx) return;
+
+    while(ctx->mem_base->next) {
+	tmp = ctx->mem_base->next;
+	ctx->mem_base->next = tmp->next;
+	sasl_FREE(tmp);
+    }
+
+    memset(ctx->mem_base->data, 0, ctx->mem_base->size);
+    prop_layout(ctx);
+}
+
 /* create a property context
  *  estimate -- an estimate of the storage needed for requests & responses
  *              0 will use module default
@@ -90,6 +90,7 @@
 # include <sys/types.h>
 # include <sys/socket.h>
 # include <sys/un.h>
+# include <time.h>
 # ifdef HAVE_UNISTD_H
 #  include <unistd.h>
 # endif
@@ -637,6 +638,326 @@ static int retry_read(int fd, void *buf0, unsigned nbyte, unsigned delta)
 #endif
 
 #ifdef HAVE_SASLAUTHD
+#ifndef USE_DOORS
+/*
+ * Pool of persistent connections to saslauthd, enabled with the
+ * saslauthd_connections option. A connection is negotiated into the
+ * pipelined protocol (see saslauthd/README.ipc) when it is opened and
+ * each request on it is tagged. A caller checks a connection out for
+ * the duration of one request, so the pool needs to be as large as
+ * the number of threads checking passwords at the same time.
+ */
+#define SASLAUTHD_POOL_MAX 16
+#define SASLAUTHD_PIPELINE_OK "OK PIPELINE"
+/* seconds to wait before asking a server that declined again */
+#define SASLAUTHD_DECLINED_RETRY 60
+
+static void *saslauthd_pool_mutex = NULL;
+
+static struct {
+    pid_t pid;				/* process the connections belong to */
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)]; /* as pwpath */
+    int idle[SASLAUTHD_POOL_MAX];	/* connections nobody is using */
+    unsigned nidle;
+    unsigned nopen;			/* idle and checked out connections */
+    time_t declined;			/* when the server last declined */
+    unsigned tag;			/* last request tag handed out */
+} saslauthd_pool;
+
+/* hello: empty login, "PIPELINE" as the password, empty service/realm */
+static const char saslauthd_hello[] = {
+    0, 0,
+    0, 8, 'P', 'I', 'P', 'E', 'L', 'I', 'N', 'E',
+    0, 0,
+    0, 0
+};
+
+static void saslauthd_pool_drop(void)
+{
+    while (saslauthd_pool.nidle > 0) {
+	close(saslauthd_pool.idle[--saslauthd_pool.nidle]);
+	saslauthd_pool.nopen--;
+    }
+}
+#endif /* !USE_DOORS */
+#endif /* HAVE_SASLAUTHD */
+
+int _sasl_checkpw_init(void)
+{
+#if defined(HAVE_SASLAUTHD) && !defined(USE_DOORS)
+    if (!saslauthd_pool_mutex) {
+	saslauthd_pool_mutex = sasl_MUTEX_ALLOC();
+    }
+    if (!saslauthd_pool_mutex) return SASL_FAIL;
+#endif
+
+    return SASL_OK;
+}
+
+void _sasl_checkpw_done(void)
+{
+#if defined(HAVE_SASLAUTHD) && !defined(USE_DOORS)
+    if (!saslauthd_pool_mutex) return;
+
+    sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+    if (saslauthd_pool.pid == getpid()) {
+	saslauthd_pool_drop();
+    }
+    memset(&saslauthd_pool, 0, sizeof(saslauthd_pool));
+    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+
+    sasl_MUTEX_FREE(saslauthd_pool_mutex);
+    saslauthd_pool_mutex = NULL;
+#endif
+}
+
+#ifdef HAVE_SASLAUTHD
+#ifndef USE_DOORS
+/* open a connection to saslauthd, returns the socket or -1 */
+static int saslauthd_connect(sasl_conn_t *conn, const char *pwpath)
+{
+    int s;
+    struct sockaddr_un srvaddr;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+	sasl_seterror(conn, 0, "cannot create socket for saslauthd: %m", errno);
+	return -1;
+    }
+
+    /* don't leak pooled connections into programs we exec */
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    /* see saslauthd_send() */
+    {
+	int on = 1;
+
+	setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
+    /* pwpath is sized like sun_path and always terminated */
+    memset((char *)&srvaddr, 0, sizeof(srvaddr));
+    srvaddr.sun_family = AF_UNIX;
+    strcpy(srvaddr.sun_path, pwpath);
+
+    if (connect(s, (struct sockaddr *) &srvaddr, sizeof(srvaddr)) == -1) {
+	close(s);
+	sasl_seterror(conn, 0, "cannot connect to saslauthd server: %m", errno);
+	return -1;
+    }
+
+    return s;
+}
+
+/*
+ * Write out iov on a pooled connection. The server may have gone away
+ * since the connection was last used (saslauthd was restarted), which
+ * must show up as EPIPE and not as a SIGPIPE killing the application.
+ * Returns 0 on success, -1 with errno set on error.
+ */
+static int saslauthd_send(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t n;
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+
+    for (;;) {
+	while (iovcnt && iov[0].iov_len == 0) {
+	    iov++;
+	    iovcnt--;
+	}
+	if (!iovcnt) return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	n = sendmsg(fd, &msg, flags);
+	if (n == -1) {
+	    if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    return -1;
+	}
+
+	while (n > 0) {
+	    if ((size_t) n < iov[0].iov_len) {
+		iov[0].iov_base = (char *) iov[0].iov_base + n;
+		iov[0].iov_len -= n;
+		break;
+	    }
+	    n -= iov[0].iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+    }
+}
+
+/*
+ * Check a connection out of the pool, opening and negotiating a new one
+ * if there is no idle connection and the pool isn't full yet.  Returns
+ * -1 when the request has to go out on a connection of its own.
+ */
+static int saslauthd_pool_get(sasl_conn_t *conn, const char *pwpath,
+			      unsigned max, unsigned *tag)
+{
+    int s;
+    char response[sizeof(SASLAUTHD_PIPELINE_OK)];
+    unsigned short count;
+    struct iovec iov[1];
+
+    if (!saslauthd_pool_mutex) return -1;
+
+    sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+
+    if (saslauthd_pool.pid != getpid()) {
+	/* forget about connections shared with our parent; it keeps its
+	   own copies of the idle ones, so ours can be closed */
+	if (saslauthd_pool.pid) {
+	    saslauthd_pool_drop();
+	}
+	memset(&saslauthd_pool, 0, sizeof(saslauthd_pool));
+	saslauthd_pool.pid = getpid();
+	strcpy(saslauthd_pool.path, pwpath);
+    }
+
+    /* the pool only serves the first saslauthd it was used with */
+    if (strcmp(saslauthd_pool.path, pwpath) ||
+	(saslauthd_pool.declined &&
+	 time(NULL) - saslauthd_pool.declined < SASLAUTHD_DECLINED_RETRY)) {
+	sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	return -1;
+    }
+
+    *tag = ++saslauthd_pool.tag;
+
+    if (saslauthd_pool.nidle > 0) {
+	s = saslauthd_pool.idle[--saslauthd_pool.nidle];
+	sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	return s;
+    }
+
+    if (saslauthd_pool.nopen >= max) {
+	sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	return -1;
+    }
+    saslauthd_pool.nopen++;
+
+    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+
+    s = saslauthd_connect(conn, pwpath);
+    if (s == -1) goto fail;
+
+    iov[0].iov_base = (void *) saslauthd_hello;
+    iov[0].iov_len = sizeof(saslauthd_hello);
+
+    if (saslauthd_send(s, iov, 1) == -1 ||
+	retry_read(s, &count, sizeof(count), 0) < (int) sizeof(count)) {
+	close(s);
+	goto fail;
+    }
+
+    /* servers without pipelining say "NO NULL login received" */
+    count = ntohs(count);
+    if (count != sizeof(response) - 1 ||
+	retry_read(s, response, count, 0) < count ||
+	memcmp(response, SASLAUTHD_PIPELINE_OK, count)) {
+	close(s);
+
+	sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+	saslauthd_pool.declined = time(NULL);
+	if (saslauthd_pool.pid == getpid()) saslauthd_pool.nopen--;
+	sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	return -1;
+    }
+
+    return s;
+
+ fail:
+    sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+    if (saslauthd_pool.pid == getpid()) saslauthd_pool.nopen--;
+    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+    return -1;
+}
+
+/* return a connection to the pool, or close it if it went bad */
+static void saslauthd_pool_put(int s, int ok)
+{
+    sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+
+    if (saslauthd_pool.pid != getpid()) {
+	/* we forked while the request was out */
+	close(s);
+    } else if (ok && saslauthd_pool.nidle < SASLAUTHD_POOL_MAX) {
+	saslauthd_pool.idle[saslauthd_pool.nidle++] = s;
+    } else {
+	close(s);
+	saslauthd_pool.nopen--;
+    }
+
+    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+}
+
+/*
+ * Send a request out on a pipelined connection and read the reply:
+ *
+ * tag count authid count password count service count realm
+ *
+ * returns 0 on success, 1 if the server had closed the connection before
+ * getting the request (it is worth trying again on another one), -1 if
+ * the connection can't be used anymore
+ */
+static int saslauthd_pipelined(int s, unsigned tag,
+			       char *query, unsigned query_len,
+			       char *response, unsigned response_len)
+{
+    struct iovec iov[2];
+    unsigned ntag = htonl(tag);
+    unsigned rtag;
+    unsigned short count;
+    int n;
+
+    iov[0].iov_base = (void *) &ntag;
+    iov[0].iov_len = sizeof(ntag);
+    iov[1].iov_base = query;
+    iov[1].iov_len = query_len;
+
+    if (saslauthd_send(s, iov, 2) == -1)
+	return (errno == EPIPE || errno == ECONNRESET) ? 1 : -1;
+
+    /*
+     * read response of the form:
+     *
+     * tag count result
+     */
+    n = retry_read(s, &rtag, sizeof(rtag), 0);
+    if (n == 0 || (n == -1 && errno == ECONNRESET))
+	return 1;
+    if (n < (int) sizeof(rtag) ||
+	retry_read(s, &count, sizeof(count), 0) < (int) sizeof(count))
+	return -1;
+
+    /* we only ever have one request out on a connection */
+    if (rtag != ntag)
+	return -1;
+
+    count = ntohs(count);
+    if (count < 2 || count >= response_len) /* MUST have "OK" or "NO" */
+	return -1;
+
+    if (retry_read(s, response, count, 0) < count)
+	return -1;
+    response[count] = '\0';
+
+    return 0;
+}
+#endif /* !USE_DOORS */
+
 /* saslauthd-authenticated login */
 static int saslauthd_verify_password(sasl_conn_t *conn,
 				     const char *userid, 
@@ -656,14 +977,29 @@ static int saslauthd_verify_password(sasl_conn_t *conn,
     char *freeme = NULL;
 #ifdef USE_DOORS
     door_arg_t arg;
+#else
+    const char *connections = NULL;
+    unsigned pool_max = 0;
 #endif
 
     /* check to see if the user configured a rundir */
     if (_sasl_getcallback(conn, SASL_CB_GETOPT, &getopt, &context) == SASL_OK) {
 	getopt(context, NULL, "saslauthd_path", &p, NULL);
+#ifndef USE_DOORS
+	getopt(context, NULL, "saslauthd_connections", &connections, NULL);
+	if (connections) {
+	    pool_max = (unsigned) atoi(connections);
+	    if (pool_max > SASLAUTHD_POOL_MAX) pool_max = SASLAUTHD_POOL_MAX;
+	}
+#endif
     }
     if (p) {
-	strncpy(pwpath, p, sizeof(pwpath));
+	if (strlen(p) + 1 > sizeof(pwpath)) {
+	    sasl_seterror(conn, 0, "saslauthd_path is too long");
+	    return SASL_FAIL;
+	}
+
+	strcpy(pwpath, p);
     } else {
 	if (strlen(PATH_SASLAUTHD_RUNDIR) + 4 + 1 > sizeof(pwpath))
 	    return SASL_FAIL;
@@ -774,25 +1110,29 @@ static int saslauthd_verify_password(sasl_conn_t *conn,
 #else
     /* unix sockets */
 
-    s = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (s == -1) {
-	sasl_seterror(conn, 0, "cannot create socket for saslauthd: %m", errno);
-	goto fail;
-    }
-
-    memset((char *)&srvaddr, 0, sizeof(srvaddr));
-    srvaddr.sun_family = AF_UNIX;
-    strncpy(srvaddr.sun_path, pwpath, sizeof(srvaddr.sun_path));
-
-    {
-	int r = connect(s, (struct sockaddr *) &srvaddr, sizeof(srvaddr));
-	if (r == -1) {
-	    close(s);
-	    sasl_seterror(conn, 0, "cannot connect to saslauthd server: %m", errno);
-	    goto fail;
+    if (pool_max > 0) {
+	int tries;
+	int r;
+	unsigned tag;
+
+	/* a pooled connection may have been closed by the server, then
+	   the request goes out again on another one */
+	for (tries = 0; tries < 2; tries++) {
+	    s = saslauthd_pool_get(conn, pwpath, pool_max, &tag);
+	    if (s == -1) break;
+
+	    r = saslauthd_pipelined(s, tag, query, query_end - query,
+				    response, sizeof(response));
+	    saslauthd_pool_put(s, r == 0);
+	    if (r == 0) goto done;
+	    if (r == -1) break;
 	}
     }
 
+    s = saslauthd_connect(conn, pwpath);
+    if (s == -1)
+	goto fail;
+
     {
  	struct iovec iov[8];
  
@@ -836,6 +1176,8 @@ static int saslauthd_verify_password(sasl_conn_t *conn,
     }
 
     close(s);
+
+ done:
 #endif /* USE_DOORS */
   
     if(freeme) free(freeme);
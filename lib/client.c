@@ -503,7 +503,7 @@ int sasl_client_new(const char *service,
   
   /* get the clientFQDN (serverFQDN was set in _sasl_conn_init) */
   memset(name, 0, sizeof(name));
-  if (get_fqhostname (name, MAXHOSTNAMELEN, 0) != 0) {
+  if (_sasl_get_fqhostname (name, MAXHOSTNAMELEN) != 0) {
       return (SASL_FAIL);
   }
 
@@ -308,11 +308,118 @@ int sasl_encode(sasl_conn_t *conn, const char *input,
     RETURN(conn, result);
 }
 
+/* Make room for at least num entries in conn->encoded_iov */
+static int
+_sasl_encoded_iov_alloc (sasl_conn_t *conn, unsigned num)
+{
+    struct iovec *new_iov;
+    buffer_info_t *new_packets;
+    unsigned len;
+
+    if (num <= conn->encoded_iov_len) return SASL_OK;
+
+    len = conn->encoded_iov_len ? conn->encoded_iov_len * 2 : 4;
+    while (len < num) len *= 2;
+
+    new_iov = sasl_REALLOC(conn->encoded_iov, sizeof(struct iovec) * len);
+    if (new_iov == NULL) return SASL_NOMEM;
+    conn->encoded_iov = new_iov;
+
+    new_packets = sasl_REALLOC(conn->encoded_packets,
+			       sizeof(buffer_info_t) * len);
+    if (new_packets == NULL) return SASL_NOMEM;
+    memset(new_packets + conn->encoded_iov_len, 0,
+	   sizeof(buffer_info_t) * (len - conn->encoded_iov_len));
+    conn->encoded_packets = new_packets;
+
+    conn->encoded_iov_len = len;
+
+    return SASL_OK;
+}
+
+/* Internal function that doesn't do any verification.
+   Adds the packet to conn->encoded_iov instead of concatenating it
+   with the previous ones. */
+static int
+_sasl_encodev_scatter (sasl_conn_t *conn,
+		       const struct iovec *invec,
+		       unsigned numiov,
+		       int * p_num_packets)
+{
+    int result;
+    unsigned n = (unsigned) *p_num_packets;
+    buffer_info_t *packet;
+    const char *output;
+    unsigned outputlen;
+    unsigned buflen;
+    char *buf;
+
+    if (_sasl_encoded_iov_alloc(conn, n + 1) != SASL_OK) {
+        MEMERROR(conn);
+    }
+
+    packet = &conn->encoded_packets[n];
+
+    if (conn->oparams.encode_packet != NULL) {
+        /* The plugin encodes straight into our per-packet buffer */
+        buf = packet->data;
+        buflen = (unsigned) packet->reallen;
+        result = conn->oparams.encode_packet(conn->context,
+                                             invec,
+                                             numiov,
+                                             &buf,
+                                             &buflen,
+                                             &outputlen);
+        packet->data = buf;
+        packet->reallen = buflen;
+
+        if (result == SASL_OK) {
+            packet->curlen = outputlen;
+            conn->encoded_iov[n].iov_base = packet->data;
+            conn->encoded_iov[n].iov_len = outputlen;
+            (*p_num_packets)++;
+        }
+
+        RETURN(conn, result);
+    }
+
+    if (n > 0) {
+        /* The previous packet is still in the output buffer of the
+           security layer, which the next encode call reuses. */
+        packet = &conn->encoded_packets[n - 1];
+        result = _buf_alloc(&packet->data, &packet->reallen,
+                            conn->encoded_iov[n - 1].iov_len);
+        if (result != SASL_OK) {
+            MEMERROR(conn);
+        }
+        memcpy(packet->data,
+               conn->encoded_iov[n - 1].iov_base,
+               conn->encoded_iov[n - 1].iov_len);
+        packet->curlen = conn->encoded_iov[n - 1].iov_len;
+        conn->encoded_iov[n - 1].iov_base = packet->data;
+    }
+
+    result = conn->oparams.encode(conn->context,
+                                  invec,
+                                  numiov,
+				  &output,
+                                  &outputlen);
+
+    if (result == SASL_OK) {
+        conn->encoded_iov[n].iov_base = (void *) output;
+        conn->encoded_iov[n].iov_len = outputlen;
+        (*p_num_packets)++;
+    }
+
+    RETURN(conn, result);
+}
+
 /* Internal function that doesn't do any verification */
 static int
 _sasl_encodev (sasl_conn_t *conn,
 	       const struct iovec *invec,
                unsigned numiov,
+               int scatter,             /* keep packets apart */
                int * p_num_packets,     /* number of packets generated so far */
 	       const char **output,     /* previous output, if *p_num_packets > 0 */
                unsigned *outputlen)
@@ -322,6 +429,10 @@ _sasl_encodev (sasl_conn_t *conn,
 
     assert (conn->oparams.encode != NULL);
 
+    if (scatter) {
+        return _sasl_encodev_scatter(conn, invec, numiov, p_num_packets);
+    }
+
     if (*p_num_packets == 1) {
         /* This is the second call to this function,
            so we need to allocate a new output buffer
@@ -394,13 +505,17 @@ _sasl_encodev (sasl_conn_t *conn,
     RETURN(conn, result);
 }
 
-/* security-encode an iovec */
-/* output is only valid until the next call to sasl_encode or sasl_encodev */
-int sasl_encodev(sasl_conn_t *conn,
-		 const struct iovec *invec,
-                 unsigned numiov,
-		 const char **output,
-                 unsigned *outputlen)
+/* Split invec into SASL packets of at most conn->oparams.maxoutbuf
+   bytes and encode them, concatenated into *output or, if scatter is set,
+   into conn->encoded_iov */
+static int
+_sasl_encodev_split (sasl_conn_t *conn,
+		     const struct iovec *invec,
+		     unsigned numiov,
+		     int scatter,
+		     int * p_num_packets,
+		     const char **output,
+		     unsigned *outputlen)
 {
     int result = SASL_OK;
     unsigned i;
@@ -416,33 +531,6 @@ int sasl_encodev(sasl_conn_t *conn,
     /* Number of generated SASL packets */
     int num_packets = 0;
 
-    if (!conn) return SASL_BADPARAM;
-    if (! invec || ! output || ! outputlen || numiov < 1) {
-	PARAMERROR(conn);
-    }
-
-    if (!conn->props.maxbufsize) {
-	sasl_seterror(conn, 0,
-		      "called sasl_encode[v] with application that does not support security layers");
-	return SASL_TOOWEAK;
-    }
-
-    /* If oparams.encode is NULL, this means there is no SASL security
-       layer in effect, so no SASL framing is needed. */
-    if (conn->oparams.encode == NULL)  {
-	result = _iovec_to_buf(invec, numiov, &conn->encode_buf);
-	if (result != SASL_OK) INTERROR(conn, result);
-       
-	*output = conn->encode_buf->data;
-	*outputlen = (unsigned) conn->encode_buf->curlen;
-
-        RETURN(conn, result);
-    }
-
-    /* This might be better to check on a per-plugin basis, but I think
-     * it's cleaner and more effective here.  It also encourages plugins
-     * to be honest about what they accept */
-
     last_invec.iov_base = NULL;
     remainder_len = 0;
     next_buf = NULL;
@@ -503,6 +591,7 @@ int sasl_encodev(sasl_conn_t *conn,
             result = _sasl_encodev (conn,
 	                            cur_invec,
                                     cur_numiov,
+                                    scatter,
                                     &num_packets,
 	                            output,
                                     outputlen);
@@ -541,6 +630,7 @@ int sasl_encodev(sasl_conn_t *conn,
                 result = _sasl_encodev (conn,
 	                                &last_invec,
                                         1,
+                                        scatter,
                                         &num_packets,
 	                                output,
                                         outputlen);
@@ -571,6 +661,7 @@ int sasl_encodev(sasl_conn_t *conn,
         result = _sasl_encodev (conn,
 	                        &last_invec,
                                 1,
+                                scatter,
                                 &num_packets,
 	                        output,
                                 outputlen);
@@ -584,6 +675,7 @@ int sasl_encodev(sasl_conn_t *conn,
         result = _sasl_encodev (conn,
 	                        invec,
                                 numiov,
+                                scatter,
                                 &num_packets,
 	                        output,
                                 outputlen);
@@ -594,6 +686,103 @@ cleanup:
         sasl_FREE(cur_invec);
     }
 
+    *p_num_packets = num_packets;
+
+    RETURN(conn, result);
+}
+
+/* security-encode an iovec */
+/* output is only valid until the next call to sasl_encode or sasl_encodev */
+int sasl_encodev(sasl_conn_t *conn,
+		 const struct iovec *invec,
+                 unsigned numiov,
+		 const char **output,
+                 unsigned *outputlen)
+{
+    int result = SASL_OK;
+    int num_packets = 0;
+
+    if (!conn) return SASL_BADPARAM;
+    if (! invec || ! output || ! outputlen || numiov < 1) {
+	PARAMERROR(conn);
+    }
+
+    /* This might be better to check on a per-plugin basis, but I think
+     * it's cleaner and more effective here.  It also encourages plugins
+     * to be honest about what they accept */
+    if (!conn->props.maxbufsize) {
+	sasl_seterror(conn, 0,
+		      "called sasl_encode[v] with application that does not support security layers");
+	return SASL_TOOWEAK;
+    }
+
+    /* If oparams.encode is NULL, this means there is no SASL security
+       layer in effect, so no SASL framing is needed. */
+    if (conn->oparams.encode == NULL)  {
+	result = _iovec_to_buf(invec, numiov, &conn->encode_buf);
+	if (result != SASL_OK) INTERROR(conn, result);
+       
+	*output = conn->encode_buf->data;
+	*outputlen = (unsigned) conn->encode_buf->curlen;
+
+        RETURN(conn, result);
+    }
+
+    result = _sasl_encodev_split(conn, invec, numiov, 0, &num_packets,
+                                 output, outputlen);
+
+    RETURN(conn, result);
+}
+
+/* security-encode an iovec, leaving each SASL packet in its own buffer */
+/* output is only valid until the next call to sasl_encode, sasl_encodev
+   or sasl_encodev_iov */
+int sasl_encodev_iov(sasl_conn_t *conn,
+		     const struct iovec *invec,
+		     unsigned numiov,
+		     const struct iovec **output,
+		     unsigned *outputnum)
+{
+    int result = SASL_OK;
+    int num_packets = 0;
+    unsigned i;
+
+    if (!conn) return SASL_BADPARAM;
+    if (! invec || ! output || ! outputnum || numiov < 1) {
+	PARAMERROR(conn);
+    }
+
+    /* This might be better to check on a per-plugin basis, but I think
+     * it's cleaner and more effective here.  It also encourages plugins
+     * to be honest about what they accept */
+    if (!conn->props.maxbufsize) {
+	sasl_seterror(conn, 0,
+		      "called sasl_encodev_iov with application that does not support security layers");
+	return SASL_TOOWEAK;
+    }
+
+    /* Without a security layer the output is the input */
+    if (conn->oparams.encode == NULL)  {
+	if (_sasl_encoded_iov_alloc(conn, numiov) != SASL_OK) {
+	    MEMERROR(conn);
+	}
+	for (i = 0; i < numiov; i++) {
+	    conn->encoded_iov[i] = invec[i];
+	}
+
+	*output = conn->encoded_iov;
+	*outputnum = numiov;
+
+        RETURN(conn, result);
+    }
+
+    result = _sasl_encodev_split(conn, invec, numiov, 1, &num_packets,
+                                 NULL, NULL);
+    if (result == SASL_OK) {
+	*output = conn->encoded_iov;
+	*outputnum = (unsigned) num_packets;
+    }
+
     RETURN(conn, result);
 }
  
@@ -685,6 +874,8 @@ void sasl_common_done(void)
     
     sasl_MUTEX_FREE(free_mutex);
     free_mutex = NULL;
+
+    _sasl_fqdn_done();
     
     _sasl_free_utils(&sasl_global_utils);
     
@@ -729,9 +920,17 @@ int _sasl_conn_init(sasl_conn_t *conn,
 
   conn->type = type;
 
-  result = _sasl_strdup(service, &conn->service, NULL);
-  if (result != SASL_OK) 
-      MEMERROR(conn);
+  /* A recycled connection (see server_recycle) comes with the strings and
+   * buffers of its previous use, which are kept where they still fit. */
+  if (conn->service && strcmp(conn->service, service) != 0) {
+      sasl_FREE(conn->service);
+      conn->service = NULL;
+  }
+  if (!conn->service) {
+      result = _sasl_strdup(service, &conn->service, NULL);
+      if (result != SASL_OK) 
+	  MEMERROR(conn);
+  }
 
   memset(&conn->oparams, 0, sizeof(sasl_out_params_t));
   memset(&conn->external, 0, sizeof(_sasl_external_properties_t));
@@ -746,7 +945,6 @@ int _sasl_conn_init(sasl_conn_t *conn,
   if(result != SASL_OK)
       RETURN(conn, result);
   
-  conn->encode_buf = NULL;
   conn->context = NULL;
   conn->secret = NULL;
   conn->idle_hook = idle_hook;
@@ -757,13 +955,14 @@ int _sasl_conn_init(sasl_conn_t *conn,
 
   /* Start this buffer out as an empty string */
   conn->error_code = SASL_OK;
-  conn->errdetail_buf = conn->error_buf = NULL;
-  conn->errdetail_buf_len = conn->error_buf_len = 150;
-
-  result = _buf_alloc(&conn->error_buf, &conn->error_buf_len, 150);     
-  if(result != SASL_OK) MEMERROR(conn);
-  result = _buf_alloc(&conn->errdetail_buf, &conn->errdetail_buf_len, 150);
-  if(result != SASL_OK) MEMERROR(conn);
+  if (!conn->error_buf) {
+      result = _buf_alloc(&conn->error_buf, &conn->error_buf_len, 150);
+      if(result != SASL_OK) MEMERROR(conn);
+  }
+  if (!conn->errdetail_buf) {
+      result = _buf_alloc(&conn->errdetail_buf, &conn->errdetail_buf_len, 150);
+      if(result != SASL_OK) MEMERROR(conn);
+  }
   
   conn->error_buf[0] = '\0';
   conn->errdetail_buf[0] = '\0';
@@ -771,17 +970,29 @@ int _sasl_conn_init(sasl_conn_t *conn,
   conn->decode_buf = NULL;
 
   if(serverFQDN) {
-      result = _sasl_strdup(serverFQDN, &conn->serverFQDN, NULL);
-      sasl_strlower (conn->serverFQDN);
+      if (conn->serverFQDN && strcasecmp(conn->serverFQDN, serverFQDN) != 0) {
+	  sasl_FREE(conn->serverFQDN);
+	  conn->serverFQDN = NULL;
+      }
+      if (!conn->serverFQDN) {
+	  result = _sasl_strdup(serverFQDN, &conn->serverFQDN, NULL);
+	  if (result == SASL_OK) sasl_strlower (conn->serverFQDN);
+      }
   } else if (conn->type == SASL_CONN_SERVER) {
       /* We can fake it because we *are* the server */
       char name[MAXHOSTNAMELEN];
       memset(name, 0, sizeof(name));
-      if (get_fqhostname (name, MAXHOSTNAMELEN, 0) != 0) {
+      if (_sasl_get_fqhostname (name, MAXHOSTNAMELEN) != 0) {
         return (SASL_FAIL);
       }
       
-      result = _sasl_strdup(name, &conn->serverFQDN, NULL);
+      if (conn->serverFQDN && strcmp(conn->serverFQDN, name) != 0) {
+	  sasl_FREE(conn->serverFQDN);
+	  conn->serverFQDN = NULL;
+      }
+      if (!conn->serverFQDN) {
+	  result = _sasl_strdup(name, &conn->serverFQDN, NULL);
+      }
   } else {
       conn->serverFQDN = NULL;
   }
@@ -823,6 +1034,9 @@ int _sasl_common_init(sasl_global_callbacks_t *global_callbacks)
     }
     if (!free_mutex) return SASL_FAIL;
 
+    result = _sasl_fqdn_init();
+    if (result != SASL_OK) return result;
+
     return SASL_OK;
 }
 
@@ -848,13 +1062,45 @@ void sasl_dispose(sasl_conn_t **pconn)
 	return;
   }
 
-  (*pconn)->destroy_conn(*pconn);
-  sasl_FREE(*pconn);
+  if (!(*pconn)->recycle_conn || (*pconn)->recycle_conn(*pconn) != SASL_OK) {
+      (*pconn)->destroy_conn(*pconn);
+      sasl_FREE(*pconn);
+  }
   *pconn=NULL;
 
   sasl_MUTEX_UNLOCK(free_mutex);
 }
 
+/* wipe a connection before it is recycled; the service and FQDN strings
+ * and the error, encode and mechlist buffers are kept for
+ * _sasl_conn_init() */
+void _sasl_conn_reset(sasl_conn_t *conn) {
+  sasl_conn_t keep;
+
+  if (conn->external.auth_id)
+      sasl_FREE(conn->external.auth_id);
+
+  if(conn->decode_buf)
+      sasl_FREE(conn->decode_buf);
+
+  memset(&keep, 0, sizeof(keep));
+  keep.service = conn->service;
+  keep.serverFQDN = conn->serverFQDN;
+  keep.encode_buf = conn->encode_buf;
+  keep.error_buf = conn->error_buf;
+  keep.error_buf_len = conn->error_buf_len;
+  keep.errdetail_buf = conn->errdetail_buf;
+  keep.errdetail_buf_len = conn->errdetail_buf_len;
+  keep.mechlist_buf = conn->mechlist_buf;
+  keep.mechlist_buf_len = conn->mechlist_buf_len;
+  keep.multipacket_encoded_data = conn->multipacket_encoded_data;
+  keep.encoded_iov = conn->encoded_iov;
+  keep.encoded_packets = conn->encoded_packets;
+  keep.encoded_iov_len = conn->encoded_iov_len;
+
+  memcpy(conn, &keep, sizeof(keep));
+}
+
 void _sasl_conn_dispose(sasl_conn_t *conn) {
   if (conn->serverFQDN)
       sasl_FREE(conn->serverFQDN);
@@ -886,6 +1132,19 @@ void _sasl_conn_dispose(sasl_conn_t *conn) {
       sasl_FREE(conn->multipacket_encoded_data.data);
   }
 
+  if (conn->encoded_packets) {
+      unsigned i;
+
+      for (i = 0; i < conn->encoded_iov_len; i++) {
+	  if (conn->encoded_packets[i].data)
+	      sasl_FREE(conn->encoded_packets[i].data);
+      }
+      sasl_FREE(conn->encoded_packets);
+  }
+
+  if (conn->encoded_iov)
+      sasl_FREE(conn->encoded_iov);
+
   /* oparams sub-members should be freed by the plugin, in so much
    * as they were allocated by the plugin */
 }
@@ -2001,6 +2260,17 @@ _sasl_alloc_utils(sasl_conn_t *conn,
   if (utils==NULL)
     return NULL;
 
+  _sasl_init_utils(utils, conn, global_callbacks);
+
+  return utils;
+}
+
+/* fill in utils for conn (the global utils if NULL) */
+void
+_sasl_init_utils(sasl_utils_t *utils,
+		 sasl_conn_t *conn,
+		 sasl_global_callbacks_t *global_callbacks)
+{
   utils->conn = conn;
 
   sasl_randcreate(&utils->rpool);
@@ -2070,8 +2340,6 @@ _sasl_alloc_utils(sasl_conn_t *conn,
   /* Spares */
   utils->spare_fptr = NULL;
   utils->spare_fptr1 = utils->spare_fptr2 = NULL;
-  
-  return utils;
 }
 
 int
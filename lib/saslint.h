@@ -153,6 +153,9 @@ struct sasl_conn {
   enum Sasl_conn_type type;
 
   void (*destroy_conn)(sasl_conn_t *); /* destroy function */
+  /* keep the connection for reuse instead, returns SASL_OK if it did (the
+   * memory then stays with its owner); NULL for connections never kept */
+  int (*recycle_conn)(sasl_conn_t *);
 
   char *service;
 
@@ -193,6 +196,14 @@ struct sasl_conn {
 
   /* Allocated by sasl_encodev if the output contains multiple SASL packet. */
   buffer_info_t multipacket_encoded_data;
+
+  /* Output of sasl_encodev_iov: one iovec per SASL packet, and the
+     buffers the security layer encodes the packets into (if it has an
+     encode_packet hook), or that packets are copied into before it
+     reuses its own output buffer */
+  struct iovec *encoded_iov;
+  buffer_info_t *encoded_packets;
+  unsigned encoded_iov_len;
 };
 
 /* Server Conn Type Information */
@@ -232,6 +243,8 @@ typedef struct sasl_server_conn {
     context_list_t *mech_contexts;
     mechanism_t *mech_list; /* list of available mechanisms */
     int mech_length;        /* number of available mechanisms */
+    int pooled;             /* sparams and utils are part of this
+			       allocation, see server_conn_arena_t */
 } sasl_server_conn_t;
 
 /* Client Conn Type Information */
@@ -324,6 +337,8 @@ extern int _sasl_is_equal_mech(const char *req_mech,
  * checkpw.c
  */
 extern struct sasl_verify_password_s _sasl_verify_password[];
+extern int _sasl_checkpw_init(void);
+extern void _sasl_checkpw_done(void);
 
 /*
  * server.c
@@ -392,11 +407,15 @@ extern int _sasl_conn_init(sasl_conn_t *conn,
 			   const char *ipremoteport,
 			   const sasl_callback_t *callbacks,
 			   const sasl_global_callbacks_t *global_callbacks);
+extern void _sasl_conn_reset(sasl_conn_t *conn);
 extern void _sasl_conn_dispose(sasl_conn_t *conn);
 
 extern sasl_utils_t *
 _sasl_alloc_utils(sasl_conn_t *conn,
 		  sasl_global_callbacks_t *global_callbacks);
+extern void _sasl_init_utils(sasl_utils_t *utils,
+			     sasl_conn_t *conn,
+			     sasl_global_callbacks_t *global_callbacks);
 extern int _sasl_free_utils(const sasl_utils_t ** utils);
 
 extern int
@@ -492,6 +511,7 @@ extern int sasldb_auxprop_plug_init(const sasl_utils_t *utils,
  */
 extern int _sasl_auxprop_add_plugin(void *p, void *library);
 extern void _sasl_auxprop_free(void);
+extern void _sasl_prop_reset(struct propctx *ctx);
 extern int _sasl_auxprop_lookup(sasl_server_params_t *sparams,
 				 unsigned flags,
 				 const char *user, unsigned ulen);
@@ -525,4 +545,13 @@ int get_fqhostname(
   int abort_if_no_fqdn
   );
 
+/* default time to live (seconds) of the cached host name, see the
+   fqdn_cache_ttl option */
+#define SASL_FQDN_TTL 3600
+
+extern int _sasl_fqdn_init(void);
+extern void _sasl_fqdn_done(void);
+extern void _sasl_fqdn_setup(unsigned ttl);
+extern int _sasl_get_fqhostname(char *name, int namelen);
+
 #endif /* SASLINT_H */
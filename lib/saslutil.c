@@ -78,6 +78,7 @@
  * sasl_rand
  * sasl_churn
  * sasl_erasebuffer
+ * sasl_refresh_fqdn
  */
 
 #ifdef sun
@@ -88,11 +89,43 @@ extern int gethostname(char *, int);
 char *encode_table;
 char *decode_table;
 
+#if !(defined(WIN32)||defined(macintosh))
+/* sasl_rand() hands out a ChaCha20 keystream (see rand_refill) instead of
+ * the jrand48() stream of a pool seeded from DEV_RANDOM.  The generator is
+ * kept per thread where the compiler has thread local storage, so a new
+ * connection asking for a challenge costs neither a system call to seed
+ * its pool nor a lock; elsewhere every pool has its own. */
+#define RAND_CHACHA
+#if defined(__GNUC__) || defined(__SUNPRO_C)
+#define RAND_THREAD_LOCAL __thread
+#endif
+
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+
+#define RAND_BLOCKS 4			/* ChaCha20 blocks per refill */
+#define RAND_RESEED_BYTES (1UL << 20)	/* output between reseeds */
+#define RAND_RESEED_SECS 300		/* and time */
+
+struct rand_state {
+    unsigned int key[8];
+    unsigned char out[RAND_BLOCKS * 64];
+    unsigned avail;			/* unused bytes at the end of out */
+    unsigned long left;			/* bytes until the next reseed */
+    time_t seeded;
+    pid_t pid;				/* 0: not seeded yet */
+};
+#endif /* !WIN32 && !macintosh */
+
 #define RPOOL_SIZE 3
 struct sasl_rand_s {
     unsigned short pool[RPOOL_SIZE];
     /* since the init time might be really bad let's make this lazy */
     int initialized; 
+#if defined(RAND_CHACHA) && !defined(RAND_THREAD_LOCAL)
+    struct rand_state state;
+#endif
 };
 
 #define CHAR64(c)  (((c) < 0 || (c) > 127) ? -1 : index_64[(c)])
@@ -387,11 +420,172 @@ void getranddata(unsigned short ret[RPOOL_SIZE])
     return;
 }
 
+#ifdef RAND_CHACHA
+#define RAND_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define RAND_QR(a, b, c, d) \
+    a += b; d ^= a; d = RAND_ROTL(d, 16); \
+    c += d; b ^= c; b = RAND_ROTL(b, 12); \
+    a += b; d ^= a; d = RAND_ROTL(d, 8); \
+    c += d; b ^= c; b = RAND_ROTL(b, 7)
+
+/* one 64 byte ChaCha20 block (RFC 8439) of key at counter, zero nonce */
+static void chacha_block(const unsigned int key[8], unsigned int counter,
+			 unsigned char *out)
+{
+    unsigned int in[16], x[16];
+    int i;
+
+    in[0] = 0x61707865;		/* "expand 32-byte k" */
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) in[4 + i] = key[i];
+    in[12] = counter;
+    in[13] = in[14] = in[15] = 0;
+
+    memcpy(x, in, sizeof(x));
+    for (i = 0; i < 10; i++) {
+	RAND_QR(x[0], x[4], x[8], x[12]);
+	RAND_QR(x[1], x[5], x[9], x[13]);
+	RAND_QR(x[2], x[6], x[10], x[14]);
+	RAND_QR(x[3], x[7], x[11], x[15]);
+	RAND_QR(x[0], x[5], x[10], x[15]);
+	RAND_QR(x[1], x[6], x[11], x[12]);
+	RAND_QR(x[2], x[7], x[8], x[13]);
+	RAND_QR(x[3], x[4], x[9], x[14]);
+    }
+
+    for (i = 0; i < 16; i++) {
+	unsigned int v = x[i] + in[i];
+
+	out[4 * i] = (unsigned char) v;
+	out[4 * i + 1] = (unsigned char) (v >> 8);
+	out[4 * i + 2] = (unsigned char) (v >> 16);
+	out[4 * i + 3] = (unsigned char) (v >> 24);
+    }
+}
+
+/* next RAND_BLOCKS blocks of keystream; the first 32 bytes become the new
+ * key and are wiped, so the state never tells what was handed out */
+static void rand_refill(struct rand_state *rs)
+{
+    int i;
+
+    for (i = 0; i < RAND_BLOCKS; i++) {
+	chacha_block(rs->key, i, rs->out + 64 * i);
+    }
+    for (i = 0; i < 8; i++) {
+	rs->key[i] = (unsigned int) rs->out[4 * i]
+	    | (unsigned int) rs->out[4 * i + 1] << 8
+	    | (unsigned int) rs->out[4 * i + 2] << 16
+	    | (unsigned int) rs->out[4 * i + 3] << 24;
+    }
+    memset(rs->out, 0, 32);
+    rs->avail = sizeof(rs->out) - 32;
+}
+
+/* xor data into the key, and drop what was derived from the old one */
+static void rand_mix(struct rand_state *rs, const char *data, unsigned len)
+{
+    unsigned lup;
+
+    for (lup = 0; lup < len; lup++) {
+	rs->key[(lup / 4) % 8] ^=
+	    (unsigned int) (unsigned char) data[lup] << (8 * (lup % 4));
+    }
+    memset(rs->out, 0, sizeof(rs->out));
+    rs->avail = 0;
+}
+
+/* 32 bytes from the kernel, returns 0 on success */
+static int rand_kernel(unsigned char *buf)
+{
+    size_t left = 32;
+
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+    while (left != 0) {
+	ssize_t got = getrandom(buf + 32 - left, left, 0);
+
+	if (got == -1 && errno == EINTR) continue;
+	else if (got <= 0) break;
+	left -= got;
+    }
+    if (left == 0) return 0;
+#endif
+
+#ifdef DEV_RANDOM
+    {
+	int fd = open(DEV_RANDOM, O_RDONLY);
+
+	if (fd != -1) {
+	    while (left != 0) {
+		ssize_t got = read(fd, buf + 32 - left, left);
+
+		if (got == -1 && errno == EINTR) continue;
+		else if (got <= 0) break;
+		left -= got;
+	    }
+	    close(fd);
+	}
+    }
+#endif
+
+    return left == 0 ? 0 : -1;
+}
+
+static void rand_seed(struct rand_state *rs)
+{
+    unsigned char seed[32];
+
+    if (rand_kernel(seed) != 0) {
+	/* no better than the pools used to be */
+	unsigned short weak[RPOOL_SIZE];
+
+	memset(seed, 0, sizeof(seed));
+	getranddata(weak);
+	memcpy(seed, weak, sizeof(weak));
+    }
+
+    /* on top of the current key, a failed reseed doesn't lose anything */
+    rand_mix(rs, (const char *) seed, sizeof(seed));
+    memset(seed, 0, sizeof(seed));
+
+    rs->pid = getpid();
+    rs->seeded = time(NULL);
+    rs->left = RAND_RESEED_BYTES;
+}
+
+/* the generator to use for rpool, seeded if it is due */
+static struct rand_state *rand_state(sasl_rand_t *rpool)
+{
+#ifdef RAND_THREAD_LOCAL
+    static RAND_THREAD_LOCAL struct rand_state thread_state;
+    struct rand_state *rs = &thread_state;
+
+    (void) rpool;
+#else
+    struct rand_state *rs = &rpool->state;
+#endif
+
+    /* a child of fork() has to stop sharing its parent's keystream */
+    if (rs->pid != getpid() || rs->left == 0 ||
+	time(NULL) - rs->seeded >= RAND_RESEED_SECS) {
+	rand_seed(rs);
+    }
+
+    return rs;
+}
+#endif /* RAND_CHACHA */
+
 int sasl_randcreate(sasl_rand_t **rpool)
 {
   (*rpool)=sasl_ALLOC(sizeof(sasl_rand_t));
   if ((*rpool) == NULL) return SASL_NOMEM;
 
+#if defined(RAND_CHACHA) && !defined(RAND_THREAD_LOCAL)
+  memset(&(*rpool)->state, 0, sizeof((*rpool)->state));
+#endif
+
   /* init is lazy */
   (*rpool)->initialized = 0;
 
@@ -405,13 +599,19 @@ void sasl_randfree(sasl_rand_t **rpool)
 
 void sasl_randseed (sasl_rand_t *rpool, const char *seed, unsigned len)
 {
+#ifndef RAND_CHACHA
     /* is it acceptable to just use the 1st 3 char's given??? */
     unsigned int lup;
+#endif
 
     /* check params */
     if (seed == NULL) return;
     if (rpool == NULL) return;
 
+#ifdef RAND_CHACHA
+    /* the seed is mixed in, it can't make the stream predictable */
+    rand_mix(rand_state(rpool), seed, len);
+#else
     rpool->initialized = 1;
 
     if (len > sizeof(unsigned short)*RPOOL_SIZE)
@@ -419,8 +619,10 @@ void sasl_randseed (sasl_rand_t *rpool, const char *seed, unsigned len)
 
     for (lup = 0; lup < len; lup += 2)
 	rpool->pool[lup/2] = (seed[lup] << 8) + seed[lup + 1];
+#endif
 }
 
+#ifndef RAND_CHACHA
 static void randinit(sasl_rand_t *rpool)
 {
     if (!rpool) return;
@@ -428,15 +630,7 @@ static void randinit(sasl_rand_t *rpool)
     if (!rpool->initialized) {
 	getranddata(rpool->pool);
 	rpool->initialized = 1;
-#if !(defined(WIN32)||defined(macintosh))
-#ifndef HAVE_JRAND48
-    {
-      /* xxx varies by platform */
-	unsigned int *foo = (unsigned int *)rpool->pool;
-	srandom(*foo);
-    }
-#endif /* HAVE_JRAND48 */
-#elif defined(WIN32)
+#if defined(WIN32)
     {
 	unsigned int *foo = (unsigned int *)rpool->pool;
 	srand(*foo);
@@ -445,10 +639,16 @@ static void randinit(sasl_rand_t *rpool)
     }
 
 }
+#endif /* !RAND_CHACHA */
 
 void sasl_rand (sasl_rand_t *rpool, char *buf, unsigned len)
 {
+#ifdef RAND_CHACHA
+    struct rand_state *rs;
+    unsigned chunk;
+#else
     unsigned int lup;
+#endif
 #if defined(WIN32) && !defined(__MINGW32__)
     unsigned int randomValue;
 #endif
@@ -456,6 +656,24 @@ void sasl_rand (sasl_rand_t *rpool, char *buf, unsigned len)
     /* check params */
     if (!rpool || !buf) return;
     
+#ifdef RAND_CHACHA
+    rs = rand_state(rpool);
+    rs->left = len < rs->left ? rs->left - len : 0;
+
+    while (len != 0) {
+	unsigned char *out;
+
+	if (rs->avail == 0) rand_refill(rs);
+
+	chunk = len < rs->avail ? len : rs->avail;
+	out = rs->out + sizeof(rs->out) - rs->avail;
+	memcpy(buf, out, chunk);
+	memset(out, 0, chunk);
+	rs->avail -= chunk;
+	buf += chunk;
+	len -= chunk;
+    }
+#else
     /* init if necessary */
     randinit(rpool);
 
@@ -468,32 +686,32 @@ void sasl_rand (sasl_rand_t *rpool, char *buf, unsigned len)
 	}
 
 	buf[lup] = (char) (randomValue >> 8);
-#elif defined(macintosh)
+#else /* macintosh */
 	buf[lup] = (char) (rand() >> 8);
-#else /* !WIN32 && !macintosh */
-#ifdef HAVE_JRAND48
-	buf[lup] = (char) (jrand48(rpool->pool) >> 8);
-#else
-	buf[lup] = (char) (random() >> 8);
-#endif /* HAVE_JRAND48 */
 #endif /* WIN32 */
     }
+#endif /* RAND_CHACHA */
 }
 
-/* this function is just a bad idea all around, since we're not trying to
-   implement a true random number generator */
+/* mix data into the generator rpool draws from */
 void sasl_churn (sasl_rand_t *rpool, const char *data, unsigned len)
 {
+#ifndef RAND_CHACHA
     unsigned int lup;
+#endif
     
     /* check params */
     if (!rpool || !data) return;
     
+#ifdef RAND_CHACHA
+    rand_mix(rand_state(rpool), data, len);
+#else
     /* init if necessary */
     randinit(rpool);
     
     for (lup=0; lup<len; lup++)
 	rpool->pool[lup % RPOOL_SIZE] ^= data[lup];
+#endif
 }
 
 void sasl_erasebuffer(char *buf, unsigned len) {
@@ -607,6 +825,113 @@ LOWERCASE:
     return (0);
 }
 
+/* The name get_fqhostname() came up with, shared by the connections that
+ * aren't told their FQDN so that setting one up doesn't wait on the
+ * resolver.  It is resolved by sasl_server_init(), by sasl_refresh_fqdn(),
+ * and again by the first connection set up after it got ttl seconds old;
+ * the other connections keep using the old name in the meantime. */
+static struct {
+    void *mutex;
+    char name[MAXHOSTNAMELEN];
+    time_t resolved;		/* 0: nothing cached yet */
+    unsigned ttl;		/* 0: until sasl_refresh_fqdn() */
+    int resolving;
+} fqdn_cache = { NULL, "", 0, SASL_FQDN_TTL, 0 };
+
+/* resolve our name into fqdn_cache, a failure keeps the old name */
+static int fqdn_resolve(void)
+{
+    char name[MAXHOSTNAMELEN];
+    int ret;
+
+    memset(name, 0, sizeof(name));
+    ret = get_fqhostname(name, sizeof(name), 0);
+    name[sizeof(name) - 1] = '\0';
+
+    if (sasl_MUTEX_LOCK(fqdn_cache.mutex) != SASL_OK) return -1;
+    if (ret == 0) {
+	strcpy(fqdn_cache.name, name);
+	fqdn_cache.resolved = time(NULL);
+    }
+    fqdn_cache.resolving = 0;
+    sasl_MUTEX_UNLOCK(fqdn_cache.mutex);
+
+    return ret;
+}
+
+int _sasl_fqdn_init(void)
+{
+    if (!fqdn_cache.mutex) {
+	fqdn_cache.mutex = sasl_MUTEX_ALLOC();
+    }
+    if (!fqdn_cache.mutex) return SASL_FAIL;
+
+    return SASL_OK;
+}
+
+void _sasl_fqdn_done(void)
+{
+    if (fqdn_cache.mutex) {
+	sasl_MUTEX_FREE(fqdn_cache.mutex);
+	fqdn_cache.mutex = NULL;
+    }
+    fqdn_cache.name[0] = '\0';
+    fqdn_cache.resolved = 0;
+    fqdn_cache.ttl = SASL_FQDN_TTL;
+    fqdn_cache.resolving = 0;
+}
+
+/* set the time to live of the cached name and resolve it */
+void _sasl_fqdn_setup(unsigned ttl)
+{
+    fqdn_cache.ttl = ttl;
+    sasl_refresh_fqdn();
+}
+
+/* get_fqhostname() for connection setup, answered from fqdn_cache */
+int _sasl_get_fqhostname(char *name, int namelen)
+{
+    time_t now;
+    int fresh;
+
+    if (!fqdn_cache.mutex) return get_fqhostname(name, namelen, 0);
+
+    now = time(NULL);
+    if (sasl_MUTEX_LOCK(fqdn_cache.mutex) != SASL_OK) return -1;
+    fresh = fqdn_cache.resolved != 0 &&
+	(fqdn_cache.ttl == 0 || fqdn_cache.resolving ||
+	 (unsigned long) (now - fqdn_cache.resolved) < fqdn_cache.ttl);
+    if (!fresh) fqdn_cache.resolving = 1;
+    sasl_MUTEX_UNLOCK(fqdn_cache.mutex);
+
+    if (!fresh) fqdn_resolve();
+
+    if (sasl_MUTEX_LOCK(fqdn_cache.mutex) != SASL_OK) return -1;
+    if (fqdn_cache.resolved == 0) {
+	sasl_MUTEX_UNLOCK(fqdn_cache.mutex);
+	return -1;
+    }
+    strncpy(name, fqdn_cache.name, namelen);
+    name[namelen - 1] = '\0';
+    sasl_MUTEX_UNLOCK(fqdn_cache.mutex);
+
+    return 0;
+}
+
+/* resolve the name given to connections without a serverFQDN again,
+ * e.g. after the host was renamed
+ * returns:
+ *  SASL_OK      -- success
+ *  SASL_NOTINIT -- sasl_server_init/sasl_client_init not called
+ *  SASL_FAIL    -- no name, the previous one (if any) is kept
+ */
+int sasl_refresh_fqdn(void)
+{
+    if (!fqdn_cache.mutex) return SASL_NOTINIT;
+
+    return fqdn_resolve() == 0 ? SASL_OK : SASL_FAIL;
+}
+
 #if defined(WIN32) && !defined(__MINGW32__)
 /***************************************************************************** 
  * 
@@ -92,6 +92,62 @@ static mech_list_t *mechlist = NULL; /* global var which holds the list */
 
 static sasl_global_callbacks_t global_callbacks;
 
+/* With the server_conn_pool option, server connections are allocated in
+ * one piece with their sparams and utils, and sasl_dispose() puts them on
+ * an idle list for sasl_server_new() to pick up again.  An idle connection
+ * keeps its propctx, error buffers and strings, so reusing one for the
+ * same service costs no allocation at all. */
+typedef struct server_conn_arena {
+    sasl_server_conn_t conn;	/* first, this is what sasl_conn_t points at */
+    sasl_server_params_t sparams;
+    sasl_utils_t utils;
+    struct server_conn_arena *next;
+} server_conn_arena_t;
+
+static struct {
+    void *mutex;
+    server_conn_arena_t *idle;
+    unsigned count;		/* idle, and about to be */
+    unsigned max;		/* 0: no pooling */
+} conn_pool;
+
+/* sasl_listmech() answers, for the connections that share a policy: the
+ * service, the listmech() decorations, the security properties and flags,
+ * the channel binding and the mechanisms on offer.  mech_avail() is still
+ * asked about the mechanisms that have one, and its verdicts are part of
+ * the key, so a change in them is a miss.  Adding (or loading) a plugin
+ * empties the cache. */
+#define LISTMECH_MAX_MECHS 64	/* longer mech_lists aren't cached */
+#define LISTMECH_BUCKETS 61
+#define LISTMECH_MAX_ENTRIES 256
+
+typedef struct listmech_key {
+    unsigned hash;
+    const char *service, *prefix, *sep, *suffix;
+    sasl_ssf_t min_ssf, external_ssf;
+    unsigned security_flags;
+    unsigned flags;		/* SASL_NEED_PROXY | SASL_NEED_HTTP */
+    int cbinding;		/* 0: none, 1: present, 2: critical */
+    int mech_length;
+    const sasl_server_plug_t *plugs[LISTMECH_MAX_MECHS];
+    char avail[LISTMECH_MAX_MECHS]; /* mech_permitted() of the mechs with
+				       a mech_avail, 0 or 1; 2 for others */
+} listmech_key_t;
+
+typedef struct listmech_entry {
+    struct listmech_entry *next;
+    listmech_key_t key;		/* strings point into data */
+    int count;
+    unsigned len;
+    char data[1];		/* service, prefix, sep, suffix, the list */
+} listmech_entry_t;
+
+static struct {
+    void *mutex;
+    listmech_entry_t *buckets[LISTMECH_BUCKETS];
+    unsigned entries;
+} listmech_cache;
+
 /* set the password for a user
  *  conn        -- SASL connection
  *  user        -- user name
@@ -301,9 +357,11 @@ int sasl_setpass(sasl_conn_t *conn,
 }
 
 /* local mechanism which disposes of server */
-static void server_dispose(sasl_conn_t *pconn)
+/* drop what a connection picked up while in use: the mechanism contexts,
+ * its own mech_list and the user realm */
+static void server_conn_clear(sasl_server_conn_t *s_conn)
 {
-    sasl_server_conn_t *s_conn=  (sasl_server_conn_t *) pconn;
+    sasl_conn_t *pconn = (sasl_conn_t *) s_conn;
     context_list_t *cur, *cur_next;
 
     /* Just sanity check that sasl_server_done wasn't called yet */
@@ -328,6 +386,55 @@ static void server_dispose(sasl_conn_t *pconn)
 	}  
 	s_conn->mech_contexts = NULL;
     }
+    s_conn->mech = NULL;
+
+    if (s_conn->user_realm) {
+	sasl_FREE(s_conn->user_realm);
+	s_conn->user_realm = NULL;
+    }
+
+    if (s_conn->mech_list != mechlist->mech_list) {
+	/* free connection-specific mech_list */
+	mechanism_t *m, *prevm;
+
+	m = s_conn->mech_list; /* m point to beginning of the list */
+
+	while (m) {
+	     prevm = m;
+	     m = m->next;
+	     sasl_FREE(prevm);
+	}
+    }
+    s_conn->mech_list = NULL;
+    s_conn->mech_length = 0;
+}
+
+/* free everything a pooled connection holds but the arena itself */
+static void server_arena_dispose(server_conn_arena_t *arena)
+{
+    sasl_randfree(&arena->utils.rpool);
+
+    if (arena->sparams.propctx) {
+	prop_dispose(&arena->sparams.propctx);
+    }
+
+    if (arena->conn.appname) {
+	sasl_FREE(arena->conn.appname);
+    }
+
+    _sasl_conn_dispose((sasl_conn_t *) &arena->conn);
+}
+
+static void server_dispose(sasl_conn_t *pconn)
+{
+    sasl_server_conn_t *s_conn=  (sasl_server_conn_t *) pconn;
+
+    server_conn_clear(s_conn);
+
+    if (s_conn->pooled) {
+	server_arena_dispose((server_conn_arena_t *) s_conn);
+	return;
+    }
   
     _sasl_free_utils(&s_conn->sparams->utils);
 
@@ -339,28 +446,95 @@ static void server_dispose(sasl_conn_t *pconn)
 	sasl_FREE(s_conn->appname);
     }
 
-    if (s_conn->user_realm) {
-	sasl_FREE(s_conn->user_realm);
-    }
-
     if (s_conn->sparams) {
 	sasl_FREE(s_conn->sparams);
     }
 
-    if (s_conn->mech_list != mechlist->mech_list) {
-	/* free connection-specific mech_list */
-	mechanism_t *m, *prevm;
+    _sasl_conn_dispose(pconn);
+}
 
-	m = s_conn->mech_list; /* m point to beginning of the list */
+/* sasl_dispose() of a pooled connection: clear it and put it on the idle
+ * list, unless that is full */
+static int server_recycle(sasl_conn_t *pconn)
+{
+    sasl_server_conn_t *s_conn = (sasl_server_conn_t *) pconn;
+    server_conn_arena_t *arena = (server_conn_arena_t *) pconn;
+    struct propctx *propctx;
+    const sasl_utils_t *utils;
 
-	while (m) {
-	     prevm = m;
-	     m = m->next;
-	     sasl_FREE(prevm);
+    if (!_sasl_server_active || !conn_pool.mutex) return SASL_FAIL;
+
+    if (sasl_MUTEX_LOCK(conn_pool.mutex) != SASL_OK) return SASL_FAIL;
+    if (conn_pool.count >= conn_pool.max) {
+	sasl_MUTEX_UNLOCK(conn_pool.mutex);
+	return SASL_FAIL;
+    }
+    conn_pool.count++;
+    sasl_MUTEX_UNLOCK(conn_pool.mutex);
+
+    server_conn_clear(s_conn);
+    _sasl_conn_reset(pconn);
+
+    propctx = s_conn->sparams->propctx;
+    utils = s_conn->sparams->utils;
+    _sasl_prop_reset(propctx);
+    memset(s_conn->sparams, 0, sizeof(sasl_server_params_t));
+    s_conn->sparams->propctx = propctx;
+    s_conn->sparams->utils = utils;
+    s_conn->sent_last = s_conn->authenticated = 0;
+
+    sasl_MUTEX_LOCK(conn_pool.mutex);
+    arena->next = conn_pool.idle;
+    conn_pool.idle = arena;
+    sasl_MUTEX_UNLOCK(conn_pool.mutex);
+
+    return SASL_OK;
+}
+
+/* an idle connection from the pool, or a new pooled one */
+static sasl_server_conn_t *server_conn_get(void)
+{
+    server_conn_arena_t *arena = NULL;
+
+    if (sasl_MUTEX_LOCK(conn_pool.mutex) == SASL_OK) {
+	arena = conn_pool.idle;
+	if (arena) {
+	    conn_pool.idle = arena->next;
+	    conn_pool.count--;
 	}
+	sasl_MUTEX_UNLOCK(conn_pool.mutex);
     }
+    if (arena) return &arena->conn;
 
-    _sasl_conn_dispose(pconn);
+    arena = sasl_ALLOC(sizeof(server_conn_arena_t));
+    if (!arena) return NULL;
+    memset(arena, 0, sizeof(server_conn_arena_t));
+
+    _sasl_init_utils(&arena->utils, (sasl_conn_t *) &arena->conn,
+		     &global_callbacks);
+    arena->sparams.utils = &arena->utils;
+    arena->conn.sparams = &arena->sparams;
+    arena->conn.pooled = 1;
+
+    return &arena->conn;
+}
+
+/* free the idle connections */
+static void server_pool_done(void)
+{
+    server_conn_arena_t *arena;
+
+    while ((arena = conn_pool.idle) != NULL) {
+	conn_pool.idle = arena->next;
+	server_arena_dispose(arena);
+	sasl_FREE(arena);
+    }
+    conn_pool.count = conn_pool.max = 0;
+
+    if (conn_pool.mutex) {
+	sasl_MUTEX_FREE(conn_pool.mutex);
+	conn_pool.mutex = NULL;
+    }
 }
 
 static int init_mechlist(void)
@@ -418,6 +592,32 @@ static int mech_compare(const sasl_server_plug_t *a,
  * parameters:
  *  p - entry point
  */
+/* empty listmech_cache, with its mutex held */
+static void listmech_cache_clear(void)
+{
+    listmech_entry_t *entry;
+    int i;
+
+    for (i = 0; i < LISTMECH_BUCKETS; i++) {
+	while ((entry = listmech_cache.buckets[i]) != NULL) {
+	    listmech_cache.buckets[i] = entry->next;
+	    sasl_FREE(entry);
+	}
+    }
+    listmech_cache.entries = 0;
+}
+
+/* forget all cached sasl_listmech() answers */
+static void listmech_cache_flush(void)
+{
+    if (!listmech_cache.mutex ||
+	sasl_MUTEX_LOCK(listmech_cache.mutex) != SASL_OK) return;
+
+    listmech_cache_clear();
+
+    sasl_MUTEX_UNLOCK(listmech_cache.mutex);
+}
+
 int sasl_server_add_plugin(const char *plugname,
 			   sasl_server_plug_init_t *p)
 {
@@ -430,6 +630,8 @@ int sasl_server_add_plugin(const char *plugname,
 
     if(!plugname || !p) return SASL_BADPARAM;
 
+    listmech_cache_flush();
+
     entry_point = (sasl_server_plug_init_t *)p;
 
     /* call into the shared library asking for information about it */
@@ -538,6 +740,14 @@ static int server_done(void) {
       return SASL_CONTINUE;
   }
 
+  server_pool_done();
+
+  listmech_cache_flush();
+  if (listmech_cache.mutex) {
+      sasl_MUTEX_FREE(listmech_cache.mutex);
+      listmech_cache.mutex = NULL;
+  }
+
   if (mechlist != NULL)
   {
       m=mechlist->mech_list; /* m point to beginning of the list */
@@ -563,6 +773,9 @@ static int server_done(void) {
   /* Free the auxprop plugins */
   _sasl_auxprop_free();
 
+  /* Close pooled saslauthd connections */
+  _sasl_checkpw_done();
+
   global_callbacks.callbacks = NULL;
   global_callbacks.appname = NULL;
 
@@ -799,6 +1012,22 @@ static int parse_mechlist_file(const char *mechlistfile)
     return r;
 }
 
+
+/* a numeric option, def if it isn't set */
+static unsigned server_option_uint(const char *option, unsigned def)
+{
+    sasl_getopt_t *getopt;
+    void *context;
+    const char *val = NULL;
+
+    if (_sasl_getcallback(NULL, SASL_CB_GETOPT, (sasl_callback_ft *)&getopt,
+			  &context) == SASL_OK) {
+	getopt(&global_callbacks, NULL, option, &val, NULL);
+    }
+
+    return val ? (unsigned) strtoul(val, NULL, 10) : def;
+}
+
 /* initialize server drivers, done once per process
  *  callbacks      -- callbacks for all server connections; must include
  *                    getopt callback
@@ -878,6 +1107,12 @@ int sasl_server_init(const sasl_callback_t *callbacks,
 	return ret;
     }
 
+    ret = _sasl_checkpw_init();
+    if (ret != SASL_OK) {
+	server_done();
+	return ret;
+    }
+
     vf = _sasl_find_verifyfile_callback(callbacks);
 
     /* load config file if applicable */
@@ -887,6 +1122,24 @@ int sasl_server_init(const sasl_callback_t *callbacks,
 	return ret;
     }
 
+    /* resolve our own name now rather than in every sasl_server_new() */
+    _sasl_fqdn_setup(server_option_uint("fqdn_cache_ttl", SASL_FQDN_TTL));
+
+    listmech_cache.mutex = sasl_MUTEX_ALLOC();
+    if (!listmech_cache.mutex) {
+	server_done();
+	return SASL_FAIL;
+    }
+
+    conn_pool.max = server_option_uint("server_conn_pool", 0);
+    if (conn_pool.max) {
+	conn_pool.mutex = sasl_MUTEX_ALLOC();
+	if (!conn_pool.mutex) {
+	    server_done();
+	    return SASL_FAIL;
+	}
+    }
+
     /* load internal plugins */
     sasl_server_add_plugin("EXTERNAL", &external_server_plug_init);
 
@@ -1030,19 +1283,28 @@ int sasl_server_new(const char *service,
   if (! pconn) return SASL_FAIL;
   if (! service) return SASL_FAIL;
 
-  *pconn=sasl_ALLOC(sizeof(sasl_server_conn_t));
-  if (*pconn==NULL) return SASL_NOMEM;
+  if (conn_pool.max) {
+      /* sparams and utils come with it, already set up */
+      serverconn = server_conn_get();
+      if (serverconn == NULL) return SASL_NOMEM;
 
-  memset(*pconn, 0, sizeof(sasl_server_conn_t));
+      *pconn = (sasl_conn_t *) serverconn;
+      (*pconn)->recycle_conn = &server_recycle;
+  } else {
+      *pconn=sasl_ALLOC(sizeof(sasl_server_conn_t));
+      if (*pconn==NULL) return SASL_NOMEM;
 
-  serverconn = (sasl_server_conn_t *)*pconn;
+      memset(*pconn, 0, sizeof(sasl_server_conn_t));
 
-  /* make sparams */
-  serverconn->sparams=sasl_ALLOC(sizeof(sasl_server_params_t));
-  if (serverconn->sparams==NULL)
-      MEMERROR(*pconn);
+      serverconn = (sasl_server_conn_t *)*pconn;
 
-  memset(serverconn->sparams, 0, sizeof(sasl_server_params_t));
+      /* make sparams */
+      serverconn->sparams=sasl_ALLOC(sizeof(sasl_server_params_t));
+      if (serverconn->sparams==NULL)
+	  MEMERROR(*pconn);
+
+      memset(serverconn->sparams, 0, sizeof(sasl_server_params_t));
+  }
 
   (*pconn)->destroy_conn = &server_dispose;
   result = _sasl_conn_init(*pconn, service, flags, SASL_CONN_SERVER,
@@ -1053,37 +1315,51 @@ int sasl_server_new(const char *service,
       goto done_error;
 
 
-  /* set util functions - need to do rest */
-  utils=_sasl_alloc_utils(*pconn, &global_callbacks);
-  if (!utils) {
-      result = SASL_NOMEM;
-      goto done_error;
+  if (serverconn->pooled) {
+      utils = (sasl_utils_t *) serverconn->sparams->utils;
+  } else {
+      /* set util functions - need to do rest */
+      utils=_sasl_alloc_utils(*pconn, &global_callbacks);
+      if (!utils) {
+	  result = SASL_NOMEM;
+	  goto done_error;
+      }
   }
   
   utils->checkpass = &_sasl_checkpass;
 
   /* Setup the propctx -> We'll assume the default size */
-  serverconn->sparams->propctx=prop_new(0);
-  if(!serverconn->sparams->propctx) {
-      result = SASL_NOMEM;
-      goto done_error;
+  if (!serverconn->sparams->propctx) {
+      serverconn->sparams->propctx=prop_new(0);
+      if(!serverconn->sparams->propctx) {
+	  result = SASL_NOMEM;
+	  goto done_error;
+      }
   }
 
   serverconn->sparams->service = (*pconn)->service;
   serverconn->sparams->servicelen = (unsigned) strlen((*pconn)->service);
 
+  if (serverconn->appname &&
+      (!global_callbacks.appname ||
+       strcmp(serverconn->appname, global_callbacks.appname) != 0)) {
+    sasl_FREE(serverconn->appname);
+    serverconn->appname = NULL;
+  }
+
   if (global_callbacks.appname && global_callbacks.appname[0] != '\0') {
-    result = _sasl_strdup (global_callbacks.appname,
-			   &serverconn->appname,
-			   NULL);
-    if (result != SASL_OK) {
-      result = SASL_NOMEM;
-      goto done_error;
+    if (!serverconn->appname) {
+      result = _sasl_strdup (global_callbacks.appname,
+			     &serverconn->appname,
+			     NULL);
+      if (result != SASL_OK) {
+	result = SASL_NOMEM;
+	goto done_error;
+      }
     }
     serverconn->sparams->appname = serverconn->appname;
     serverconn->sparams->applen = (unsigned) strlen(serverconn->sparams->appname);
   } else {
-    serverconn->appname = NULL;
     serverconn->sparams->appname = NULL;
     serverconn->sparams->applen = 0;
   }
@@ -1173,7 +1449,11 @@ int sasl_server_new(const char *service,
   if(result == SASL_OK) return SASL_OK;
 
  done_error:
-  _sasl_conn_dispose(*pconn);
+  if (serverconn->pooled) {
+      server_dispose(*pconn);
+  } else {
+      _sasl_conn_dispose(*pconn);
+  }
   sasl_FREE(*pconn);
   *pconn = NULL;
   return result;
@@ -1472,6 +1752,7 @@ int sasl_server_start(sasl_conn_t *conn,
 	    sasl_FREE((sasl_server_plug_t *) m->m.plug);
 	    m->m.plug = &pluglist[l];
 	    m->m.condition = SASL_OK;
+	    listmech_cache_flush();
 	}
 
 	if (result != SASL_OK) {
@@ -1717,6 +1998,180 @@ static unsigned mech_names_len(mechanism_t *mech_list)
  *
  * The default behavior is to separate with spaces if sep == NULL
  */
+static unsigned listmech_hash(unsigned hash, const void *mem, size_t len)
+{
+    const unsigned char *p = mem;
+
+    while (len--) {
+	hash = (hash ^ *p++) * 16777619;
+    }
+
+    return hash;
+}
+
+/* the policy of conn, as far as the sasl_listmech() answer goes, with
+ * mech_avail() asked for its verdicts
+ * returns SASL_FAIL if the answer shouldn't be cached */
+static int listmech_key(sasl_conn_t *conn,
+			const char *prefix,
+			const char *sep,
+			const char *suffix,
+			listmech_key_t *key)
+{
+    sasl_server_conn_t *s_conn = (sasl_server_conn_t *) conn;
+    mechanism_t *m;
+    int lup;
+
+    if (!listmech_cache.mutex || s_conn->mech_length > LISTMECH_MAX_MECHS)
+	return SASL_FAIL;
+
+    key->service = conn->service;
+    key->prefix = prefix ? prefix : "";
+    key->sep = sep;
+    key->suffix = suffix ? suffix : "";
+    key->min_ssf = conn->props.min_ssf;
+    key->external_ssf = conn->external.ssf;
+    key->security_flags = conn->props.security_flags;
+    key->flags = conn->flags & (SASL_NEED_PROXY | SASL_NEED_HTTP);
+    key->cbinding = SASL_CB_CRITICAL(s_conn->sparams) ? 2 :
+	SASL_CB_PRESENT(s_conn->sparams) ? 1 : 0;
+
+    for (m = s_conn->mech_list, lup = 0;
+	 m && lup < s_conn->mech_length;
+	 m = m->next, lup++) {
+	key->plugs[lup] = m->m.plug;
+	if (m->m.plug->mech_avail) {
+	    key->avail[lup] = mech_permitted(conn, m) == SASL_OK;
+	} else {
+	    key->avail[lup] = 2;
+	}
+    }
+    key->mech_length = lup;
+
+    key->hash = listmech_hash(2166136261U, key->service,
+			      strlen(key->service) + 1);
+    key->hash = listmech_hash(key->hash, key->prefix, strlen(key->prefix) + 1);
+    key->hash = listmech_hash(key->hash, key->sep, strlen(key->sep) + 1);
+    key->hash = listmech_hash(key->hash, key->suffix, strlen(key->suffix) + 1);
+    key->hash = listmech_hash(key->hash, &key->min_ssf, sizeof(key->min_ssf));
+    key->hash = listmech_hash(key->hash, &key->external_ssf,
+			      sizeof(key->external_ssf));
+    key->hash = listmech_hash(key->hash, &key->security_flags,
+			      sizeof(key->security_flags));
+    key->hash = listmech_hash(key->hash, &key->flags, sizeof(key->flags));
+    key->hash = listmech_hash(key->hash, &key->cbinding,
+			      sizeof(key->cbinding));
+    key->hash = listmech_hash(key->hash, key->plugs,
+			      key->mech_length * sizeof(key->plugs[0]));
+    key->hash = listmech_hash(key->hash, key->avail, key->mech_length);
+
+    return SASL_OK;
+}
+
+static int listmech_key_equal(const listmech_key_t *a, const listmech_key_t *b)
+{
+    return a->hash == b->hash
+	&& a->min_ssf == b->min_ssf
+	&& a->external_ssf == b->external_ssf
+	&& a->security_flags == b->security_flags
+	&& a->flags == b->flags
+	&& a->cbinding == b->cbinding
+	&& a->mech_length == b->mech_length
+	&& !memcmp(a->plugs, b->plugs, a->mech_length * sizeof(a->plugs[0]))
+	&& !memcmp(a->avail, b->avail, a->mech_length)
+	&& !strcmp(a->service, b->service)
+	&& !strcmp(a->prefix, b->prefix)
+	&& !strcmp(a->sep, b->sep)
+	&& !strcmp(a->suffix, b->suffix);
+}
+
+/* copy the cached answer for key into conn->mechlist_buf
+ * returns SASL_OK if there was one, SASL_CONTINUE if not */
+static int listmech_lookup(sasl_conn_t *conn,
+			   const listmech_key_t *key,
+			   unsigned *plen,
+			   int *pcount)
+{
+    listmech_entry_t *entry;
+    int ret = SASL_CONTINUE;
+
+    if (sasl_MUTEX_LOCK(listmech_cache.mutex) != SASL_OK) return SASL_CONTINUE;
+
+    for (entry = listmech_cache.buckets[key->hash % LISTMECH_BUCKETS];
+	 entry;
+	 entry = entry->next) {
+	if (listmech_key_equal(&entry->key, key)) break;
+    }
+
+    if (entry) {
+	const char *list = entry->data + entry->len;
+
+	ret = _buf_alloc(&conn->mechlist_buf,
+			 &conn->mechlist_buf_len, strlen(list) + 1);
+	if (ret == SASL_OK) {
+	    strcpy(conn->mechlist_buf, list);
+	    if (plen != NULL) *plen = (unsigned) strlen(list);
+	    if (pcount != NULL) *pcount = entry->count;
+	}
+    }
+
+    sasl_MUTEX_UNLOCK(listmech_cache.mutex);
+
+    return ret;
+}
+
+/* remember list as the answer for key */
+static void listmech_insert(const listmech_key_t *key,
+			    const char *list,
+			    int count)
+{
+    listmech_entry_t *entry, **bucket;
+    size_t servicelen = strlen(key->service) + 1;
+    size_t prefixlen = strlen(key->prefix) + 1;
+    size_t seplen = strlen(key->sep) + 1;
+    size_t suffixlen = strlen(key->suffix) + 1;
+    size_t len = servicelen + prefixlen + seplen + suffixlen;
+    char *p;
+
+    entry = sasl_ALLOC(sizeof(listmech_entry_t) + len + strlen(list));
+    if (!entry) return;
+
+    entry->key = *key;
+    entry->count = count;
+    entry->len = (unsigned) len;
+
+    p = entry->data;
+    memcpy(p, key->service, servicelen);
+    entry->key.service = p;
+    p += servicelen;
+    memcpy(p, key->prefix, prefixlen);
+    entry->key.prefix = p;
+    p += prefixlen;
+    memcpy(p, key->sep, seplen);
+    entry->key.sep = p;
+    p += seplen;
+    memcpy(p, key->suffix, suffixlen);
+    entry->key.suffix = p;
+    p += suffixlen;
+    strcpy(p, list);
+
+    if (sasl_MUTEX_LOCK(listmech_cache.mutex) != SASL_OK) {
+	sasl_FREE(entry);
+	return;
+    }
+
+    if (listmech_cache.entries >= LISTMECH_MAX_ENTRIES) {
+	listmech_cache_clear();
+    }
+
+    bucket = &listmech_cache.buckets[key->hash % LISTMECH_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    listmech_cache.entries++;
+
+    sasl_MUTEX_UNLOCK(listmech_cache.mutex);
+}
+
 int _sasl_server_listmech(sasl_conn_t *conn,
 			  const char *user __attribute__((unused)),
 			  const char *prefix,
@@ -1733,6 +2188,8 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   size_t resultlen;
   int flag;
   const char *mysep;
+  listmech_key_t key;
+  int cached, permitted, count = 0;
 
   /* if there hasn't been a sasl_sever_init() fail */
   if (_sasl_server_active==0) return SASL_NOTINIT;
@@ -1756,6 +2213,17 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   if (!s_conn->mech_list || s_conn->mech_length <= 0)
       INTERROR(conn, SASL_NOMECH);
 
+  cached = listmech_key(conn, prefix, mysep, suffix, &key) == SASL_OK;
+  if (cached) {
+      ret = listmech_lookup(conn, &key, plen, pcount);
+      if (ret == SASL_OK) {
+	  *result = conn->mechlist_buf;
+	  return SASL_OK;
+      } else if (ret != SASL_CONTINUE) {
+	  MEMERROR(conn);
+      }
+  }
+
   resultlen = (prefix ? strlen(prefix) : 0)
             + (strlen(mysep) * (s_conn->mech_length - 1) * 2)
 	    + (mech_names_len(s_conn->mech_list) * 2) /* including -PLUS variant */
@@ -1778,7 +2246,14 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   /* make list */
   for (lup = 0; lup < s_conn->mech_length; lup++) {
       /* currently, we don't use the "user" parameter for anything */
-      if (mech_permitted(conn, listptr) == SASL_OK) {
+      if (cached && key.avail[lup] != 2) {
+	  /* mech_avail() was just asked */
+	  permitted = key.avail[lup];
+      } else {
+	  permitted = mech_permitted(conn, listptr) == SASL_OK;
+      }
+
+      if (permitted) {
 
           /*
            * If the server would never succeed in the authentication of
@@ -1787,9 +2262,7 @@ int _sasl_server_listmech(sasl_conn_t *conn,
            */
 	  if ((listptr->m.plug->features & SASL_FEAT_CHANNEL_BINDING) &&
 	      SASL_CB_PRESENT(s_conn->sparams)) {
-	    if (pcount != NULL) {
-		(*pcount)++;
-	    }
+	    count++;
 	    if (flag) {
               strcat(conn->mechlist_buf, mysep);
 	    } else {
@@ -1807,9 +2280,7 @@ int _sasl_server_listmech(sasl_conn_t *conn,
            */
           if (!SASL_CB_PRESENT(s_conn->sparams) ||
               !SASL_CB_CRITICAL(s_conn->sparams)) {
-            if (pcount != NULL) {
-	      (*pcount)++;
-	    }
+	    count++;
 	    if (flag) {
               strcat(conn->mechlist_buf, mysep);
 	    } else {
@@ -1827,6 +2298,11 @@ int _sasl_server_listmech(sasl_conn_t *conn,
 
   if (plen!=NULL)
       *plen = (unsigned) strlen(conn->mechlist_buf);
+  if (pcount != NULL)
+      *pcount = count;
+
+  if (cached)
+      listmech_insert(&key, conn->mechlist_buf, count);
 
   *result = conn->mechlist_buf;
 
@@ -1379,11 +1379,12 @@ static const unsigned short version = 1;
  * integrity:
  * len, HMAC(ki, {SeqNum, msg})[0..9], x0001, SeqNum
  */
-static int digestmd5_encode(void *context,
-			    const struct iovec *invec,
-			    unsigned numiov,
-			    const char **output,
-			    unsigned *outputlen)
+static int digestmd5_encode_packet(void *context,
+				   const struct iovec *invec,
+				   unsigned numiov,
+				   char **buf,
+				   unsigned *buflen,
+				   unsigned *outputlen)
 {
     context_t *text = (context_t *) context;
     int tmp;
@@ -1393,7 +1394,7 @@ static int digestmd5_encode(void *context,
     char *out;
     struct buffer_info *inblob, bufinfo;
     
-    if(!context || !invec || !numiov || !output || !outputlen) {
+    if(!context || !invec || !numiov || !buf || !buflen || !outputlen) {
 	PARAMERROR(text->utils);
 	return SASL_BADPARAM;
     }
@@ -1410,8 +1411,7 @@ static int digestmd5_encode(void *context,
     }
     
     /* make sure the output buffer is big enough for this blob */
-    ret = _plug_buf_alloc(text->utils, &(text->encode_buf),
-			  &(text->encode_buf_len),
+    ret = _plug_buf_alloc(text->utils, buf, buflen,
 			  (4 +			/* for length */
 			   inblob->curlen +	/* for content */
 			   10 +			/* for MAC */
@@ -1420,7 +1420,7 @@ static int digestmd5_encode(void *context,
     if(ret != SASL_OK) return ret;
     
     /* skip by the length for now */
-    out = (text->encode_buf)+4;
+    out = (*buf)+4;
     
     /* construct (seqnum, msg)
      *
@@ -1428,14 +1428,14 @@ static int digestmd5_encode(void *context,
      * for an integrity-only layer.
      */
     tmpnum = htonl(text->seqnum);
-    memcpy(text->encode_buf, &tmpnum, 4);
-    memcpy(text->encode_buf + 4, inblob->data, inblob->curlen);
+    memcpy(*buf, &tmpnum, 4);
+    memcpy(*buf + 4, inblob->data, inblob->curlen);
     
     if (text->cipher_enc) {
 	unsigned char digest[16];
 
 	/* HMAC(ki, (seqnum, msg) ) */
-	text->utils->hmac_md5((const unsigned char *) text->encode_buf,
+	text->utils->hmac_md5((const unsigned char *) *buf,
 			      inblob->curlen + 4, 
 			      text->Ki_send, HASHLEN, digest);
 
@@ -1446,10 +1446,10 @@ static int digestmd5_encode(void *context,
     }
     else {
 	/* HMAC(ki, (seqnum, msg) ) -- put directly into output buffer */
-	text->utils->hmac_md5((const unsigned char *) text->encode_buf,
+	text->utils->hmac_md5((const unsigned char *) *buf,
 			      inblob->curlen + 4, 
 			      text->Ki_send, HASHLEN,
-			      (unsigned char *) text->encode_buf +
+			      (unsigned char *) *buf +
 						inblob->curlen + 4);
 
 	*outputlen = inblob->curlen + 10; /* for message + CMAC */
@@ -1471,16 +1471,36 @@ static int digestmd5_encode(void *context,
     
     /* put the 1st 4 bytes in */
     tmp=htonl(*outputlen);  
-    memcpy(text->encode_buf, &tmp, 4);
+    memcpy(*buf, &tmp, 4);
     
     (*outputlen)+=4;
     
-    *output = text->encode_buf;
     text->seqnum++;
     
     return SASL_OK;
 }
 
+static int digestmd5_encode(void *context,
+			    const struct iovec *invec,
+			    unsigned numiov,
+			    const char **output,
+			    unsigned *outputlen)
+{
+    context_t *text = (context_t *) context;
+    int ret;
+
+    if(!context || !output) {
+	PARAMERROR(text->utils);
+	return SASL_BADPARAM;
+    }
+
+    ret = digestmd5_encode_packet(context, invec, numiov, &text->encode_buf,
+				  &text->encode_buf_len, outputlen);
+    if (ret == SASL_OK) *output = text->encode_buf;
+
+    return ret;
+}
+
 static int digestmd5_decode_packet(void *context,
 					   const char *input,
 					   unsigned inputlen,
@@ -2721,14 +2741,17 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 	}
 	
 	oparams->encode=&digestmd5_encode;
+	oparams->encode_packet=&digestmd5_encode_packet;
 	oparams->decode=&digestmd5_decode;
     } else if (!strcasecmp(qop, "auth-int") &&
 	       stext->requiressf <= 1 && stext->limitssf >= 1) {
 	oparams->encode = &digestmd5_encode;
+	oparams->encode_packet = &digestmd5_encode_packet;
 	oparams->decode = &digestmd5_decode;
 	oparams->mech_ssf = 1;
     } else if (!strcasecmp(qop, "auth") && stext->requiressf == 0) {
 	oparams->encode = NULL;
+	oparams->encode_packet = NULL;
 	oparams->decode = NULL;
 	oparams->mech_ssf = 0;
     } else {
@@ -3392,6 +3415,7 @@ static int make_client_response(context_t *text,
     case DIGEST_PRIVACY:
 	qop = "auth-conf";
 	oparams->encode = &digestmd5_encode; 
+	oparams->encode_packet = &digestmd5_encode_packet;
 	oparams->decode = &digestmd5_decode;
 	oparams->mech_ssf = ctext->cipher->ssf;
 
@@ -3404,6 +3428,7 @@ static int make_client_response(context_t *text,
     case DIGEST_INTEGRITY:
 	qop = "auth-int";
 	oparams->encode = &digestmd5_encode;
+	oparams->encode_packet = &digestmd5_encode_packet;
 	oparams->decode = &digestmd5_decode;
 	oparams->mech_ssf = 1;
 	break;
@@ -3411,6 +3436,7 @@ static int make_client_response(context_t *text,
     default:
 	qop = "auth";
 	oparams->encode = NULL;
+	oparams->encode_packet = NULL;
 	oparams->decode = NULL;
 	oparams->mech_ssf = 0;
     }
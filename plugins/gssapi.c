@@ -323,7 +323,8 @@ sasl_gss_seterror_(const sasl_utils_t *utils, OM_uint32 maj, OM_uint32 min,
 
 static int 
 sasl_gss_encode(void *context, const struct iovec *invec, unsigned numiov,
-		const char **output, unsigned *outputlen, int privacy)
+		char **buf, unsigned *buflen, unsigned *outputlen,
+		int privacy)
 {
     context_t *text = (context_t *)context;
     OM_uint32 maj_stat, min_stat;
@@ -332,7 +333,7 @@ sasl_gss_encode(void *context, const struct iovec *invec, unsigned numiov,
     int ret;
     struct buffer_info *inblob, bufinfo;
     
-    if (!output) return SASL_BADPARAM;
+    if (!buf || !buflen) return SASL_BADPARAM;
     
     if (numiov > 1) {
 	ret = _plug_iovec_to_buf(text->utils, invec, numiov, &text->enc_in_buf);
@@ -375,12 +376,10 @@ sasl_gss_encode(void *context, const struct iovec *invec, unsigned numiov,
 	return SASL_FAIL;
     }
     
-    if (output_token->value && output) {
+    if (output_token->value) {
 	unsigned char * p;
 	
-	ret = _plug_buf_alloc(text->utils,
-			      &(text->encode_buf),
-			      &(text->encode_buf_len),
+	ret = _plug_buf_alloc(text->utils, buf, buflen,
 			      output_token->length + 4);
 	
 	if (ret != SASL_OK) {
@@ -390,22 +389,20 @@ sasl_gss_encode(void *context, const struct iovec *invec, unsigned numiov,
 	    return ret;
 	}
 
-	p = (unsigned char *) text->encode_buf;
+	p = (unsigned char *) *buf;
 	
 	p[0] = (output_token->length>>24) & 0xFF;
 	p[1] = (output_token->length>>16) & 0xFF;
 	p[2] = (output_token->length>>8) & 0xFF;
 	p[3] = output_token->length & 0xFF;
 
-	memcpy(text->encode_buf + 4, output_token->value, output_token->length);
+	memcpy(*buf + 4, output_token->value, output_token->length);
     }
     
     if (outputlen) {
 	*outputlen = output_token->length + 4;
     }
     
-    *output = text->encode_buf;
-    
     if (output_token->value) {
 	GSS_LOCK_MUTEX(text->utils);
 	gss_release_buffer(&min_stat, output_token);
@@ -419,14 +416,48 @@ static int gssapi_privacy_encode(void *context, const struct iovec *invec,
 				 unsigned numiov, const char **output,
 				 unsigned *outputlen)
 {
-    return sasl_gss_encode(context,invec,numiov,output,outputlen,1);
+    context_t *text = (context_t *)context;
+    int ret;
+
+    if (!output) return SASL_BADPARAM;
+
+    ret = sasl_gss_encode(context,invec,numiov,&text->encode_buf,
+			  &text->encode_buf_len,outputlen,1);
+    if (ret == SASL_OK) *output = text->encode_buf;
+
+    return ret;
 }
 
 static int gssapi_integrity_encode(void *context, const struct iovec *invec,
 				   unsigned numiov, const char **output,
 				   unsigned *outputlen) 
 {
-    return sasl_gss_encode(context,invec,numiov,output,outputlen,0);
+    context_t *text = (context_t *)context;
+    int ret;
+
+    if (!output) return SASL_BADPARAM;
+
+    ret = sasl_gss_encode(context,invec,numiov,&text->encode_buf,
+			  &text->encode_buf_len,outputlen,0);
+    if (ret == SASL_OK) *output = text->encode_buf;
+
+    return ret;
+}
+
+static int gssapi_privacy_encode_packet(void *context,
+					const struct iovec *invec,
+					unsigned numiov, char **buf,
+					unsigned *buflen, unsigned *outputlen)
+{
+    return sasl_gss_encode(context,invec,numiov,buf,buflen,outputlen,1);
+}
+
+static int gssapi_integrity_encode_packet(void *context,
+					  const struct iovec *invec,
+					  unsigned numiov, char **buf,
+					  unsigned *buflen, unsigned *outputlen)
+{
+    return sasl_gss_encode(context,invec,numiov,buf,buflen,outputlen,0);
 }
 
 static int
@@ -1153,11 +1184,13 @@ gssapi_server_mech_ssfreq(context_t *text,
     if (layerchoice == LAYER_NONE &&
 	(text->qop & LAYER_NONE)) { /* no encryption */
 	oparams->encode = NULL;
+	oparams->encode_packet = NULL;
 	oparams->decode = NULL;
 	oparams->mech_ssf = 0;
     } else if (layerchoice == LAYER_INTEGRITY &&
 	       (text->qop & LAYER_INTEGRITY)) { /* integrity */
 	oparams->encode = &gssapi_integrity_encode;
+	oparams->encode_packet = &gssapi_integrity_encode_packet;
 	oparams->decode = &gssapi_decode;
 	oparams->mech_ssf = 1;
     } else if ((layerchoice == LAYER_CONFIDENTIALITY ||
@@ -1165,6 +1198,7 @@ gssapi_server_mech_ssfreq(context_t *text,
 		layerchoice == (LAYER_CONFIDENTIALITY|LAYER_INTEGRITY)) &&
 	       (text->qop & LAYER_CONFIDENTIALITY)) { /* privacy */
 	oparams->encode = &gssapi_privacy_encode;
+	oparams->encode_packet = &gssapi_privacy_encode_packet;
 	oparams->decode = &gssapi_decode;
 	/* FIX ME: Need to extract the proper value here */
 	oparams->mech_ssf = K5_MAX_SSF;
@@ -1810,6 +1844,7 @@ static int gssapi_client_mech_step(void *conn_context,
 
 	    /* encryption */
 	    oparams->encode = &gssapi_privacy_encode;
+	    oparams->encode_packet = &gssapi_privacy_encode_packet;
 	    oparams->decode = &gssapi_decode;
 	    /* FIX ME: Need to extract the proper value here */
 	    oparams->mech_ssf = K5_MAX_SSF;
@@ -1835,6 +1870,7 @@ static int gssapi_client_mech_step(void *conn_context,
 		    (serverhas & LAYER_INTEGRITY)) {
 	    /* integrity */
 	    oparams->encode = &gssapi_integrity_encode;
+	    oparams->encode_packet = &gssapi_integrity_encode_packet;
 	    oparams->decode = &gssapi_decode;
 	    oparams->mech_ssf = 1;
 	    mychoice = LAYER_INTEGRITY;
@@ -1842,6 +1878,7 @@ static int gssapi_client_mech_step(void *conn_context,
 		   need <= 0 && (serverhas & LAYER_NONE)) {
 	    /* no layer */
 	    oparams->encode = NULL;
+	    oparams->encode_packet = NULL;
 	    oparams->decode = NULL;
 	    oparams->mech_ssf = 0;
 	    mychoice = LAYER_NONE;
@@ -69,10 +69,12 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <signal.h>
 #include <netdb.h>
+#include <poll.h>
+#include <time.h>
 
 #include "mechanisms.h"
 #include "utils.h"
@@ -96,6 +98,47 @@ static struct addrinfo *ai = NULL;      /* remote host, as looked up    */
 
 #define NETWORK_IO_TIMEOUT 30		/* network I/O timeout (seconds) */
 #define RESP_LEN 1000			/* size of read response buffer  */
+#define HTTP_BUF_LEN 4096		/* per connection read buffer	 */
+#define HTTP_CONNECTIONS 4		/* connections to the remote host */
+#define HTTP_PIPELINE 1			/* requests in flight per connection */
+#define HTTP_IDLE_TIMEOUT 4		/* reconnect connections idle longer */
+
+/* A persistent connection to the remote host. Requests on it get
+   consecutive tickets; written counts the requests sent and done the
+   responses read, so the request whose ticket equals written writes
+   next and the one whose ticket equals done reads next. */
+struct http_conn {
+    int fd;
+    int closing;			/* no further requests on it	 */
+    int users;				/* requests sent or about to be	 */
+    unsigned int sent;
+    unsigned int written;
+    unsigned int done;
+    time_t last_used;
+    size_t pos, len;			/* unread part of buf		 */
+    char buf[HTTP_BUF_LEN];
+};
+
+static struct http_conn *conns = NULL;
+static int max_conns = HTTP_CONNECTIONS;	/* httpform_connections */
+static int pipeline = HTTP_PIPELINE;		/* httpform_pipeline */
+static int idle_timeout = HTTP_IDLE_TIMEOUT;	/* httpform_idle_timeout */
+
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+# define HTTPFORM_THREADS
+# include <pthread.h>
+static pthread_mutex_t http_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t http_cond = PTHREAD_COND_INITIALIZER;
+# define HTTP_LOCK()	pthread_mutex_lock(&http_lock)
+# define HTTP_UNLOCK()	pthread_mutex_unlock(&http_lock)
+# define HTTP_WAIT()	pthread_cond_wait(&http_cond, &http_lock)
+# define HTTP_SIGNAL()	pthread_cond_broadcast(&http_cond)
+#else
+# define HTTP_LOCK()
+# define HTTP_UNLOCK()
+# define HTTP_WAIT()
+# define HTTP_SIGNAL()
+#endif
 
 #define TWO_CRLF "\r\n\r\n"
 #define CRLF "\r\n"
@@ -110,46 +153,6 @@ static struct addrinfo *ai = NULL;      /* remote host, as looked up    */
 #define RESP_UNAVAILABLE "NO [ALERT] The remote authentication server is currently unavailable"
 #define RESP_UNEXPECTED	"NO [ALERT] Unexpected response from remote authentication server"
 
-/* FUNCTION: sig_null */
-
-/* SYNOPSIS
- * Catch and ignore a signal.
- * END SYNOPSIS */
-
-static RETSIGTYPE				/* R: OS dependent */
-sig_null (
-  /* PARAMETERS */
-  int sig					/* I: signal being caught */
-  /* END PARAMETERS */
-  )
-{
-    switch (sig) {
-	
-      case SIGALRM:
-	signal(SIGALRM, sig_null);
-	break;
-
-      case SIGPIPE:
-	signal(SIGPIPE, sig_null);
-	break;
-
-      default:
-	logger(L_INFO, "auth_httpform", "unexpected signal %d", sig);
-	break;
-    }
-#ifdef __APPLE__
-    return;
-#else /* __APPLE__ */
-# if RETSIGTYPE == void
-    return;
-# else /* RETSIGTYPE */
-    return 0;
-# endif /* RETSIGTYPE */
-#endif /* __APPLE__ */
-}
-
-/* END FUNCTION: sig_null */
-
 /* FUNCTION: url_escape */
 
 /* SYNOPSIS
@@ -374,9 +377,18 @@ static char *build_sasl_response(
     }
 
     /* isolate the HTTP response code and string */
-    http_response_code = strpbrk(http_response, SPACE) + 1;
-    http_response_string = strpbrk(http_response_code, SPACE) + 1;
-    *(http_response_string-1) = '\0';  /* replace space after code with 0 */
+    http_response_code = strpbrk(http_response, SPACE);
+    if (http_response_code == NULL) {
+        logger(L_INFO, "auth_httpform", "malformed response to auth request: %s",
+               http_response);
+        return strdup(RESP_UNEXPECTED);
+    }
+    http_response_code++;
+    http_response_string = strpbrk(http_response_code, SPACE);
+    if (http_response_string != NULL)
+        *http_response_string++ = '\0';  /* replace space after code with 0 */
+    else
+        http_response_string = (char *) "";
 
     if (!strcmp(http_response_code, HTTP_STATUS_SUCCESS)) {
         return strdup("OK remote authentication successful");
@@ -417,6 +429,7 @@ auth_httpform_init (
     int rc;
     char *configname = NULL;
     struct addrinfo hints;
+    int i;
     /* END VARIABLES */
 
     /* name of config file may be given with -O option */
@@ -440,7 +453,14 @@ auth_httpform_init (
         r_port = cfile_getstring(config, "httpform_port", r_port);
         r_uri = cfile_getstring(config, "httpform_uri", r_uri);
         formdata = cfile_getstring(config, "httpform_data", formdata);
+        max_conns = cfile_getint(config, "httpform_connections", max_conns);
+        pipeline = cfile_getint(config, "httpform_pipeline", pipeline);
+        idle_timeout = cfile_getint(config, "httpform_idle_timeout", idle_timeout);
     }
+    if (max_conns < 1)
+        max_conns = 1;
+    if (pipeline < 1)
+        pipeline = 1;
     
     if (formdata == NULL || r_uri == NULL) {
         syslog(LOG_ERR, "auth_httpform_init formdata and uri must be specified");
@@ -469,60 +489,290 @@ auth_httpform_init (
         return -1;
     }
 
+    conns = calloc(max_conns, sizeof(*conns));
+    if (conns == NULL) {
+        syslog(LOG_ERR, "auth_httpform_init: out of memory");
+        return -1;
+    }
+    for (i = 0; i < max_conns; i++)
+        conns[i].fd = -1;
+
     return 0;
 }
 
 /* END FUNCTION: auth_httpform_init */
 
-/* FUNCTION: auth_httpform */
+/* FUNCTION: http_fill */
 
 /* SYNOPSIS
- * Proxy authenticate to a remote HTTP server with a form POST.
- *
- * This mechanism takes the plaintext authenticator and password, forms
- * them into an HTTP POST request. If the HTTP server responds with a 200
- * status code, the credentials are considered valid. If it responds with
- * a 403 HTTP status code, the credentials are considered wrong. Any other
- * HTTP status code is treated like a network error.
- */
+ * Read more of the response into the connection buffer, waiting at
+ * most NETWORK_IO_TIMEOUT seconds.
+ * END SYNOPSIS */
 
-/* XXX This should be extended to support SASL PLAIN authentication */
+static int				/* R: bytes read, 0 on EOF, -1 on error */
+http_fill (
+  /* PARAMETERS */
+  struct http_conn *conn		/* I: connection to read from */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct pollfd pfd;
+    ssize_t n;
+    /* END VARIABLES */
 
-char *					/* R: Allocated response string */
-auth_httpform (
+    if (conn->pos > 0) {
+        memmove(conn->buf, conn->buf + conn->pos, conn->len - conn->pos);
+        conn->len -= conn->pos;
+        conn->pos = 0;
+    }
+    if (conn->len == sizeof(conn->buf)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    for (;;) {
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN;
+        n = poll(&pfd, 1, NETWORK_IO_TIMEOUT * 1000);
+        if (n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (n > 0)
+            n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n > 0)
+            conn->len += n;
+        return n;
+    }
+}
+
+/* END FUNCTION: http_fill */
+
+/* FUNCTION: http_getline */
+
+/* SYNOPSIS
+ * Get the next line of the response, without its CRLF. A line longer
+ * than the buffer is truncated and the rest of it dropped.
+ * END SYNOPSIS */
+
+static int				/* R: 1 on success, 0 on EOF, -1 on error */
+http_getline (
   /* PARAMETERS */
-  const char *user,			/* I: plaintext authenticator */
-  const char *password,			/* I: plaintext password */
-  const char *service,
-  const char *realm
+  struct http_conn *conn,		/* I: connection to read from */
+  char *line,				/* O: the line */
+  size_t size				/* I: size of line */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char *eol;
+    size_t n;
+    int rc;
+    /* END VARIABLES */
+
+    while ((eol = memchr(conn->buf + conn->pos, '\n', conn->len - conn->pos)) == NULL) {
+        rc = http_fill(conn);
+        if (rc <= 0)
+            return rc;
+    }
+
+    n = eol - (conn->buf + conn->pos);
+    if (n > 0 && eol[-1] == '\r')
+        n--;
+    if (n >= size)
+        n = size - 1;
+    memcpy(line, conn->buf + conn->pos, n);
+    line[n] = '\0';
+    conn->pos = eol - conn->buf + 1;
+
+    return 1;
+}
+
+/* END FUNCTION: http_getline */
+
+/* FUNCTION: http_skip */
+
+/* SYNOPSIS
+ * Drop the next len bytes of the response (the body, which we don't use).
+ * END SYNOPSIS */
+
+static int				/* R: 1 on success, 0 on EOF, -1 on error */
+http_skip (
+  /* PARAMETERS */
+  struct http_conn *conn,		/* I: connection to read from */
+  unsigned long len			/* I: bytes to drop */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    size_t n;
+    int rc;
+    /* END VARIABLES */
+
+    for (;;) {
+        n = conn->len - conn->pos;
+        if (n > len)
+            n = len;
+        conn->pos += n;
+        len -= n;
+        if (len == 0)
+            return 1;
+        rc = http_fill(conn);
+        if (rc <= 0)
+            return rc;
+    }
+}
+
+/* END FUNCTION: http_skip */
+
+/* FUNCTION: http_response */
+
+/* SYNOPSIS
+ * Read one complete HTTP response, so that the connection is left at
+ * the start of the next one. The status line is returned in status,
+ * and keepalive tells whether the server will take further requests on
+ * this connection. Interim (1xx) responses are skipped; a body is
+ * delimited by Content-Length, chunked encoding or, failing both, the
+ * end of the connection.
+ * END SYNOPSIS */
+
+static int				/* R: 1 on success, 0 on EOF, -1 on error */
+http_response (
+  /* PARAMETERS */
+  struct http_conn *conn,		/* I: connection to read from */
+  char *status,				/* O: the status line, RESP_LEN */
+  int *keepalive			/* O: connection can be reused */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char line[RESP_LEN];		/* header or chunk size line */
+    char *c;				/* scratch pointer */
+    unsigned long length;		/* body length */
+    int has_length;			/* Content-Length seen */
+    int chunked;			/* Transfer-Encoding: chunked */
+    int code;				/* HTTP status code */
+    int rc;
+    /* END VARIABLES */
+
+    do {
+        rc = http_getline(conn, status, RESP_LEN);
+        if (rc <= 0)
+            return rc;
+        if (strncmp(status, "HTTP/1.", sizeof("HTTP/1.")-1) ||
+            (c = strchr(status, ' ')) == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        code = atoi(c + 1);
+        *keepalive = (status[sizeof("HTTP/1.")-1] != '0');
+        has_length = chunked = 0;
+        length = 0;
+
+        for (;;) {
+            rc = http_getline(conn, line, sizeof(line));
+            if (rc <= 0)
+                return rc ? rc : -1;
+            if (line[0] == '\0')
+                break;
+            if ((c = strchr(line, ':')) == NULL)
+                continue;
+            *c++ = '\0';
+            while (*c == ' ' || *c == '\t')
+                c++;
+            if (!strcasecmp(line, "Content-Length")) {
+                length = strtoul(c, NULL, 10);
+                has_length = 1;
+            } else if (!strcasecmp(line, "Transfer-Encoding")) {
+                chunked = (strstr(c, "chunked") != NULL);
+            } else if (!strcasecmp(line, "Connection")) {
+                if (!strcasecmp(c, "close"))
+                    *keepalive = 0;
+                else if (!strcasecmp(c, "keep-alive"))
+                    *keepalive = 1;
+            }
+        }
+    } while (code >= 100 && code < 200);
+
+    if (code == 204 || code == 304)
+        return 1;
+
+    if (chunked) {
+        for (;;) {
+            rc = http_getline(conn, line, sizeof(line));
+            if (rc <= 0)
+                return rc ? rc : -1;
+            length = strtoul(line, NULL, 16);
+            if (length == 0)
+                break;
+            rc = http_skip(conn, length + 2);	/* and the CRLF */
+            if (rc <= 0)
+                return rc ? rc : -1;
+        }
+        /* trailer, up to an empty line */
+        do {
+            rc = http_getline(conn, line, sizeof(line));
+            if (rc <= 0)
+                return rc ? rc : -1;
+        } while (line[0] != '\0');
+        return 1;
+    }
+
+    if (has_length) {
+        rc = http_skip(conn, length);
+        return rc ? rc : -1;
+    }
+
+    /* the body runs up to the end of the connection */
+    *keepalive = 0;
+    do {
+        conn->pos = conn->len;
+        rc = http_fill(conn);
+    } while (rc > 0);
+
+    return rc == 0 ? 1 : -1;
+}
+
+/* END FUNCTION: http_response */
+
+/* FUNCTION: http_connect */
+
+/* SYNOPSIS
+ * Open a connection to the remote HTTP server, trying each of its
+ * addresses in turn.
+ * END SYNOPSIS */
+
+static int				/* R: the socket, or -1 */
+http_connect (
+  /* PARAMETERS */
+  void					/* no parameters */
   /* END PARAMETERS */
   )
 {
     /* VARIABLES */
     int s=-1;                           /* socket to remote auth host   */
     struct addrinfo *r;                 /* remote socket address info   */
-    char *req;                          /* request, with user and pw    */
-    char *c;                            /* scratch pointer              */
-    int rc;                             /* return code scratch area     */
-    char postbuf[RESP_LEN];             /* request buffer               */
-    int postlen;                        /* length of post request       */
-    char rbuf[RESP_LEN];                /* response read buffer         */
     char hbuf[NI_MAXHOST], pbuf[NI_MAXSERV];
     int saved_errno;
     int niflags;
+    struct timeval tv;
     /* END VARIABLES */
 
-    /* sanity checks */
-    assert(user != NULL);
-    assert(password != NULL);
+    /* a stalled server must not hang the sender, who holds the lock */
+    tv.tv_sec = NETWORK_IO_TIMEOUT;
+    tv.tv_usec = 0;
 
-    /*establish connection to remote */
     for (r = ai; r; r = r->ai_next) {
         s = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
         if (s < 0)
             continue;
-        if (connect(s, r->ai_addr, r->ai_addrlen) >= 0)
+        if (connect(s, r->ai_addr, r->ai_addrlen) >= 0) {
+            setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
             break;
+        }
         close(s);
         s = -1;
         saved_errno = errno;
@@ -546,77 +796,294 @@ auth_httpform (
             strlcpy(pbuf, "unknown", sizeof(pbuf));
         syslog(LOG_WARNING, "auth_httpform: couldn't connect to %s/%s",
                ai->ai_canonname ? ai->ai_canonname : r_host, pbuf);
-        return strdup("NO [ALERT] Couldn't contact remote authentication server");
+    }
+
+    return s;
+}
+
+/* END FUNCTION: http_connect */
+
+/* FUNCTION: http_close */
+
+static void
+http_close (
+  /* PARAMETERS */
+  struct http_conn *conn		/* I: connection nobody is using */
+  /* END PARAMETERS */
+  )
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->closing = 0;
+    conn->sent = conn->written = conn->done = 0;
+    conn->pos = conn->len = 0;
+}
+
+/* END FUNCTION: http_close */
+
+/* FUNCTION: http_get */
+
+/* SYNOPSIS
+ * Choose the connection for a request: an idle open one, else a free
+ * slot to open a new one in, else (with httpform_pipeline) the open one
+ * with the fewest requests outstanding. Waits when all httpform_connections
+ * are busy. Must be called with the lock held.
+ * END SYNOPSIS */
+
+static struct http_conn *		/* R: the connection, reserved */
+http_get (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct http_conn *conn, *idle, *slot, *busy;
+    time_t now;
+    int i;
+    /* END VARIABLES */
+
+    for (;;) {
+        now = time(NULL);
+        idle = slot = busy = NULL;
+
+        for (i = 0; i < max_conns; i++) {
+            conn = &conns[i];
+            if (conn->fd >= 0 && conn->users == 0 &&
+                (conn->closing ||
+                 (idle_timeout > 0 && now - conn->last_used > idle_timeout)))
+                http_close(conn);
+
+            if (conn->fd < 0) {
+                if (conn->users == 0 && slot == NULL)
+                    slot = conn;
+            } else if (!conn->closing) {
+                if (conn->users == 0) {
+                    if (idle == NULL)
+                        idle = conn;
+                } else if (conn->users < pipeline &&
+                           (busy == NULL || conn->users < busy->users)) {
+                    busy = conn;
+                }
+            }
+        }
+
+        conn = idle ? idle : (slot ? slot : busy);
+        if (conn != NULL)
+            break;
+#ifdef HTTPFORM_THREADS
+        pthread_cond_wait(&http_cond, &http_lock);
+#endif
+    }
+
+    conn->users++;
+    return conn;
+}
+
+/* END FUNCTION: http_get */
+
+/* FUNCTION: http_request */
+
+/* SYNOPSIS
+ * Send a request and read its response on a pooled connection. With
+ * pipelining, requests on a connection are sent in the order of their
+ * tickets and each waits for its turn to read its response. The lock
+ * is only held to take a turn, never across network I/O.
+ * END SYNOPSIS */
+
+static int				/* R: 1 on success, 0 to retry, -1 on error */
+http_request (
+  /* PARAMETERS */
+  const char *postbuf,			/* I: the request */
+  size_t postlen,			/* I: its length */
+  char *status				/* O: response status line */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct http_conn *conn;
+    unsigned int ticket;		/* our place on the connection */
+    int reused;				/* connection was open already */
+    int keepalive = 0;
+    int failed = 0;			/* sending the request failed */
+    int saved_errno;
+    int s;
+    int rc;
+    /* END VARIABLES */
+
+    HTTP_LOCK();
+    conn = http_get();
+    reused = (conn->fd >= 0);
+    HTTP_UNLOCK();
+
+    if (!reused) {
+        s = http_connect();
+        HTTP_LOCK();
+        conn->fd = s;
+        if (s < 0) {
+            conn->users--;
+            HTTP_SIGNAL();
+            HTTP_UNLOCK();
+            return -1;
+        }
+        HTTP_UNLOCK();
     }
 
     /* CLAIM: we now have a TCP connection to the remote HTTP server */
 
-    /*
-     * Install noop signal handlers. These just reinstall the handler
-     * and return so that we take an EINTR during network I/O.
-     */
-    (void) signal(SIGALRM, sig_null);
-    (void) signal(SIGPIPE, sig_null);
-    
+    HTTP_LOCK();
+    ticket = conn->sent++;
+    while (!conn->closing && conn->written != ticket)
+        HTTP_WAIT();
+    if (!conn->closing) {
+        /* our turn to write; the connection stays open while we hold
+           a reservation on it */
+        HTTP_UNLOCK();
+        rc = tx_rec(conn->fd, (void *) postbuf, postlen);
+        HTTP_LOCK();
+        conn->written++;
+        if (rc < (int) postlen) {
+            conn->closing = 1;
+            failed = 1;
+        }
+        HTTP_SIGNAL();
+    }
+    while (!conn->closing && conn->done != ticket)
+        HTTP_WAIT();
+    if (conn->closing) {
+        /* the connection failed or the server is closing it before
+           getting to our request */
+        if (--conn->users == 0)
+            http_close(conn);
+        HTTP_SIGNAL();
+        HTTP_UNLOCK();
+        if (failed)
+            syslog(LOG_WARNING, "auth_httpform: failed to send request");
+        return (reused || ticket > 0) ? 0 : -1;
+    }
+    HTTP_UNLOCK();
+
+    rc = http_response(conn, status, &keepalive);
+    saved_errno = errno;
+
+    HTTP_LOCK();
+    conn->done++;
+    conn->last_used = time(NULL);
+    if (rc <= 0 || !keepalive)
+        conn->closing = 1;
+    if (--conn->users == 0 && conn->closing)
+        http_close(conn);
+    HTTP_SIGNAL();
+    HTTP_UNLOCK();
+
+    if ((rc == 0 || saved_errno == ECONNRESET) && (reused || ticket > 0))
+        return 0;			/* dropped while idle */
+    if (rc <= 0) {
+        errno = (rc == 0) ? ECONNRESET : saved_errno;
+        syslog(LOG_WARNING, "auth_httpform: read (response): %m");
+        return -1;
+    }
+
+    return 1;
+}
+
+/* END FUNCTION: http_request */
+
+/* FUNCTION: auth_httpform */
+
+/* SYNOPSIS
+ * Proxy authenticate to a remote HTTP server with a form POST.
+ *
+ * This mechanism takes the plaintext authenticator and password, forms
+ * them into an HTTP POST request. If the HTTP server responds with a 200
+ * status code, the credentials are considered valid. If it responds with
+ * a 403 HTTP status code, the credentials are considered wrong. Any other
+ * HTTP status code is treated like a network error.
+ *
+ * Requests go over persistent HTTP/1.1 connections, at most
+ * httpform_connections of them, each carrying up to httpform_pipeline
+ * requests at a time.
+ */
+
+/* XXX This should be extended to support SASL PLAIN authentication */
+
+char *					/* R: Allocated response string */
+auth_httpform (
+  /* PARAMETERS */
+  const char *user,			/* I: plaintext authenticator */
+  const char *password,			/* I: plaintext password */
+  const char *service,
+  const char *realm
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char *req;                          /* request, with user and pw    */
+    int rc;                             /* return code scratch area     */
+    int attempt;                        /* retry counter                */
+    char *postbuf;                      /* request buffer               */
+    size_t postsize;                    /* size of postbuf              */
+    int postlen;                        /* length of post request       */
+    char rbuf[RESP_LEN];                /* response status line         */
+    /* END VARIABLES */
+
+    /* sanity checks */
+    assert(user != NULL);
+    assert(password != NULL);
+
     /* build the HTTP request */
     req = create_post_data(formdata, user, password, realm);
     if (req == NULL) {
-        close(s);
         syslog(LOG_WARNING, "auth_httpform: create_post_data == NULL");
         return strdup(RESP_IERROR);
     }
 
-    postlen = snprintf(postbuf, RESP_LEN-1,
+    postsize = strlen(r_uri) + strlen(r_host) + strlen(r_port) +
+               strlen(req) + 256;
+    postbuf = malloc(postsize);
+    if (postbuf == NULL) {
+        memset(req, 0, strlen(req));
+        free(req);
+        syslog(LOG_WARNING, "auth_httpform: out of memory");
+        return strdup(RESP_IERROR);
+    }
+
+    postlen = snprintf(postbuf, postsize,
               "POST %s HTTP/1.1" CRLF
               "Host: %s:%s" CRLF
               "User-Agent: saslauthd" CRLF
               "Accept: */*" CRLF
               "Content-Type: application/x-www-form-urlencoded" CRLF
-              "Content-Length: %d" TWO_CRLF
+              "Content-Length: %lu" TWO_CRLF
               "%s",
-              r_uri, r_host, r_port, strlen(req), req);
+              r_uri, r_host, r_port, (unsigned long) strlen(req), req);
 
     if (flags & VERBOSE) {
         syslog(LOG_DEBUG, "auth_httpform: sending %s %s %s",
                r_host, r_uri, req);
     }
-    
-    /* send it */
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = tx_rec(s, postbuf, postlen);
-    alarm(0);
-    
-    if (rc < postlen) {
-        syslog(LOG_WARNING, "auth_httpform: failed to send request");
-        memset(req, 0, strlen(req));
-        free(req); 
-        memset(postbuf, 0, postlen);
-        close(s);
-        return strdup(RESP_IERROR);
-    }
 
-    /* don't need these any longer */
+    /* don't need this any longer */
     memset(req, 0, strlen(req));
     free(req); 
-    memset(postbuf, 0, postlen);
 
-    /* read and parse the response */
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = read(s, rbuf, sizeof(rbuf));
-    alarm(0);
-    
-    close(s);                    /* we're done with the remote */
+    /* pooled connections may have been closed by the server meanwhile;
+       each such one is dropped and the request sent again */
+    for (attempt = 0, rc = 0; attempt <= max_conns && rc == 0; attempt++)
+        rc = http_request(postbuf, postlen, rbuf);
 
-    if (rc == -1) {
-        syslog(LOG_WARNING, "auth_httpform: read (response): %m");
-        return strdup(RESP_IERROR);
-    }
+    memset(postbuf, 0, postlen);
+    free(postbuf);
+
+    if (rc <= 0)
+        return strdup(rc == 0 ? RESP_IERROR :
+                      "NO [ALERT] Couldn't contact remote authentication server");
 
     if (flags & VERBOSE) {
         syslog(LOG_DEBUG, "auth_httpform: [%s] %s", user, rbuf);
     }
 
-    rbuf[rc] = '\0';             /* make sure str-funcs find null */
     return build_sasl_response(rbuf);
 }
 
@@ -51,24 +51,43 @@
 #include "mechanisms.h"
 #include "globals.h" /* mech_option */
 #include "cfile.h"
-#include "krbtf.h"
-
-#ifdef AUTH_KRB5
-# include <krb5.h>
-static cfile config = 0;
-static char *keytabname = NULL; /* "system default" */
-static char *verify_principal = "host"; /* a principal in the default keytab */
-#endif /* AUTH_KRB5 */
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "auth_krb5.h"
 
+#ifdef AUTH_KRB5
+# include <krb5.h>
+static cfile config = 0;
+static char *keytabname = NULL; /* "system default" */
+static char *verify_principal = "host"; /* a principal in the default keytab */
+
+/* Rebuild the library context and the keytab copy this often (seconds),
+ * so changes to krb5.conf are picked up eventually. */
+# define K5_STATE_TTL 60
+
+/* Kerberos state kept from one request to the next. It is built by the
+ * first request each process answers and only touched by one request at
+ * a time, since the mechanism isn't MECH_THREADSAFE. */
+static struct {
+    int valid;				/* the rest has been set up */
+    time_t built;			/* when it was set up */
+    krb5_context context;		/* library context */
+    krb5_principal server;		/* verify_principal on this host */
+    krb5_keytab kt;			/* memory copy of server's keys */
+    char kt_file[1024];			/* keytab file, empty if not a file */
+    struct stat kt_stat;		/* the file when it was copied */
+    char thishost[BUFSIZ];		/* name of this host */
+} k5;
+static unsigned int k5_generation = 0;	/* memory keytabs made so far */
+#endif /* AUTH_KRB5 */
+
 /* END PUBLIC DEPENDENCIES */
 
 int					/* R: -1 on failure, else 0 */
@@ -79,14 +98,8 @@ auth_krb5_init (
   )
 {
 #ifdef AUTH_KRB5
-    int rc;
     char *configname = 0;
 
-    if (krbtf_init() == -1) {
-	syslog(LOG_ERR, "auth_krb5_init krbtf_init failed");
-	return -1;
-    }
-
     if (mech_option)
 	configname = mech_option;
     else if (access(SASLAUTHD_CONF_FILE_DEFAULT, F_OK) == 0)
@@ -164,6 +177,229 @@ form_principal_name (
     return 0;
 }
 
+static void k5support_log_err(krb5_context context,
+			      krb5_error_code code,
+			      char const *msg)
+{
+    const char *k5_msg = krb5_get_error_message(context, code);
+
+    syslog(LOG_DEBUG, "auth_krb5: %s: %s (%d)\n", msg, k5_msg, code);
+    krb5_free_error_message(context, k5_msg);
+}
+
+/* FUNCTION: k5_state_free */
+
+/* SYNOPSIS
+ * Throw away the Kerberos state, the next request builds it anew.
+ * END SYNOPSIS */
+
+static void
+k5_state_free (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    if (k5.kt)
+	krb5_kt_close(k5.context, k5.kt);
+    if (k5.server)
+	krb5_free_principal(k5.context, k5.server);
+    if (k5.context)
+	krb5_free_context(k5.context);
+
+    memset(&k5, 0, sizeof(k5));
+}
+
+/* END FUNCTION: k5_state_free */
+
+/* FUNCTION: k5_keytab_file */
+
+/* SYNOPSIS
+ * Find the file behind the configured (or default) keytab, so it can be
+ * watched for changes. Keytabs that aren't files leave kt_file empty.
+ * END SYNOPSIS */
+
+static void
+k5_keytab_file (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char name[sizeof(k5.kt_file) + 16];
+    char *path;
+    char *colon;
+    /* END VARIABLES */
+
+    k5.kt_file[0] = '\0';
+
+    if (keytabname) {
+	strncpy(name, keytabname, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+    } else if (krb5_kt_default_name(k5.context, name, sizeof(name))) {
+	return;
+    }
+
+    path = name;
+    colon = strchr(name, ':');
+    if (colon && (strchr(name, '/') == NULL || colon < strchr(name, '/'))) {
+	*colon = '\0';
+	if (strcmp(name, "FILE") && strcmp(name, "WRFILE"))
+	    return;
+	path = colon + 1;
+    }
+
+    if (strlen(path) < sizeof(k5.kt_file))
+	strcpy(k5.kt_file, path);
+}
+
+/* END FUNCTION: k5_keytab_file */
+
+/* FUNCTION: k5_keytab_load */
+
+/* SYNOPSIS
+ * Copy the keys of the verify principal out of the keytab into a memory
+ * keytab, so verifying a TGT doesn't go back to the keytab file.
+ * END SYNOPSIS */
+
+static int				/* R: -1 on failure, else 0 */
+k5_keytab_load (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    krb5_keytab kt = NULL;
+    krb5_kt_cursor cursor;
+    krb5_keytab_entry entry;
+    krb5_error_code code;
+    char memname[64];
+    int nkeys = 0;
+    /* END VARIABLES */
+
+    if (keytabname)
+	code = krb5_kt_resolve(k5.context, keytabname, &kt);
+    else
+	code = krb5_kt_default(k5.context, &kt);
+    if (code) {
+	k5support_log_err(k5.context, code, "krb5_kt_resolve()");
+	return -1;
+    }
+
+    if (k5.kt_file[0] && stat(k5.kt_file, &k5.kt_stat) != 0)
+	memset(&k5.kt_stat, 0, sizeof(k5.kt_stat));
+
+    snprintf(memname, sizeof(memname), "MEMORY:saslauthd_%ld_%u",
+	     (long)getpid(), k5_generation++);
+    if ((code = krb5_kt_resolve(k5.context, memname, &k5.kt))) {
+	k5support_log_err(k5.context, code, "krb5_kt_resolve(MEMORY)");
+	krb5_kt_close(k5.context, kt);
+	return -1;
+    }
+
+    if ((code = krb5_kt_start_seq_get(k5.context, kt, &cursor))) {
+	k5support_log_err(k5.context, code, "krb5_kt_start_seq_get()");
+	krb5_kt_close(k5.context, kt);
+	return -1;
+    }
+
+    while (krb5_kt_next_entry(k5.context, kt, &entry, &cursor) == 0) {
+	if (krb5_principal_compare(k5.context, entry.principal, k5.server)) {
+	    if ((code = krb5_kt_add_entry(k5.context, k5.kt, &entry)))
+		k5support_log_err(k5.context, code, "krb5_kt_add_entry()");
+	    else
+		nkeys++;
+	}
+	krb5_kt_free_entry(k5.context, &entry);
+    }
+
+    krb5_kt_end_seq_get(k5.context, kt, &cursor);
+    krb5_kt_close(k5.context, kt);
+
+    if (nkeys == 0) {
+	syslog(LOG_ERR, "auth_krb5: no keys for %s in the keytab",
+	       verify_principal);
+	return -1;
+    }
+
+    return 0;
+}
+
+/* END FUNCTION: k5_keytab_load */
+
+/* FUNCTION: k5_state_get */
+
+/* SYNOPSIS
+ * Make sure the Kerberos state is there and current: it is rebuilt
+ * after K5_STATE_TTL seconds, when the keytab file changed, or after
+ * something went wrong with it.
+ * END SYNOPSIS */
+
+static int				/* R: -1 on failure, else 0 */
+k5_state_get (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    krb5_error_code code;
+    struct stat st;
+    time_t now;
+    /* END VARIABLES */
+
+    now = time(NULL);
+
+    if (k5.valid && now - k5.built < K5_STATE_TTL &&
+	(k5.kt_file[0] == '\0' ||
+	 (stat(k5.kt_file, &st) == 0 &&
+	  st.st_mtime == k5.kt_stat.st_mtime &&
+	  st.st_size == k5.kt_stat.st_size &&
+	  st.st_ino == k5.kt_stat.st_ino)))
+	return 0;
+
+    k5_state_free();
+
+    if (krb5_init_context(&k5.context)) {
+	syslog(LOG_ERR, "auth_krb5: krb5_init_context");
+	k5.context = NULL;
+	return -1;
+    }
+
+    if ((code = krb5_sname_to_principal(k5.context, NULL, verify_principal,
+					KRB5_NT_SRV_HST, &k5.server))) {
+	k5support_log_err(k5.context, code, "krb5_sname_to_principal()");
+	k5_state_free();
+	return -1;
+    }
+
+    /* this duplicates work done in krb5_sname_to_principal
+     * oh well.
+     */
+    if (gethostname(k5.thishost, sizeof(k5.thishost)) < 0) {
+	syslog(LOG_ERR, "auth_krb5: gethostname: %m");
+	k5_state_free();
+	return -1;
+    }
+    k5.thishost[sizeof(k5.thishost) - 1] = '\0';
+
+    k5_keytab_file();
+
+    if (k5_keytab_load() != 0) {
+	k5_state_free();
+	return -1;
+    }
+
+    k5.built = now;
+    k5.valid = 1;
+
+    return 0;
+}
+
+/* END FUNCTION: k5_state_get */
+
 #ifdef KRB5_HEIMDAL
 
 char *					/* R: allocated response string */
@@ -177,13 +413,10 @@ auth_krb5 (
   )
 {
     /* VARIABLES */
-    krb5_context context;
     krb5_ccache ccache = NULL;
-    krb5_keytab kt = NULL;
     krb5_principal auth_user;
     krb5_verify_opt opt;
     char * result;
-    char tfname[2048];
     char principalbuf[2048];
     /* END VARIABLES */
 
@@ -192,8 +425,7 @@ auth_krb5 (
 	return strdup("NO saslauthd internal NULL password or username");
     }
 
-    if (krb5_init_context(&context)) {
-	syslog(LOG_ERR, "auth_krb5: krb5_init_context");
+    if (k5_state_get() != 0) {
 	return strdup("NO saslauthd internal krb5_init_context error");
     }
 
@@ -202,116 +434,54 @@ auth_krb5 (
 	return strdup("NO saslauthd principal name error");
     }
 
-    if (krb5_parse_name (context, principalbuf, &auth_user)) {
-	krb5_free_context(context);
+    if (krb5_parse_name (k5.context, principalbuf, &auth_user)) {
 	syslog(LOG_ERR, "auth_krb5: krb5_parse_name");
 	return strdup("NO saslauthd internal krb5_parse_name error");
     }
 
-    if (krbtf_name(tfname, sizeof (tfname)) != 0) {
-	syslog(LOG_ERR, "auth_krb5: could not generate ccache name");
-	return strdup("NO saslauthd internal error");
-    }
-
-    if (krb5_cc_resolve(context, tfname, &ccache)) {
-	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
-	syslog(LOG_ERR, "auth_krb5: krb5_cc_resolve");
+    if (krb5_cc_new_unique(k5.context, "MEMORY", NULL, &ccache)) {
+	krb5_free_principal(k5.context, auth_user);
+	syslog(LOG_ERR, "auth_krb5: krb5_cc_new_unique");
 	return strdup("NO saslauthd internal error");
     }
 
-    if (keytabname) {
-	if (krb5_kt_resolve(context, keytabname, &kt)) {
-	    krb5_free_principal(context, auth_user);
-	    krb5_cc_destroy(context, ccache);
-	    krb5_free_context(context);
-	    syslog(LOG_ERR, "auth_krb5: krb5_kt_resolve");
-	    return strdup("NO saslauthd internal error");
-	}
-    }
-    
     krb5_verify_opt_init(&opt);
     krb5_verify_opt_set_secure(&opt, 1);
     krb5_verify_opt_set_ccache(&opt, ccache);
-    if (kt)
-	krb5_verify_opt_set_keytab(&opt,  kt);
+    krb5_verify_opt_set_keytab(&opt, k5.kt);
     krb5_verify_opt_set_service(&opt, verify_principal);
     
-    if (krb5_verify_user_opt(context, auth_user, password, &opt)) {
+    if (krb5_verify_user_opt(k5.context, auth_user, password, &opt)) {
 	result = strdup("NO krb5_verify_user_opt failed");
     } else {
         result = strdup("OK");
     }
     
-    krb5_free_principal(context, auth_user);
-    krb5_cc_destroy(context, ccache);
-    if (kt)
-	krb5_kt_close(context, kt);
-    krb5_free_context(context);
+    krb5_free_principal(k5.context, auth_user);
+    krb5_cc_destroy(k5.context, ccache);
 
     return result;
 }
 
 #else /* !KRB5_HEIMDAL */
 
-static void k5support_log_err(krb5_context context,
-			      krb5_error_code code,
-			      char const *msg)
-{
-    const char *k5_msg = krb5_get_error_message(context, code);
-
-    syslog(LOG_DEBUG, "auth_krb5: %s: %s (%d)\n", msg, k5_msg, code);
-    krb5_free_error_message(context, k5_msg);
-}
-
 /* returns 0 for failure, 1 for success */
 static int k5support_verify_tgt(krb5_context context, 
 				krb5_ccache ccache) 
 {
-    krb5_principal server;
     krb5_data packet;
-    krb5_keyblock *keyblock = NULL;
     krb5_auth_context auth_context = NULL;
     krb5_error_code k5_retcode;
-    krb5_keytab kt = NULL;
-    char thishost[BUFSIZ];
     int result = 0;
     
     memset(&packet, 0, sizeof(packet));
 
-    if ((k5_retcode = krb5_sname_to_principal(context, NULL, verify_principal,
-					      KRB5_NT_SRV_HST, &server))) {
-	k5support_log_err(context, k5_retcode, "krb5_sname_to_principal()");
-	return 0;
-    }
-
-    if (keytabname) {
-	if ((k5_retcode = krb5_kt_resolve(context, keytabname, &kt))) {
-	    k5support_log_err(context, k5_retcode, "krb5_kt_resolve()");
-	    goto fini;
-	}
-    }
-    
-    if ((k5_retcode = krb5_kt_read_service_key(context, kt, server, 0,
-					       0, &keyblock))) {
-	k5support_log_err(context, k5_retcode, "krb5_kt_read_service_key()");
-	goto fini;
-    }
-    
-    if (keyblock) {
-	krb5_free_keyblock(context, keyblock);
-    }
-    
-    /* this duplicates work done in krb5_sname_to_principal
-     * oh well.
+    /* the TGS exchange for a ticket to ourselves proves the TGT
+     * came from the KDC; the keys it is checked against were
+     * copied out of the keytab by k5_state_get()
      */
-    if (gethostname(thishost, BUFSIZ) < 0) {
-	goto fini;
-    }
-    thishost[BUFSIZ-1] = '\0';
-    
     if ((k5_retcode = krb5_mk_req(context, &auth_context, 0, verify_principal, 
-				  thishost, NULL, ccache, &packet))) {
+				  k5.thishost, NULL, ccache, &packet))) {
 	k5support_log_err(context, k5_retcode, "krb5_mk_req()");
     }
     
@@ -321,12 +491,14 @@ static int k5support_verify_tgt(krb5_context context,
     }
     
     if (k5_retcode) {
-	goto fini;
+	return 0;
     }
     
     if ((k5_retcode = krb5_rd_req(context, &auth_context, &packet, 
-				  server, NULL, NULL, NULL))) {
+				  k5.server, k5.kt, NULL, NULL))) {
 	k5support_log_err(context, k5_retcode, "krb5_rd_req()");
+	/* maybe the keys changed in a keytab that isn't a file */
+	k5.valid = 0;
 	goto fini;
     }
 
@@ -338,10 +510,7 @@ static int k5support_verify_tgt(krb5_context context,
     /* all is good now */
     result = 1;
  fini:
-    if (!k5_retcode) {
-        krb5_free_data_contents(context, &packet);
-    }
-    krb5_free_principal(context, server);
+    krb5_free_data_contents(context, &packet);
     
     return result;
 }
@@ -369,7 +538,6 @@ auth_krb5 (
     krb5_creds creds;
     krb5_get_init_creds_opt opts;
     char * result;
-    char tfname[2048];
     char principalbuf[2048];
     krb5_error_code code;
     /* END VARIABLES */
@@ -379,10 +547,10 @@ auth_krb5 (
 	return strdup("NO saslauthd internal error");
     }
 
-    if (krb5_init_context(&context)) {
-	syslog(LOG_ERR, "auth_krb5: krb5_init_context");
+    if (k5_state_get() != 0) {
 	return strdup("NO saslauthd internal error");
     }
+    context = k5.context;
 
     if (form_principal_name(user, service, realm, principalbuf, sizeof (principalbuf))) {
 	syslog(LOG_ERR, "auth_krb5: form_principal_name");
@@ -390,26 +558,20 @@ auth_krb5 (
     }
 
     if (krb5_parse_name (context, principalbuf, &auth_user)) {
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_parse_name");
 	return strdup("NO saslauthd internal error");
     }
     
-    if (krbtf_name(tfname, sizeof (tfname)) != 0) {
-	syslog(LOG_ERR, "auth_krb5: could not generate ticket file name");
-	return strdup("NO saslauthd internal error");
-    }
-
-    if (krb5_cc_resolve(context, tfname, &ccache)) {
+    /* the tickets never need to leave this process */
+    if (krb5_cc_new_unique(context, "MEMORY", NULL, &ccache)) {
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
-	syslog(LOG_ERR, "auth_krb5: krb5_cc_resolve");
+	syslog(LOG_ERR, "auth_krb5: krb5_cc_new_unique");
 	return strdup("NO saslauthd internal error");
     }
     
     if (krb5_cc_initialize (context, ccache, auth_user)) {
+	krb5_cc_destroy(context, ccache);
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_cc_initialize");
 	return strdup("NO saslauthd internal error");
     }
@@ -422,18 +584,15 @@ auth_krb5 (
 				     0, NULL, &opts)) {
 	krb5_cc_destroy(context, ccache);
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_get_init_creds_password: %d", code);
 	return strdup("NO saslauthd internal error");
     }
     
     /* at this point we should have a TGT. Let's make sure it is valid */
     if (krb5_cc_store_cred(context, ccache, &creds)) {
-	krb5_free_principal(context, auth_user);
-	krb5_cc_destroy(context, ccache);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_cc_store_cred");
-	return strdup("NO saslauthd internal error");
+	result = strdup("NO saslauthd internal error");
+	goto fini;
     }
     
     if (!k5support_verify_tgt(context, ccache)) {
@@ -452,7 +611,6 @@ auth_krb5 (
     krb5_free_cred_contents(context, &creds);
     krb5_free_principal(context, auth_user);
     krb5_cc_destroy(context, ccache);
-    krb5_free_context(context);
 
     return result;
 }
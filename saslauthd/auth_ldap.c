@@ -54,6 +54,10 @@
 
 const char *SASLAUTHD_CONF_FILE = SASLAUTHD_CONF_FILE_DEFAULT;
 
+#ifdef LAK_THREADS
+static pthread_mutex_t lak_init_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 char *					/* R: allocated response string */
 auth_ldap(
   /* PARAMETERS */
@@ -64,18 +68,25 @@ auth_ldap(
   /* END PARAMETERS */
   )
 {
-	static LAK *lak = NULL;
+	static LAK_POOL *pool = NULL;
 	int rc = 0;
 
-	if (lak == NULL) {
-		rc = lak_init(SASLAUTHD_CONF_FILE, &lak);
-		if (rc != LAK_OK) {
-			lak = NULL;
-			RETURN("NO");
-		}
+#ifdef LAK_THREADS
+	pthread_mutex_lock(&lak_init_lock);
+#endif
+	if (pool == NULL) {
+		rc = lak_init(SASLAUTHD_CONF_FILE, &pool);
+		if (rc != LAK_OK)
+			pool = NULL;
+	}
+#ifdef LAK_THREADS
+	pthread_mutex_unlock(&lak_init_lock);
+#endif
+	if (pool == NULL) {
+		RETURN("NO");
 	}
 
-	rc = lak_authenticate(lak, login, service, realm, password);
+	rc = lak_authenticate(pool, login, service, realm, password);
     	if (rc == LAK_OK) {
 		RETURN("OK");
 	} else {
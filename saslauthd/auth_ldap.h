@@ -27,3 +27,12 @@
 
 char *auth_ldap(const char *, const char *, const char *, const char *);
 int auth_ldap_init(void);
+
+/* The connection pool lets requests run concurrently when libldap
+ * itself is thread safe. */
+#include "lak.h"
+#ifdef LAK_THREADS
+# define AUTH_LDAP_FLAGS MECH_THREADSAFE
+#else
+# define AUTH_LDAP_FLAGS 0
+#endif
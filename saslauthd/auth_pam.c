@@ -52,8 +52,10 @@
 
 #ifdef AUTH_PAM
 
+# include <stdlib.h>
 # include <string.h>
 # include <syslog.h>
+# include <time.h>
 #ifdef HAVE_SECURITY_PAM_APPL_H
 # include <security/pam_appl.h>
 #elif defined(HAVE_PAM_PAM_APPL_H)
@@ -72,6 +74,34 @@ typedef struct {
     pam_handle_t *pamh;			/* pointer to PAM handle */
 } pam_appdata;
 
+/* A started PAM transaction, kept between requests so that the
+ * service's modules and configuration are only loaded once. A PAM
+ * handle is a single user transaction: modules keep per-user state in
+ * it with pam_set_data(), which can't be cleared, so a handle is only
+ * reused for the service and login it was started for. The
+ * conversation is registered with appdata, which is filled in for
+ * each request, so a handle must not move once started. */
+typedef struct {
+    pam_handle_t *pamh;
+    char *service;
+    char *login;
+    time_t started;
+    pam_appdata appdata;
+    struct pam_conv conv;
+} pam_slot;
+
+# define PAM_POOL_SIZE 16		/* idle handles kept */
+# define PAM_HANDLE_TTL 60		/* seconds; rereads the PAM config */
+
+static pam_slot *pam_pool[PAM_POOL_SIZE];
+static int pam_idle = 0;
+
+# if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#  define PAM_THREADS
+#  include <pthread.h>
+static pthread_mutex_t pam_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+# endif
+
 # define RETURN(x) return strdup(x)
 
 
@@ -178,6 +208,158 @@ ret_error:
 
 /* END FUNCTION: saslauthd_pam_conv */
 
+/* FUNCTION: pam_slot_end */
+
+static void
+pam_slot_end (
+  /* PARAMETERS */
+  pam_slot *slot,			/* I: handle to discard */
+  int status				/* I: status for pam_end() */
+  /* END PARAMETERS */
+  )
+{
+    if (slot->pamh != NULL)
+	pam_end(slot->pamh, status);
+    free(slot->service);
+    free(slot->login);
+    free(slot);
+}
+
+/* END FUNCTION: pam_slot_end */
+
+/* FUNCTION: pam_slot_get */
+
+/* SYNOPSIS
+ * Take an idle handle for service and login from the pool, or start a
+ * new one. Handles older than PAM_HANDLE_TTL are ended rather than
+ * reused.
+ * END SYNOPSIS */
+
+static pam_slot *			/* R: handle, NULL on error */
+pam_slot_get (
+  /* PARAMETERS */
+  const char *service,			/* I: service name */
+  const char *login,			/* I: plaintext authenticator */
+  int *rc				/* O: PAM return code */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    pam_slot *slot = NULL;
+    pam_slot *stale[PAM_POOL_SIZE];
+    int nstale = 0;
+    time_t now;
+    int i;
+    /* END VARIABLES */
+
+    now = time(NULL);
+
+# ifdef PAM_THREADS
+    pthread_mutex_lock(&pam_pool_lock);
+# endif
+    for (i = pam_idle - 1; i >= 0; i--) {
+	if (now - pam_pool[i]->started >= PAM_HANDLE_TTL) {
+	    stale[nstale++] = pam_pool[i];
+	} else if (slot == NULL && !strcmp(pam_pool[i]->service, service) &&
+		   !strcmp(pam_pool[i]->login, login)) {
+	    slot = pam_pool[i];
+	} else {
+	    continue;
+	}
+	pam_pool[i] = pam_pool[--pam_idle];
+    }
+# ifdef PAM_THREADS
+    pthread_mutex_unlock(&pam_pool_lock);
+# endif
+
+    for (i = 0; i < nstale; i++)
+	pam_slot_end(stale[i], PAM_SUCCESS);
+
+    if (slot != NULL) {
+	*rc = PAM_SUCCESS;
+	return slot;
+    }
+
+    slot = calloc(1, sizeof(*slot));
+    if (slot == NULL || (slot->service = strdup(service)) == NULL ||
+	(slot->login = strdup(login)) == NULL) {
+	if (slot != NULL)
+	    free(slot->service);
+	free(slot);
+	*rc = PAM_BUF_ERR;
+	return NULL;
+    }
+    slot->started = now;
+    slot->conv.conv = saslauthd_pam_conv;
+    slot->conv.appdata_ptr = &slot->appdata;
+
+    *rc = pam_start(service, login, &slot->conv, &slot->pamh);
+    if (*rc != PAM_SUCCESS) {
+	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_start failed: %s",
+	       pam_strerror(slot->pamh, *rc));
+	pam_slot_end(slot, *rc);
+	return NULL;
+    }
+
+    return slot;
+}
+
+/* END FUNCTION: pam_slot_get */
+
+/* FUNCTION: pam_slot_put */
+
+/* SYNOPSIS
+ * Return a handle to the pool after a transaction that ended with
+ * status. Anything the modules were given for this request is
+ * forgotten first; a handle left in an unexpected state is ended.
+ * END SYNOPSIS */
+
+static void
+pam_slot_put (
+  /* PARAMETERS */
+  pam_slot *slot,			/* I: handle */
+  int status				/* I: outcome of the transaction */
+  /* END PARAMETERS */
+  )
+{
+    slot->appdata.login = NULL;
+    slot->appdata.password = NULL;
+
+    switch (status) {
+    case PAM_SUCCESS:
+    case PAM_AUTH_ERR:
+    case PAM_USER_UNKNOWN:
+    case PAM_ACCT_EXPIRED:
+    case PAM_NEW_AUTHTOK_REQD:
+	break;
+    default:
+	pam_slot_end(slot, status);
+	return;
+    }
+
+    if (pam_set_item(slot->pamh, PAM_AUTHTOK, NULL) != PAM_SUCCESS ||
+	pam_set_item(slot->pamh, PAM_OLDAUTHTOK, NULL) != PAM_SUCCESS) {
+	pam_slot_end(slot, status);
+	return;
+    }
+
+# ifdef PAM_THREADS
+    pthread_mutex_lock(&pam_pool_lock);
+# endif
+    if (pam_idle < PAM_POOL_SIZE) {
+	pam_pool[pam_idle++] = slot;
+	slot = NULL;
+    }
+# ifdef PAM_THREADS
+    pthread_mutex_unlock(&pam_pool_lock);
+# endif
+
+    if (slot != NULL)
+	pam_slot_end(slot, status);
+}
+
+/* END FUNCTION: pam_slot_put */
+
 /* FUNCTION: auth_pam */
 
 char *					/* R: allocated response string */
@@ -191,33 +373,25 @@ auth_pam (
   )
 {
     /* VARIABLES */
-    pam_appdata my_appdata;		/* application specific data */
-    struct pam_conv my_conv;		/* pam conversion data */
+    pam_slot *slot;			/* started PAM transaction */
     pam_handle_t *pamh;			/* pointer to PAM handle */
     int rc;				/* return code holder */
     /* END VARIABLES */
 
-    my_appdata.login = login;
-    my_appdata.password = password;
-    my_appdata.pamh = NULL;
-
-    my_conv.conv = saslauthd_pam_conv;
-    my_conv.appdata_ptr = &my_appdata;
-
-    rc = pam_start(service, login, &my_conv, &pamh);
-    if (rc != PAM_SUCCESS) {
-	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_start failed: %s",
-	       pam_strerror(pamh, rc));
+    slot = pam_slot_get(service, login, &rc);
+    if (slot == NULL)
 	RETURN("NO PAM start error");
-    }
 
-    my_appdata.pamh = pamh;
+    pamh = slot->pamh;
+    slot->appdata.login = login;
+    slot->appdata.password = password;
+    slot->appdata.pamh = pamh;
 
     rc = pam_authenticate(pamh, PAM_SILENT);
     if (rc != PAM_SUCCESS) {
 	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_authenticate failed: %s",
 	       pam_strerror(pamh, rc));
-	pam_end(pamh, rc);
+	pam_slot_put(slot, rc);
 	RETURN("NO PAM auth error");
     }
 
@@ -225,11 +399,11 @@ auth_pam (
     if (rc != PAM_SUCCESS) {
 	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_acct_mgmt failed: %s",
 	       pam_strerror(pamh, rc));
-	pam_end(pamh, rc);
+	pam_slot_put(slot, rc);
 	RETURN("NO PAM acct error");
     }
 
-    pam_end(pamh, PAM_SUCCESS);
+    pam_slot_put(slot, PAM_SUCCESS);
     RETURN("OK");
 }
 
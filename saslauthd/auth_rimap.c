@@ -73,8 +73,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <signal.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include "auth_rimap.h"
 #include "utils.h"
@@ -84,14 +86,42 @@
 /* PRIVATE DEPENDENCIES */
 static const char *r_host = NULL;       /* remote hostname (mech_option) */
 static struct addrinfo *ai = NULL;	/* remote authentication host    */
+static struct addrinfo *r_good = NULL;	/* address that last connected   */
 /* END PRIVATE DEPENDENCIES */
 
 #define DEFAULT_REMOTE_SERVICE "imap"	/* getservbyname() name for remote
 					   service we connect to.	 */
 #define TAG "saslauthd"			/* IMAP command tag */
 #define LOGIN_CMD (TAG " LOGIN ")	/* IMAP login command (with tag) */
+#define UNAUTH_CMD (TAG " UNAUTHENTICATE\r\n")
+#define LOGOUT_CMD (TAG " LOGOUT\r\n")
 #define NETWORK_IO_TIMEOUT 30		/* network I/O timeout (seconds) */
 #define RESP_LEN 1000			/* size of read response buffer  */
+#define RIMAP_MAX_SESSIONS 8		/* connections to the remote host */
+#define RIMAP_IDLE_TIMEOUT 60		/* reconnect sessions idle longer */
+
+/* Session states; a session handed out is never authenticated */
+#define RIMAP_CLOSED		0
+#define RIMAP_CONNECTING	1	/* greeting not read yet	 */
+#define RIMAP_READY		2
+#define RIMAP_UNAUTHENTICATING	3	/* UNAUTHENTICATE response due	 */
+
+struct rimap_session {
+    int fd;
+    int state;
+    int in_use;
+    time_t last_used;
+};
+
+static struct rimap_session sessions[RIMAP_MAX_SESSIONS];
+static int unauthenticate = -1;		/* server supports it? -1 unknown */
+
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+# define RIMAP_THREADS
+# include <pthread.h>
+static pthread_mutex_t rimap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rimap_cond = PTHREAD_COND_INITIALIZER;
+#endif
 
 /* Common failure response strings for auth_rimap() */
 
@@ -99,47 +129,7 @@ static struct addrinfo *ai = NULL;	/* remote authentication host    */
 #define RESP_UNAVAILABLE "NO [ALERT] The remote authentication server is currently unavailable"
 #define RESP_UNEXPECTED	"NO [ALERT] Unexpected response from remote authentication server"
 
-/* FUNCTION: sig_null */
-
-/* SYNOPSIS
- * Catch and ignore a signal.
- * END SYNOPSIS */
-
-static RETSIGTYPE				/* R: OS dependent */
-sig_null (
-  /* PARAMETERS */
-  int sig					/* I: signal being caught */
-  /* END PARAMETERS */
-  )
-{
 
-    switch (sig) {
-	
-      case SIGALRM:
-	signal(SIGALRM, sig_null);
-	break;
-
-      case SIGPIPE:
-	signal(SIGPIPE, sig_null);
-	break;
-
-      default:
-	syslog(LOG_WARNING, "auth_rimap: unexpected signal %d", sig);
-	break;
-    }
-#ifdef __APPLE__
-    return;
-#else /* __APPLE__ */
-# if RETSIGTYPE == void
-    return;
-# else /* RETSIGTYPE */
-    return 0;
-# endif /* RETSIGTYPE */
-#endif /* __APPLE__ */
-}
-
-/* END FUNCTION: sig_null */
-
 /* FUNCTION: qstring */
 
 /* SYNOPSIS
@@ -223,6 +213,7 @@ auth_rimap_init (
     /* VARIABLES */
     struct addrinfo hints;
     int err;
+    int i;				/* loop counter                  */
     char *c;				/* scratch pointer               */
     /* END VARIABLES */
 
@@ -271,56 +262,274 @@ auth_rimap_init (
 	ai = NULL;
 	return -1;
     }
+    r_good = NULL;
+
+    for (i = 0; i < RIMAP_MAX_SESSIONS; i++) {
+	sessions[i].fd = -1;
+	sessions[i].state = RIMAP_CLOSED;
+    }
 
     return 0;
 }
 
 /* END FUNCTION: auth_rimap_init */
 
-/* FUNCTION: auth_rimap */
+/* FUNCTION: rimap_response */
 
 /* SYNOPSIS
- * Proxy authenticate to a remote IMAP server.
- *
- * This mechanism takes the plaintext authenticator and password, forms
- * them into an IMAP LOGIN command, then attempts to authenticate to
- * a remote IMAP server using those values. If the remote authentication
- * succeeds the credentials are considered valid.
- *
- * NOTE: since IMSP uses the same form of LOGIN command as IMAP does,
- * this driver will also work with IMSP servers.
- */
+ * Read from the remote server up to the response line we're waiting
+ * for: the first line (the greeting) if tag is NULL, otherwise the line
+ * starting with tag. Untagged lines before it are skipped. The line is
+ * returned in rbuf without its termination; one that doesn't fit is
+ * truncated and the rest of it skipped along with the next response.
+ * END SYNOPSIS */
 
-/* XXX This should be extended to support SASL PLAIN authentication */
+static int				/* R: line length, 0 on EOF, -1 on error */
+rimap_response (
+  /* PARAMETERS */
+  int fd,				/* I: connection to remote	*/
+  char *rbuf,				/* O: response line, RESP_LEN	*/
+  const char *tag			/* I: tag and space, or NULL	*/
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    size_t len = 0;			/* bytes in rbuf		*/
+    size_t linelen;			/* length of a complete line	*/
+    size_t taglen;			/* length of tag		*/
+    int skip = 0;			/* dropping an overlong line	*/
+    char *eol;				/* end of line scratch pointer	*/
+    ssize_t n;				/* read() return		*/
+    struct pollfd pfd;
+    /* END VARIABLES */
 
-char *					/* R: Allocated response string */
-auth_rimap (
+    taglen = tag ? strlen(tag) : 0;
+
+    for (;;) {
+	while ((eol = memchr(rbuf, '\n', len)) != NULL) {
+	    linelen = eol - rbuf + 1;
+	    if (!skip &&
+		(tag == NULL || (linelen > taglen && !strncmp(rbuf, tag, taglen)))) {
+		*eol = '\0';
+		if (eol > rbuf && eol[-1] == '\r')
+		    eol[-1] = '\0';
+		return linelen;
+	    }
+	    skip = 0;
+	    len -= linelen;
+	    memmove(rbuf, eol + 1, len);
+	}
+
+	if (len == RESP_LEN - 1) {
+	    if (!skip && (tag == NULL || !strncmp(rbuf, tag, taglen))) {
+		rbuf[len] = '\0';
+		return len;
+	    }
+	    skip = 1;
+	    len = 0;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, NETWORK_IO_TIMEOUT * 1000);
+	if (n == 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	n = read(fd, rbuf + len, RESP_LEN - 1 - len);
+	if (n < 0) {
+	    if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    return -1;
+	}
+	if (n == 0)
+	    return 0;
+	len += n;
+    }
+}
+
+/* END FUNCTION: rimap_response */
+
+/* FUNCTION: rimap_get */
+
+/* SYNOPSIS
+ * Take a session slot for one authentication, waiting while
+ * RIMAP_MAX_SESSIONS are already talking to the remote server.
+ * Slots holding an open connection are preferred.
+ * END SYNOPSIS */
+
+static struct rimap_session *		/* R: the session to use */
+rimap_get (
   /* PARAMETERS */
-  const char *login,			/* I: plaintext authenticator */
-  const char *password,			/* I: plaintext password */
-  const char *service __attribute__((unused)),
-  const char *realm __attribute__((unused))
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct rimap_session *sess;		/* the chosen slot		*/
+    int i;				/* loop counter			*/
+    /* END VARIABLES */
+
+#ifdef RIMAP_THREADS
+    pthread_mutex_lock(&rimap_lock);
+#endif
+    for (;;) {
+	sess = NULL;
+	for (i = 0; i < RIMAP_MAX_SESSIONS; i++) {
+	    if (sessions[i].in_use)
+		continue;
+	    if (sessions[i].fd >= 0) {
+		sess = &sessions[i];
+		break;
+	    }
+	    if (sess == NULL)
+		sess = &sessions[i];
+	}
+	if (sess != NULL)
+	    break;
+#ifdef RIMAP_THREADS
+	pthread_cond_wait(&rimap_cond, &rimap_lock);
+#endif
+    }
+    sess->in_use = 1;
+#ifdef RIMAP_THREADS
+    pthread_mutex_unlock(&rimap_lock);
+#endif
+
+    return sess;
+}
+
+/* END FUNCTION: rimap_get */
+
+/* FUNCTION: rimap_put */
+
+static void
+rimap_put (
+  /* PARAMETERS */
+  struct rimap_session *sess		/* I: session to give back */
+  /* END PARAMETERS */
+  )
+{
+#ifdef RIMAP_THREADS
+    pthread_mutex_lock(&rimap_lock);
+#endif
+    sess->in_use = 0;
+    sess->last_used = time(NULL);
+#ifdef RIMAP_THREADS
+    pthread_cond_signal(&rimap_cond);
+    pthread_mutex_unlock(&rimap_lock);
+#endif
+}
+
+/* END FUNCTION: rimap_put */
+
+/* FUNCTION: rimap_close */
+
+static void
+rimap_close (
+  /* PARAMETERS */
+  struct rimap_session *sess,		/* I: session to close		*/
+  int logout				/* I: say goodbye first		*/
+  /* END PARAMETERS */
+  )
+{
+    if (sess->fd < 0)
+	return;
+
+    if (logout)
+	(void) send(sess->fd, LOGOUT_CMD, sizeof(LOGOUT_CMD) - 1, 0);
+    (void) close(sess->fd);
+    sess->fd = -1;
+    sess->state = RIMAP_CLOSED;
+}
+
+/* END FUNCTION: rimap_close */
+
+/* FUNCTION: rimap_greeting */
+
+/* SYNOPSIS
+ * Read and check the IMAP banner of a new connection. On failure the
+ * session is closed and the response for the client is returned.
+ * END SYNOPSIS */
+
+static char *				/* R: NULL, or allocated response */
+rimap_greeting (
+  /* PARAMETERS */
+  struct rimap_session *sess,		/* I: freshly connected session	*/
+  char *rbuf				/* I: response buffer		*/
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    int rc;				/* return code scratch area	*/
+    int fl;				/* file status flags		*/
+    /* END VARIABLES */
+
+    rc = rimap_response(sess->fd, rbuf, NULL);
+    if (rc <= 0) {
+	if (rc == 0)
+	    errno = ECONNRESET;
+	syslog(LOG_WARNING, "auth_rimap: read (banner): %m");
+	rimap_close(sess, 0);
+	return strdup("NO [ALERT] error synchronizing with remote authentication server");
+    }
+
+    if (!strncmp(rbuf, "* NO", sizeof("* NO")-1)) {
+	rimap_close(sess, 0);
+	return strdup(RESP_UNAVAILABLE);
+    }
+    if (!strncmp(rbuf, "* BYE", sizeof("* BYE")-1)) {
+	rimap_close(sess, 0);
+	return strdup(RESP_UNAVAILABLE);
+    }
+    if (strncmp(rbuf, "* OK", sizeof("* OK")-1)) {
+	syslog(LOG_WARNING,
+	       "auth_rimap: unexpected response during initial handshake: %s",
+	       rbuf);
+	rimap_close(sess, 0);
+	return strdup(RESP_UNEXPECTED);
+    }
+
+    /* a connection made in the background is still non-blocking */
+    fl = fcntl(sess->fd, F_GETFL);
+    if (fl != -1 && (fl & O_NONBLOCK))
+	(void) fcntl(sess->fd, F_SETFL, fl & ~O_NONBLOCK);
+
+    sess->state = RIMAP_READY;
+    return NULL;
+}
+
+/* END FUNCTION: rimap_greeting */
+
+/* FUNCTION: rimap_open */
+
+/* SYNOPSIS
+ * Connect a session to the remote server, trying each of its addresses
+ * in turn, and read the greeting.
+ * END SYNOPSIS */
+
+static char *				/* R: NULL, or allocated response */
+rimap_open (
+  /* PARAMETERS */
+  struct rimap_session *sess,		/* I: closed session		*/
+  char *rbuf				/* I: response buffer		*/
   /* END PARAMETERS */
   )
 {
     /* VARIABLES */
     int	s=-1;				/* socket to remote auth host   */
     struct addrinfo *r;			/* remote socket address info   */
-    struct iovec iov[5];		/* for sending LOGIN command    */
-    char *qlogin;			/* pointer to "quoted" login    */
-    char *qpass;			/* pointer to "quoted" password */
-    char *c;				/* scratch pointer              */
-    int rc;				/* return code scratch area     */
-    char rbuf[RESP_LEN];		/* response read buffer         */
     char hbuf[NI_MAXHOST], pbuf[NI_MAXSERV];
     int saved_errno;
     int niflags;
     /* END VARIABLES */
 
-    /* sanity checks */
-    assert(login != NULL);
-    assert(password != NULL);
-
     /*establish connection to remote */
     for (r = ai; r; r = r->ai_next) {
 	s = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
@@ -356,69 +565,183 @@ auth_rimap (
 
     /* CLAIM: we now have a TCP connection to the remote IMAP server */
 
-    /*
-     * Install noop signal handlers. These just reinstall the handler
-     * and return so that we take an EINTR during network I/O.
-     */
-    (void) signal(SIGALRM, sig_null);
-    (void) signal(SIGPIPE, sig_null);
-    
-    /* read and parse the IMAP banner */
-
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = read(s, rbuf, sizeof(rbuf));
-    alarm(0);
-    if ( rc>0 ) {
-        /* check if there is more to read */
-        fd_set         perm;
-        int            fds, ret;
-        struct timeval timeout;
-
-        FD_ZERO(&perm);
-        FD_SET(s, &perm);
-        fds = s +1;
-
-        timeout.tv_sec  = 1;
-        timeout.tv_usec = 0;
-        while( select (fds, &perm, NULL, NULL, &timeout ) >0 ) {
-           if ( FD_ISSET(s, &perm) ) {
-              ret = read(s, rbuf+rc, sizeof(rbuf)-rc);
-              if ( ret<0 ) {
-                 rc = ret;
-                 break;
-              } else {
-                 rc += ret;
-              }
-           }
-        }
-    }
-    if (rc == -1) {
-	syslog(LOG_WARNING, "auth_rimap: read (banner): %m");
-	(void) close(s);
-	return strdup("NO [ALERT] error synchronizing with remote authentication server");
-    }
-    rbuf[rc] = '\0';			/* tie off response */
-    c = strpbrk(rbuf, "\r\n");
-    if (c != NULL) {
-	*c = '\0';			/* tie off line termination */
-    }
+    r_good = r;
+    sess->fd = s;
+    sess->state = RIMAP_CONNECTING;
 
-    if (!strncmp(rbuf, "* NO", sizeof("* NO")-1)) {
+    return rimap_greeting(sess, rbuf);
+}
+
+/* END FUNCTION: rimap_open */
+
+/* FUNCTION: rimap_prefetch */
+
+/* SYNOPSIS
+ * Start connecting a session to the address that worked last, without
+ * waiting. The greeting is read when the session is next used, by which
+ * time it has usually arrived. Errors are left for that point too.
+ * END SYNOPSIS */
+
+static void
+rimap_prefetch (
+  /* PARAMETERS */
+  struct rimap_session *sess		/* I: closed session		*/
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct addrinfo *r;			/* remote socket address info   */
+    int s;				/* socket to remote auth host   */
+    int fl;				/* file status flags		*/
+    /* END VARIABLES */
+
+    r = r_good ? r_good : ai;
+
+    s = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+    if (s < 0)
+	return;
+
+    fl = fcntl(s, F_GETFL);
+    if (fl == -1 || fcntl(s, F_SETFL, fl | O_NONBLOCK) == -1 ||
+	(connect(s, r->ai_addr, r->ai_addrlen) < 0 && errno != EINPROGRESS)) {
 	(void) close(s);
-	return strdup(RESP_UNAVAILABLE);
+	return;
     }
-    if (!strncmp(rbuf, "* BYE", sizeof("* BYE")-1)) {
-	(void) close(s);
-	return strdup(RESP_UNAVAILABLE);
+
+    sess->fd = s;
+    sess->state = RIMAP_CONNECTING;
+}
+
+/* END FUNCTION: rimap_prefetch */
+
+/* FUNCTION: rimap_settle */
+
+/* SYNOPSIS
+ * Complete the work left pending on a pooled session: the greeting of
+ * a background connection, or the response to UNAUTHENTICATE after the
+ * previous login. On failure the session is closed.
+ * END SYNOPSIS */
+
+static int				/* R: 0 if the session is ready */
+rimap_settle (
+  /* PARAMETERS */
+  struct rimap_session *sess,		/* I: pooled session		*/
+  char *rbuf				/* I: response buffer		*/
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char *c;				/* greeting failure response	*/
+    int rc;				/* return code scratch area	*/
+    /* END VARIABLES */
+
+    switch (sess->state) {
+
+      case RIMAP_READY:
+	return 0;
+
+      case RIMAP_CONNECTING:
+	c = rimap_greeting(sess, rbuf);
+	if (c == NULL)
+	    return 0;
+	free(c);
+	return -1;
+
+      case RIMAP_UNAUTHENTICATING:
+	rc = rimap_response(sess->fd, rbuf, TAG " ");
+	if (rc > 0 && !strncmp(rbuf, TAG " OK", sizeof(TAG " OK")-1)) {
+	    unauthenticate = 1;
+	    sess->state = RIMAP_READY;
+	    return 0;
+	}
+	if (rc > 0 && unauthenticate < 0) {
+	    syslog(LOG_INFO, "auth_rimap: remote server doesn't support UNAUTHENTICATE, "
+		   "sessions will be reconnected after each login");
+	    unauthenticate = 0;
+	}
+	break;
     }
-    if (strncmp(rbuf, "* OK", sizeof("* OK")-1)) {
-	syslog(LOG_WARNING,
-	       "auth_rimap: unexpected response during initial handshake: %s",
-	       rbuf);
-	(void) close(s);
-	return strdup(RESP_UNEXPECTED);
+
+    rimap_close(sess, 1);
+    return -1;
+}
+
+/* END FUNCTION: rimap_settle */
+
+/* FUNCTION: rimap_recycle */
+
+/* SYNOPSIS
+ * Return a session that just logged in to the not authenticated state,
+ * so it can serve the next login. UNAUTHENTICATE (RFC 8437) is sent but
+ * its response only read by the next user of the session. Servers that
+ * don't support it get a LOGOUT and a new connection in its place.
+ * END SYNOPSIS */
+
+static void
+rimap_recycle (
+  /* PARAMETERS */
+  struct rimap_session *sess		/* I: authenticated session	*/
+  /* END PARAMETERS */
+  )
+{
+    if (unauthenticate != 0 &&
+	send(sess->fd, UNAUTH_CMD, sizeof(UNAUTH_CMD) - 1, 0) ==
+	(ssize_t) (sizeof(UNAUTH_CMD) - 1)) {
+	sess->state = RIMAP_UNAUTHENTICATING;
+	return;
     }
-    
+
+    rimap_close(sess, 1);
+    rimap_prefetch(sess);
+}
+
+/* END FUNCTION: rimap_recycle */
+
+/* FUNCTION: auth_rimap */
+
+/* SYNOPSIS
+ * Proxy authenticate to a remote IMAP server.
+ *
+ * This mechanism takes the plaintext authenticator and password, forms
+ * them into an IMAP LOGIN command, then attempts to authenticate to
+ * a remote IMAP server using those values. If the remote authentication
+ * succeeds the credentials are considered valid.
+ *
+ * Connections are kept in a pool of up to RIMAP_MAX_SESSIONS sessions,
+ * which are only ever handed out in the not authenticated state, so
+ * that most logins cost a single round trip.
+ *
+ * NOTE: since IMSP uses the same form of LOGIN command as IMAP does,
+ * this driver will also work with IMSP servers.
+ */
+
+/* XXX This should be extended to support SASL PLAIN authentication */
+
+char *					/* R: Allocated response string */
+auth_rimap (
+  /* PARAMETERS */
+  const char *login,			/* I: plaintext authenticator */
+  const char *password,			/* I: plaintext password */
+  const char *service __attribute__((unused)),
+  const char *realm __attribute__((unused))
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct rimap_session *sess;		/* connection to remote host	*/
+    struct iovec iov[5];		/* for sending LOGIN command    */
+    char *qlogin;			/* pointer to "quoted" login    */
+    char *qpass;			/* pointer to "quoted" password */
+    char *reply = NULL;			/* response for the client	*/
+    int rc;				/* return code scratch area     */
+    int reused;				/* session came from the pool	*/
+    char rbuf[RESP_LEN];		/* response read buffer         */
+    /* END VARIABLES */
+
+    /* sanity checks */
+    assert(login != NULL);
+    assert(password != NULL);
+
     /* build the LOGIN command */
 
     qlogin = qstring(login);		/* quote login */
@@ -428,7 +751,6 @@ auth_rimap (
 	    memset(qpass, 0, strlen(qpass));
 	    free(qpass);
 	}
-	(void) close(s);
 	syslog(LOG_WARNING, "auth_rimap: qstring(login) == NULL");
 	return strdup(RESP_IERROR);
     }
@@ -437,7 +759,6 @@ auth_rimap (
 	    memset(qlogin, 0, strlen(qlogin));
 	    free(qlogin);
 	}
-	(void) close(s);
 	syslog(LOG_WARNING, "auth_rimap: qstring(password) == NULL");
 	return strdup(RESP_IERROR);
     }
@@ -453,86 +774,90 @@ auth_rimap (
     iov[4].iov_base = "\r\n";
     iov[4].iov_len  = sizeof("\r\n") - 1;
 
-    if (flags & VERBOSE) {
-	syslog(LOG_DEBUG, "auth_rimap: sending %s%s %s",
-	       LOGIN_CMD, qlogin, qpass);
-    }
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = retry_writev(s, iov, 5);
-    alarm(0);
-    if (rc == -1) {
-	syslog(LOG_WARNING, "auth_rimap: writev: %m");
-	memset(qlogin, 0, strlen(qlogin));
-	free(qlogin);
-	memset(qpass, 0, strlen(qpass));
-	free(qpass);
-	(void)close(s);
-	return strdup(RESP_IERROR);
-    }
+    sess = rimap_get();
 
-    /* don't need these any longer */
-    memset(qlogin, 0, strlen(qlogin));
-    free(qlogin);
-    memset(qpass, 0, strlen(qpass));
-    free(qpass);
+    /*
+     * A pooled session may have been dropped by the server while it sat
+     * idle, which only shows once we use it. In that case the login is
+     * tried once more on a new connection.
+     */
+    for (reused = 1; ; reused = 0) {
+	if (sess->fd >= 0 &&
+	    time(NULL) - sess->last_used > RIMAP_IDLE_TIMEOUT)
+	    rimap_close(sess, 1);
+
+	if (sess->fd < 0) {
+	    reused = 0;
+	    reply = rimap_open(sess, rbuf);
+	    if (reply != NULL)
+		goto done;
+	} else if (rimap_settle(sess, rbuf) != 0) {
+	    continue;
+	}
 
-    /* read and parse the LOGIN response */
-
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = read(s, rbuf, sizeof(rbuf));
-    alarm(0);
-    if ( rc>0 ) {
-        /* check if there is more to read */
-        fd_set         perm;
-        int            fds, ret;
-        struct timeval timeout;
-
-        FD_ZERO(&perm);
-        FD_SET(s, &perm);
-        fds = s +1;
-
-        timeout.tv_sec  = 1;
-        timeout.tv_usec = 0;
-        while( select (fds, &perm, NULL, NULL, &timeout ) >0 ) {
-           if ( FD_ISSET(s, &perm) ) {
-              ret = read(s, rbuf+rc, sizeof(rbuf)-rc);
-              if ( ret<0 ) {
-                 rc = ret;
-                 break;
-              } else {
-                 rc += ret;
-              }
-           }
-        }
-    }
-    (void) close(s);			/* we're done with the remote */
-    if (rc == -1) {
-	syslog(LOG_WARNING, "auth_rimap: read (response): %m");
-	return strdup(RESP_IERROR);
-    }
+	if (flags & VERBOSE) {
+	    syslog(LOG_DEBUG, "auth_rimap: sending %s%s %s",
+		   LOGIN_CMD, qlogin, qpass);
+	}
+	rc = retry_writev(sess->fd, iov, 5);
+	if (rc == -1) {
+	    if (reused) {
+		rimap_close(sess, 0);
+		continue;
+	    }
+	    syslog(LOG_WARNING, "auth_rimap: writev: %m");
+	    rimap_close(sess, 0);
+	    reply = strdup(RESP_IERROR);
+	    goto done;
+	}
 
-    rbuf[rc] = '\0';			/* tie off response */
-    c = strpbrk(rbuf, "\r\n");
-    if (c != NULL) {
-	*c = '\0';			/* tie off line termination */
+	/* read and parse the LOGIN response */
+
+	rc = rimap_response(sess->fd, rbuf, TAG " ");
+	if (rc <= 0) {
+	    if (reused) {
+		rimap_close(sess, 0);
+		continue;
+	    }
+	    if (rc == 0)
+		errno = ECONNRESET;
+	    syslog(LOG_WARNING, "auth_rimap: read (response): %m");
+	    rimap_close(sess, 0);
+	    reply = strdup(RESP_IERROR);
+	    goto done;
+	}
+	break;
     }
 
-     if (!strncmp(rbuf, TAG " OK", sizeof(TAG " OK")-1)) {
+    if (!strncmp(rbuf, TAG " OK", sizeof(TAG " OK")-1)) {
 	if (flags & VERBOSE) {
 	    syslog(LOG_DEBUG, "auth_rimap: [%s] %s", login, rbuf);
 	}
-	return strdup("OK remote authentication successful");
-    }
-    if (!strncmp(rbuf, TAG " NO", sizeof(TAG " NO")-1)) {
+	rimap_recycle(sess);
+	reply = strdup("OK remote authentication successful");
+    } else if (!strncmp(rbuf, TAG " NO", sizeof(TAG " NO")-1)) {
 	if (flags & VERBOSE) {
 	    syslog(LOG_DEBUG, "auth_rimap: [%s] %s", login, rbuf);
 	}
-	return strdup("NO remote server rejected your credentials");
+	/* still not authenticated, the session can be used as it is */
+	reply = strdup("NO remote server rejected your credentials");
+    } else {
+	syslog(LOG_WARNING, "auth_rimap: unexpected response to auth request: %s",
+	       rbuf);
+	rimap_close(sess, 1);
+	reply = strdup(RESP_UNEXPECTED);
     }
-    syslog(LOG_WARNING, "auth_rimap: unexpected response to auth request: %s",
-	   rbuf);
-    return strdup(RESP_UNEXPECTED);
-    
+
+ done:
+    rimap_put(sess);
+
+    /* don't need these any longer */
+    memset(qlogin, 0, strlen(qlogin));
+    free(qlogin);
+    memset(qpass, 0, strlen(qpass));
+    free(qpass);
+
+    return reply;
 }
 
 /* END FUNCTION: auth_rimap */
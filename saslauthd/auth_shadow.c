@@ -42,6 +42,8 @@
 # include <stdlib.h>
 # include <string.h>
 # include <sys/types.h>
+# include <sys/stat.h>
+# include <fcntl.h>
 # include <time.h>
 # include <pwd.h>
 # include <errno.h>
@@ -73,6 +75,500 @@
 # include "auth_shadow.h"
 # include "globals.h"
 /* END PUBLIC DEPENDENCIES */
+
+# ifdef HAVE_GETSPNAM
+
+/*
+ * With -O index the passwd and shadow files are read into a hash index
+ * at startup, instead of asking getpwnam()/getspnam() for every request,
+ * which with the files NSS backend scans them line by line. The files
+ * are looked at again at most once a second and the index rebuilt when
+ * either changed. Only accounts in these files are known in this mode.
+ */
+
+#  define SHADOW_PASSWD_FILE "/etc/passwd"
+#  define SHADOW_SHADOW_FILE "/etc/shadow"
+#  define SHADOW_RECHECK 1		/* seconds between stat()s */
+
+typedef struct {
+    char *name;
+    char *pwdp;				/* NULL if not in shadow */
+    long lstchg;
+    long max;
+    long expire;
+    unsigned int next;			/* chain, entry + 1 or 0 */
+} shadow_entry;
+
+typedef struct {
+    char *pwdata, *spdata;		/* the files, split in place */
+    shadow_entry *entries;
+    unsigned int count;
+    unsigned int *buckets;		/* entry + 1 or 0 */
+    unsigned int mask;
+    struct stat pwst, spst;		/* files as read */
+} shadow_db;
+
+static shadow_db *shadow_index = NULL;	/* NULL unless -O index */
+static time_t shadow_checked = 0;
+static int shadow_loading = 0;
+
+#  if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#   define SHADOW_THREADS
+#   include <pthread.h>
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+#  endif
+
+/* FUNCTION: shadow_hash */
+
+static unsigned int
+shadow_hash (
+  /* PARAMETERS */
+  const char *name			/* I: login name */
+  /* END PARAMETERS */
+  )
+{
+    unsigned int h = 2166136261U;	/* FNV-1a */
+
+    while (*name) {
+	h ^= (unsigned char) *name++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+/* END FUNCTION: shadow_hash */
+
+/* FUNCTION: shadow_find */
+
+static shadow_entry *			/* R: entry, NULL if none */
+shadow_find (
+  /* PARAMETERS */
+  shadow_db *db,			/* I: index */
+  const char *name			/* I: login name */
+  /* END PARAMETERS */
+  )
+{
+    unsigned int i;
+
+    for (i = db->buckets[shadow_hash(name) & db->mask]; i; i = db->entries[i - 1].next)
+	if (!strcmp(db->entries[i - 1].name, name))
+	    return &db->entries[i - 1];
+    return NULL;
+}
+
+/* END FUNCTION: shadow_find */
+
+/* FUNCTION: shadow_read */
+
+/* SYNOPSIS
+ * Read a whole file into a NUL terminated buffer.
+ * END SYNOPSIS */
+
+static char *				/* R: malloc()ed contents, or NULL */
+shadow_read (
+  /* PARAMETERS */
+  const char *path,			/* I: file to read */
+  struct stat *st			/* O: the file read */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char *data;
+    ssize_t n;
+    size_t len = 0;
+    int fd;
+    /* END VARIABLES */
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, st) < 0) {
+	syslog(LOG_ERR, "auth_shadow: %s: %m", path);
+	if (fd >= 0)
+	    close(fd);
+	return NULL;
+    }
+    data = malloc(st->st_size + 1);
+    if (data == NULL) {
+	syslog(LOG_ERR, "auth_shadow: out of memory reading %s", path);
+	close(fd);
+	return NULL;
+    }
+    while (len < (size_t) st->st_size &&
+	   (n = read(fd, data + len, st->st_size - len)) != 0) {
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    syslog(LOG_ERR, "auth_shadow: read %s: %m", path);
+	    free(data);
+	    close(fd);
+	    return NULL;
+	}
+	len += n;
+    }
+    close(fd);
+    data[len] = '\0';
+    return data;
+}
+
+/* END FUNCTION: shadow_read */
+
+/* FUNCTION: shadow_field */
+
+/* SYNOPSIS
+ * Split off the next ':' separated field of a line.
+ * END SYNOPSIS */
+
+static char *				/* R: the field */
+shadow_field (
+  /* PARAMETERS */
+  char **line				/* I/O: rest of the line */
+  /* END PARAMETERS */
+  )
+{
+    char *field = *line;
+    char *c = strchr(field, ':');
+
+    if (c != NULL) {
+	*c = '\0';
+	*line = c + 1;
+    } else {
+	*line = field + strlen(field);
+    }
+    return field;
+}
+
+/* END FUNCTION: shadow_field */
+
+/* FUNCTION: shadow_number */
+
+static long				/* R: value, -1 if empty */
+shadow_number (
+  /* PARAMETERS */
+  const char *field			/* I: numeric shadow field */
+  /* END PARAMETERS */
+  )
+{
+    return *field ? strtol(field, NULL, 10) : -1;
+}
+
+/* END FUNCTION: shadow_number */
+
+/* FUNCTION: shadow_free */
+
+static void
+shadow_free (
+  /* PARAMETERS */
+  shadow_db *db				/* I: index to free */
+  /* END PARAMETERS */
+  )
+{
+    if (db == NULL)
+	return;
+    if (db->spdata != NULL)
+	memset(db->spdata, 0, db->spst.st_size);
+    free(db->pwdata);
+    free(db->spdata);
+    free(db->entries);
+    free(db->buckets);
+    free(db);
+}
+
+/* END FUNCTION: shadow_free */
+
+/* FUNCTION: shadow_load */
+
+/* SYNOPSIS
+ * Build an index of the passwd and shadow files. As with getpwnam(),
+ * the first entry for a name wins; NIS compat ("+", "-") and comment
+ * lines are skipped.
+ * END SYNOPSIS */
+
+static shadow_db *			/* R: the index, NULL on error */
+shadow_load (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    shadow_db *db;
+    shadow_entry *e;
+    char *line, *next, *name;
+    unsigned int lines, size, h;
+    /* END VARIABLES */
+
+    db = calloc(1, sizeof(*db));
+    if (db == NULL)
+	return NULL;
+    if ((db->pwdata = shadow_read(SHADOW_PASSWD_FILE, &db->pwst)) == NULL ||
+	(db->spdata = shadow_read(SHADOW_SHADOW_FILE, &db->spst)) == NULL)
+	goto fail;
+
+    for (lines = 1, line = db->pwdata; (line = strchr(line, '\n')); line++)
+	lines++;
+    for (size = 16; size < 2 * lines; size <<= 1)
+	;
+    db->entries = calloc(lines, sizeof(*db->entries));
+    db->buckets = calloc(size, sizeof(*db->buckets));
+    if (db->entries == NULL || db->buckets == NULL)
+	goto fail;
+    db->mask = size - 1;
+
+    for (line = db->pwdata; *line; line = next) {
+	if ((next = strchr(line, '\n')) != NULL)
+	    *next++ = '\0';
+	else
+	    next = line + strlen(line);
+	if (*line == '+' || *line == '-' || *line == '#')
+	    continue;
+	name = shadow_field(&line);
+	if (*name == '\0' || shadow_find(db, name) != NULL)
+	    continue;
+	e = &db->entries[db->count];
+	e->name = name;
+	h = shadow_hash(name) & db->mask;
+	e->next = db->buckets[h];
+	db->buckets[h] = ++db->count;
+    }
+
+    for (line = db->spdata; *line; line = next) {
+	if ((next = strchr(line, '\n')) != NULL)
+	    *next++ = '\0';
+	else
+	    next = line + strlen(line);
+	if (*line == '+' || *line == '-' || *line == '#')
+	    continue;
+	name = shadow_field(&line);
+	if ((e = shadow_find(db, name)) == NULL || e->pwdp != NULL)
+	    continue;
+	e->pwdp = shadow_field(&line);
+	e->lstchg = shadow_number(shadow_field(&line));
+	(void) shadow_field(&line);		/* sp_min */
+	e->max = shadow_number(shadow_field(&line));
+	(void) shadow_field(&line);		/* sp_warn */
+	(void) shadow_field(&line);		/* sp_inact */
+	e->expire = shadow_number(shadow_field(&line));
+    }
+
+    return db;
+
+  fail:
+    shadow_free(db);
+    return NULL;
+}
+
+/* END FUNCTION: shadow_load */
+
+/* FUNCTION: shadow_changed */
+
+static int				/* R: file differs from the one read */
+shadow_changed (
+  /* PARAMETERS */
+  const char *path,			/* I: file */
+  const struct stat *old		/* I: as it was read */
+  /* END PARAMETERS */
+  )
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+	return 0;			/* keep what we have */
+    return st.st_mtime != old->st_mtime || st.st_size != old->st_size ||
+	st.st_ino != old->st_ino || st.st_dev != old->st_dev;
+}
+
+/* END FUNCTION: shadow_changed */
+
+/* FUNCTION: shadow_refresh */
+
+/* SYNOPSIS
+ * Rebuild the index if the files changed since it was built. The
+ * request that notices does the work; others go on with the old index.
+ * END SYNOPSIS */
+
+static void
+shadow_refresh (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    shadow_db *db, *old;
+    time_t now;
+    int stale;
+    /* END VARIABLES */
+
+    now = time(NULL);
+#  ifdef SHADOW_THREADS
+    pthread_mutex_lock(&shadow_lock);
+#  endif
+    stale = (!shadow_loading && now - shadow_checked >= SHADOW_RECHECK);
+    if (stale) {
+	shadow_checked = now;
+	stale = shadow_changed(SHADOW_PASSWD_FILE, &shadow_index->pwst) ||
+	    shadow_changed(SHADOW_SHADOW_FILE, &shadow_index->spst);
+	shadow_loading = stale;
+    }
+#  ifdef SHADOW_THREADS
+    pthread_mutex_unlock(&shadow_lock);
+#  endif
+    if (!stale)
+	return;
+
+    db = shadow_load();
+    if (db == NULL)
+	syslog(LOG_ERR, "auth_shadow: failed to reload the shadow index, keeping the old one");
+    else if (flags & VERBOSE)
+	syslog(LOG_DEBUG, "DEBUG: auth_shadow: reloaded shadow index, %u users", db->count);
+
+#  ifdef SHADOW_THREADS
+    pthread_mutex_lock(&shadow_lock);
+#  endif
+    old = db ? shadow_index : NULL;
+    if (db != NULL)
+	shadow_index = db;
+    shadow_loading = 0;
+#  ifdef SHADOW_THREADS
+    pthread_mutex_unlock(&shadow_lock);
+#  endif
+    shadow_free(old);
+}
+
+/* END FUNCTION: shadow_refresh */
+
+/* FUNCTION: shadow_lookup */
+
+/* SYNOPSIS
+ * Look up login in the index, copying its shadow entry into spbuf with
+ * the password hash stored in spdata.
+ * END SYNOPSIS */
+
+static int				/* R: 0 found, 1 no user, 2 no shadow entry */
+shadow_lookup (
+  /* PARAMETERS */
+  const char *login,			/* I: login name */
+  struct spwd *spbuf,			/* O: shadow entry */
+  char *spdata,				/* O: storage for the hash */
+  size_t spsize				/* I: size of spdata */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    shadow_entry *e;
+    int rc;
+    /* END VARIABLES */
+
+    shadow_refresh();
+
+#  ifdef SHADOW_THREADS
+    pthread_mutex_lock(&shadow_lock);
+#  endif
+    e = shadow_find(shadow_index, login);
+    if (e == NULL) {
+	rc = 1;
+    } else if (e->pwdp == NULL) {
+	rc = 2;
+    } else {
+	memset(spbuf, 0, sizeof(*spbuf));
+	strlcpy(spdata, e->pwdp, spsize);
+	spbuf->sp_pwdp = spdata;
+	spbuf->sp_lstchg = e->lstchg;
+	spbuf->sp_max = e->max;
+	spbuf->sp_expire = e->expire;
+	rc = 0;
+    }
+#  ifdef SHADOW_THREADS
+    pthread_mutex_unlock(&shadow_lock);
+#  endif
+
+    return rc;
+}
+
+/* END FUNCTION: shadow_lookup */
+
+/* FUNCTION: shadow_crypt */
+
+/* SYNOPSIS
+ * Hash password with the salt of the stored hash. Uses crypt_r() where
+ * available, so that requests can hash concurrently.
+ * END SYNOPSIS */
+
+static char *				/* R: malloc()ed hash, NULL on error */
+shadow_crypt (
+  /* PARAMETERS */
+  const char *password,			/* I: plaintext password */
+  const char *salt			/* I: stored hash */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    const char *cpw;
+    char *result;
+#  ifdef HAVE_CRYPT_R
+    struct crypt_data *data;
+#  endif
+    /* END VARIABLES */
+
+#  ifdef HAVE_CRYPT_R
+    data = calloc(1, sizeof(*data));
+    if (data == NULL)
+	return NULL;
+    cpw = crypt_r(password, salt, data);
+    result = cpw ? strdup(cpw) : NULL;
+    memset(data, 0, sizeof(*data));
+    free(data);
+#  else
+    cpw = crypt(password, salt);
+    result = cpw ? strdup(cpw) : NULL;
+#  endif
+    return result;
+}
+
+/* END FUNCTION: shadow_crypt */
+
+# endif /* HAVE_GETSPNAM */
+
+/* FUNCTION: auth_shadow_init */
+
+/* SYNOPSIS
+ * With -O index, build the shadow index.
+ * END SYNOPSIS */
+
+int
+auth_shadow_init (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+    if (mech_option == NULL)
+	return 0;
+    if (strcmp(mech_option, "index")) {
+	syslog(LOG_ERR, "auth_shadow_init: unknown option %s", mech_option);
+	return -1;
+    }
+
+# ifdef HAVE_GETSPNAM
+    shadow_index = shadow_load();
+    if (shadow_index == NULL) {
+	syslog(LOG_ERR, "auth_shadow_init: failed to build the shadow index");
+	return -1;
+    }
+    shadow_checked = time(NULL);
+    if (flags & VERBOSE)
+	syslog(LOG_DEBUG, "DEBUG: auth_shadow_init: indexed %u users", shadow_index->count);
+#  ifdef HAVE_CRYPT_R
+    /* neither the index nor crypt_r() need the mechanism lock */
+    auth_mech->flags |= MECH_THREADSAFE;
+#  endif
+    return 0;
+# else
+    syslog(LOG_ERR, "auth_shadow_init: -O index needs getspnam()");
+    return -1;
+# endif
+}
+
+/* END FUNCTION: auth_shadow_init */
 
 /* FUNCTION: auth_shadow */
 
@@ -112,6 +608,8 @@ auth_shadow (
     struct passwd	*pw;		/* return from getpwnam_r() */
     struct spwd   	*sp;		/* return from getspnam_r() */
     int errnum;
+    struct spwd idx_spbuf;		/* entry from the shadow index */
+    char idx_spdata[PWBUFSZ];
 #  ifdef _REENTRANT
     struct passwd pwbuf;
     char pwdata[PWBUFSZ];		/* pwbuf indirect data goes in here */
@@ -137,69 +635,85 @@ auth_shadow (
 #  define SHADOW_PW_LOCKED "*LK*"	/* account locked (not used by us) */
 #  define SHADOW_PW_EPERM  "*NP*"	/* insufficient database perms */
 
+    today = (long)time(NULL)/(24L*60*60);
+
+    if (shadow_index != NULL) {
+	switch (shadow_lookup(login, &idx_spbuf, idx_spdata, sizeof(idx_spdata))) {
+	case 1:
+	    if (flags & VERBOSE) {
+		syslog(LOG_DEBUG, "DEBUG: auth_shadow: %s: invalid username", login);
+	    }
+	    RETURN("NO Invalid username");
+	case 2:
+	    if (flags & VERBOSE) {
+		syslog(LOG_DEBUG, "DEBUG: auth_shadow: %s: invalid shadow username", login);
+	    }
+	    RETURN("NO Invalid shadow username");
+	}
+	sp = &idx_spbuf;
+    } else {
 #  ifdef _REENTRANT
 #    ifdef GETXXNAM_R_5ARG
-	(void) getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata), &pw);
+	    (void) getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata), &pw);
 #    else
-    pw = getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata));
+	pw = getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata));
 #    endif /* GETXXNAM_R_5ARG */
 #  else
-    pw = getpwnam(login);
+	pw = getpwnam(login);
 #  endif /* _REENTRANT */
-    errnum = errno;
-    endpwent();
-
-    if (pw == NULL) {
-	if (errnum != 0) {
-	    char *errstr;
-
-	    if (flags & VERBOSE) {
-		syslog(LOG_DEBUG, "DEBUG: auth_shadow: getpwnam(%s) failure: %m", login);
-	    }
-	    if (asprintf(&errstr, "NO Username lookup failure: %s", strerror(errno)) == -1) {
-		/* XXX the hidden strdup() will likely fail and return NULL here.... */
-		RETURN("NO Username lookup failure: unknown error (ENOMEM formatting strerror())");
+	errnum = errno;
+	endpwent();
+
+	if (pw == NULL) {
+	    if (errnum != 0) {
+		char *errstr;
+
+		if (flags & VERBOSE) {
+		    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getpwnam(%s) failure: %m", login);
+		}
+		if (asprintf(&errstr, "NO Username lookup failure: %s", strerror(errno)) == -1) {
+		    /* XXX the hidden strdup() will likely fail and return NULL here.... */
+		    RETURN("NO Username lookup failure: unknown error (ENOMEM formatting strerror())");
+		}
+		return errstr;
+	    } else {
+		if (flags & VERBOSE) {
+		    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getpwnam(%s): invalid username", login);
+		}
+		RETURN("NO Invalid username");
 	    }
-	    return errstr;
-	} else {
-	    if (flags & VERBOSE) {
-		syslog(LOG_DEBUG, "DEBUG: auth_shadow: getpwnam(%s): invalid username", login);
-	    }
-	    RETURN("NO Invalid username");
 	}
-    }
-
-    today = (long)time(NULL)/(24L*60*60);
 
 #  ifdef _REENTRANT
 #    ifdef GETXXNAM_R_5ARG
-	(void) getspnam_r(login, &spbuf, spdata, sizeof(spdata), &sp);
+	    (void) getspnam_r(login, &spbuf, spdata, sizeof(spdata), &sp);
 #    else
-    sp = getspnam_r(login, &spbuf, spdata, sizeof(spdata));
+	sp = getspnam_r(login, &spbuf, spdata, sizeof(spdata));
 #    endif /* GETXXNAM_R_5ARG */
 #  else
-    sp = getspnam(login);
+	sp = getspnam(login);
 #  endif /* _REENTRANT */
-    errnum = errno;
-    endspent();
-
-    if (sp == NULL) {
-	if (errnum != 0) {
-	    char *errstr;
-
-	    if (flags & VERBOSE) {
-		syslog(LOG_DEBUG, "DEBUG: auth_shadow: getspnam(%s) failure: %m", login);
-	    }
-	    if (asprintf(&errstr, "NO Username shadow lookup failure: %s", strerror(errno)) == -1) {
-		/* XXX the hidden strdup() will likely fail and return NULL here.... */
-		RETURN("NO Username shadow lookup failure: unknown error (ENOMEM formatting strerror())");
-	    }
-	    return errstr;
-	} else {
-	    if (flags & VERBOSE) {
-		syslog(LOG_DEBUG, "DEBUG: auth_shadow: getspnam(%s): invalid shadow username", login);
+	errnum = errno;
+	endspent();
+
+	if (sp == NULL) {
+	    if (errnum != 0) {
+		char *errstr;
+
+		if (flags & VERBOSE) {
+		    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getspnam(%s) failure: %m", login);
+		}
+		if (asprintf(&errstr, "NO Username shadow lookup failure: %s", strerror(errno)) == -1) {
+		    /* XXX the hidden strdup() will likely fail and return NULL here.... */
+		    RETURN("NO Username shadow lookup failure: unknown error (ENOMEM formatting strerror())");
+		}
+		return errstr;
+	    } else {
+		if (flags & VERBOSE) {
+		    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getspnam(%s): invalid shadow username", login);
+		}
+		RETURN("NO Invalid shadow username");
 	    }
-	    RETURN("NO Invalid shadow username");
 	}
     }
 
@@ -210,8 +724,8 @@ auth_shadow (
 	RETURN("NO Insufficient permission to access NIS authentication database (saslauthd)");
     }
 
-    cpw = strdup((const char *)crypt(password, sp->sp_pwdp));
-    if (strcmp(sp->sp_pwdp, cpw)) {
+    cpw = shadow_crypt(password, sp->sp_pwdp);
+    if (cpw == NULL || strcmp(sp->sp_pwdp, cpw)) {
 	if (flags & VERBOSE) {
 	    /*
 	     * This _should_ reveal the SHADOW_PW_LOCKED prefix to an
@@ -219,7 +733,7 @@ auth_shadow (
 	     * should do the check here and be less obtuse about it....
 	     */
 	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: pw mismatch: '%s' != '%s'",
-		   sp->sp_pwdp, cpw);
+		   sp->sp_pwdp, cpw ? cpw : "(null)");
 	}
 	free(cpw);
 	RETURN("NO Incorrect password");
@@ -305,6 +819,14 @@ auth_shadow (
 
 #else /* !AUTH_SHADOW */
 
+int
+auth_shadow_init (
+  void
+  )
+{
+    return 0;
+}
+
 char *
 auth_shadow (
   const char *login __attribute__((unused)),
@@ -50,6 +50,8 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <time.h>
+#include <sched.h>
+#include <signal.h>
 
 #include "cache.h"
 #include "utils.h"
@@ -62,10 +64,22 @@
  *****************************************/
 static  struct mm_ctl	mm;
 static  struct lock_ctl	lock;
-static  struct bucket	*table = NULL;
+static  struct slot	*table = NULL;
 static  struct stats	*table_stats = NULL;
+static  struct shard_stats *shard_stats = NULL;
+static  unsigned int	shards = 1;
+static  unsigned int	shard_slots = 0;
 static  unsigned int	table_size = 0;
 static  unsigned int	table_timeout = 0;
+static  unsigned int	neg_table_size = 0;
+static  unsigned int	neg_timeout = 0;
+
+/* bump a counter of a shard */
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_4
+# define SHARD_STATS_INC(shard, counter)	__sync_fetch_and_add(&shard_stats[(shard)].counter, 1)
+#else
+# define SHARD_STATS_INC(shard, counter)	(shard_stats[(shard)].counter++)
+#endif
 
 /****************************************
  * flags               global from saslauthd-main.c
@@ -83,22 +97,57 @@ int cache_init(void) {
 	char		cache_magic[64];
 	void		*base;
 
-	if (!(flags & CACHE_ENABLED))
+	if (!(flags & CACHE_ENABLED)) {
+		if (flags & CACHE_NEG_ENABLED) {
+			logger(L_ERR, L_FUNC, "the failed credentials cache requires the credential cache (-c)");
+			return -1;
+		}
+
+		if (flags & CACHE_PERSIST) {
+			logger(L_ERR, L_FUNC, "keeping the cache across restarts requires the credential cache (-c)");
+			return -1;
+		}
+
 		return 0;
+	}
 
 	memset(cache_magic, 0, sizeof(cache_magic));
 	strlcpy(cache_magic, CACHE_CACHE_MAGIC, sizeof(cache_magic));
 
 	/**************************************************************
-	 * Compute the size of the hash table. This and a stats 
-	 * struct will make up the memory region. 
+	 * Compute the size of the hash table. This, a stats struct
+	 * and the counters of the shards will make up the memory
+	 * region. The hash table is split into shards of equally
+	 * many (a prime number of) slots, one shard per cpu, each
+	 * with counters of its own, see cache_hash_slot(). The
+	 * slots of the failed credentials table (if any) are tacked
+	 * onto the end of the hash table, so they share the same
+	 * locking.
 	 **************************************************************/
 
 	if (table_size == 0)
 		table_size = CACHE_DEFAULT_TABLE_SIZE;
 
-	bytes = (table_size * CACHE_MAX_BUCKETS_PER * sizeof(struct bucket)) \
-		+ sizeof(struct stats) + 256;
+	shards = cache_shard_count();
+
+	if (shards > 1) {
+		shard_slots = cache_get_next_prime((table_size + shards - 1) / shards - 1);
+		table_size = shards * shard_slots;
+	} else {
+		shard_slots = table_size;
+	}
+
+	if (flags & CACHE_NEG_ENABLED) {
+		if (neg_table_size == 0)
+			neg_table_size = CACHE_DEFAULT_NEG_TABLE_SIZE;
+
+		if (neg_timeout == 0)
+			neg_timeout = CACHE_DEFAULT_NEG_TIMEOUT;
+	}
+
+	bytes = ((table_size + neg_table_size) * sizeof(struct slot)) \
+		+ 64 + 128 + (shards * sizeof(struct shard_stats)) \
+		+ CACHE_LOCK_BYTES(table_size + neg_table_size) + 256;
 
 
 	if ((base = cache_alloc_mm(bytes)) == NULL)
@@ -110,6 +159,8 @@ int cache_init(void) {
 	if (flags & VERBOSE) {
 		logger(L_DEBUG, L_FUNC, "bucket size: %d bytes",
 		       sizeof(struct bucket));
+		logger(L_DEBUG, L_FUNC, "slot size  : %d bytes",
+		       sizeof(struct slot));
 		logger(L_DEBUG, L_FUNC, "stats size : %d bytes",
 		       sizeof(struct stats));
 		logger(L_DEBUG, L_FUNC, "timeout    : %d seconds",
@@ -120,25 +171,47 @@ int cache_init(void) {
 		       table_size);
 		logger(L_DEBUG, L_FUNC, "cache table: %d buckets",
 		       table_size * CACHE_MAX_BUCKETS_PER);
+		logger(L_DEBUG, L_FUNC, "cache table: %d shards of %d slots",
+		       shards, shard_slots);
+
+		if (flags & CACHE_NEG_ENABLED) {
+			logger(L_DEBUG, L_FUNC, "failed creds timeout: %d seconds",
+			       neg_timeout);
+			logger(L_DEBUG, L_FUNC, "failed creds table: %d slots",
+			       neg_table_size);
+		}
 	} 
 
 	/**************************************************************
-	 * At the top of the region is the magic and stats struct. The
-	 * slots follow. Due to locking, the counters in the stats
-	 * struct will not be entirely accurate.
+	 * At the top of the region is the magic and stats struct,
+	 * then the counters of the shards. The slots follow, then
+	 * whatever the lock implementation keeps in the shared
+	 * region. Where atomic increments aren't available the
+	 * counters will not be entirely accurate. A region kept from
+	 * a previous run (-p) is used as is if it checks out, see
+	 * cache_reuse_table().
 	 **************************************************************/
 
-	memset(base, 0, bytes);
-
-	memcpy(base, cache_magic, 64);
 	table_stats = (void *)((char *)base + 64);
-	table_stats->table_size = table_size;
-	table_stats->max_buckets_per = CACHE_MAX_BUCKETS_PER;
-	table_stats->sizeof_bucket = sizeof(struct bucket);
-	table_stats->timeout = table_timeout;
-	table_stats->bytes = bytes;
+	shard_stats = (void *)((char *)table_stats + 128);
+	table = (void *)(shard_stats + shards);
+
+	if (!mm.reuse || cache_reuse_table(base, bytes) != 0) {
+		memset(base, 0, bytes);
+
+		memcpy(base, cache_magic, 64);
+		table_stats->table_size = table_size;
+		table_stats->max_buckets_per = CACHE_MAX_BUCKETS_PER;
+		table_stats->sizeof_bucket = sizeof(struct bucket);
+		table_stats->bytes = bytes;
+		table_stats->neg_table_size = neg_table_size;
+		table_stats->shards = shards;
+		table_stats->shard_slots = shard_slots;
+	}
 
-	table = (void *)((char *)table_stats + 128);
+	table_stats->timeout = table_timeout;
+	table_stats->neg_timeout = neg_timeout;
+	table_stats->clean = 0;
 
 	/**************************************************************
 	 * Last, initialize the hash table locking.
@@ -153,25 +226,36 @@ int cache_init(void) {
 /*************************************************************
  * Here we'll take some credentials and run them through
  * the hash table. If we have a valid hit then all is good
- * return CACHE_OK. If we don't get a hit, write the entry to
- * the result pointer and expect a later call to
- * cache_commit() to flush the bucket into the table.
+ * return CACHE_OK. If the same credentials were recently
+ * turned down by the mechanism, return CACHE_DENIED. If we
+ * don't get a hit, write the entry to the result pointer and
+ * expect a later call to cache_commit() (or to
+ * cache_commit_failure()) to flush the bucket into the table.
+ *
+ * A hit on an entry close to its timeout may come with
+ * result->status set to CACHE_REFRESH, in which case the
+ * caller should check the credentials with the mechanism
+ * anyway (once the hit is answered) and follow up with
+ * cache_commit() or cache_commit_failure(). If another
+ * lookup is already checking the very same credentials with
+ * the mechanism, we wait for its verdict instead.
  **************************************************************/
 int cache_lookup(const char *user, const char *realm, const char *service, const char *password, struct cache_result *result) {
 
-	int			user_length = 0;
-	int			realm_length = 0;
-	int			service_length = 0;
-	int			hash_offset;
-	unsigned char		pwd_digest[16];
+	unsigned int		user_length = 0;
+	unsigned int		realm_length = 0;
+	unsigned int		service_length = 0;
+	unsigned int		hash_offset;
+	unsigned int		neg_offset = 0;
+	unsigned int		shard;
+	int			index;
 	MD5_CTX			md5_context;
 	time_t			epoch;
 	time_t			epoch_timeout;
-	struct bucket		*ref_bucket;
-	struct bucket		*low_bucket;
-	struct bucket		*high_bucket;
-	struct bucket		*read_bucket = NULL;
-	char			userrealmserv[CACHE_MAX_CREDS_LENGTH];
+	time_t			epoch_refresh;
+	int			waiting = 0;
+	struct bucket		*key;
+	struct bucket		found;
 	static char		*debug = "[login=%s] [service=%s] [realm=%s]: %s";
 
 
@@ -185,9 +269,9 @@ int cache_lookup(const char *user, const char *realm, const char *service, const
 	 * Initial length checks
 	 **************************************************************/
 
-	user_length = strlen(user) + 1;
-	realm_length = strlen(realm) + 1;
-	service_length = strlen(service) + 1;
+	user_length = strlen(user);
+	realm_length = strlen(realm);
+	service_length = strlen(service);
 
 	if ((user_length + realm_length + service_length) > CACHE_MAX_CREDS_LENGTH) {
 		return CACHE_TOO_BIG;
@@ -199,188 +283,755 @@ int cache_lookup(const char *user, const char *realm, const char *service, const
 
 	epoch = time(NULL);
 	epoch_timeout = epoch - table_timeout;
+	epoch_refresh = epoch_timeout + (table_timeout * CACHE_REFRESH_AHEAD / 100);
 
 	/**************************************************************
-	 * Get the offset into the hash table and the md5 sum of
-	 * the password.
+	 * Build the key (the credentials laid end to end, as they'll
+	 * be kept in the arena), hash it to get the shard and offset
+	 * into the hash table, and take the md5 sum of the password.
 	 **************************************************************/
 
-	strlcpy(userrealmserv, user, sizeof(userrealmserv));
-	strlcat(userrealmserv, realm, sizeof(userrealmserv));
-	strlcat(userrealmserv, service, sizeof(userrealmserv));
+	key = &result->bucket;
+
+	memcpy(result->creds, user, user_length);
+	memcpy(result->creds + user_length, realm, realm_length);
+	memcpy(result->creds + user_length + realm_length, service, service_length);
+
+	key->user_length = user_length;
+	key->realm_length = realm_length;
+	key->service_length = service_length;
+	key->hash = cache_hash(result->creds, user_length + realm_length + service_length);
 
-	hash_offset = cache_pjwhash(userrealmserv);
+	hash_offset = cache_hash_slot(key->hash, &shard);
+	result->shard = shard;
 
 	_saslauthd_MD5Init(&md5_context);
 	_saslauthd_MD5Update(&md5_context, password, strlen(password));
-	_saslauthd_MD5Final(pwd_digest, &md5_context);
+	_saslauthd_MD5Final(key->pwd_digest, &md5_context);
 
 	/**************************************************************
-	 * Loop through the bucket chain to try and find a hit.
-	 *
-	 * low_bucket = bucket at the start of the slot.
-	 *
-	 * high_bucket = last bucket in the slot.
-	 * 
-	 * read_bucket = Contains the matched bucket if found. 
-	 *               Otherwise is NULL.
-	 *
-	 * Also, lock the slot first to avoid contention in the 
-	 * bucket chain.
-	 *
+	 * Look for the credentials in the slot, see cache_read_slot().
 	 **************************************************************/
 
-	table_stats->attempts++;
+	SHARD_STATS_INC(shard, attempts);
 
-	if (cache_get_rlock(hash_offset) != 0) {
-		table_stats->misses++;
-		table_stats->lock_failures++;
-		return CACHE_FAIL;
-	}	
+	while (1) {
+		if ((index = cache_read_slot(hash_offset, key, result->creds, NULL, &found)) == -2) {
+			SHARD_STATS_INC(shard, misses);
+			SHARD_STATS_INC(shard, lock_failures);
+			return CACHE_FAIL;
+		}
+
+		/**************************************************************
+		 * If we have our fish, check the password. If it's good, mark
+		 * the bucket as referenced for the CLOCK and return CACHE_OK.
+		 * An entry that is about to time out gets a refresh scheduled
+		 * by the first hit to claim it (see cache_claim()), the
+		 * others carry on answering from the entry in the meantime.
+		 **************************************************************/
+
+		if (index >= 0 && found.created > epoch_timeout && \
+		    memcmp(key->pwd_digest, found.pwd_digest, 16) == 0) {
 
-	low_bucket = table + (CACHE_MAX_BUCKETS_PER * hash_offset);
-	high_bucket = low_bucket + CACHE_MAX_BUCKETS_PER;
+			if (flags & VERBOSE)
+				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found with valid passwd");
+
+			if (!table[hash_offset].buckets[index].referenced)
+				table[hash_offset].buckets[index].referenced = 1;
+
+			SHARD_STATS_INC(shard, hits);
+
+			if (found.created <= epoch_refresh) {
+				result->status = CACHE_REFRESH;
+				result->hash_offset = hash_offset;
+				key->created = epoch;
 
-	for (ref_bucket = low_bucket; ref_bucket < high_bucket; ref_bucket++) {
-		if (strcmp(user, ref_bucket->creds + ref_bucket->user_offt) == 0 && \
-		    strcmp (realm, ref_bucket->creds + ref_bucket->realm_offt) == 0 && \
-		    strcmp(service, ref_bucket->creds + ref_bucket->service_offt) == 0) {
-			read_bucket = ref_bucket;
+				if (cache_claim(result, epoch) == 0) {
+					if (flags & VERBOSE)
+						logger(L_DEBUG, L_FUNC, debug, user, realm, service, "refresh pending");
+
+					SHARD_STATS_INC(shard, refreshes);
+					return CACHE_OK;
+				}
+
+				memset((void *)result, 0, sizeof(struct cache_result));
+				result->status = CACHE_NO_FLUSH;
+				result->shard = shard;
+			}
+
+			return CACHE_OK;
+		}
+
+		/**************************************************************
+		 * Somebody else asking the mechanism about the same user and
+		 * password? Then wait for the answer rather than ask again,
+		 * for as long as their claim holds. Worker threads (-w) leave
+		 * this to auth_coalesce(), which sleeps on a condition until
+		 * the answer is in rather than poll the slot.
+		 **************************************************************/
+
+		if ((flags & USE_THREAD_MODEL) || \
+		    index < 0 || found.pending == 0 || \
+		    (unsigned int)epoch - found.pending >= CACHE_PENDING_TIMEOUT || \
+		    memcmp(key->pwd_digest, found.pwd_digest, 16) != 0)
 			break;
+
+		if (!waiting) {
+			if (flags & VERBOSE)
+				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "lookup pending elsewhere, waiting");
+
+			SHARD_STATS_INC(shard, waits);
+			waiting = 1;
 		}
+
+		usleep(CACHE_PENDING_POLL * 1000);
+
+		epoch = time(NULL);
+		epoch_timeout = epoch - table_timeout;
+		epoch_refresh = epoch_timeout + (table_timeout * CACHE_REFRESH_AHEAD / 100);
+	}
+
+	/**************************************************************
+	 * Else, we'll leave the entry in the result pointer for 
+	 * cache_commit() to flush into the slot (CACHE_FLUSH).
+	 **************************************************************/
+
+	if (flags & VERBOSE) {
+		if (index >= 0 && found.created > epoch_timeout)
+			logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found with invalid passwd, update pending");
+		else
+			logger(L_DEBUG, L_FUNC, debug, user, realm, service, "not found, update pending");
 	}
 
+	result->status = CACHE_FLUSH;
+	result->hash_offset = hash_offset;
+
 	/**************************************************************
-	 * If we have our fish, check the password. If it's good,
-	 * release the slot (row) lock and return CACHE_OK. Else,
-	 * we'll write the entry to the result pointer. If we have a
-	 * read_bucket, then tell cache_commit() to not rescan the 
-	 * chain (CACHE_FLUSH). Else, have cache_commit() determine the
-	 * best bucket to place the new entry (CACHE_FLUSH_WITH_RESCAN).
+	 * Check the failed credentials table. Its slot is picked
+	 * by the password digest as well, so a flood of guesses for
+	 * a single user spreads out over the table.
 	 **************************************************************/
 
-	if (read_bucket != NULL && read_bucket->created > epoch_timeout) {
+	if (flags & CACHE_NEG_ENABLED) {
+		neg_offset = table_size + ((key->hash ^ ((unsigned int)key->pwd_digest[0] | \
+			(unsigned int)key->pwd_digest[1] << 8 | (unsigned int)key->pwd_digest[2] << 16 | \
+			(unsigned int)key->pwd_digest[3] << 24)) % neg_table_size);
+
+		index = cache_read_slot(neg_offset, key, result->creds, key->pwd_digest, &found);
 
-		if (memcmp(pwd_digest, read_bucket->pwd_digest, 16) == 0) {
+		if (index == -2) {
+			SHARD_STATS_INC(shard, lock_failures);
+			neg_offset = 0;
+		} else if (index >= 0 && found.created > epoch - neg_timeout) {
 
 			if (flags & VERBOSE)
-				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found with valid passwd");
+				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found as a failed login");
 
-			cache_un_lock(hash_offset);
-			table_stats->hits++;
-			return CACHE_OK;
+			SHARD_STATS_INC(shard, neg_hits);
+			memset((void *)result, 0, sizeof(struct cache_result));
+			result->status = CACHE_NO_FLUSH;
+			return CACHE_DENIED;
+		}
+	}
+
+	result->neg_offset = neg_offset;
+	key->created = epoch;
+
+	/**************************************************************
+	 * Last, claim the credentials so lookups for them coming in
+	 * while the mechanism is at it wait for us. Not getting the
+	 * claim doesn't keep us from asking the mechanism ourselves.
+	 **************************************************************/
+
+	cache_claim(result, epoch);
+
+	SHARD_STATS_INC(shard, misses);
+	return CACHE_FAIL;
+}
+
+
+/*************************************************************
+ * Look for the bucket holding the key's credentials (and
+ * password digest, unless it's NULL) in a slot. Return the
+ * bucket's index in the slot with a consistent copy of it
+ * in found, -1 if it isn't there, or -2 if the slot
+ * couldn't be read.
+ *
+ * The scan is bracketed by cache_read_begin() and
+ * cache_read_retry(). Depending on the lock implementation
+ * that either holds a read lock on the slot for the duration
+ * of the scan, or validates the slot's sequence counter and
+ * has us scan again if a writer got in the way. In the latter
+ * case the scan can see a half written slot, so nothing read
+ * from it is trusted further than the arena bounds.
+ **************************************************************/
+int cache_read_slot(unsigned int slot, const struct bucket *key, const char *creds, const unsigned char *pwd_digest, struct bucket *found) {
+
+	unsigned int		seq;
+	int			index;
+
+
+	do {
+		if (cache_read_begin(slot, &seq) != 0)
+			return -2;
+
+		index = cache_find_bucket(table + slot, key, creds, pwd_digest, found);
+	} while (cache_read_retry(slot, seq) != 0);
+
+	return index;
+}
+
+
+/*************************************************************
+ * The scan behind cache_read_slot(), without any locking.
+ * Return the index of the matching bucket (copied to found),
+ * or -1 if there is none.
+ **************************************************************/
+int cache_find_bucket(struct slot *ref_slot, const struct bucket *key, const char *creds, const unsigned char *pwd_digest, struct bucket *found) {
+
+	struct bucket		*ref_bucket;
+	unsigned int		length;
+	int			x;
+
+
+	length = key->user_length + key->realm_length + key->service_length;
+
+	for (x = 0; x < CACHE_MAX_BUCKETS_PER; x++) {
+		ref_bucket = ref_slot->buckets + x;
+
+		if (ref_bucket->hash != key->hash)
+			continue;
+
+		memcpy((void *)found, (void *)ref_bucket, sizeof(struct bucket));
+
+		if (found->user_length != key->user_length || \
+		    found->realm_length != key->realm_length || \
+		    found->service_length != key->service_length || \
+		    found->creds_offt + length > CACHE_SLOT_ARENA)
+			continue;
+
+		if (pwd_digest != NULL && memcmp(pwd_digest, found->pwd_digest, 16) != 0)
+			continue;
+
+		if (memcmp(creds, ref_slot->arena + found->creds_offt, length) == 0)
+			return x;
+	}
+
+	return -1;
+}
+
+
+/*************************************************************
+ * If it was later determined that the previous failed lookup
+ * is ok, flush the result->bucket out to it's permanent home
+ * in the hash table. 
+ **************************************************************/
+void cache_commit(struct cache_result *result) {
+
+	if (!(flags & CACHE_ENABLED))
+		return;
+
+	if (result->status == CACHE_NO_FLUSH)
+		return;
+
+	if (cache_get_wlock(result->hash_offset) != 0) {
+		SHARD_STATS_INC(result->shard, lock_failures);
+		return;
+	}	
+
+	cache_write_slot(result->hash_offset, &result->bucket, result->creds, \
+			 result->bucket.created - table_timeout, 1);
+
+	cache_un_lock(result->hash_offset);
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "lookup committed");
+
+	return;
+}
+
+
+/*************************************************************
+ * If the mechanism turned the credentials of the previous
+ * failed lookup down, remember them in the failed credentials
+ * table. A zero result->neg_offset means there is nothing to
+ * flush (the failed credentials slots come after the hash
+ * table's, so they never start at zero). If the credentials
+ * were up for a refresh, the entry holding them goes away.
+ **************************************************************/
+void cache_commit_failure(struct cache_result *result) {
+
+	struct bucket		*ref_bucket;
+	struct bucket		found;
+	int			index;
+
+
+	if (!(flags & CACHE_ENABLED))
+		return;
+
+	if (result->status == CACHE_REFRESH) {
+		if (cache_get_wlock(result->hash_offset) != 0) {
+			SHARD_STATS_INC(result->shard, lock_failures);
+			return;
 		}
 
+		index = cache_find_bucket(table + result->hash_offset, &result->bucket,
+					  result->creds, result->bucket.pwd_digest, &found);
+
+		if (index >= 0) {
+			ref_bucket = table[result->hash_offset].buckets + index;
+			ref_bucket->hash = 0;
+		}
+
+		cache_un_lock(result->hash_offset);
+
 		if (flags & VERBOSE)
-			logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found with invalid passwd, update pending");
+			logger(L_DEBUG, L_FUNC, "refreshed entry dropped");
+
+		return;
+	}
 
-		result->status = CACHE_FLUSH;
+	cache_release(result);
+
+	if (!(flags & CACHE_NEG_ENABLED))
+		return;
+
+	if (result->neg_offset == 0)
+		return;
+
+	if (cache_get_wlock(result->neg_offset) != 0) {
+		SHARD_STATS_INC(result->shard, lock_failures);
+		return;
+	}	
+
+	cache_write_slot(result->neg_offset, &result->bucket, result->creds, \
+			 result->bucket.created - neg_timeout, 1);
+
+	cache_un_lock(result->neg_offset);
+
+	SHARD_STATS_INC(result->shard, neg_commits);
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "failed lookup committed");
+
+	return;
+}
+
+
+/*************************************************************
+ * Claim the credentials of a lookup for the mechanism call
+ * the caller is about to make, so other lookups for them know
+ * to wait (see cache_lookup()). For a refresh (CACHE_REFRESH)
+ * the claim goes on the entry being refreshed, else on an
+ * expired entry for the credentials, or on an entry set up to
+ * stand in until cache_commit() fills it in. Return 0 if the
+ * claim is ours, -1 if someone else's claim holds, if the
+ * credentials are cached with another password, or if there
+ * is no room for a stand-in. A stand-in only takes a free (or
+ * expired) bucket and never evicts an entry: misses include
+ * every wrong password and unknown user, and a flood of those
+ * mustn't push good entries out of the table.
+ **************************************************************/
+int cache_claim(struct cache_result *result, time_t epoch) {
+
+	struct bucket		*key;
+	struct bucket		*ref_bucket;
+	struct bucket		found;
+	int			index;
+	int			rc = -1;
+
+
+	key = &result->bucket;
+
+	if (cache_get_wlock(result->hash_offset) != 0) {
+		SHARD_STATS_INC(result->shard, lock_failures);
+		return -1;
+	}
+
+	index = cache_find_bucket(table + result->hash_offset, key, result->creds, NULL, &found);
+
+	if (index >= 0) {
+		ref_bucket = table[result->hash_offset].buckets + index;
+
+		if ((ref_bucket->pending == 0 || \
+		     (unsigned int)epoch - ref_bucket->pending >= CACHE_PENDING_TIMEOUT) && \
+		    (result->status == CACHE_REFRESH ? \
+		     memcmp(ref_bucket->pwd_digest, key->pwd_digest, 16) == 0 : \
+		     ref_bucket->created <= epoch - table_timeout)) {
+			memcpy(ref_bucket->pwd_digest, key->pwd_digest, 16);
+			ref_bucket->pending = epoch;
+			rc = 0;
+		}
+	} else if (result->status != CACHE_REFRESH) {
+		key->created = 0;
+		key->pending = epoch;
+
+		if (cache_write_slot(result->hash_offset, key, result->creds, epoch - table_timeout, 0) == 0)
+			rc = 0;
+
+		key->created = epoch;
+		key->pending = 0;
+	}
+
+	cache_un_lock(result->hash_offset);
+
+	if (rc == 0)
+		result->pending = epoch;
+
+	return rc;
+}
+
+
+/*************************************************************
+ * Drop our claim on the credentials of a lookup, if we have
+ * one, without a verdict from the mechanism. An entry that
+ * only stood in for the claim goes away with it.
+ **************************************************************/
+void cache_release(struct cache_result *result) {
+
+	struct bucket		*ref_bucket;
+	struct bucket		found;
+	int			index;
+
+
+	if (!(flags & CACHE_ENABLED))
+		return;
+
+	if (result->pending == 0)
+		return;
+
+	if (cache_get_wlock(result->hash_offset) != 0) {
+		SHARD_STATS_INC(result->shard, lock_failures);
+		return;
+	}
+
+	index = cache_find_bucket(table + result->hash_offset, &result->bucket,
+				  result->creds, result->bucket.pwd_digest, &found);
+
+	if (index >= 0) {
+		ref_bucket = table[result->hash_offset].buckets + index;
+
+		if (ref_bucket->pending == result->pending) {
+			ref_bucket->pending = 0;
+
+			if (ref_bucket->created == 0)
+				ref_bucket->hash = 0;
+		}
+	}
+
+	cache_un_lock(result->hash_offset);
+
+	result->pending = 0;
+
+	return;
+}
+
+
+/*************************************************************
+ * Write a bucket and its credentials into a slot. The caller
+ * must hold the write lock on the slot.
+ *
+ * A bucket for the same credentials (and password digest) is
+ * simply updated. Otherwise buckets created before epoch_timeout
+ * are dropped first, then, if evict is set, the CLOCK evicts
+ * buckets until there is a free one and enough room left in
+ * the arena for the credentials. If the free room isn't in one
+ * piece, the arena is compacted before the credentials are
+ * appended to it. Return 0 if the bucket was written, -1 if
+ * there was no room for it without evicting.
+ **************************************************************/
+int cache_write_slot(unsigned int slot, const struct bucket *key, const char *creds, time_t epoch_timeout, int evict) {
+
+	struct slot		*ref_slot;
+	struct bucket		*ref_bucket;
+	struct bucket		*write_bucket = NULL;
+	struct bucket		found;
+	unsigned int		length;
+	unsigned int		used;
+	int			index;
+	int			x;
+
+
+	ref_slot = table + slot;
+	length = key->user_length + key->realm_length + key->service_length;
+
+	/**************************************************************
+	 * Same credentials already there?
+	 **************************************************************/
+	if ((index = cache_find_bucket(ref_slot, key, creds, slot >= table_size ? key->pwd_digest : NULL, &found)) >= 0) {
+		ref_bucket = ref_slot->buckets + index;
+
+		memcpy(ref_bucket->pwd_digest, key->pwd_digest, 16);
+		ref_bucket->created = key->created;
+		ref_bucket->pending = key->pending;
+		ref_bucket->referenced = 0;
+
+		return 0;
+	}
+
+	/**************************************************************
+	 * Make room, then take the first free bucket.
+	 **************************************************************/
+	while (1) {
+		used = 0;
+		write_bucket = NULL;
+
+		for (x = 0; x < CACHE_MAX_BUCKETS_PER; x++) {
+			ref_bucket = ref_slot->buckets + x;
+
+			if (ref_bucket->hash != 0 && ref_bucket->created <= epoch_timeout && \
+			    ref_bucket->pending == 0)
+				ref_bucket->hash = 0;
+
+			if (ref_bucket->hash == 0) {
+				if (write_bucket == NULL)
+					write_bucket = ref_bucket;
+				continue;
+			}
+
+			used += ref_bucket->user_length + ref_bucket->realm_length + \
+				ref_bucket->service_length;
+		}
+
+		if (write_bucket != NULL && used + length <= CACHE_SLOT_ARENA)
+			break;
+
+		if (!evict)
+			return -1;
+
+		cache_clock_evict(ref_slot);
+	}
+
+	if (ref_slot->arena_used + length > CACHE_SLOT_ARENA)
+		cache_compact_slot(ref_slot);
+
+	memcpy(ref_slot->arena + ref_slot->arena_used, creds, length);
+
+	memcpy((void *)write_bucket, (void *)key, sizeof(struct bucket));
+	write_bucket->creds_offt = ref_slot->arena_used;
+	write_bucket->referenced = 0;
+
+	ref_slot->arena_used += length;
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Evict one bucket from a slot, CLOCK style. The hand sweeps
+ * over the buckets, giving a referenced bucket a second
+ * chance by clearing its bit, and evicts the first bucket
+ * that wasn't referenced since the last sweep. The caller
+ * must hold the write lock on the slot.
+ **************************************************************/
+void cache_clock_evict(struct slot *ref_slot) {
+
+	struct bucket		*ref_bucket;
+	int			x;
+
+
+	for (x = 0; x < 2 * CACHE_MAX_BUCKETS_PER; x++) {
+		ref_bucket = ref_slot->buckets + ref_slot->clock_hand;
+		ref_slot->clock_hand = (ref_slot->clock_hand + 1) % CACHE_MAX_BUCKETS_PER;
+
+		if (ref_bucket->hash == 0)
+			continue;
+
+		if (ref_bucket->referenced) {
+			ref_bucket->referenced = 0;
+			continue;
+		}
+
+		ref_bucket->hash = 0;
+		return;
+	}
+
+	return;
+}
+
+
+/*************************************************************
+ * Squeeze the credentials of the buckets in use together at
+ * the start of the slot's arena. The caller must hold the
+ * write lock on the slot.
+ **************************************************************/
+void cache_compact_slot(struct slot *ref_slot) {
+
+	struct bucket		*ref_bucket;
+	char			arena[CACHE_SLOT_ARENA];
+	unsigned int		length;
+	unsigned int		used = 0;
+	int			x;
+
+
+	for (x = 0; x < CACHE_MAX_BUCKETS_PER; x++) {
+		ref_bucket = ref_slot->buckets + x;
+
+		if (ref_bucket->hash == 0)
+			continue;
+
+		length = ref_bucket->user_length + ref_bucket->realm_length + \
+			 ref_bucket->service_length;
+
+		memcpy(arena + used, ref_slot->arena + ref_bucket->creds_offt, length);
+		ref_bucket->creds_offt = used;
+		used += length;
+	}
+
+	memcpy(ref_slot->arena, arena, used);
+	ref_slot->arena_used = used;
+
+	return;
+}
+
+
+/*************************************************************
+ * Hashing function. FNV-1a over the key, with a final
+ * avalanche (the MurmurHash3 finalizer) so that all bits of
+ * the result depend on all of the key. Never returns 0,
+ * which marks an empty bucket.
+ **************************************************************/
+unsigned int cache_hash(const char *datum, unsigned int length) {
+
+	unsigned int		hash_value = 2166136261U;
+	unsigned int		x;
+
+
+	for (x = 0; x < length; x++) {
+		hash_value ^= (unsigned char)datum[x];
+		hash_value *= 16777619U;
+	}
+
+	hash_value ^= hash_value >> 16;
+	hash_value *= 0x85ebca6bU;
+	hash_value ^= hash_value >> 13;
+	hash_value *= 0xc2b2ae35U;
+	hash_value ^= hash_value >> 16;
+
+	return hash_value ? hash_value : 1;
+}
+
+
+/*************************************************************
+ * Map a hash to its slot in the hash table. The shard is
+ * picked by the hash, the slot within the shard by what's
+ * left of it once the shard is taken out, so the two don't
+ * depend on each other.
+ **************************************************************/
+unsigned int cache_hash_slot(unsigned int hash, unsigned int *shard) {
+
+	*shard = hash % shards;
+
+	return (*shard * shard_slots) + ((hash / shards) % shard_slots);
+}
+
+
+/*************************************************************
+ * The shard a slot belongs to. The failed credentials slots
+ * are dealt out to the shards in turn.
+ **************************************************************/
+unsigned int cache_slot_shard(unsigned int slot) {
+
+	if (slot < table_size)
+		return slot / shard_slots;
+
+	return (slot - table_size) % shards;
+}
+
+
+/*************************************************************
+ * Work out how many shards to split the hash table into: one
+ * per online cpu, up to CACHE_MAX_SHARDS, but no more than
+ * leave each shard CACHE_MIN_SHARD_SLOTS slots or so.
+ **************************************************************/
+unsigned int cache_shard_count(void) {
+
+	long		cpus = 1;
+	unsigned int	count;
 
-	} else {
 
-		if (flags & VERBOSE)
-			logger(L_DEBUG, L_FUNC, debug, user, realm, service, "not found, update pending");
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
-		result->status = CACHE_FLUSH_WITH_RESCAN;
-	}
+	if (cpus < 1)
+		cpus = 1;
 
-	result->hash_offset = hash_offset;
-	result->read_bucket = read_bucket;
-	
-	result->bucket.user_offt = 0;
-	result->bucket.realm_offt = user_length;
-	result->bucket.service_offt = user_length + realm_length;
+	if (cpus > CACHE_MAX_SHARDS)
+		cpus = CACHE_MAX_SHARDS;
 
-	strcpy(result->bucket.creds + result->bucket.user_offt, user);	
-	strcpy(result->bucket.creds + result->bucket.realm_offt, realm);	
-	strcpy(result->bucket.creds + result->bucket.service_offt, service);	
+	count = table_size / CACHE_MIN_SHARD_SLOTS;
 
-	memcpy(result->bucket.pwd_digest, pwd_digest, 16);
-	result->bucket.created = epoch;
+	if (count < 1)
+		count = 1;
 
-	cache_un_lock(hash_offset);
-	table_stats->misses++;
-	return CACHE_FAIL;
+	return (unsigned int)cpus < count ? (unsigned int)cpus : count;
 }
 
 
 /*************************************************************
- * If it was later determined that the previous failed lookup
- * is ok, flush the result->bucket out to it's permanent home
- * in the hash table. 
+ * Allow someone to set the hash table size (in kilobytes).
+ * Since the hash table has to be prime, this won't be exact.
  **************************************************************/
-void cache_commit(struct cache_result *result) {
-	struct bucket           *write_bucket;
-	struct bucket		*ref_bucket;
-	struct bucket		*low_bucket;
-	struct bucket		*high_bucket;
+void cache_set_table_size(const char *size) {
 
-	if (!(flags & CACHE_ENABLED))
-		return;
+	table_size = cache_size_to_slots(size);
 
-	if (result->status == CACHE_NO_FLUSH)
-		return;
+	return;
+}
 
-	if (cache_get_wlock(result->hash_offset) != 0) {
-		table_stats->lock_failures++;
-		return;
-	}	
 
-	if (result->status == CACHE_FLUSH) {
-		write_bucket = result->read_bucket;
-	} else {
-		/*********************************************************
-		 * CACHE_FLUSH_WITH_RESCAN is the default action to take.
-	 	 * Simply traverse the slot looking for the oldest bucket
-		 * and mark it for writing.
-	 	 **********************************************************/
-		low_bucket = table + (CACHE_MAX_BUCKETS_PER * result->hash_offset);
-		high_bucket = low_bucket + CACHE_MAX_BUCKETS_PER;
-		write_bucket = low_bucket;
-
-		for (ref_bucket = low_bucket; ref_bucket < high_bucket; ref_bucket++) {
-			if (ref_bucket->created < write_bucket->created) 
-				write_bucket = ref_bucket;
-		}
+/*************************************************************
+ * Allow someone to set the table timeout (in seconds)
+ **************************************************************/
+void cache_set_timeout(const char *time) {
+	table_timeout = strtol(time, (char **)NULL, 10);
+
+	if (table_timeout <= 0) {
+		logger(L_ERR, L_FUNC, "cache timeout must be positive");
+		exit(1);
 	}
 
-	memcpy((void *)write_bucket, (void *)&(result->bucket), sizeof(struct bucket));
+	return;
+}
 
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "lookup committed");
 
-	cache_un_lock(result->hash_offset);
+/*************************************************************
+ * Allow someone to set the size of the failed credentials
+ * table (in kilobytes). This also turns the table on.
+ **************************************************************/
+void cache_set_neg_table_size(const char *size) {
+
+	neg_table_size = cache_size_to_slots(size);
+	flags |= CACHE_NEG_ENABLED;
+
 	return;
 }
 
 
 /*************************************************************
- * Hashing function. Algorithm is an adaptation of Peter
- * Weinberger's (PJW) generic hashing algorithm, which
- * is based on Allen Holub's version. 
+ * Allow someone to set the timeout of the failed credentials
+ * table (in seconds). This also turns the table on.
  **************************************************************/
-int cache_pjwhash(char *datum ) {
-    const int BITS_IN_int = ( sizeof(int) * CHAR_BIT );
-    const int THREE_QUARTERS = ((int) ((BITS_IN_int * 3) / 4));
-    const int ONE_EIGHTH = ((int) (BITS_IN_int / 8));
-    const int HIGH_BITS = ( ~((unsigned int)(~0) >> ONE_EIGHTH ));
-    
-    unsigned int            hash_value, i;
-    
-    for (hash_value = 0; *datum; ++datum) {
-	hash_value = (hash_value << ONE_EIGHTH) + *datum;
-	if ((i = hash_value & HIGH_BITS) != 0)
-	    hash_value = (hash_value ^ (i >> THREE_QUARTERS)) & ~HIGH_BITS;
-    }
-    
-    return (hash_value % table_size);
+void cache_set_neg_timeout(const char *time) {
+	neg_timeout = strtol(time, (char **)NULL, 10);
+
+	if (neg_timeout <= 0) {
+		logger(L_ERR, L_FUNC, "failed credentials cache timeout must be positive");
+		exit(1);
+	}
+
+	flags |= CACHE_NEG_ENABLED;
+
+	return;
 }
 
+
 /*************************************************************
- * Allow someone to set the hash table size (in kilobytes).
- * Since the hash table has to be prime, this won't be exact.
+ * Work out the number of slots (a prime) taking up about
+ * the given kilobytes.
  **************************************************************/
-void cache_set_table_size(const char *size) {
+unsigned int cache_size_to_slots(const char *size) {
 	unsigned int	kilobytes;
 	unsigned int	bytes;
 	unsigned int	calc_bytes = 0;
@@ -396,33 +1047,14 @@ void cache_set_table_size(const char *size) {
 
 	bytes = kilobytes * 1024;
 
-	calc_table_size =
-	    bytes / (sizeof(struct bucket) * CACHE_MAX_BUCKETS_PER);
+	calc_table_size = bytes / sizeof(struct slot);
 
 	do {
 	    calc_table_size = cache_get_next_prime(calc_table_size);
-	    calc_bytes = calc_table_size *
-		sizeof(struct bucket) * CACHE_MAX_BUCKETS_PER; 
+	    calc_bytes = calc_table_size * sizeof(struct slot);
 	} while (calc_bytes < bytes);
 
-	table_size = calc_table_size;
-
-	return;
-}
-
-
-/*************************************************************
- * Allow someone to set the table timeout (in seconds)
- **************************************************************/
-void cache_set_timeout(const char *time) {
-	table_timeout = strtol(time, (char **)NULL, 10);
-
-	if (table_timeout <= 0) {
-		logger(L_ERR, L_FUNC, "cache timeout must be positive");
-		exit(1);
-	}
-
-	return;
+	return calc_table_size;
 }
 
 
@@ -485,8 +1117,10 @@ void *cache_alloc_mm(unsigned int bytes) {
 	int		chunk_count;
 	char		null_buff[1024];
 	size_t          mm_file_len;
+	struct stat	file_st;
 	
 	mm.bytes = bytes;
+	mm.reuse = 0;
 
 	mm_file_len = strlen(run_path) + sizeof(CACHE_MMAP_FILE) + 1;
 	if (!(mm.file =
@@ -499,7 +1133,8 @@ void *cache_alloc_mm(unsigned int bytes) {
 	strlcat(mm.file, CACHE_MMAP_FILE, mm_file_len);
 	
 	if ((file_fd =
-	     open(mm.file, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0) {
+	     open(mm.file, O_RDWR|O_CREAT|((flags & CACHE_PERSIST) ? 0 : O_TRUNC),
+		  S_IRUSR|S_IWUSR)) < 0) {
 		rc = errno;
 		logger(L_ERR, L_FUNC, "could not open mmap file: %s", mm.file);
 		logger(L_ERR, L_FUNC, "open: %s", strerror(rc));
@@ -510,6 +1145,33 @@ void *cache_alloc_mm(unsigned int bytes) {
 
 	chunk_count = (bytes / sizeof(null_buff)) + 1;
 
+	/**************************************************************
+	 * A persistent cache file is only worth a look if it has the
+	 * right size and nobody but us could have written to it, else
+	 * start it over.
+	 **************************************************************/
+	if (flags & CACHE_PERSIST) {
+		if (fstat(file_fd, &file_st) == 0 &&
+		    file_st.st_uid == geteuid() &&
+		    !(file_st.st_mode & (S_IRWXG|S_IRWXO)) &&
+		    file_st.st_size == (off_t)(chunk_count * sizeof(null_buff))) {
+			mm.reuse = 1;
+			chunk_count = 0;
+		} else {
+			if (file_st.st_size != 0)
+				logger(L_INFO, L_FUNC, "cache file %s doesn't match the cache settings, starting out empty", mm.file);
+
+			if (ftruncate(file_fd, 0) != 0 ||
+			    fchmod(file_fd, S_IRUSR|S_IWUSR) != 0) {
+				rc = errno;
+				logger(L_ERR, L_FUNC, "could not reset mmap file: %s", mm.file);
+				logger(L_ERR, L_FUNC, "ftruncate: %s", strerror(rc));
+				close(file_fd);
+				return NULL;
+			}
+		}
+	}
+
 	while (chunk_count > 0) {
 	    if (tx_rec(file_fd, null_buff, sizeof(null_buff))
 		!= (ssize_t)sizeof(null_buff)) {
@@ -544,6 +1206,105 @@ void *cache_alloc_mm(unsigned int bytes) {
 }
 
 
+/*************************************************************
+ * Check whether the region mapped from a file left behind by
+ * a previous run (-p) can be used as is. It must have been
+ * laid out for the same table, and left by a clean shutdown.
+ * The workers may still have been killed halfway through
+ * writing a slot though; those slots are given up. Entries
+ * keep their creation time, so the ones that expired while
+ * we were down are treated as such by the lookups. Return 0
+ * if the region may be used, -1 if it must be started over.
+ **************************************************************/
+int cache_reuse_table(void *base, unsigned int bytes) {
+#ifdef CACHE_USE_SEQLOCK
+	unsigned int		slots;
+	unsigned int		entries = 0;
+	unsigned int		x;
+	unsigned int		y;
+	unsigned int		*seq;
+	time_t			epoch;
+	struct slot		*ref_slot;
+	struct bucket		*ref_bucket;
+#endif
+
+	if (strncmp((char *)base, CACHE_CACHE_MAGIC, 64) != 0 ||
+	    table_stats->table_size != table_size ||
+	    table_stats->max_buckets_per != CACHE_MAX_BUCKETS_PER ||
+	    table_stats->sizeof_bucket != sizeof(struct bucket) ||
+	    table_stats->bytes != bytes ||
+	    table_stats->neg_table_size != neg_table_size ||
+	    table_stats->shards != shards ||
+	    table_stats->shard_slots != shard_slots) {
+		logger(L_INFO, L_FUNC, "cache file %s doesn't match the cache settings, starting out empty", mm.file);
+		return -1;
+	}
+
+	if (!table_stats->clean) {
+		logger(L_INFO, L_FUNC, "cache file %s wasn't shut down cleanly, starting out empty", mm.file);
+		return -1;
+	}
+
+#ifdef CACHE_USE_SEQLOCK
+	slots = table_size + neg_table_size;
+	seq = (unsigned int *)((char *)table + (slots * sizeof(struct slot)));
+	epoch = time(NULL);
+
+	for (x = 0; x < slots; x++) {
+		ref_slot = table + x;
+
+		/**************************************************************
+		 * An odd counter means a writer died in the slot. Clocks
+		 * going backwards, or a slot otherwise out of shape, get
+		 * the slot dropped too. Claims on mechanism calls (see
+		 * cache_claim()) died with their owners.
+		 **************************************************************/
+		seq[x * CACHE_SEQ_STRIDE + 1] = 0;
+
+		if (seq[x * CACHE_SEQ_STRIDE] & 1 || ref_slot->arena_used > CACHE_SLOT_ARENA ||
+		    ref_slot->clock_hand >= CACHE_MAX_BUCKETS_PER) {
+			memset((void *)ref_slot, 0, sizeof(struct slot));
+			seq[x * CACHE_SEQ_STRIDE] = 0;
+			continue;
+		}
+
+		for (y = 0; y < CACHE_MAX_BUCKETS_PER; y++) {
+			ref_bucket = ref_slot->buckets + y;
+
+			if (ref_bucket->hash == 0)
+				continue;
+
+			ref_bucket->pending = 0;
+
+			if (ref_bucket->created == 0 || ref_bucket->created > epoch ||
+			    ref_bucket->creds_offt + ref_bucket->user_length + \
+			    ref_bucket->realm_length + ref_bucket->service_length > ref_slot->arena_used) {
+				memset((void *)ref_bucket, 0, sizeof(struct bucket));
+				continue;
+			}
+
+			if (x < table_size)
+				entries++;
+		}
+	}
+
+	memset((void *)shard_stats, 0, shards * sizeof(struct shard_stats));
+
+	logger(L_INFO, L_FUNC, "reusing cache file %s: %d entries", mm.file, entries);
+
+	return 0;
+#else
+	/**************************************************************
+	 * Only the seqlocks tell which slots were being written to
+	 * when the workers were killed.
+	 **************************************************************/
+	logger(L_INFO, L_FUNC, "cache file %s can't be reused with this cache locking, starting out empty", mm.file);
+
+	return -1;
+#endif
+}
+
+
 /*************************************************************
  * When we die we may need to perform some cleanup on the
  * mmaped region. We assume we're the last process out here.
@@ -551,7 +1312,16 @@ void *cache_alloc_mm(unsigned int bytes) {
  * be generated for other processes.
  **************************************************************/
 void cache_cleanup_mm(void) {
-	if (mm.base != NULL) {
+	if (mm.base != NULL && (flags & CACHE_PERSIST)) {
+		table_stats->clean = 1;
+		msync(mm.base, mm.bytes, MS_SYNC);
+		munmap(mm.base, mm.bytes);
+
+		if (flags & VERBOSE) {
+			logger(L_DEBUG, L_FUNC,
+			       "cache mmap file kept: %s", mm.file);
+		}
+	} else if (mm.base != NULL) {
 		munmap(mm.base, mm.bytes);
 		unlink(mm.file);
 
@@ -564,6 +1334,187 @@ void cache_cleanup_mm(void) {
 	return;
 }
 
+/*****************************************************************
+ * The following is relative to the seqlock method. Every slot has a
+ * sequence counter living in the shared region right behind the hash
+ * table, each on a cache line of its own. Writers bump the counter
+ * to an odd value with an atomic compare and swap, note their pid
+ * next to it, update the slot and bump it back to even. Readers copy
+ * the slot and then check the counter didn't move underneath them.
+ * A slot left odd by a writer that died is dropped by whoever runs
+ * into it next.
+ ****************************************************************/
+#ifdef CACHE_USE_SEQLOCK
+
+#define SLOT_SEQ(slot)		(lock.seq + (slot) * CACHE_SEQ_STRIDE)
+#define SLOT_OWNER(slot)	(SLOT_SEQ(slot) + 1)
+
+/*************************************************************
+ * Point the lock control at the counters trailing the hash
+ * table. cache_init() already zeroed the region, so all of
+ * the slots start out unlocked.
+ * __Seqlock Impl__
+ **************************************************************/
+int cache_init_lock(void) {
+
+	lock.seq = (volatile unsigned int *)((char *)table +
+	    ((table_size + neg_table_size) * sizeof(struct slot)));
+
+	if (flags & VERBOSE) 
+		logger(L_DEBUG, L_FUNC, "%d seqlocks initialized", table_size + neg_table_size);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * The counters go away with the mmaped region.
+ * __Seqlock Impl__
+ **************************************************************/
+void cache_cleanup_lock(void) {
+
+	lock.seq = NULL;
+
+	return;
+}
+
+
+/*************************************************************
+ * Called on a slot that stayed locked for a while. If the
+ * writer holding it is gone, take over its lock, drop the
+ * half written slot and unlock it. The owner is unknown for
+ * the few instructions between a writer's compare and swap
+ * and noting its pid; such a slot is left alone. Threads
+ * share their process's pid, and die only along with it.
+ * __Seqlock Impl__
+ **************************************************************/
+static void cache_recover_slot(unsigned int slot) {
+	unsigned int	owner;
+	unsigned int	me;
+
+	owner = *SLOT_OWNER(slot);
+	me = (unsigned int)getpid();
+
+	if (owner == 0 || owner == me)
+		return;
+
+	if (kill((pid_t)owner, 0) == 0 || errno != ESRCH)
+		return;
+
+	/* only one process gets to clean up after the dead one */
+	if (!__sync_bool_compare_and_swap(SLOT_OWNER(slot), owner, me))
+		return;
+
+	logger(L_ERR, L_FUNC, "writer %u died holding slot: %d, dropping the slot", owner, slot);
+
+	memset((void *)(table + slot), 0, sizeof(struct slot));
+	*SLOT_OWNER(slot) = 0;
+	__sync_fetch_and_add(SLOT_SEQ(slot), 1);
+
+	return;
+}
+
+
+/*************************************************************
+ * Attempt to get a write lock on a slot. Return 0 if 
+ * everything went ok, return -1 if something bad happened.
+ * We'll spin (and eventually yield) while another writer
+ * holds the slot, and recover the slot if that writer died
+ * holding it.
+ * __Seqlock Impl__
+ **************************************************************/
+int cache_get_wlock(unsigned int slot) {
+	unsigned int	seq;
+	unsigned int	spins;
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "attempting a write lock on slot: %d", slot);
+
+	for (spins = 0; spins < CACHE_SEQLOCK_MAX_SPINS; spins++) {
+		seq = *SLOT_SEQ(slot);
+
+		if (!(seq & 1) &&
+		    __sync_bool_compare_and_swap(SLOT_SEQ(slot), seq, seq + 1)) {
+			*SLOT_OWNER(slot) = (unsigned int)getpid();
+			return 0;
+		}
+
+		if (spins == CACHE_SEQLOCK_SPINS)
+			cache_recover_slot(slot);
+
+		if (spins >= CACHE_SEQLOCK_SPINS)
+			sched_yield();
+	}
+
+	logger(L_ERR, L_FUNC, "could not acquire a write lock on slot: %d\n", slot);
+	return -1;
+}
+
+
+/*************************************************************
+ * Releases a previously acquired write lock on a slot. The
+ * increment is a full barrier, so the bucket updates are
+ * visible before the counter goes even again.
+ * __Seqlock Impl__
+ **************************************************************/
+int cache_un_lock(unsigned int slot) {
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "attempting to release lock on slot: %d", slot);
+
+	*SLOT_OWNER(slot) = 0;
+	__sync_fetch_and_add(SLOT_SEQ(slot), 1);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Start an optimistic read of a slot. Wait for the slot to
+ * be free of writers and hand back the sequence counter to
+ * validate the read against. Return 0 if everything went ok,
+ * return -1 if the slot stayed locked by a live writer.
+ * __Seqlock Impl__
+ **************************************************************/
+int cache_read_begin(unsigned int slot, unsigned int *seq) {
+	unsigned int	spins;
+
+	for (spins = 0; spins < CACHE_SEQLOCK_MAX_SPINS; spins++) {
+		*seq = *SLOT_SEQ(slot);
+
+		if (!(*seq & 1)) {
+			__sync_synchronize();
+			return 0;
+		}
+
+		if (spins == CACHE_SEQLOCK_SPINS)
+			cache_recover_slot(slot);
+
+		if (spins >= CACHE_SEQLOCK_SPINS)
+			sched_yield();
+	}
+
+	logger(L_ERR, L_FUNC, "could not acquire a read lock on slot: %d\n", slot);
+	return -1;
+}
+
+
+/*************************************************************
+ * Finish an optimistic read of a slot. Return 0 if the data
+ * read since cache_read_begin() is consistent, non zero if a
+ * writer got in the way and the read needs to be repeated.
+ * __Seqlock Impl__
+ **************************************************************/
+int cache_read_retry(unsigned int slot, unsigned int seq) {
+
+	__sync_synchronize();
+
+	return *SLOT_SEQ(slot) != seq;
+}
+
+
+#endif  /* CACHE_USE_SEQLOCK */
+
 /*****************************************************************
  * The following is relative to the fcntl() locking method. Probably
  * used when the Sys IV SHM Implementation is in effect.
@@ -572,32 +1523,41 @@ void cache_cleanup_mm(void) {
 
 /*************************************************************
  * Setup the locking stuff required to implement the fcntl()
- * style record locking of the hash table. Return 0 if
- * everything is peachy, otherwise -1.
+ * style record locking of the hash table, a lock file for
+ * every shard. Return 0 if everything is peachy, otherwise -1.
  * __FCNTL Impl__
  **************************************************************/
 int cache_init_lock(void) {
-	int	rc;
-	size_t  flock_file_len;
+	int		rc;
+	size_t		flock_file_len;
+	unsigned int	x;
 
-	flock_file_len = strlen(run_path) + sizeof(CACHE_FLOCK_FILE) + 1;
-	if ((lock.flock_file = (char *)malloc(flock_file_len)) == NULL) {
+	if ((lock.flock_file = (char **)calloc(shards, sizeof(char *))) == NULL ||
+	    (lock.flock_fd = (int *)malloc(shards * sizeof(int))) == NULL) {
 		logger(L_ERR, L_FUNC, "could not allocate memory");
 		return -1;
 	}
 
-	strlcpy(lock.flock_file, run_path, flock_file_len);
-	strlcat(lock.flock_file, CACHE_FLOCK_FILE, flock_file_len);
+	flock_file_len = strlen(run_path) + sizeof(CACHE_FLOCK_FILE) + 12;
 
-	if ((lock.flock_fd = open(lock.flock_file, O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR)) == -1) {
-		rc = errno;
-		logger(L_ERR, L_FUNC, "could not open flock file: %s", lock.flock_file);
-		logger(L_ERR, L_FUNC, "open: %s", strerror(rc));
-		return -1;
-	}
+	for (x = 0; x < shards; x++) {
+		if ((lock.flock_file[x] = (char *)malloc(flock_file_len)) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			return -1;
+		}
 
-	if (flags & VERBOSE) 
-		logger(L_DEBUG, L_FUNC, "flock file opened at %s", lock.flock_file);
+		snprintf(lock.flock_file[x], flock_file_len, "%s%s.%u", run_path, CACHE_FLOCK_FILE, x);
+
+		if ((lock.flock_fd[x] = open(lock.flock_file[x], O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR)) == -1) {
+			rc = errno;
+			logger(L_ERR, L_FUNC, "could not open flock file: %s", lock.flock_file[x]);
+			logger(L_ERR, L_FUNC, "open: %s", strerror(rc));
+			return -1;
+		}
+
+		if (flags & VERBOSE) 
+			logger(L_DEBUG, L_FUNC, "flock file opened at %s", lock.flock_file[x]);
+	}
 
 	return 0;
 }
@@ -605,18 +1565,23 @@ int cache_init_lock(void) {
 
 /*************************************************************
  * When the processes die we'll need to cleanup/delete
- * the flock_file. More for correctness than anything.
+ * the flock files. More for correctness than anything.
  * __FCNTL Impl__
  **************************************************************/
 void cache_cleanup_lock(void) {
+	unsigned int	x;
+
+	if (lock.flock_file == NULL)
+		return;
 
+	for (x = 0; x < shards; x++) {
+		if (lock.flock_file[x] == NULL)
+			continue;
 
-	if (lock.flock_file != NULL) {
-		unlink(lock.flock_file);
+		unlink(lock.flock_file[x]);
 
 		if (flags & VERBOSE) 
-			logger(L_DEBUG, L_FUNC, "flock file removed: %s", lock.flock_file);
-
+			logger(L_DEBUG, L_FUNC, "flock file removed: %s", lock.flock_file[x]);
 	}
 
 	return;
@@ -644,7 +1609,7 @@ int cache_get_wlock(unsigned int slot) {
 		if (flags & VERBOSE)
 			logger(L_DEBUG, L_FUNC, "attempting a write lock on slot: %d", slot);
 
-		rc = fcntl(lock.flock_fd, F_SETLKW, &lock_st);
+		rc = fcntl(lock.flock_fd[cache_slot_shard(slot)], F_SETLKW, &lock_st);
 	} while (rc != 0 && errno == EINTR);
 
 	if (rc != 0) {	
@@ -681,7 +1646,7 @@ int cache_get_rlock(unsigned int slot) {
 		if (flags & VERBOSE)
 			logger(L_DEBUG, L_FUNC, "attempting a read lock on slot: %d", slot);
 
-		rc = fcntl(lock.flock_fd, F_SETLKW, &lock_st);
+		rc = fcntl(lock.flock_fd[cache_slot_shard(slot)], F_SETLKW, &lock_st);
 	} while (rc != 0 && errno == EINTR);
 
 	if (rc != 0) {	
@@ -716,7 +1681,7 @@ int cache_un_lock(unsigned int slot) {
 		if (flags & VERBOSE)
 			logger(L_DEBUG, L_FUNC, "attempting to release lock on slot: %d", slot);
 
-		rc = fcntl(lock.flock_fd, F_SETLKW, &lock_st);
+		rc = fcntl(lock.flock_fd[cache_slot_shard(slot)], F_SETLKW, &lock_st);
 	} while (rc != 0 && errno == EINTR);
 
 	if (rc != 0) {	
@@ -729,6 +1694,30 @@ int cache_un_lock(unsigned int slot) {
 	return 0;
 }
 
+/*************************************************************
+ * Start a read of a slot, a plain read lock in this case.
+ * __FCNTL Impl__
+ **************************************************************/
+int cache_read_begin(unsigned int slot, unsigned int *seq) {
+
+	*seq = 0;
+
+	return cache_get_rlock(slot);
+}
+
+
+/*************************************************************
+ * Finish a read of a slot. The read lock kept writers out,
+ * so the read never needs to be repeated.
+ * __FCNTL Impl__
+ **************************************************************/
+int cache_read_retry(unsigned int slot, unsigned int seq) {
+
+	cache_un_lock(slot);
+
+	return 0;
+}
+
 
 #endif  /* CACHE_USE_FCNTL */
 
@@ -750,13 +1739,13 @@ int cache_init_lock(void) {
 	pthread_rwlock_t	*rwlock;
 
 	if (!(lock.rwlock =
-	     (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t) * table_size))) {
+	     (union cache_rwlock *)malloc(sizeof(union cache_rwlock) * (table_size + neg_table_size)))) {
 		logger(L_ERR, L_FUNC, "could not allocate memory");
 		return -1;
 	}
 
-	for (x = 0; x < table_size; x++) {
-		rwlock = lock.rwlock + x;
+	for (x = 0; x < table_size + neg_table_size; x++) {
+		rwlock = &lock.rwlock[x].rwlock;
 
 		if (pthread_rwlock_init(rwlock, NULL) != 0) {
 			logger(L_ERR, L_FUNC, "failed to initialize lock %d", x);
@@ -765,7 +1754,7 @@ int cache_init_lock(void) {
 	}
 
 	if (flags & VERBOSE) 
-		logger(L_DEBUG, L_FUNC, "%d rwlocks initialized", table_size);
+		logger(L_DEBUG, L_FUNC, "%d rwlocks initialized", table_size + neg_table_size);
 
 	return 0;
 }
@@ -781,8 +1770,8 @@ void cache_cleanup_lock(void) {
 
     if(!lock.rwlock) return;
     
-    for(x=0; x<table_size; x++) {
-	rwlock = lock.rwlock + x;
+    for(x=0; x<table_size + neg_table_size; x++) {
+	rwlock = &lock.rwlock[x].rwlock;
 	pthread_rwlock_destroy(rwlock);
     }
     
@@ -806,7 +1795,7 @@ int cache_get_wlock(unsigned int slot) {
 	if (flags & VERBOSE)
 		logger(L_DEBUG, L_FUNC, "attempting a write lock on slot: %d", slot);
 
-	rc = pthread_rwlock_wrlock(lock.rwlock + slot);
+	rc = pthread_rwlock_wrlock(&lock.rwlock[slot].rwlock);
 
 	if (rc != 0) {	
 		logger(L_ERR, L_FUNC, "could not acquire a write lock on slot: %d\n", slot);
@@ -831,7 +1820,7 @@ int cache_get_rlock(unsigned int slot) {
 	if (flags & VERBOSE)
 		logger(L_DEBUG, L_FUNC, "attempting a read lock on slot: %d", slot);
 
-	rc = pthread_rwlock_rdlock(lock.rwlock + slot);
+	rc = pthread_rwlock_rdlock(&lock.rwlock[slot].rwlock);
 
 	if (rc != 0) {	
 		logger(L_ERR, L_FUNC, "could not acquire a read lock on slot: %d\n", slot);
@@ -854,7 +1843,7 @@ int cache_un_lock(unsigned int slot) {
 	if (flags & VERBOSE)
 		logger(L_DEBUG, L_FUNC, "attempting to release lock on slot: %d", slot);
 
-	rc = pthread_rwlock_unlock(lock.rwlock + slot);
+	rc = pthread_rwlock_unlock(&lock.rwlock[slot].rwlock);
 
 	if (rc != 0) {	
 		logger(L_ERR, L_FUNC, "could not release lock on slot: %d\n", slot);
@@ -864,6 +1853,30 @@ int cache_un_lock(unsigned int slot) {
 	return 0;
 }
 
+/*************************************************************
+ * Start a read of a slot, a plain read lock in this case.
+ * __RWLock Impl__
+ **************************************************************/
+int cache_read_begin(unsigned int slot, unsigned int *seq) {
+
+	*seq = 0;
+
+	return cache_get_rlock(slot);
+}
+
+
+/*************************************************************
+ * Finish a read of a slot. The read lock kept writers out,
+ * so the read never needs to be repeated.
+ * __RWLock Impl__
+ **************************************************************/
+int cache_read_retry(unsigned int slot, unsigned int seq) {
+
+	cache_un_lock(slot);
+
+	return 0;
+}
+
 
 #endif  /* CACHE_USE_PTHREAD_RWLOCK */
 /***************************************************************************************/
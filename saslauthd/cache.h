@@ -48,23 +48,70 @@
 * * Plug in some autoconf magic to determine what implementation
 * * to use for the table slot (row) locking.
 ****************************************************************/
-#ifdef USE_DOORS
-# define CACHE_USE_PTHREAD_RWLOCK
+#if !defined(CACHE_USE_SEQLOCK) && !defined(CACHE_USE_FCNTL) && \
+    !defined(CACHE_USE_PTHREAD_RWLOCK)
+# if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+#  define CACHE_USE_SEQLOCK
+# elif defined(USE_DOORS)
+#  define CACHE_USE_PTHREAD_RWLOCK
+# else
+#  define CACHE_USE_FCNTL
+# endif
+#endif
+
+
+
+/****************************************************************
+* * Whatever different processes write to a lot (the shards'
+* * counters, slots, slot locks) is kept on cache lines of its
+* * own, so cpus don't take the lines away from each other for
+* * data they don't share.
+****************************************************************/
+#define CACHE_LINE			64
+
+#ifdef __GNUC__
+# define CACHE_LINE_ALIGNED		__attribute__((aligned(CACHE_LINE)))
 #else
-# define CACHE_USE_FCNTL
+# define CACHE_LINE_ALIGNED
 #endif
 
 
 
+/************************************************/
+#ifdef CACHE_USE_SEQLOCK
+	/* Seqlock Impl */
+
+struct lock_ctl {
+	volatile unsigned int	*seq;
+};
+
+/* one sequence counter per slot, each on a cache line of its own,
+ * kept in the shared region; the pid of the writer holding the slot
+ * follows the counter on its line */
+#define CACHE_LOCK_BYTES(slots)		((slots) * CACHE_LINE)
+#define CACHE_SEQ_STRIDE		(CACHE_LINE / sizeof(unsigned int))
+
+/* spins before yielding the cpu, and before giving up */
+#define CACHE_SEQLOCK_SPINS		64
+#define CACHE_SEQLOCK_MAX_SPINS		100000
+
+#endif  /* CACHE_USE_SEQLOCK */
+/************************************************/
+
+
+
 /************************************************/
 #ifdef CACHE_USE_FCNTL
 	/* FCNTL Impl */
 
+/* one lock file per shard */
 struct lock_ctl {
-	char			*flock_file;
-	int			flock_fd;
+	char			**flock_file;
+	int			*flock_fd;
 };
 
+#define CACHE_LOCK_BYTES(slots)		0
+
 #endif  /* CACHE_USE_FCNTL */
 /************************************************/
 
@@ -76,10 +123,17 @@ struct lock_ctl {
 
 #include <pthread.h>
 
+union cache_rwlock {
+	pthread_rwlock_t	rwlock;
+	char			pad[CACHE_LINE];
+};
+
 struct lock_ctl {
-	pthread_rwlock_t	*rwlock;
+	union cache_rwlock	*rwlock;
 };
 
+#define CACHE_LOCK_BYTES(slots)		0
+
 #endif  /* CACHE_USE_PTHREAD_RWLOCK */
 /************************************************/
 
@@ -87,21 +141,39 @@ struct lock_ctl {
 
 /* defaults */
 #define CACHE_DEFAULT_TIMEOUT		28800
-#define CACHE_DEFAULT_TABLE_SIZE	1711
+#define CACHE_DEFAULT_TABLE_SIZE	1283
 #define CACHE_DEFAULT_FLAGS		0
-#define CACHE_MAX_BUCKETS_PER		6
+#define CACHE_DEFAULT_NEG_TIMEOUT	60
+#define CACHE_DEFAULT_NEG_TABLE_SIZE	211
+#define CACHE_MAX_BUCKETS_PER		8
+#define CACHE_SLOT_ARENA		512
+#define CACHE_MAX_SHARDS		64
+#define CACHE_MIN_SHARD_SLOTS		16
 #define CACHE_MMAP_FILE			"/cache.mmap"  /* don't forget the "/" */
 #define CACHE_FLOCK_FILE		"/cache.flock" /* don't forget the "/" */
 
 
 
+/* hits in the last CACHE_REFRESH_AHEAD percent of an entry's timeout
+ * schedule a refresh of the entry */
+#define CACHE_REFRESH_AHEAD		10
+
+/* how long (in seconds) a claim on the credentials of a pending
+ * mechanism call holds, and how often (in milliseconds) a lookup
+ * waiting on someone else's claim looks again */
+#define CACHE_PENDING_TIMEOUT		10
+#define CACHE_PENDING_POLL		20
+
+
+
 /* If debugging uncomment this for always verbose  */
 /* #define CACHE_DEFAULT_FLAGS		CACHE_VERBOSE */
 
 
 
-/* max length for cached credential values */
-#define CACHE_MAX_CREDS_LENGTH		60
+/* max combined length of the cached user, realm and service
+ * (must fit in CACHE_SLOT_ARENA) */
+#define CACHE_MAX_CREDS_LENGTH		256
 
 
 
@@ -114,48 +186,76 @@ struct lock_ctl {
 #define CACHE_OK			0
 #define CACHE_FAIL			1
 #define CACHE_TOO_BIG			2	
+#define CACHE_DENIED			3
 
 
 
 /* cache_result status values */
 #define CACHE_NO_FLUSH			0
 #define CACHE_FLUSH			1
-#define CACHE_FLUSH_WITH_RESCAN		2	
+#define CACHE_REFRESH			2
 
 
 
 /* declarations */
 struct bucket {
-        char            	creds[CACHE_MAX_CREDS_LENGTH];
-        unsigned int		user_offt;
-        unsigned int		realm_offt;
-        unsigned int		service_offt;
+        unsigned int		hash;		/* 0 if the bucket is empty */
+        unsigned short		creds_offt;	/* into the slot's arena */
+        unsigned short		user_length;
+        unsigned short		realm_length;
+        unsigned short		service_length;
         unsigned char   	pwd_digest[16];
+        unsigned int		pending;	/* claim on a mechanism call */
         time_t          	created;
+        volatile unsigned char	referenced;	/* CLOCK reference bit */
 };
 
+struct slot {
+        struct bucket		buckets[CACHE_MAX_BUCKETS_PER];
+        unsigned short		arena_used;
+        unsigned char		clock_hand;
+        char			arena[CACHE_SLOT_ARENA];
+} CACHE_LINE_ALIGNED;
+
 struct stats {
-        volatile unsigned int   hits;
-        volatile unsigned int   misses;
-        volatile unsigned int   lock_failures;
-        volatile unsigned int   attempts;
         unsigned int            table_size;
         unsigned int            max_buckets_per;
         unsigned int            sizeof_bucket;
         unsigned int            bytes;
         unsigned int            timeout;
+        unsigned int            neg_table_size;
+        unsigned int            neg_timeout;
+        unsigned int            clean;		/* set on a clean shutdown */
+        unsigned int            shards;
+        unsigned int            shard_slots;	/* slots of the hash table per shard */
 };
 
+/* counters of a shard, summed up by whoever reads them */
+struct shard_stats {
+        volatile unsigned int   hits;
+        volatile unsigned int   misses;
+        volatile unsigned int   lock_failures;
+        volatile unsigned int   attempts;
+        volatile unsigned int   neg_hits;
+        volatile unsigned int   neg_commits;
+        volatile unsigned int   refreshes;
+        volatile unsigned int   waits;
+} CACHE_LINE_ALIGNED;
+
 struct mm_ctl {
 	void			*base;
 	unsigned int		bytes;
 	char			*file;
+	int			reuse;		/* file left by a previous run */
 };
 
 struct cache_result {
 	struct bucket		bucket;
-	struct bucket   	*read_bucket;
+	char			creds[CACHE_MAX_CREDS_LENGTH];
 	unsigned int		hash_offset;
+	unsigned int		neg_offset;
+	unsigned int		shard;		/* whose counters to bump */
+	unsigned int		pending;	/* our claim, if any */
 	int			status;
 };
 
@@ -164,17 +264,36 @@ struct cache_result {
 extern int cache_init(void);
 extern int cache_lookup(const char *, const char *, const char *, const char *, struct cache_result *);
 extern void cache_commit(struct cache_result *);
-extern int cache_pjwhash(char *);
+extern void cache_commit_failure(struct cache_result *);
+extern int cache_claim(struct cache_result *, time_t);
+extern void cache_release(struct cache_result *);
+extern int cache_read_slot(unsigned int, const struct bucket *, const char *, const unsigned char *, struct bucket *);
+extern int cache_find_bucket(struct slot *, const struct bucket *, const char *, const unsigned char *, struct bucket *);
+extern int cache_write_slot(unsigned int, const struct bucket *, const char *, time_t, int);
+extern void cache_clock_evict(struct slot *);
+extern void cache_compact_slot(struct slot *);
+extern unsigned int cache_hash(const char *, unsigned int);
+extern unsigned int cache_hash_slot(unsigned int, unsigned int *);
+extern unsigned int cache_slot_shard(unsigned int);
+extern unsigned int cache_shard_count(void);
 extern void cache_set_table_size(const char *);
 extern void cache_set_timeout(const char *);
+extern void cache_set_neg_table_size(const char *);
+extern void cache_set_neg_timeout(const char *);
+extern unsigned int cache_size_to_slots(const char *);
 extern unsigned int cache_get_next_prime(unsigned int);
 extern void *cache_alloc_mm(unsigned int);
 extern void cache_cleanup_mm(void);
+extern int cache_reuse_table(void *, unsigned int);
 extern void cache_cleanup_lock(void);
 extern int cache_init_lock(void);
 extern int cache_get_wlock(unsigned int);
-extern int cache_get_rlock(unsigned int);
 extern int cache_un_lock(unsigned int);
+extern int cache_read_begin(unsigned int, unsigned int *);
+extern int cache_read_retry(unsigned int, unsigned int);
+#ifndef CACHE_USE_SEQLOCK
+extern int cache_get_rlock(unsigned int);
+#endif
 
 #endif  /* _CACHE_H */
 
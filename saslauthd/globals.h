@@ -48,6 +48,8 @@ extern int              g_argc;
 extern char             **g_argv;
 extern int              flags;
 extern int              num_procs;
+extern int              num_threads;
+extern int              queue_len;
 extern char             *mech_option;
 extern char             *run_path;
 extern authmech_t       *auth_mech;
@@ -63,6 +65,10 @@ extern authmech_t       *auth_mech;
 #define CACHE_ENABLED           (1 << 7)
 #define USE_PROCESS_MODEL       (1 << 8)
 #define CONCAT_LOGIN_REALM      (1 << 9)
+#define USE_THREAD_MODEL        (1 << 10)
+#define USE_EXCL_ACCEPT         (1 << 11)
+#define CACHE_NEG_ENABLED       (1 << 12)
+#define CACHE_PERSIST           (1 << 13)
 
 
 #endif  /* _GLOBALS_H */
@@ -66,8 +66,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <stropts.h>
+#include <ucred.h>
 
 #include "globals.h"
+#include "cache.h"
 #include "utils.h"
  
 
@@ -218,6 +220,9 @@ void do_request(void *cookie, char *data, size_t datasize, door_desc_t *dp, size
 	char			password[MAX_REQ_LEN + 1]; /* password for authentication            */
 	char			service[MAX_REQ_LEN + 1];  /* service name for authentication        */
 	char			realm[MAX_REQ_LEN + 1];    /* user realm for authentication          */
+	struct cache_result	lkup_result;               /* cache lookup, see do_auth()            */
+	ucred_t			*cred = NULL;              /* client's credentials, for STATS        */
+	uid_t			uid;
 
 
 	/**************************************************************
@@ -295,24 +300,56 @@ void do_request(void *cookie, char *data, size_t datasize, door_desc_t *dp, size
 	realm[count] = '\0';
 
 	/**************************************************************
- 	 * We don't allow NULL passwords or login names
+	 * An empty login with STATS_REQUEST as the password asks for
+	 * the server statistics rather than an authentication. They
+	 * are only handed out to root and saslauthd's own user.
 	 **************************************************************/
-	if (*login == '\0') {
-		logger(L_ERR, L_FUNC, "NULL login received");
-		send_no("NULL login received");
-		return;
-	}	
+	if (*login == '\0' && strcmp(password, STATS_REQUEST) == 0) {
+		if (door_ucred(&cred) != 0) {
+			logger(L_ERR, L_FUNC, "door_ucred: %s", strerror(errno));
+			send_no("statistics not available");
+			return;
+		}
+
+		uid = ucred_geteuid(cred);
+		ucred_free(cred);
+
+		if (uid != 0 && uid != geteuid()) {
+			logger(L_ERR, L_FUNC, "statistics request from an unprivileged client refused");
+			send_no("statistics not available");
+			return;
+		}
+
+		response = stats_report();
+	} else {
+		/**************************************************************
+		 * We don't allow NULL passwords or login names
+		 **************************************************************/
+		if (*login == '\0') {
+			logger(L_ERR, L_FUNC, "NULL login received");
+			send_no("NULL login received");
+			return;
+		}	
 	
-	if (*password == '\0') {
-		logger(L_ERR, L_FUNC, "NULL password received");
-		send_no("NULL password received");
-		return;
-	}	
-
-	/**************************************************************
-	 * Get the mechanism response from do_auth() and send it back.
-	 **************************************************************/
-	response = do_auth(login, password, service, realm);
+		if (*password == '\0') {
+			logger(L_ERR, L_FUNC, "NULL password received");
+			send_no("NULL password received");
+			return;
+		}	
+
+		/**************************************************************
+		 * Get the mechanism response from do_auth() and send it back.
+		 **************************************************************/
+		memset((void *)&lkup_result, 0, sizeof(lkup_result));
+
+		response = do_auth(login, password, service, realm, &lkup_result);
+
+		/**************************************************************
+		 * door_return() doesn't come back, so a cache refresh has to
+		 * be done before answering.
+		 **************************************************************/
+		do_refresh(login, password, service, realm, &lkup_result);
+	}
 
 	memset(password, 0, strlen(password));
 
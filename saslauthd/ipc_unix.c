@@ -40,6 +40,11 @@
  *
  ********************************************************************************/
 
+/* struct ucred, for SO_PEERCRED */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 /****************************************
  * enable/disable ifdef
 *****************************************/
@@ -62,16 +67,101 @@
 #include <errno.h>
 #include <netinet/in.h>
 
+#ifdef USE_UNIX_EPOLL
+# include <pthread.h>
+# include <signal.h>
+# include <time.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+/* Preforked processes can wait for connections on the shared socket
+ * in epoll() with exclusive wakeups instead of taking turns through
+ * the accept lock file. */
+#if defined(HAVE_SYS_EPOLL_H) && defined(EPOLLEXCLUSIVE)
+# define USE_EPOLL_EXCLUSIVE
+#endif
+
 #include "globals.h"
+#include "cache.h"
 #include "utils.h"
 
+/****************************************
+ * data types
+ *****************************************/
+
+/* longest request: a pipelining tag and four counted length strings */
+#define REQ_FRAME_LEN	(sizeof(unsigned int) + 4 * (sizeof(unsigned short) + MAX_REQ_LEN))
+
+/* request as read off the socket, the strings point into the frame */
+struct request {
+	char			frame[REQ_FRAME_LEN + 1];  /* request as received, parsed in place   */
+	unsigned int		tag;                       /* client's tag for the request, network  */
+	char			*login;                    /* account name to authenticate           */
+	char			*password;                 /* password for authentication            */
+	char			*service;                  /* service name for authentication        */
+	char			*realm;                    /* user realm for authentication          */
+};
+
+#ifdef USE_UNIX_EPOLL
+/* connection watched by the event loop */
+struct conn {
+	int			fd;          /* descriptor of the connection       */
+	int			refs;        /* event loop + requests in flight    */
+	int			pipelined;   /* pipelined protocol was negotiated  */
+	size_t			len;         /* bytes received, not yet queued     */
+	struct conn		*next;       /* next connection held back          */
+	pthread_mutex_t		lock;        /* guards refs and outgoing replies   */
+	char			buf[REQ_FRAME_LEN]; /* the bytes received          */
+};
+
+/* request read off a connection, waiting for a worker */
+struct job {
+	struct conn		*conn;       /* connection the request came in on  */
+	int			tagged;      /* request came in pipelined          */
+	struct request		req;         /* the request                        */
+};
+#endif
+
 /****************************************
  * declarations/protos
  *****************************************/
 static void	do_request(int);
+static int	rx_request(int, struct request *);
+static int	scan_request(const char *, size_t, size_t, size_t *, unsigned short *);
+static void	parse_request(struct request *, size_t, const size_t *, const unsigned short *);
+static int	tx_string(int, const char *, unsigned short);
+static char	*process_request(int, struct request *, struct cache_result *);
+static int	peer_may_stat(int);
+static void	finish_request(struct request *, struct cache_result *);
+static void	answer_request(int, struct request *);
 static void	send_no(int, char *);
 static int	rel_accept_lock();
 static int	get_accept_lock();
+#ifdef USE_EPOLL_EXCLUSIVE
+static void	excl_accept_init();
+static int	excl_accept_wait();
+#endif
+#ifdef USE_UNIX_EPOLL
+static void	event_loop();
+static void	accept_conns();
+static void	listener_update();
+static int	conn_input(struct conn *);
+static int	conn_dispatch(struct conn *);
+static void	conn_consume(struct conn *, size_t);
+static void	conn_settle(struct conn *, int);
+static void	resume_stalled();
+static int	send_now(int, const char *, unsigned short);
+static void	*worker_thread(void *);
+static void	serve_job(struct job *);
+static void	send_pipelined(struct conn *, unsigned int, const char *);
+static int	conn_rearm(struct conn *);
+static void	conn_release(struct conn *);
+static int	queue_push(struct job *);
+static struct job *queue_pop();
+#endif
 
 /****************************************
  * module globals
@@ -83,14 +173,34 @@ static struct sockaddr_un	client;      /* domain socket control, client side */
 static SALEN_TYPE		len;         /* length for the client sockaddr_un  */
 static char			*sock_file;  /* path to the AF_UNIX socket         */
 static char			*accept_file;/* path to the accept() lock file     */
+#ifdef USE_EPOLL_EXCLUSIVE
+static int			excl_fd;     /* this process' exclusive epoll set  */
+#endif
+#ifdef USE_UNIX_EPOLL
+static int			epoll_fd;    /* descriptor for the event loop      */
+static int			wake_pipe[2];/* workers wake the event loop        */
+static int			listening;   /* socket is watched by the loop      */
+static time_t			accept_retry;/* accept() paused until then, or 0   */
+static struct conn		*stalled_head;/* held back while the queue is full */
+static struct conn		*stalled_tail;
+static struct job		**queue;     /* requests waiting for a worker      */
+static unsigned int		queue_head;  /* oldest entry in the queue          */
+static unsigned int		queue_count; /* number of entries in the queue     */
+static int			queue_waiting;/* event loop waits for a free spot  */
+static pthread_mutex_t		queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		queue_not_empty = PTHREAD_COND_INITIALIZER;
+#endif
 
 /****************************************
  * flags       	global from saslauthd-main.c
  * run_path    	global from saslauthd-main.c
  * num_procs   	global from saslauthd-main.c
+ * num_threads 	global from saslauthd-main.c
+ * queue_len   	global from saslauthd-main.c
  * detach_tty()	function from saslauthd-main.c
  * rx_rec()		function from utils.c
  * tx_rec()		function from utils.c
+ * retry_writev()	function from utils.c
  * logger()		function from utils.c
  *****************************************/
 
@@ -110,8 +220,33 @@ void ipc_init() {
 	 * waste of resources. Otherwise, setup the accept lock
 	 * file.
 	 **********************************************************/
-	if (num_procs == 0) 
+	if (num_procs == 0 || (flags & USE_THREAD_MODEL)) 
+		flags &= ~(USE_ACCEPT_LOCK | USE_EXCL_ACCEPT);
+
+	/*********************************************************
+	 * With -e the kernel hands each connection to a single
+	 * waiting process by itself, no need for the lock file
+	 * round trips.
+	 **********************************************************/
+	if (flags & USE_EXCL_ACCEPT) {
+#ifdef USE_EPOLL_EXCLUSIVE
 		flags &= ~USE_ACCEPT_LOCK;
+#else
+		logger(L_ERR, L_FUNC, "exclusive epoll wakeups aren't supported here, ignoring -e");
+		flags &= ~USE_EXCL_ACCEPT;
+#endif
+	}
+
+#ifdef CACHE_USE_FCNTL
+	/*********************************************************
+	 * fcntl() locks are owned by the process, they won't keep
+	 * our own threads out of a cache slot.
+	 **********************************************************/
+	if ((flags & USE_THREAD_MODEL) && (flags & CACHE_ENABLED)) {
+		logger(L_ERR, L_FUNC, "the credential cache can not be used with worker threads on this platform");
+		exit(1);
+	}
+#endif
 	
 	if (flags & USE_ACCEPT_LOCK) {
 		size_t accept_file_len;
@@ -196,6 +331,28 @@ void ipc_init() {
 
 	logger(L_INFO, L_FUNC, "listening on socket: %s", sock_file);
 
+	/**************************************************************
+	 * The event loop accepts until it runs dry, so it needs a
+	 * non blocking socket, as do processes woken up exclusively
+	 * (they may find the connection taken by a process that was
+	 * already awake).
+	 **************************************************************/
+	if (flags & (USE_THREAD_MODEL | USE_EXCL_ACCEPT)) {
+		if (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+			rc = errno;
+			logger(L_ERR, L_FUNC, "could not set socket non blocking: %s", sock_file);
+			logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
+			exit(1);
+		}
+	}
+
+	/**************************************************************
+	 * All of the work happens in threads of this one process,
+	 * don't procreate.
+	 **************************************************************/
+	if (flags & USE_THREAD_MODEL)
+		return;
+
 	/**************************************************************
 	 * Ok boys... Let's procreate... If necessary of course...
 	 * Num_procs == 0 means we're running one shot per process. In
@@ -219,6 +376,18 @@ void ipc_loop() {
 	int		conn_fd;
 
 
+#ifdef USE_UNIX_EPOLL
+	if (flags & USE_THREAD_MODEL) {
+		event_loop();
+		return;
+	}
+#endif
+
+#ifdef USE_EPOLL_EXCLUSIVE
+	if (flags & USE_EXCL_ACCEPT)
+		excl_accept_init();
+#endif
+
 	while(1) {
 
 		len = sizeof(client);
@@ -238,7 +407,7 @@ void ipc_loop() {
 		rel_accept_lock();
 
 		if (conn_fd == -1) {
-			if (rc != EINTR) {
+			if (rc != EINTR && rc != EAGAIN && rc != EWOULDBLOCK) {
 				logger(L_ERR, L_FUNC, "socket accept failure");
 				logger(L_ERR, L_FUNC, "accept: %s", strerror(rc));
 				sleep(5);
@@ -282,289 +451,1205 @@ void ipc_loop() {
 }
 
 
+#ifdef USE_UNIX_EPOLL
 /*************************************************************
- * General cleanup. Unlock, close, and unlink our files.
- *
- * __Required Function__
+ * Event driven IPC loop. Start up the worker threads, then sit
+ * in epoll_wait() accepting connections, reading what comes
+ * in on them and queueing up the complete requests for the
+ * workers. Nothing in here waits on a client: reads don't
+ * block, and a request that finds the queue full is held
+ * back with its connection until a worker wakes us up.
  **************************************************************/
-void ipc_cleanup() {
-
-	struct flock    lock_st;
-
-	if (flags & USE_ACCEPT_LOCK) {
-
-		lock_st.l_type = F_UNLCK;
-		lock_st.l_start = 0;
-		lock_st.l_whence = SEEK_SET;
-		lock_st.l_len = 1;
+void event_loop() {
+
+	int			rc;
+	int			x;
+	int			nevents;
+	int			timeout;
+	char			drain[64];
+	pthread_t		thread;
+	pthread_attr_t		thread_attr;
+	sigset_t		sigs;
+	sigset_t		old_sigs;
+	struct epoll_event	ev;
+	struct epoll_event	events[MAX_EPOLL_EVENTS];
+
+
+	if ((queue = malloc(sizeof(struct job *) * queue_len)) == NULL) {
+		logger(L_ERR, L_FUNC, "could not allocate memory");
+		exit(1);
+	}
 
-		fcntl(accept_fd, F_SETLK, &lock_st);
+	if ((epoll_fd = epoll_create(MAX_EPOLL_EVENTS)) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create event loop");
+		logger(L_ERR, L_FUNC, "epoll_create: %s", strerror(rc));
+		exit(1);
+	}
 
-		close(accept_fd);
-		unlink(accept_file);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
 
-		if (flags & VERBOSE)
-			logger(L_DEBUG, L_FUNC, "accept lock file removed: %s", accept_file);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not watch socket: %s", sock_file);
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		exit(1);
 	}
 
-	close(sock_fd);
-	unlink(sock_file);
-
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "socket removed: %s", sock_file);
-}
+	listening = 1;
 
+	/**************************************************************
+	 * Workers poke the pipe when they free up a spot in the queue
+	 * while requests are held back.
+	 **************************************************************/
+	if (pipe(wake_pipe) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create wakeup pipe");
+		logger(L_ERR, L_FUNC, "pipe: %s", strerror(rc));
+		exit(1);
+	}
 
-/*************************************************************
- * Handle the comms on the socket, pass the request off to
- * do_auth() back in saslauthd-main.c, then transmit the
- * result back out on the socket.
- **************************************************************/
-void do_request(int conn_fd) {
+	for (x = 0; x < 2; x++)
+		fcntl(wake_pipe[x], F_SETFL, fcntl(wake_pipe[x], F_GETFL, 0) | O_NONBLOCK);
 
-	unsigned short		count;                     /* input/output data byte count           */
-	unsigned short		ncount;                    /* input/output data byte count, network  */ 
-	char			*response;                 /* response to send to the client         */
-	char			login[MAX_REQ_LEN + 1];    /* account name to authenticate           */
-	char			password[MAX_REQ_LEN + 1]; /* password for authentication            */
-	char			service[MAX_REQ_LEN + 1];  /* service name for authentication        */
-	char			realm[MAX_REQ_LEN + 1];    /* user realm for authentication          */
+	ev.events = EPOLLIN;
+	ev.data.ptr = wake_pipe;
 
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not watch wakeup pipe");
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		exit(1);
+	}
 
 	/**************************************************************
-	 * The input data stream consists of the login id, password,
-	 * service name and user realm as counted length strings.
-	 * We read in each string, then dispatch the data.
+	 * Signals are left to this thread, the workers start out
+	 * with everything blocked.
 	 **************************************************************/
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
 
-	/* login id */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
 
-	count = ntohs(count);
+	for (x = 0; x < num_threads; x++) {
+		if ((rc = pthread_create(&thread, &thread_attr, worker_thread, NULL)) != 0) {
+			logger(L_ERR, L_FUNC, "could not create worker thread");
+			logger(L_ERR, L_FUNC, "pthread_create: %s", strerror(rc));
+			exit(1);
+		}
+	}
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "login exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+	pthread_attr_destroy(&thread_attr);
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
 
-	if (rx_rec(conn_fd, (void *)login, (size_t)count) != (ssize_t)count) 
-		return;
-	
-	login[count] = '\0';
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "started %d worker threads", num_threads);
 
-	/* password */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+	while(1) {
+		timeout = -1;
 
-	count = ntohs(count);
+		if (accept_retry != 0) {
+			timeout = (int)(accept_retry - time(NULL)) * 1000;
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "password exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+			if (timeout < 0)
+				timeout = 0;
+		}
 
-	if (rx_rec(conn_fd, (void *)password, (size_t)count) != (ssize_t)count) 
-		return;
-		
-	password[count] = '\0';
+		nevents = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
 
-	/* service */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+		if (nevents == -1) {
+			rc = errno;
 
-	count = ntohs(count);
+			if (rc != EINTR) {
+				logger(L_ERR, L_FUNC, "event loop failure");
+				logger(L_ERR, L_FUNC, "epoll_wait: %s", strerror(rc));
+				sleep(5);
+			}
+			continue;
+		}
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "service exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+		if (accept_retry != 0 && time(NULL) >= accept_retry) {
+			accept_retry = 0;
+			listener_update();
+		}
 
-	if (rx_rec(conn_fd, (void *)service, (size_t)count) != (ssize_t)count) 
-		return;
+		for (x = 0; x < nevents; x++) {
+			if (events[x].data.ptr == NULL) {
+				accept_conns();
+				continue;
+			}
 
-	service[count] = '\0';
+			if (events[x].data.ptr == wake_pipe) {
+				while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+					;
+				resume_stalled();
+				continue;
+			}
 
-	/* realm */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+			/******************************************************
+			 * The connection was registered one shot, it won't
+			 * fire again until conn_settle() rearms it.
+			 *****************************************************/
+			conn_settle(events[x].data.ptr, conn_input(events[x].data.ptr));
+		}
+	}
 
-	count = ntohs(count);
+	return;
+}
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "realm exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
 
-	if (rx_rec(conn_fd, (void *)realm, (size_t)count) != (ssize_t)count) 
-		return;
+/*************************************************************
+ * Accept all of the pending connections on the (non blocking)
+ * socket and register them with the event loop. When accept()
+ * fails for want of descriptors or memory, stop watching the
+ * socket for ACCEPT_RETRY_DELAY seconds rather than spin on
+ * the connection still pending.
+ **************************************************************/
+void accept_conns() {
 
-	realm[count] = '\0';
+	int			rc;
+	int			conn_fd;
+	socklen_t		client_len;
+	struct conn		*c;
+	struct epoll_event	ev;
+	struct timeval		tv;
 
-	/**************************************************************
- 	 * We don't allow NULL passwords or login names
-	 **************************************************************/
-	if (*login == '\0') {
-		logger(L_ERR, L_FUNC, "NULL login received");
-		send_no(conn_fd, "NULL login received");
-		return;
-	}	
-	
-	if (*password == '\0') {
-		logger(L_ERR, L_FUNC, "NULL password received");
-		send_no(conn_fd, "NULL password received");
-		return;
-	}	
 
-	/**************************************************************
-	 * Get the mechanism response from do_auth() and send it back.
-	 **************************************************************/
-	response = do_auth(login, password, service, realm);
+	while(1) {
+		client_len = sizeof(client);
 
-	memset(password, 0, strlen(password));
+        	conn_fd = accept(sock_fd, (struct sockaddr *)&client, &client_len);
 
-	if (response == NULL) {
-		send_no(conn_fd, "NULL response from mechanism");
-		return;
-	}	
+		if (conn_fd == -1) {
+			rc = errno;
 
-	count = strlen(response);
-	ncount = htons(count);
+			if (rc == EINTR || rc == ECONNABORTED)
+				continue;
 
-	if (tx_rec(conn_fd, (void *)&ncount, (size_t)sizeof(ncount)) != (ssize_t)sizeof(ncount)) {
-		free(response);
-		return;
-	}
+			if (rc != EAGAIN && rc != EWOULDBLOCK) {
+				logger(L_ERR, L_FUNC, "socket accept failure");
+				logger(L_ERR, L_FUNC, "accept: %s", strerror(rc));
+				accept_retry = time(NULL) + ACCEPT_RETRY_DELAY;
+				listener_update();
+			}
+			return;
+		}
 
-	if (tx_rec(conn_fd, (void *)response, (size_t)count) != (ssize_t)sizeof(count)) {
-		free(response);
-		return;
-	}
+		/**************************************************************
+		 * Replies are written by the workers, don't let a client
+		 * that doesn't read them hold one up for good.
+		 **************************************************************/
+		tv.tv_sec = CONN_SEND_TIMEOUT;
+		tv.tv_usec = 0;
 
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "response: %s", response);
+		if (setsockopt(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+			rc = errno;
+			logger(L_ERR, L_FUNC, "could not set send timeout");
+			logger(L_ERR, L_FUNC, "setsockopt: %s", strerror(rc));
+		}
 
-	free(response);
+		if ((c = malloc(sizeof(struct conn))) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			close(conn_fd);
+			continue;
+		}
 
-	return;
+		c->fd = conn_fd;
+		c->refs = 1;
+		c->pipelined = 0;
+		c->len = 0;
+		c->next = NULL;
+		pthread_mutex_init(&c->lock, NULL);
+
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = c;
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1) {
+			rc = errno;
+			logger(L_ERR, L_FUNC, "could not watch connection");
+			logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+			conn_release(c);
+		}
+	}
 }
 
 
 /*************************************************************
- * In case something went out to lunch while reading in the
- * request data, we may want to attempt to send out a default 
- * "NO" response on the socket. The mesg is optional.
+ * Watch the listening socket only while new connections can
+ * be taken on: not while requests are held back for a full
+ * queue, which leaves new connections waiting in the socket
+ * backlog, nor while accept() is paused.
  **************************************************************/
-void send_no(int conn_fd, char *mesg) {
-	char		buff[1024];
-	unsigned short	count; 
-	unsigned short	ncount; 
+void listener_update() {
 
-	buff[0] = 'N';
-	buff[1] = 'O';
-	buff[2] = ' ';
+	int			rc;
+	int			want;
+	struct epoll_event	ev;
 
-	/* buff, except for the trailing NUL and 'NO ' */
-	strncpy(buff + 3, mesg, sizeof(buff) - 1 - 3);
-	buff[1023] = '\0';
 
-	count = strlen(buff);
-	ncount = htons(count);
+	want = (stalled_head == NULL && accept_retry == 0);
 
-	if (tx_rec(conn_fd, (void *)&ncount, (size_t)sizeof(ncount)) != (ssize_t)sizeof(ncount))
+	if (want == listening)
 		return;
 
-	if (tx_rec(conn_fd, (void *)buff, (size_t)count) != (ssize_t)sizeof(count))
+	ev.events = want ? EPOLLIN : 0;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock_fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not watch socket: %s", sock_file);
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
 		return;
+	}
 
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "response: %s", buff);
-	
-	return;	
+	listening = want;
 }
 
 
 /*************************************************************
- * Attempt to get a write lock on the accept lock file.
- * Return 0 if everything went ok, return -1 if something bad
- * happened. This function is expected to block.
+ * Read whatever the client sent on a connection, without
+ * waiting for more, and queue up the requests it completes.
+ * Return as conn_dispatch() does; -1 also when the client
+ * hung up or the connection failed.
  **************************************************************/
-int get_accept_lock() {
+int conn_input(struct conn *c) {
 
-	struct flock    lock_st;
-	int             rc;
+	ssize_t			bytesio;                   /* bytes read                             */
+	int			rc;
 
 
-	if (!(flags & USE_ACCEPT_LOCK))
-		return 0;
+	while(1) {
+		if ((rc = conn_dispatch(c)) != 0)
+			return rc;
 
-	lock_st.l_type = F_WRLCK;
-	lock_st.l_start = 0;
-	lock_st.l_whence = SEEK_SET;
-	lock_st.l_len = 1;
+		/* a full buffer always holds a request, conn_dispatch() took it */
+		bytesio = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
 
-	errno = 0;
+		if (bytesio > 0) {
+			c->len += bytesio;
+			continue;
+		}
 
-	do {
-		rc = fcntl(accept_fd, F_SETLKW, &lock_st);
-	} while (rc != 0 && errno == EINTR);
+		if (bytesio == 0)
+			return -1;
 
-	if (rc != 0) {
 		rc = errno;
-		logger(L_ERR, L_FUNC, "could not acquire accept lock");
-		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
-		return -1;
-	}
 
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "acquired accept lock");
+		if (rc == EINTR)
+			continue;
 
-	return 0;
+		if (rc == EAGAIN || rc == EWOULDBLOCK)
+			return 0;
+
+		logger(L_ERR, L_FUNC, "read failure");
+		logger(L_ERR, L_FUNC, "recv: %s", strerror(rc));
+		return -1;
+	}
 }
 
 
 /*************************************************************
- * Attempt to release the write lock on the accept lock file.
- * Return 0 if everything went ok, return -1 if something bad
- * happened.
+ * Queue up the complete requests in a connection's buffer.
+ * A plain connection gets one request, answered by a worker
+ * which then hangs up, same as with a preforked child, unless
+ * the request is the hello asking for the pipelined protocol.
+ * The hello is answered right here, so its reply goes out
+ * before that of any tagged request following it (see
+ * README.ipc). Return 0 if more input is needed, 1 if the
+ * queue is full, 2 if the connection was handed over to a
+ * worker for good, or -1 if it should be hung up.
  **************************************************************/
-int rel_accept_lock() {
+int conn_dispatch(struct conn *c) {
 
-	struct flock    lock_st;
-	int             rc;
+	struct job		*job;                      /* request to hand to a worker            */
+	size_t			start;                     /* where the counted strings begin        */
+	size_t			off[4];                    /* offsets of the strings in the frame    */
+	unsigned short		count[4];                  /* lengths of the strings                 */
+	int			frame_len;                 /* length of the frame, see scan_request  */
+	int			tagged;
 
 
-	if (!(flags & USE_ACCEPT_LOCK))
-		return 0;
+	while(1) {
+		tagged = c->pipelined;
+		start = tagged ? sizeof(job->req.tag) : 0;
 
-	lock_st.l_type = F_UNLCK;
-	lock_st.l_start = 0;
-	lock_st.l_whence = SEEK_SET;
-	lock_st.l_len = 1;
+		if ((frame_len = scan_request(c->buf, c->len, start, off, count)) == 0)
+			return 0;
 
-	errno = 0;
+		if (frame_len < 0) {
+			if (!tagged)
+				send_now(c->fd, "NO ", 3);
+			return -1;
+		}
 
-	do {
-		rc = fcntl(accept_fd, F_SETLKW, &lock_st);
-	} while (rc != 0 && errno == EINTR);
+		if ((job = malloc(sizeof(struct job))) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			return -1;
+		}
 
-	if (rc != 0) {
-		rc = errno;
-		logger(L_ERR, L_FUNC, "could not release accept lock");
-		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
-		return -1;
-	}
+		memcpy(job->req.frame, c->buf, frame_len);
+		parse_request(&job->req, start, off, count);
+		job->conn = c;
+		job->tagged = tagged;
 
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "released accept lock");
+		if (!tagged && *job->req.login == '\0' && strcmp(job->req.password, PIPELINE_HELLO) == 0) {
+			free(job);
 
-	return 0;
+			if (send_now(c->fd, PIPELINE_OK, sizeof(PIPELINE_OK) - 1) != 0)
+				return -1;
+
+			if (flags & VERBOSE)
+				logger(L_DEBUG, L_FUNC, "connection switched to pipelined requests");
+
+			c->pipelined = 1;
+			conn_consume(c, frame_len);
+			continue;
+		}
+
+		/**************************************************************
+		 * A plain request takes over the event loop's reference, the
+		 * worker may be done with the connection before queue_push()
+		 * even returns. A tagged request holds one of its own.
+		 **************************************************************/
+		if (tagged) {
+			pthread_mutex_lock(&c->lock);
+			c->refs++;
+			pthread_mutex_unlock(&c->lock);
+		}
+
+		if (queue_push(job) != 0) {
+			if (tagged) {
+				pthread_mutex_lock(&c->lock);
+				c->refs--;
+				pthread_mutex_unlock(&c->lock);
+			}
+
+			memset(job, 0, sizeof(struct job));
+			free(job);
+			return 1;
+		}
+
+		if (!tagged)
+			return 2;
+
+		conn_consume(c, frame_len);
+	}
 }
 
 
+/*************************************************************
+ * Drop a request that was queued up from the head of a
+ * connection's buffer, wiping the bytes it leaves behind.
+ **************************************************************/
+void conn_consume(struct conn *c, size_t frame_len) {
+
+	memmove(c->buf, c->buf + frame_len, c->len - frame_len);
+	c->len -= frame_len;
+	memset(c->buf + c->len, 0, frame_len);
+}
+
+
+/*************************************************************
+ * Act on what conn_input() made of a connection: watch it for
+ * more input, hold it back until the queue has room, forget
+ * about it (a worker has it) or hang it up.
+ **************************************************************/
+void conn_settle(struct conn *c, int rc) {
+
+	switch (rc) {
+		case 0:
+			if (conn_rearm(c) != 0)
+				conn_release(c);
+			break;
+
+		case 1:
+			c->next = NULL;
+
+			if (stalled_tail != NULL)
+				stalled_tail->next = c;
+			else
+				stalled_head = c;
+
+			stalled_tail = c;
+			listener_update();
+			break;
+
+		case 2:
+			break;
+
+		default:
+			conn_release(c);
+			break;
+	}
+}
+
+
+/*************************************************************
+ * A worker freed up a spot in the queue: move the requests
+ * held back into it, oldest connection first, for as long as
+ * there is room.
+ **************************************************************/
+void resume_stalled() {
+
+	struct conn		*c;
+	int			rc;
+
+
+	while ((c = stalled_head) != NULL) {
+		if ((rc = conn_input(c)) == 1)
+			break;
+
+		if ((stalled_head = c->next) == NULL)
+			stalled_tail = NULL;
+
+		conn_settle(c, rc);
+	}
+
+	listener_update();
+}
+
+
+/*************************************************************
+ * Send a counted length string from the event loop, without
+ * waiting for the client to make room for it. Only used for
+ * the first reply on a connection, which fits in the empty
+ * socket buffer. Return 0 if it all went out, -1 otherwise.
+ **************************************************************/
+int send_now(int conn_fd, const char *str, unsigned short count) {
+
+	char			buff[sizeof(unsigned short) + 64];
+	unsigned short		ncount;                    /* output data byte count, network        */
+	ssize_t			bytesio;                   /* bytes written                          */
+	int			rc;
+
+
+	if (count > sizeof(buff) - sizeof(ncount))
+		count = sizeof(buff) - sizeof(ncount);
+
+	ncount = htons(count);
+
+	memcpy(buff, &ncount, sizeof(ncount));
+	memcpy(buff + sizeof(ncount), str, count);
+
+	do {
+		bytesio = send(conn_fd, buff, sizeof(ncount) + count, MSG_DONTWAIT);
+	} while (bytesio == -1 && errno == EINTR);
+
+	if (bytesio != (ssize_t)(sizeof(ncount) + count)) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "write failure");
+		logger(L_ERR, L_FUNC, "send: %s", bytesio == -1 ? strerror(rc) : "short write");
+		return -1;
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "response: %.*s", (int)count, str);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Worker thread. Pull requests off the queue and serve them.
+ **************************************************************/
+void *worker_thread(void *arg) {
+
+	while(1)
+		serve_job(queue_pop());
+
+	return NULL;
+}
+
+
+/*************************************************************
+ * Answer a request the event loop queued up. A plain request
+ * is answered just like a preforked child would and the
+ * connection is hung up. A tagged request is answered with
+ * its tag; replies on a pipelined connection go out in
+ * whatever order the requests finish.
+ **************************************************************/
+void serve_job(struct job *job) {
+
+	struct conn		*c = job->conn;
+	char			*response;                 /* response to send to the client         */
+	struct cache_result	lkup_result;               /* cache lookup, see do_auth()            */
+
+
+	if (!job->tagged) {
+		answer_request(c->fd, &job->req);
+		conn_release(c);
+		free(job);
+		return;
+	}
+
+	if ((response = process_request(c->fd, &job->req, &lkup_result)) == NULL) {
+		send_pipelined(c, job->req.tag, "NO NULL response from mechanism");
+	} else {
+		send_pipelined(c, job->req.tag, response);
+		free(response);
+	}
+
+	conn_release(c);
+
+	finish_request(&job->req, &lkup_result);
+	free(job);
+
+	return;
+}
+
+
+/*************************************************************
+ * Send a tagged reply out on a pipelined connection. The
+ * reply goes out in a single write under the connection
+ * lock so it can't interleave with another worker's reply.
+ **************************************************************/
+void send_pipelined(struct conn *c, unsigned int tag, const char *response) {
+
+	char			buff[sizeof(tag) + sizeof(unsigned short) + 1024];
+	unsigned short		count;                     /* output data byte count                 */
+	unsigned short		ncount;                    /* output data byte count, network        */ 
+
+
+	count = strlen(response);
+
+	if (count > sizeof(buff) - sizeof(tag) - sizeof(ncount))
+		count = sizeof(buff) - sizeof(tag) - sizeof(ncount);
+
+	ncount = htons(count);
+
+	memcpy(buff, &tag, sizeof(tag));
+	memcpy(buff + sizeof(tag), &ncount, sizeof(ncount));
+	memcpy(buff + sizeof(tag) + sizeof(ncount), response, count);
+
+	pthread_mutex_lock(&c->lock);
+	tx_rec(c->fd, (void *)buff, sizeof(tag) + sizeof(ncount) + count);
+	pthread_mutex_unlock(&c->lock);
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "response: %s", response);
+
+	return;
+}
+
+
+/*************************************************************
+ * Hand a (one shot) connection back to the event loop.
+ * Return 0 if everything went ok, -1 otherwise.
+ **************************************************************/
+int conn_rearm(struct conn *c) {
+
+	int			rc;
+	struct epoll_event	ev;
+
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = c;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not watch connection");
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Drop a reference on a connection, hang it up once nobody
+ * holds on to it anymore.
+ **************************************************************/
+void conn_release(struct conn *c) {
+
+	int			refs;
+
+
+	pthread_mutex_lock(&c->lock);
+	refs = --c->refs;
+	pthread_mutex_unlock(&c->lock);
+
+	if (refs > 0)
+		return;
+
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	memset(c->buf, 0, sizeof(c->buf));
+	free(c);
+}
+
+
+/*************************************************************
+ * Add a request to the tail of the queue. Return 0 if it went
+ * in, -1 if the queue is full, in which case the next worker
+ * to take a request off the queue wakes up the event loop.
+ **************************************************************/
+int queue_push(struct job *job) {
+
+	pthread_mutex_lock(&queue_lock);
+
+	if (queue_count == (unsigned int)queue_len) {
+		queue_waiting = 1;
+		pthread_mutex_unlock(&queue_lock);
+		return -1;
+	}
+
+	queue[(queue_head + queue_count) % queue_len] = job;
+	queue_count++;
+
+	server_stats->queue_depth = queue_count;
+
+	if (queue_count > server_stats->queue_max)
+		server_stats->queue_max = queue_count;
+
+	pthread_cond_signal(&queue_not_empty);
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Take the request at the head of the queue, blocking until
+ * there is one.
+ **************************************************************/
+struct job *queue_pop() {
+
+	struct job	*job;
+	int		wake;
+
+
+	pthread_mutex_lock(&queue_lock);
+
+	while (queue_count == 0)
+		pthread_cond_wait(&queue_not_empty, &queue_lock);
+
+	job = queue[queue_head];
+	queue_head = (queue_head + 1) % queue_len;
+	queue_count--;
+
+	server_stats->queue_depth = queue_count;
+
+	wake = queue_waiting;
+	queue_waiting = 0;
+
+	pthread_mutex_unlock(&queue_lock);
+
+	/* a full pipe already has the event loop's attention */
+	if (wake) {
+		while (write(wake_pipe[1], "", 1) == -1 && errno == EINTR)
+			;
+	}
+
+	return job;
+}
+#endif /* USE_UNIX_EPOLL */
+
+
+/*************************************************************
+ * General cleanup. Unlock, close, and unlink our files.
+ *
+ * __Required Function__
+ **************************************************************/
+void ipc_cleanup() {
+
+	struct flock    lock_st;
+
+	if (flags & USE_ACCEPT_LOCK) {
+
+		lock_st.l_type = F_UNLCK;
+		lock_st.l_start = 0;
+		lock_st.l_whence = SEEK_SET;
+		lock_st.l_len = 1;
+
+		fcntl(accept_fd, F_SETLK, &lock_st);
+
+		close(accept_fd);
+		unlink(accept_file);
+
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "accept lock file removed: %s", accept_file);
+	}
+
+	close(sock_fd);
+	unlink(sock_file);
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "socket removed: %s", sock_file);
+}
+
+
+/*************************************************************
+ * Handle the comms on the socket, pass the request off to
+ * do_auth() back in saslauthd-main.c, then transmit the
+ * result back out on the socket.
+ **************************************************************/
+void do_request(int conn_fd) {
+
+	struct request		req;                       /* request read from the client           */
+
+
+	switch (rx_request(conn_fd, &req)) {
+		case 0:
+			break;
+
+		case 1:
+			send_no(conn_fd, "");
+			return;
+
+		default:
+			return;
+	}
+
+	answer_request(conn_fd, &req);
+
+	return;
+}
+
+
+/*************************************************************
+ * Read in a request. The input data stream consists of the
+ * login id, password, service name and user realm as counted
+ * length strings. Rather than reading each count and string
+ * on its own, whatever the client sent is pulled in with as
+ * few reads as it allows, the connection is hung up after
+ * the reply anyway. Return 0 if everything went ok, 1 if the
+ * request was bogus and deserves a "NO", -1 if the client
+ * went away or the data couldn't be read.
+ **************************************************************/
+int rx_request(int conn_fd, struct request *req) {
+
+	size_t			len;                       /* bytes of the frame read so far         */
+	size_t			off[4];                    /* offsets of the strings in the frame    */
+	unsigned short		count[4];                  /* lengths of the strings                 */
+	ssize_t			bytesio;                   /* bytes read                             */
+	int			frame_len;                 /* length of the frame, see scan_request  */
+	int			rc;
+
+
+	len = 0;
+
+	while ((frame_len = scan_request(req->frame, len, 0, off, count)) == 0) {
+		bytesio = read(conn_fd, req->frame + len, REQ_FRAME_LEN - len);
+
+		if (bytesio < 0 && errno == EINTR)
+			continue;
+
+		if (bytesio < 0) {
+			rc = errno;
+			logger(L_ERR, L_FUNC, "read failure");
+			logger(L_ERR, L_FUNC, "read: %s", strerror(rc));
+			return -1;
+		}
+
+		if (bytesio == 0)
+			return -1;
+
+		len += bytesio;
+	}
+
+	if (frame_len < 0)
+		return 1;
+
+	parse_request(req, 0, off, count);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Walk the counted length strings of a request frame starting
+ * at start, of which the first len bytes are in. Fill in the
+ * offsets and lengths of the four strings, and return the
+ * length of the frame once it's complete, 0 if more of it is
+ * needed, or -1 if a string is longer than MAX_REQ_LEN.
+ **************************************************************/
+int scan_request(const char *frame, size_t len, size_t start, size_t *off, unsigned short *count) {
+
+	static const char	*what[] = { "login", "password", "service", "realm" };
+	unsigned short		ncount;                    /* input data byte count, network         */
+	size_t			pos;                       /* start of the next count                */
+	int			i;
+
+
+	pos = start;
+
+	for (i = 0; i < 4; i++) {
+		if (len < pos + sizeof(ncount))
+			return 0;
+
+		memcpy(&ncount, frame + pos, sizeof(ncount));
+		count[i] = ntohs(ncount);
+
+		if (count[i] > MAX_REQ_LEN) {
+			logger(L_ERR, L_FUNC, "%s exceeded MAX_REQ_LEN: %d", what[i], MAX_REQ_LEN);
+			return -1;
+		}
+
+		off[i] = pos + sizeof(ncount);
+		pos = off[i] + count[i];
+	}
+
+	if (len < pos)
+		return 0;
+
+	return (int)pos;
+}
+
+
+/*************************************************************
+ * Point the strings of a request at the counted length strings
+ * scan_request() found in its frame, the tag (if start leaves
+ * room for one) being the first bytes. The strings are NUL
+ * terminated where they lie, the NUL going over the count of
+ * the next string, which has been looked at already.
+ **************************************************************/
+void parse_request(struct request *req, size_t start, const size_t *off, const unsigned short *count) {
+
+	int			i;
+
+
+	memcpy(&req->tag, req->frame, start);
+
+	req->login = req->frame + off[0];
+	req->password = req->frame + off[1];
+	req->service = req->frame + off[2];
+	req->realm = req->frame + off[3];
+
+	for (i = 0; i < 4; i++)
+		req->frame[off[i] + count[i]] = '\0';
+}
+
+
+/*************************************************************
+ * Pass a request off to do_auth() and hand back the response
+ * to send to the client. The caller is responsible for
+ * freeing the pointer, and for calling finish_request() once
+ * the response is sent. NULL is returned if the mechanism
+ * didn't come up with a response.
+ **************************************************************/
+char *process_request(int conn_fd, struct request *req, struct cache_result *lkup_result) {
+
+	char			*response;                 /* response to send to the client         */
+
+
+	memset((void *)lkup_result, 0, sizeof(struct cache_result));
+
+	/**************************************************************
+	 * An empty login with STATS_REQUEST as the password asks for
+	 * the server statistics rather than an authentication. They
+	 * are only handed out to root and saslauthd's own user.
+	 **************************************************************/
+	if (*req->login == '\0' && strcmp(req->password, STATS_REQUEST) == 0) {
+		if (!peer_may_stat(conn_fd)) {
+			logger(L_ERR, L_FUNC, "statistics request from an unprivileged client refused");
+			return strdup("NO statistics not available");
+		}
+
+		return stats_report();
+	}
+
+	/**************************************************************
+ 	 * We don't allow NULL passwords or login names
+	 **************************************************************/
+	if (*req->login == '\0') {
+		logger(L_ERR, L_FUNC, "NULL login received");
+		return strdup("NO NULL login received");
+	}	
+	
+	if (*req->password == '\0') {
+		logger(L_ERR, L_FUNC, "NULL password received");
+		return strdup("NO NULL password received");
+	}	
+
+	/**************************************************************
+	 * Get the mechanism response from do_auth().
+	 **************************************************************/
+	response = do_auth(req->login, req->password, req->service, req->realm, lkup_result);
+
+	return response;
+}
+
+
+/*************************************************************
+ * Wrap up a request after its response went out: carry out
+ * the cache refresh do_auth() may have asked for, and wipe
+ * the password.
+ **************************************************************/
+void finish_request(struct request *req, struct cache_result *lkup_result) {
+
+	do_refresh(req->login, req->password, req->service, req->realm, lkup_result);
+
+	memset(req->password, 0, strlen(req->password));
+
+	return;
+}
+
+
+/*************************************************************
+ * Tell whether the client on the other end of a connection
+ * may have the server statistics, that is whether it runs
+ * as root or as the user saslauthd runs as. Return 1 if so,
+ * 0 if not or if the client's credentials can't be had.
+ **************************************************************/
+int peer_may_stat(int conn_fd) {
+
+#if defined(HAVE_GETPEEREID)
+	uid_t			uid;                       /* client's effective uid                 */
+	gid_t			gid;
+
+	if (getpeereid(conn_fd, &uid, &gid) != 0) {
+		logger(L_ERR, L_FUNC, "getpeereid: %s", strerror(errno));
+		return 0;
+	}
+
+	return (uid == 0 || uid == geteuid());
+#elif defined(SO_PEERCRED)
+	struct ucred		cred;                      /* client's credentials                   */
+	socklen_t		len = sizeof(cred);
+
+	if (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		logger(L_ERR, L_FUNC, "getsockopt(SO_PEERCRED): %s", strerror(errno));
+		return 0;
+	}
+
+	return (cred.uid == 0 || cred.uid == geteuid());
+#else
+	return 0;
+#endif
+}
+
+
+/*************************************************************
+ * Get the response to a request and send it back as a
+ * counted length string.
+ **************************************************************/
+void answer_request(int conn_fd, struct request *req) {
+
+	char			*response;                 /* response to send to the client         */
+	struct cache_result	lkup_result;               /* cache lookup, see do_auth()            */
+
+
+	response = process_request(conn_fd, req, &lkup_result);
+
+	if (response == NULL) {
+		send_no(conn_fd, "NULL response from mechanism");
+		finish_request(req, &lkup_result);
+		return;
+	}	
+
+	if (tx_string(conn_fd, response, strlen(response)) == 0 && (flags & VERBOSE))
+		logger(L_DEBUG, L_FUNC, "response: %s", response);
+
+	free(response);
+
+	finish_request(req, &lkup_result);
+
+	return;
+}
+
+
+/*************************************************************
+ * In case something went out to lunch while reading in the
+ * request data, we may want to attempt to send out a default 
+ * "NO" response on the socket. The mesg is optional.
+ **************************************************************/
+void send_no(int conn_fd, char *mesg) {
+	char		buff[1024];
+
+	buff[0] = 'N';
+	buff[1] = 'O';
+	buff[2] = ' ';
+
+	/* buff, except for the trailing NUL and 'NO ' */
+	strncpy(buff + 3, mesg, sizeof(buff) - 1 - 3);
+	buff[1023] = '\0';
+
+	if (tx_string(conn_fd, buff, strlen(buff)) != 0)
+		return;
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "response: %s", buff);
+	
+	return;	
+}
+
+
+/*************************************************************
+ * Send out a counted length string, the count and the string
+ * in a single writev(). Return 0 if it all went out, -1
+ * otherwise.
+ **************************************************************/
+int tx_string(int conn_fd, const char *str, unsigned short count) {
+
+	unsigned short		ncount;                    /* output data byte count, network        */
+	struct iovec		iov[2];                    /* count and string                       */
+	int			rc;
+
+
+	ncount = htons(count);
+
+	iov[0].iov_base = (void *)&ncount;
+	iov[0].iov_len = sizeof(ncount);
+	iov[1].iov_base = (void *)str;
+	iov[1].iov_len = count;
+
+	if (retry_writev(conn_fd, iov, 2) != (int)(sizeof(ncount) + count)) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "write failure");
+		logger(L_ERR, L_FUNC, "writev: %s", strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Attempt to get a write lock on the accept lock file.
+ * Return 0 if everything went ok, return -1 if something bad
+ * happened. This function is expected to block.
+ **************************************************************/
+int get_accept_lock() {
+
+	struct flock    lock_st;
+	int             rc;
+
+
+#ifdef USE_EPOLL_EXCLUSIVE
+	if (flags & USE_EXCL_ACCEPT)
+		return excl_accept_wait();
+#endif
+
+	if (!(flags & USE_ACCEPT_LOCK))
+		return 0;
+
+	lock_st.l_type = F_WRLCK;
+	lock_st.l_start = 0;
+	lock_st.l_whence = SEEK_SET;
+	lock_st.l_len = 1;
+
+	errno = 0;
+
+	do {
+		rc = fcntl(accept_fd, F_SETLKW, &lock_st);
+	} while (rc != 0 && errno == EINTR);
+
+	if (rc != 0) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not acquire accept lock");
+		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
+		return -1;
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "acquired accept lock");
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Attempt to release the write lock on the accept lock file.
+ * Return 0 if everything went ok, return -1 if something bad
+ * happened.
+ **************************************************************/
+int rel_accept_lock() {
+
+	struct flock    lock_st;
+	int             rc;
+
+
+	if (!(flags & USE_ACCEPT_LOCK))
+		return 0;
+
+	lock_st.l_type = F_UNLCK;
+	lock_st.l_start = 0;
+	lock_st.l_whence = SEEK_SET;
+	lock_st.l_len = 1;
+
+	errno = 0;
+
+	do {
+		rc = fcntl(accept_fd, F_SETLKW, &lock_st);
+	} while (rc != 0 && errno == EINTR);
+
+	if (rc != 0) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not release accept lock");
+		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
+		return -1;
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "released accept lock");
+
+	return 0;
+}
+
+
+
+#ifdef USE_EPOLL_EXCLUSIVE
+/*************************************************************
+ * Register the listening socket with an epoll set of our own.
+ * This has to happen in every (forked) process, a shared set
+ * would only ever count as a single waiter.
+ **************************************************************/
+void excl_accept_init() {
+
+	int			rc;
+	struct epoll_event	ev;
+
+
+	if ((excl_fd = epoll_create(1)) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create epoll set");
+		logger(L_ERR, L_FUNC, "epoll_create: %s", strerror(rc));
+		exit(1);
+	}
+
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.fd = sock_fd;
+
+	if (epoll_ctl(excl_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not watch socket: %s", sock_file);
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		exit(1);
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "using exclusive epoll wakeups for accept()");
+}
+
+
+/*************************************************************
+ * Wait until the kernel picks us to accept a connection. 
+ * Return 0 if everything went ok, return -1 if something bad
+ * happened. This function is expected to block.
+ **************************************************************/
+int excl_accept_wait() {
+
+	int			rc;
+	struct epoll_event	ev;
+
+
+	do {
+		rc = epoll_wait(excl_fd, &ev, 1, -1);
+	} while (rc == -1 && errno == EINTR);
+
+	if (rc == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not wait for connections");
+		logger(L_ERR, L_FUNC, "epoll_wait: %s", strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* USE_EPOLL_EXCLUSIVE */
+
 
 #endif /* USE_UNIX_IPC */
@@ -86,6 +86,17 @@ static int lak_escape(const char *, const unsigned int, char **);
 static int lak_tokenize_domains(const char *, int, char **);
 static int lak_expand_tokens(const char *, const char *, const char *, const char *, const char *, char **);
 static int lak_connect(LAK *);
+static int lak_result(LAK *, int, LDAPMessage **);
+static int lak_search(LAK *, const char *, int, const char *, const char **, LDAPMessage **);
+static int lak_pool_server(LAK_POOL *, time_t);
+static LAK *lak_pool_get(LAK_POOL *);
+static void lak_pool_put(LAK_POOL *, LAK *, int);
+static int lak_cache_key(char *, const char *, const char *, const char *, const char *, const char *);
+static int lak_cache_get(LAK_POOL *, const char *, char **, int *);
+static void lak_cache_put(LAK_POOL *, const char *, const char *, int);
+static void lak_cache_drop(LAK_POOL *, const char *);
+static void lak_cache_free(LAK_CACHE_ENTRY *);
+static int lak_user_dn(LAK *, const char *, const char *, const char *, char **, int *);
 static int lak_bind(LAK *, LAK_USER *);
 static void lak_unbind(LAK *);
 static int lak_auth_custom(LAK *, const char *, const char *, const char *, const char *);
@@ -316,8 +327,29 @@ static int lak_config_read(
 
 		else if (!strcasecmp(key, "ldap_debug"))
 			conf->debug = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_pool_size"))
+			conf->pool_size = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_retry_interval"))
+			conf->retry_interval = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_idle_timeout"))
+			conf->idle_timeout = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_cache_ttl"))
+			conf->cache_ttl = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_cache_size"))
+			conf->cache_size = lak_config_int(p);
 	}
 
+	if (conf->cache_size < 1)
+		conf->cache_ttl = 0;
+
+	if (conf->pool_size < 1)
+		conf->pool_size = 1;
+
 	if (conf->version != LDAP_VERSION3 && 
 	    (conf->use_sasl ||
 	     conf->start_tls))
@@ -393,6 +425,11 @@ static int lak_config(
 	conf->restart = 1;
 	conf->start_tls = 0;
 	conf->use_sasl = 0;
+	conf->pool_size = LAK_POOL_SIZE;
+	conf->retry_interval = LAK_RETRY_INTERVAL;
+	conf->idle_timeout = 0;
+	conf->cache_ttl = 0;
+	conf->cache_size = LAK_CACHE_SIZE;
 
 	strlcpy(conf->path, configfile, LAK_PATH_LEN);
 
@@ -703,52 +740,124 @@ static int lak_expand_tokens(
 
 int lak_init(
 	const char *configfile, 
-	LAK **ret) 
+	LAK_POOL **ret) 
 {
-	LAK *lak;
-	int rc;
+	LAK_POOL *pool;
+	LAK_CONF *conf = NULL;
+	char servers[LAK_URL_LEN];
+	char *p, *last;
+	int rc, i;
 
-	lak = *ret;
+	pool = *ret;
 
-	if (lak != NULL) {
+	if (pool != NULL) {
 		return LAK_OK;
 	}
 
-	lak = (LAK *)malloc(sizeof(LAK));
-	if (lak == NULL)
+	rc = lak_config(configfile, &conf);
+	if (rc != LAK_OK)
+		return rc;
+
+	pool = (LAK_POOL *)malloc(sizeof(LAK_POOL));
+	if (pool == NULL) {
+		lak_config_free(conf);
 		return LAK_NOMEM;
+	}
 
-	lak->status=LAK_NOT_BOUND;
-	lak->ld=NULL;
-	lak->conf=NULL;
-	lak->user=NULL;
+	memset(pool, 0, sizeof(LAK_POOL));
+	pool->conf = conf;
 
-	rc = lak_config(configfile, &lak->conf);
-	if (rc != LAK_OK) {
-		free(lak);
-		return rc;
+	/* Every URL in ldap_servers gets its own connections, so that
+	   requests can be spread over them and a dead one skipped. */
+	strlcpy(servers, conf->servers, LAK_URL_LEN);
+	for (p = strtok_r(servers, " \t", &last); p != NULL;
+	     p = strtok_r(NULL, " \t", &last))
+		pool->servers++;
+
+	if (pool->servers == 0) {
+		syslog(LOG_ERR|LOG_AUTH, "No ldap_servers configured.");
+		free(pool);
+		lak_config_free(conf);
+		return LAK_FAIL;
+	}
+
+	pool->server = (LAK_SERVER *)calloc(pool->servers, sizeof(LAK_SERVER));
+	pool->conn = (LAK *)calloc(conf->pool_size, sizeof(LAK));
+	if (pool->server == NULL || pool->conn == NULL) {
+		free(pool->server);
+		free(pool->conn);
+		free(pool);
+		lak_config_free(conf);
+		return LAK_NOMEM;
 	}
 
+	strlcpy(servers, conf->servers, LAK_URL_LEN);
+	for (i = 0, p = strtok_r(servers, " \t", &last); p != NULL;
+	     i++, p = strtok_r(NULL, " \t", &last))
+		strlcpy(pool->server[i].url, p, LAK_URL_LEN);
+
+	if (conf->cache_ttl > 0) {
+		pool->cache = (LAK_CACHE_ENTRY *)calloc(conf->cache_size, sizeof(LAK_CACHE_ENTRY));
+		if (pool->cache == NULL) {
+			free(pool->server);
+			free(pool->conn);
+			free(pool);
+			lak_config_free(conf);
+			return LAK_NOMEM;
+		}
+		pool->cache_size = conf->cache_size;
+	}
+
+	pool->conns = conf->pool_size;
+	for (i = 0; i < pool->conns; i++) {
+		pool->conn[i].status = LAK_NOT_BOUND;
+		pool->conn[i].conf = conf;
+		pool->conn[i].pool = pool;
+		pool->conn[i].server = -1;
+	}
+
+#ifdef LAK_THREADS
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+#endif
+
 #ifdef HAVE_OPENSSL
 	OpenSSL_add_all_digests();
 #endif
 
-	*ret=lak;
+	*ret=pool;
 	return LAK_OK;
 }
 
 void lak_close(
-	LAK *lak) 
+	LAK_POOL *pool) 
 {
+	int i;
 
-	if (lak == NULL)
+	if (pool == NULL)
 		return;
 
-	lak_config_free(lak->conf);
+	for (i = 0; i < pool->conns; i++)
+		lak_unbind(&pool->conn[i]);
+
+	if (pool->cache != NULL) {
+		syslog(LOG_INFO|LOG_AUTH, "LDAP cache: %lu hits, %lu misses, %lu expired, %lu invalidated.",
+		       pool->cache_hits, pool->cache_misses, pool->cache_expired, pool->cache_invalidated);
+		for (i = 0; i < pool->cache_size; i++)
+			lak_cache_free(&pool->cache[i]);
+		free(pool->cache);
+	}
+
+#ifdef LAK_THREADS
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+#endif
 
-	lak_unbind(lak);
+	lak_config_free(pool->conf);
 
-	free(lak);
+	free(pool->conn);
+	free(pool->server);
+	free(pool);
 
 #ifdef HAVE_OPENSSL
 	EVP_cleanup();
@@ -762,6 +871,7 @@ static int lak_connect(
 {
 	int rc = 0;
 	char *p = NULL;
+	const char *url;
 
 	if (ISSET(lak->conf->tls_cacert_file)) {
 		rc = ldap_set_option (NULL, LDAP_OPT_X_TLS_CACERTFILE, lak->conf->tls_cacert_file);
@@ -806,12 +916,16 @@ static int lak_connect(
 		}
 	}
 
-	rc = ldap_initialize(&lak->ld, lak->conf->servers);
+	url = lak->pool->server[lak->server].url;
+
+	rc = ldap_initialize(&lak->ld, url);
 	if (rc != LDAP_SUCCESS) {
-		syslog(LOG_ERR|LOG_AUTH, "ldap_initialize failed (%s)", lak->conf->servers);
+		syslog(LOG_ERR|LOG_AUTH, "ldap_initialize failed (%s)", url);
 		return LAK_CONNECT_FAIL;
 	}
 
+	lak->opened = time(NULL);
+
 	if (lak->conf->debug) {
 		rc = ldap_set_option(NULL, LDAP_OPT_DEBUG_LEVEL, &(lak->conf->debug));
 		if (rc != LDAP_OPT_SUCCESS)
@@ -1076,8 +1190,17 @@ static int lak_bind(
 			LDAP_SASL_QUIET, 
 			lak_sasl_interact, 
 			user);
-	else
-		rc = ldap_simple_bind_s(lak->ld, user->bind_dn, user->password);
+	else {
+		struct berval cred;
+		int msgid;
+
+		cred.bv_val = user->password;
+		cred.bv_len = strlen(user->password);
+
+		rc = ldap_sasl_bind(lak->ld, user->bind_dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &msgid);
+		if (rc == LDAP_SUCCESS)
+			rc = lak_result(lak, msgid, NULL);
+	}
 
 	switch (rc) {
 		case LDAP_SUCCESS:
@@ -1124,6 +1247,232 @@ static void lak_unbind(
 	return;
 }
 
+/*
+ * The DN and group membership cache (ldap_cache_ttl).  Entries are direct
+ * mapped by a hash of their key; a colliding entry replaces the older one.
+ * Only lookups that completed are stored, never errors or timeouts.
+ */
+static int lak_cache_key(
+	char *key,
+	const char *kind,
+	const char *user,
+	const char *service,
+	const char *realm,
+	const char *dn)
+{
+	int n;
+
+	n = snprintf(key, LAK_CACHE_KEY_LEN, "%s\001%s\001%s\001%s\001%s", kind,
+		     user, ISSET(service) ? service : "", ISSET(realm) ? realm : "",
+		     ISSET(dn) ? dn : "");
+	if (n < 0 || n >= LAK_CACHE_KEY_LEN)
+		return LAK_FAIL;
+
+	return LAK_OK;
+}
+
+static unsigned int lak_cache_hash(
+	const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *key; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static void lak_cache_free(
+	LAK_CACHE_ENTRY *entry)
+{
+	if (entry->key)
+		free(entry->key);
+	if (entry->dn)
+		free(entry->dn);
+
+	memset(entry, 0, sizeof(LAK_CACHE_ENTRY));
+
+	return;
+}
+
+static int lak_cache_get(
+	LAK_POOL *pool,
+	const char *key,
+	char **dn,
+	int *verdict)
+{
+	LAK_CACHE_ENTRY *entry;
+	unsigned int hash;
+	time_t now;
+	int rc = LAK_FAIL;
+
+	if (pool->cache == NULL)
+		return LAK_FAIL;
+
+	hash = lak_cache_hash(key);
+	now = time(NULL);
+
+#ifdef LAK_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	entry = &pool->cache[hash % pool->cache_size];
+	if (entry->key != NULL && entry->hash == hash && !strcmp(entry->key, key)) {
+		if (entry->expires <= now) {
+			pool->cache_expired++;
+			lak_cache_free(entry);
+		} else if (dn == NULL ||
+			   (entry->dn != NULL && (*dn = strdup(entry->dn)) != NULL)) {
+			if (verdict)
+				*verdict = entry->verdict;
+			rc = LAK_OK;
+		}
+	}
+
+	if (rc == LAK_OK)
+		pool->cache_hits++;
+	else
+		pool->cache_misses++;
+
+	if ((pool->cache_hits + pool->cache_misses) % LAK_CACHE_REPORT == 0)
+		syslog(LOG_INFO|LOG_AUTH, "LDAP cache: %lu hits, %lu misses, %lu expired, %lu invalidated.",
+		       pool->cache_hits, pool->cache_misses, pool->cache_expired, pool->cache_invalidated);
+
+#ifdef LAK_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return rc;
+}
+
+static void lak_cache_put(
+	LAK_POOL *pool,
+	const char *key,
+	const char *dn,
+	int verdict)
+{
+	LAK_CACHE_ENTRY *entry, new;
+
+	if (pool->cache == NULL)
+		return;
+
+	memset(&new, 0, sizeof(LAK_CACHE_ENTRY));
+	new.hash = lak_cache_hash(key);
+	new.expires = time(NULL) + pool->conf->cache_ttl;
+	new.verdict = verdict;
+	new.key = strdup(key);
+	if (dn)
+		new.dn = strdup(dn);
+	if (new.key == NULL || (dn && new.dn == NULL)) {
+		lak_cache_free(&new);
+		return;
+	}
+
+#ifdef LAK_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	entry = &pool->cache[new.hash % pool->cache_size];
+	lak_cache_free(entry);
+	*entry = new;
+
+#ifdef LAK_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return;
+}
+
+static void lak_cache_drop(
+	LAK_POOL *pool,
+	const char *key)
+{
+	LAK_CACHE_ENTRY *entry;
+	unsigned int hash;
+
+	if (pool->cache == NULL)
+		return;
+
+	hash = lak_cache_hash(key);
+
+#ifdef LAK_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	entry = &pool->cache[hash % pool->cache_size];
+	if (entry->key != NULL && entry->hash == hash && !strcmp(entry->key, key)) {
+		pool->cache_invalidated++;
+		lak_cache_free(entry);
+	}
+
+#ifdef LAK_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return;
+}
+
+/*
+ * lak_result - wait for the result of an operation started with one of
+ * the asynchronous calls and return its result code.  An operation that
+ * doesn't complete within ldap_timeout is abandoned, so that a server
+ * that stopped answering costs one timeout and not a stalled process.
+ */
+static int lak_result(
+	LAK *lak,
+	int msgid,
+	LDAPMessage **ret)
+{
+	struct timeval tv;
+	LDAPMessage *res = NULL;
+	int rc, err;
+
+	tv = lak->conf->timeout;
+
+	rc = ldap_result(lak->ld, msgid, LDAP_MSG_ALL, &tv, &res);
+	if (rc == 0) {
+		ldap_abandon_ext(lak->ld, msgid, NULL, NULL);
+		lak->timedout = 1;
+		return LDAP_TIMEOUT;
+	}
+
+	if (rc == -1) {
+		if (ldap_get_option(lak->ld, LDAP_OPT_ERROR_NUMBER, &err) != LDAP_OPT_SUCCESS)
+			err = LDAP_SERVER_DOWN;
+		return err;
+	}
+
+	rc = ldap_parse_result(lak->ld, res, &err, NULL, NULL, NULL, NULL, 0);
+	if (rc != LDAP_SUCCESS)
+		err = rc;
+
+	if (ret)
+		*ret = res;
+	else
+		ldap_msgfree(res);
+
+	return err;
+}
+
+static int lak_search(
+	LAK *lak,
+	const char *search_base,
+	int scope,
+	const char *filter,
+	const char **attrs,
+	LDAPMessage **res)
+{
+	int rc, msgid;
+
+	rc = ldap_search_ext(lak->ld, search_base, scope, filter, (char **) attrs, 0, NULL, NULL, NULL, lak->conf->size_limit, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+
+	return lak_result(lak, msgid, res);
+}
+
 /* 
  * lak_retrieve - retrieve user@realm values specified by 'attrs'
  */
@@ -1180,7 +1529,7 @@ int lak_retrieve(
 	if (rc != LAK_OK)
         goto done;
 
-	rc = ldap_search_st(lak->ld, search_base, lak->conf->scope, filter, (char **) attrs, 0, &(lak->conf->timeout), &res);
+	rc = lak_search(lak, search_base, lak->conf->scope, filter, attrs, &res);
 	switch (rc) {
 		case LDAP_SUCCESS:
 		case LDAP_NO_SUCH_OBJECT:
@@ -1191,13 +1540,13 @@ int lak_retrieve(
 		case LDAP_INSUFFICIENT_ACCESS:
 			/*  We do not need to re-connect to the LDAP server 
 			    under these conditions */
-			syslog(LOG_ERR|LOG_AUTH, "user ldap_search_st() failed: %s", ldap_err2string(rc));
+			syslog(LOG_ERR|LOG_AUTH, "user ldap_search_ext() failed: %s", ldap_err2string(rc));
             rc = LAK_USER_NOT_FOUND;
 			goto done;
 		case LDAP_TIMEOUT:
 		case LDAP_SERVER_DOWN:
 		default:
-			syslog(LOG_ERR|LOG_AUTH, "user ldap_search_st() failed: %s", ldap_err2string(rc));
+			syslog(LOG_ERR|LOG_AUTH, "user ldap_search_ext() failed: %s", ldap_err2string(rc));
             rc = LAK_RETRY;
 			lak->status = LAK_NOT_BOUND;
 			goto done;
@@ -1276,6 +1625,51 @@ done:;
 	return rc;
 }
 
+/*
+ * lak_user_dn - find the DN of user@realm, from the cache when it is on.
+ * 'cached' tells the caller whether the DN may be stale.
+ */
+static int lak_user_dn(
+	LAK *lak,
+	const char *user,
+	const char *service,
+	const char *realm,
+	char **ret,
+	int *cached)
+{
+	char key[LAK_CACHE_KEY_LEN];
+	LAK_RESULT *lres = NULL;
+	const char *attrs[] = { dn_attr, NULL };
+	int rc, keyed;
+
+	*ret = NULL;
+	if (cached)
+		*cached = 0;
+
+	keyed = (lak->pool->cache != NULL &&
+		 lak_cache_key(key, "dn", user, service, realm, NULL) == LAK_OK);
+
+	if (keyed && lak_cache_get(lak->pool, key, ret, NULL) == LAK_OK) {
+		if (cached)
+			*cached = 1;
+		return LAK_OK;
+	}
+
+	rc = lak_retrieve(lak, user, service, realm, attrs, &lres);
+	if (rc != LAK_OK)
+		return rc;
+
+	*ret = strdup(lres->value);
+	lak_result_free(lres);
+	if (*ret == NULL)
+		return LAK_NOMEM;
+
+	if (keyed)
+		lak_cache_put(lak->pool, key, *ret, LAK_OK);
+
+	return LAK_OK;
+}
+
 static int lak_group_member(
 	LAK *lak, 
 	const char *user, 
@@ -1287,13 +1681,21 @@ static int lak_group_member(
     char *group_filter = NULL;
     char *group_search_base = NULL;
 	struct berval *dn_bv = NULL;
-	int rc;
-    LAK_RESULT *lres = NULL;
-    const char *attrs[] = { dn_attr, NULL };
+	struct berval dn_val;
+	int rc, msgid;
+    char *found_dn = NULL;
     const char *group_attrs[] = {"1.1", NULL};
+    char key[LAK_CACHE_KEY_LEN];
+    int keyed, cacheable = 0;
 
 	LDAPMessage *res = NULL;
 
+    keyed = (lak->pool->cache != NULL &&
+             lak_cache_key(key, "group", user, service, realm, dn) == LAK_OK);
+
+    if (keyed && lak_cache_get(lak->pool, key, NULL, &rc) == LAK_OK)
+        return rc;
+
     user_dn = (char *)dn;
 
     if (EMPTY(user_dn)) {
@@ -1315,11 +1717,11 @@ static int lak_group_member(
 
         } else {
             
-            rc = lak_retrieve(lak, user, service, realm, attrs, &lres);
+            rc = lak_user_dn(lak, user, service, realm, &found_dn, NULL);
             if (rc != LAK_OK)
                 goto done;
 
-            user_dn = lres->value;
+            user_dn = found_dn;
         }
     }
 
@@ -1329,8 +1731,16 @@ static int lak_group_member(
             if (rc != LAK_OK)
                 goto done;
 
-            rc = ((ldap_compare_s(lak->ld, group_dn, lak->conf->group_attr, user_dn)) == LDAP_COMPARE_TRUE ? 
-                     LAK_OK : LAK_NOT_GROUP_MEMBER);
+            dn_val.bv_val = user_dn;
+            dn_val.bv_len = strlen(user_dn);
+
+            rc = ldap_compare_ext(lak->ld, group_dn, lak->conf->group_attr, &dn_val, NULL, NULL, &msgid);
+            if (rc == LDAP_SUCCESS)
+                rc = lak_result(lak, msgid, NULL);
+
+            cacheable = (rc == LDAP_COMPARE_TRUE || rc == LDAP_COMPARE_FALSE);
+
+            rc = (rc == LDAP_COMPARE_TRUE ? LAK_OK : LAK_NOT_GROUP_MEMBER);
 
     } else if (lak->conf->group_match_method == LAK_GROUP_MATCH_METHOD_FILTER) {
 
@@ -1342,7 +1752,7 @@ static int lak_group_member(
         if (rc != LAK_OK)
             goto done;
 
-        rc = ldap_search_st(lak->ld, group_search_base, lak->conf->group_scope, group_filter, (char **) group_attrs, 0, &(lak->conf->timeout), &res);
+        rc = lak_search(lak, group_search_base, lak->conf->group_scope, group_filter, group_attrs, &res);
         switch (rc) {
             case LDAP_SUCCESS:
             case LDAP_NO_SUCH_OBJECT:
@@ -1351,19 +1761,20 @@ static int lak_group_member(
             case LDAP_BUSY:
             case LDAP_UNAVAILABLE:
             case LDAP_INSUFFICIENT_ACCESS:
-                syslog(LOG_ERR|LOG_AUTH, "group ldap_search_st() failed: %s", ldap_err2string(rc));
+                syslog(LOG_ERR|LOG_AUTH, "group ldap_search_ext() failed: %s", ldap_err2string(rc));
                 rc = LAK_NOT_GROUP_MEMBER;
                 goto done;
             case LDAP_TIMEOUT:
             case LDAP_SERVER_DOWN:
             default:
-                syslog(LOG_ERR|LOG_AUTH, "group ldap_search_st() failed: %s", ldap_err2string(rc));
+                syslog(LOG_ERR|LOG_AUTH, "group ldap_search_ext() failed: %s", ldap_err2string(rc));
                 rc = LAK_RETRY;
                 lak->status = LAK_NOT_BOUND;
                 goto done;
         }
 
         rc = ( (ldap_count_entries(lak->ld, res) >= 1) ? LAK_OK : LAK_NOT_GROUP_MEMBER );
+        cacheable = 1;
 
     } else {
 
@@ -1381,11 +1792,14 @@ done:;
         free(group_filter);
     if (group_search_base)
         free(group_search_base);
-    if (lres)
-        lak_result_free(lres);
+    if (found_dn)
+        free(found_dn);
     if (dn_bv)
         ber_bvfree(dn_bv);
 
+    if (keyed && cacheable)
+        lak_cache_put(lak->pool, key, NULL, rc);
+
 	return rc;
 }
 
@@ -1424,16 +1838,16 @@ static int lak_auth_bind(
 	const char *password) 
 {
     LAK_USER *lu = NULL;
-	LAK_RESULT *dn = NULL;
-	int rc;
-	const char *attrs[] = {dn_attr, NULL};
+	char *dn = NULL, *stale = NULL;
+	char key[LAK_CACHE_KEY_LEN];
+	int rc, cached;
 
-	rc = lak_retrieve(lak, user, service, realm, attrs, &dn);
+	rc = lak_user_dn(lak, user, service, realm, &dn, &cached);
 	if (rc != LAK_OK)
 		goto done;
 
 	rc = lak_user(	
-		dn->value,
+		dn,
 		NULL,
 		NULL,
 		NULL,
@@ -1445,16 +1859,42 @@ static int lak_auth_bind(
 
 	rc = lak_bind(lak, lu);
 
+	/* A cached DN goes stale when the entry is moved or renamed.  Look
+	   it up again, and only bind a second time if it did change. */
+	if (rc == LAK_BIND_FAIL && cached &&
+	    lak_cache_key(key, "dn", user, service, realm, NULL) == LAK_OK) {
+		lak_cache_drop(lak->pool, key);
+
+		stale = dn;
+		rc = lak_user_dn(lak, user, service, realm, &dn, NULL);
+		if (rc != LAK_OK)
+			goto done;
+
+		if (!strcmp(dn, stale)) {
+			rc = LAK_BIND_FAIL;
+			goto done;
+		}
+
+		lak_user_free(lu);
+		rc = lak_user(dn, NULL, NULL, NULL, NULL, password, &lu);
+		if (rc != LAK_OK)
+			goto done;
+
+		rc = lak_bind(lak, lu);
+	}
+
 	if ( rc == LAK_OK &&
 	    (ISSET(lak->conf->group_dn) ||
          ISSET(lak->conf->group_filter)) )
-		rc = lak_group_member(lak, user, service, realm, dn->value);
+		rc = lak_group_member(lak, user, service, realm, dn);
 
 done:;
 	if (lu)
 		lak_user_free(lu);
 	if (dn)
-		lak_result_free(dn);
+		free(dn);
+	if (stale)
+		free(stale);
 
 	return rc;
 }
@@ -1514,8 +1954,157 @@ done:;
 	return rc;
 }
 
-int lak_authenticate(
+/*
+ * lak_pool_server - pick the server for the next request: the one with
+ * the fewest requests in flight among those not marked down, round robin
+ * between equals.  When all of them are down, the one that failed
+ * longest ago is tried, which is also how a server comes back.
+ */
+static int lak_pool_server(
+	LAK_POOL *pool,
+	time_t now)
+{
+	int i, s, best = -1;
+
+	for (i = 0; i < pool->servers; i++) {
+		s = (pool->next + i) % pool->servers;
+		if (pool->server[s].down_until > now)
+			continue;
+		if (best == -1 ||
+		    pool->server[s].outstanding < pool->server[best].outstanding)
+			best = s;
+	}
+
+	if (best == -1) {
+		best = 0;
+		for (s = 1; s < pool->servers; s++)
+			if (pool->server[s].down_until < pool->server[best].down_until)
+				best = s;
+	}
+
+	pool->next = (best + 1) % pool->servers;
+
+	return best;
+}
+
+/*
+ * lak_pool_get - take a connection for one request.  An idle connection
+ * to the chosen server is preferred; failing that an unused slot is
+ * (re)pointed at it.  Without threads there is only ever one request in
+ * a process, so a free connection always exists.
+ */
+static LAK *lak_pool_get(
+	LAK_POOL *pool)
+{
+	LAK *lak, *spare;
+	time_t now;
+	int i, s, reopen;
+
+#ifdef LAK_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	for (;;) {
+		now = time(NULL);
+		s = lak_pool_server(pool, now);
+
+		lak = NULL;
+		spare = NULL;
+		for (i = 0; i < pool->conns; i++) {
+			if (pool->conn[i].in_use)
+				continue;
+			if (pool->conn[i].ld != NULL && pool->conn[i].server == s) {
+				lak = &pool->conn[i];
+				break;
+			}
+			if (spare == NULL ||
+			    (spare->ld != NULL && pool->conn[i].ld == NULL))
+				spare = &pool->conn[i];
+		}
+		if (lak == NULL)
+			lak = spare;
+		if (lak != NULL)
+			break;
+
+#ifdef LAK_THREADS
+		pthread_cond_wait(&pool->cond, &pool->lock);
+#else
+		syslog(LOG_ERR|LOG_AUTH, "No free LDAP connection.");
+		return NULL;
+#endif
+	}
+
+	/* A connection idle for longer than ldap_idle_timeout has likely
+	   been dropped by the server or a firewall on the way; open a new
+	   one rather than spend the request finding out. */
+	reopen = (lak->server != s) ||
+		 (lak->conf->idle_timeout > 0 &&
+		  now - lak->last_used > lak->conf->idle_timeout);
+
+	lak->in_use = 1;
+	lak->server = s;
+	lak->timedout = 0;
+	lak->checkout = now;
+	pool->server[s].outstanding++;
+
+#ifdef LAK_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	if (reopen && lak->ld != NULL)
+		lak_unbind(lak);
+
+	return lak;
+}
+
+/*
+ * lak_pool_put - return a connection after a request.  A timeout, or a
+ * failure on a connection opened for this request, marks its server
+ * down for ldap_retry_interval seconds; a retry on a connection that
+ * had been sitting idle is more likely a stale connection than a dead
+ * server.
+ */
+static void lak_pool_put(
+	LAK_POOL *pool,
 	LAK *lak,
+	int rc)
+{
+	LAK_SERVER *server;
+	time_t now;
+
+	now = time(NULL);
+
+#ifdef LAK_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	server = &pool->server[lak->server];
+	server->outstanding--;
+
+	if (lak->timedout ||
+	    (rc == LAK_RETRY && lak->opened >= lak->checkout)) {
+		if (server->down_until <= now && pool->servers > 1)
+			syslog(LOG_WARNING|LOG_AUTH,
+			       "LDAP server %s is not responding, failing over for %d seconds.",
+			       server->url, pool->conf->retry_interval);
+		server->down_until = now + pool->conf->retry_interval;
+	} else if (rc != LAK_RETRY && rc != LAK_CONNECT_FAIL) {
+		server->down_until = 0;
+	}
+
+	lak->in_use = 0;
+	lak->last_used = now;
+
+#ifdef LAK_THREADS
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return;
+}
+
+int lak_authenticate(
+	LAK_POOL *pool,
 	const char *user,
 	const char *service,
 	const char *realm,
@@ -1524,8 +2113,9 @@ int lak_authenticate(
 	int i;
 	int rc;
     int retry = 2;
+	LAK *lak;
 
-	if (lak == NULL) {
+	if (pool == NULL) {
 		syslog(LOG_ERR|LOG_AUTH, "lak_init did not run.");
 		return LAK_FAIL;
 	}
@@ -1534,13 +2124,18 @@ int lak_authenticate(
 		return LAK_FAIL;
 
 	if (EMPTY(realm))
-		realm = lak->conf->default_realm;
+		realm = pool->conf->default_realm;
 
 	for (i = 0; authenticator[i].method != -1; i++) {
-		if (authenticator[i].method == lak->conf->auth_method) {
+		if (authenticator[i].method == pool->conf->auth_method) {
 			if (authenticator[i].check) {
                 for (;retry > 0; retry--) {
+                    lak = lak_pool_get(pool);
+                    if (lak == NULL)
+                        return LAK_FAIL;
+
                     rc = (authenticator[i].check)(lak, user, service, realm, password);
+                    lak_pool_put(pool, lak, rc);
                     switch(rc) {
                         case LAK_OK:
                             return LAK_OK;
@@ -1567,7 +2162,7 @@ int lak_authenticate(
 	}
 
     /* Should not get here */
-    syslog(LOG_DEBUG|LOG_AUTH, "Authentication method not setup properly (%d)", lak->conf->auth_method);
+    syslog(LOG_DEBUG|LOG_AUTH, "Authentication method not setup properly (%d)", pool->conf->auth_method);
 
 	return LAK_FAIL;
 }
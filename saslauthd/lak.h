@@ -42,6 +42,14 @@
 # endif
 #endif
 
+/* libldap may only be used from several threads at once since
+ * OpenLDAP 2.5; older releases need libldap_r, which we don't link. */
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H) && \
+    defined(LDAP_VENDOR_VERSION) && LDAP_VENDOR_VERSION >= 20500
+# define LAK_THREADS
+# include <pthread.h>
+#endif
+
 #define LAK_OK 0
 #define LAK_FAIL -1
 #define LAK_NOMEM -2
@@ -67,6 +75,12 @@
 #define LAK_PATH_LEN 1024
 #define LAK_URL_LEN LAK_PATH_LEN
 
+#define LAK_POOL_SIZE 8
+#define LAK_RETRY_INTERVAL 30
+#define LAK_CACHE_SIZE 1024
+#define LAK_CACHE_KEY_LEN (LAK_DN_LEN * 2)
+#define LAK_CACHE_REPORT 1000	/* log the counters every N lookups */
+
 typedef struct lak_conf {
     char   path[LAK_PATH_LEN];
     char   servers[LAK_URL_LEN];
@@ -105,6 +119,11 @@ typedef struct lak_conf {
     char   tls_cert[LAK_PATH_LEN];
     char   tls_key[LAK_PATH_LEN];
     int    debug;
+    int    pool_size;
+    int    retry_interval;
+    int    idle_timeout;
+    int    cache_ttl;
+    int    cache_size;
 } LAK_CONF;
 
 typedef struct lak_user {
@@ -122,8 +141,50 @@ typedef struct lak {
     char      status;
     LAK_USER *user;
     LAK_CONF *conf;
+    struct lak_pool *pool;
+    int       server;		/* index into pool->server */
+    int       in_use;
+    int       timedout;		/* an operation was abandoned */
+    time_t    opened;		/* when lak_connect() last ran */
+    time_t    checkout;		/* when the current request took it */
+    time_t    last_used;
 } LAK;
 
+typedef struct lak_server {
+    char   url[LAK_URL_LEN];
+    int    outstanding;		/* requests currently using it */
+    time_t down_until;		/* skipped until then after a failure */
+} LAK_SERVER;
+
+/* A user DN (dn != NULL) or a group membership verdict, keyed by the
+ * request tokens that produced it. */
+typedef struct lak_cache_entry {
+    unsigned int hash;
+    time_t       expires;
+    char        *key;
+    char        *dn;
+    int          verdict;
+} LAK_CACHE_ENTRY;
+
+typedef struct lak_pool {
+    LAK_CONF   *conf;
+    LAK_SERVER *server;
+    int         servers;
+    int         next;		/* round robin cursor */
+    LAK        *conn;
+    int         conns;
+    LAK_CACHE_ENTRY *cache;
+    int         cache_size;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long cache_expired;
+    unsigned long cache_invalidated;
+#ifdef LAK_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+#endif
+} LAK_POOL;
+
 typedef struct lak_result {
     char              *attribute;
     char              *value;
@@ -131,9 +192,9 @@ typedef struct lak_result {
     struct lak_result *next;
 } LAK_RESULT;
 
-int lak_init(const char *, LAK **);
-void lak_close(LAK *);
-int lak_authenticate(LAK *, const char *, const char *, const char *, const char *);
+int lak_init(const char *, LAK_POOL **);
+void lak_close(LAK_POOL *);
+int lak_authenticate(LAK_POOL *, const char *, const char *, const char *, const char *);
 int lak_retrieve(LAK *, const char *, const char *, const char *, const char **, LAK_RESULT **);
 void lak_result_free(LAK_RESULT *);
 char *lak_error(const int errno);
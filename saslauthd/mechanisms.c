@@ -65,34 +65,34 @@
 authmech_t mechanisms[] =
 {
 #ifdef AUTH_SASLDB
-    {	"sasldb",	0,			auth_sasldb },
+    {	"sasldb",	0,			auth_sasldb,	0 },
 #endif /* AUTH_SASLDB */
 #ifdef AUTH_DCE
-    {	"dce",		0,			auth_dce },
+    {	"dce",		0,			auth_dce,	0 },
 #endif /* AUTH_DCE */
-    {	"getpwent",	0,			auth_getpwent },
+    {	"getpwent",	0,			auth_getpwent,	0 },
 #ifdef AUTH_KRB4
-    {	"kerberos4",	auth_krb4_init,		auth_krb4 },
+    {	"kerberos4",	auth_krb4_init,		auth_krb4,	0 },
 #endif /* AUTH_KRB4 */
 #ifdef AUTH_KRB5
-    {	"kerberos5",	auth_krb5_init,		auth_krb5 },
+    {	"kerberos5",	auth_krb5_init,		auth_krb5,	0 },
 #endif /* AUTH_KRB5 */
 #ifdef AUTH_PAM
-    {	"pam",		0,			auth_pam },
+    {	"pam",		0,			auth_pam,	MECH_THREADSAFE },
 #endif /* AUTH_PAM */
-    {	"rimap",	auth_rimap_init,	auth_rimap },
+    {	"rimap",	auth_rimap_init,	auth_rimap,	MECH_THREADSAFE },
 #ifdef AUTH_SHADOW
-    {	"shadow",	0,			auth_shadow },
+    {	"shadow",	auth_shadow_init,	auth_shadow,	0 },
 #endif /* AUTH_SHADOW */
 #ifdef AUTH_SIA
-    {   "sia",		0,			auth_sia },
+    {   "sia",		0,			auth_sia,	0 },
 #endif /* AUTH_SIA */
 #ifdef AUTH_LDAP
-    {   "ldap",		auth_ldap_init,		auth_ldap },
+    {   "ldap",		auth_ldap_init,		auth_ldap,	AUTH_LDAP_FLAGS },
 #endif /* AUTH_LDAP */
 #ifdef AUTH_HTTPFORM
-    {   "httpform",     auth_httpform_init,     auth_httpform },
+    {   "httpform",     auth_httpform_init,     auth_httpform,	MECH_THREADSAFE },
 #endif /* AUTH_LDAP */
-    {	0,		0,			0 }
+    {	0,		0,			0,		0 }
 };
 
@@ -42,8 +42,12 @@ typedef struct {
     char *(*authenticate)(const char *, const char *,
 			  const char *, const char *); /* authentication
 							  function */
+    int flags;				/* MECH_* capability bits */
 } authmech_t;
 
+/* authmech_t flags */
+#define MECH_THREADSAFE	(1 << 0)	/* authenticate() may run concurrently */
+
 extern authmech_t mechanisms[];		/* array of supported auth mechs */
 extern authmech_t *authmech;		/* auth mech daemon is using */
 /* END PUBLIC DEPENDENCIES */
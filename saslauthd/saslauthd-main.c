@@ -107,13 +107,25 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/uio.h>
+#include <sched.h>
 
 #include "globals.h"
 #include "saslauthd-main.h"
 #include "cache.h"
 #include "utils.h"
+#include "md5global.h"
+#include "saslauthd_md5.h"
+
+#ifdef USE_UNIX_EPOLL
+# include <pthread.h>
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
 
 /* max login + max realm + '@' */
 #define MAX_LOGIN_REALM_LEN (MAX_REQ_LEN * 2) + 1
@@ -123,6 +135,14 @@
  *****************************************/
 static void	show_version();
 static void	show_usage();
+static char	*auth_login(const char *, const char *, char *);
+static char	*auth_authenticate(const char *, const char *, const char *, const char *);
+static char	*auth_coalesce(const char *, const char *, const char *, const char *);
+static char	*auth_limit(const char *, const char *, const char *, const char *);
+static int	rate_allow(const char *, const char *);
+static char	*auth_answer(const char *, const char *, const char *, const char *, struct cache_result *);
+static unsigned long stats_bucket_max(unsigned int);
+static unsigned long stats_percentile(struct stats_hist *, unsigned int, unsigned int);
 
 /****************************************
  * application globals
@@ -134,6 +154,11 @@ char		*run_path = NULL;	/* path to our working directory     */
 authmech_t	*auth_mech = NULL;	/* Authentication mechanism to use   */
 char		*mech_option = NULL;	/* mechanism-specific option	     */
 int		num_procs = 5;		/* The max number of worker processes*/
+int		num_threads = 0;	/* The number of worker threads      */
+int		queue_len = DEFAULT_QUEUE_LEN;	/* Max requests waiting for a thread */
+struct server_stats *server_stats = NULL; /* Shared server statistics          */
+double		rate_limit = 0;		/* -L mech calls per second and user */
+unsigned int	rate_burst = RATE_DEFAULT_BURST; /* and calls in a burst     */
 
 
 /****************************************
@@ -146,6 +171,25 @@ static int 	pid_file_lock_fd; 		/* Descriptor to the open pid lock file  */
 static char	*pid_file;		/* Pid file name                         */
 static char	*pid_file_lock;		/* Pid lock file name                    */
 static int       startup_pipe[2] = { -1, -1 };
+#ifdef USE_UNIX_EPOLL
+static pthread_mutex_t mech_lock = PTHREAD_MUTEX_INITIALIZER; /* Serializes non thread safe mechs */
+
+/* mechanism calls in progress in the threaded model, see auth_coalesce() */
+struct inflight {
+	struct inflight		*next;
+	const char		*login;
+	const char		*service;
+	const char		*realm;
+	unsigned char		pwd_digest[16];
+	char			*response;    /* set once the call is done          */
+	int			waiters;      /* requests sharing the response      */
+};
+
+static struct inflight	*inflight = NULL;
+static pthread_mutex_t	inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	inflight_cond = PTHREAD_COND_INITIALIZER;
+#endif
+static struct rate_set *rate_table = NULL; /* Shared -L token buckets     */
 
 int main(int argc, char **argv) {
 	int		option;
@@ -170,7 +214,7 @@ int main(int argc, char **argv) {
 	flags |= LOG_USE_STDERR;
 	flags |= AM_MASTER;
 
-	while ((option = getopt(argc, argv, "a:cdhO:lm:n:rs:t:vV")) != -1) {
+	while ((option = getopt(argc, argv, "a:cdef:F:hL:O:lm:n:pq:rs:t:vVw:")) != -1) {
 		switch(option) {
 			case 'a':
 			        /* Only one at a time, please! */
@@ -196,10 +240,26 @@ int main(int argc, char **argv) {
 				flags &= ~DETACH_TTY;
 				break;
 
+			case 'e':
+				flags |= USE_EXCL_ACCEPT;
+				break;
+
 			case 'h':
 				show_usage();
 				break;
 				
+			case 'f':
+				cache_set_neg_timeout(optarg);
+				break;
+
+			case 'F':
+				cache_set_neg_table_size(optarg);
+				break;
+
+			case 'L':
+				set_rate_limit(optarg);
+				break;
+
 			case 'O':
 				set_mech_option(optarg);
 				break;
@@ -216,6 +276,14 @@ int main(int argc, char **argv) {
 				set_max_procs(optarg);
 				break;
 
+			case 'p':
+				flags |= CACHE_PERSIST;
+				break;
+
+			case 'q':
+				set_queue_len(optarg);
+				break;
+
 			case 'r':
 				flags |= CONCAT_LOGIN_REALM;
 				break;
@@ -235,6 +303,10 @@ int main(int argc, char **argv) {
 			case 'v':
 				show_version();
 				break;
+
+			case 'w':
+				set_max_threads(optarg);
+				break;
 				
 			default:
 				show_usage();
@@ -264,11 +336,19 @@ int main(int argc, char **argv) {
 	if (flags & VERBOSE)  {
 		logger(L_DEBUG, L_FUNC, "num_procs  : %d", num_procs);
 
+		if (flags & USE_THREAD_MODEL) {
+			logger(L_DEBUG, L_FUNC, "num_threads: %d", num_threads);
+			logger(L_DEBUG, L_FUNC, "queue_len  : %d", queue_len);
+		}
+
 		if (mech_option == NULL)
 			logger(L_DEBUG, L_FUNC, "mech_option: NULL");
 		else
 			logger(L_DEBUG, L_FUNC, "mech_option: %s", mech_option);
 
+		if (rate_limit > 0)
+			logger(L_DEBUG, L_FUNC, "rate_limit : %g/s, burst %u", rate_limit, rate_burst);
+
 		logger(L_DEBUG, L_FUNC, "run_path   : %s", run_path);
 		logger(L_DEBUG, L_FUNC, "auth_mech  : %s", auth_mech->name);
 	}
@@ -330,6 +410,13 @@ int main(int argc, char **argv) {
 	 **********************************************************/
 	signal_setup();
 
+	/*********************************************************
+	 * Statistics and rate limit setup, ahead of any forking so
+	 * all of the processes share them.
+	 **********************************************************/
+	if (stats_init() != 0 || rate_init() != 0)
+		exit(1);
+
 	/*********************************************************
 	 * Cache setup, exit if it doesn't succeed (optional would
 	 * be to disable the cache and log a warning).
@@ -376,47 +463,70 @@ int main(int argc, char **argv) {
  * Performs all authentication centric duties. We should be
  * getting callbacks from the ipc method here. We'll simply 
  * return a pointer to a string to send back to the client.
- * The caller is responsible for freeing the pointer. 
+ * The caller is responsible for freeing the pointer. If the
+ * answer came from a cache entry that is due for a refresh,
+ * lkup_result->status is CACHE_REFRESH on return, and the
+ * caller should pass the same arguments on to do_refresh()
+ * once the answer is out.
+ **************************************************************/
+char *do_auth(const char *login, const char *password, const char *service, const char *realm, struct cache_result *lkup_result) {
+
+	char			*response;
+	struct timeval		start;
+
+
+	gettimeofday(&start, NULL);
+	STATS_ADD(server_stats->requests, 1);
+	STATS_ADD(server_stats->busy, 1);
+
+	response = auth_answer(login, password, service, realm, lkup_result);
+
+	if (strncmp(response, "OK", 2) == 0)
+		STATS_ADD(server_stats->ok, 1);
+	else
+		STATS_ADD(server_stats->no, 1);
+
+	STATS_ADD(server_stats->busy, -1);
+	stats_record(&server_stats->auth_usec, &start);
+
+	return response;
+}
+
+
+/*************************************************************
+ * The body of do_auth(): ask the cache, then the mechanism.
  **************************************************************/
-char *do_auth(const char *_login, const char *password, const char *service, const char *realm) {
+char *auth_answer(const char *_login, const char *password, const char *service, const char *realm, struct cache_result *lkup_result) {
 
-	struct cache_result	lkup_result;
 	char			*response;
 	int			cached = 0;
+	int			rc;
 	char			login_buff[MAX_LOGIN_REALM_LEN];
 	char			*login;
 
 
-	/***********************************************************
-	 * Check to concat the login and realm into a single login.
-	 * Aka, login: foo realm: bar becomes login: foo@bar.
-	 * We do this because some mechs have no concept of a realm.
-	 * Ie. auth_pam and friends.
-	 ***********************************************************/
-	if ((flags & CONCAT_LOGIN_REALM) && realm && realm[0] != '\0') {
-	    strlcpy(login_buff, _login, sizeof(login_buff));
-	    strlcat(login_buff, "@", sizeof(login_buff));
-	    strlcat(login_buff, realm, sizeof(login_buff));
+	login = auth_login(_login, realm, login_buff);
 
-	    login = login_buff;
-	} else {
-	    login = (char *)_login;
-	}
+	rc = cache_lookup(login, realm, service, password, lkup_result);
 
-	if (cache_lookup(login, realm, service, password, &lkup_result) == CACHE_OK) {	
+	if (rc == CACHE_OK) {	
+		STATS_ADD(server_stats->cache_hits, 1);
 		response = strdup("OK");
 		cached = 1;
+	} else if (rc == CACHE_DENIED) {
+		STATS_ADD(server_stats->cache_denied, 1);
+		response = strdup("NO authentication failed recently (cached)");
+		cached = 1;
 	} else {
-		response = auth_mech->authenticate(login, password, service, realm);
+		if (flags & CACHE_ENABLED)
+			STATS_ADD(server_stats->cache_misses, 1);
 
-		if (response == NULL) {
-			logger(L_ERR, L_FUNC, "internal mechanism failure: %s", auth_mech->name);
-			response = strdup("NO internal mechanism failure");
-		}
+		response = auth_coalesce(login, password, service, realm);
 	}
 
 	if (strncmp(response, "OK", 2) == 0) {
-		cache_commit(&lkup_result);
+		if (!cached)
+			cache_commit(lkup_result);
 
 		if (flags & VERBOSE) {
 			if (cached) 
@@ -430,6 +540,16 @@ char *do_auth(const char *_login, const char *password, const char *service, con
 	}
 
 	if (strncmp(response, "NO", 2) == 0) {
+		/***********************************************************
+		 * Remember the failure, unless it looks like the mechanism
+		 * (or whatever is behind it) was in trouble rather than
+		 * the credentials being bad.
+		 ***********************************************************/
+		if (!cached && strstr(response, "[ALERT]") == NULL && strstr(response, "internal") == NULL)
+			cache_commit_failure(lkup_result);
+		else if (!cached)
+			cache_release(lkup_result);
+
 		logger(L_INFO, L_FUNC, "auth failure: [user=%s] [service=%s] [realm=%s] [mech=%s] [reason=%s]", \
 			login, service, realm, auth_mech->name,
 		        strlen(response) >= 4 ? response+3 : "Unknown");
@@ -437,13 +557,587 @@ char *do_auth(const char *_login, const char *password, const char *service, con
 		return response;
 	}
 
+	cache_release(lkup_result);
+
 	logger(L_ERR, L_FUNC, "mechanism returned unknown response: %s", auth_mech->name);
+	free(response);
 	response = strdup("NO internal mechanism failure");
 
 	return response;
 }
 
 
+/*************************************************************
+ * Check credentials that were answered from a cache entry due
+ * for a refresh (see do_auth()) with the mechanism, and
+ * update or drop the entry according to its verdict. If the
+ * mechanism can't tell, the entry is left to time out.
+ **************************************************************/
+void do_refresh(const char *_login, const char *password, const char *service, const char *realm, struct cache_result *lkup_result) {
+
+	char			*response;
+	char			login_buff[MAX_LOGIN_REALM_LEN];
+	char			*login;
+
+
+	if (lkup_result->status != CACHE_REFRESH)
+		return;
+
+	login = auth_login(_login, realm, login_buff);
+
+	response = auth_authenticate(login, password, service, realm);
+
+	if (strncmp(response, "OK", 2) == 0) {
+		cache_commit(lkup_result);
+	} else if (strncmp(response, "NO", 2) == 0 && strstr(response, "[ALERT]") == NULL &&
+		   strstr(response, "internal") == NULL) {
+		logger(L_INFO, L_FUNC, "cached credentials no longer valid: [user=%s] [service=%s] [realm=%s] [mech=%s]", \
+			login, service, realm, auth_mech->name);
+		cache_commit_failure(lkup_result);
+	} else {
+		cache_release(lkup_result);
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "cache refresh: [user=%s] [service=%s] [realm=%s] [mech=%s]: %s", \
+			login, service, realm, auth_mech->name, response);
+
+	free(response);
+
+	return;
+}
+
+
+/*************************************************************
+ * Check to concat the login and realm into a single login.
+ * Aka, login: foo realm: bar becomes login: foo@bar.
+ * We do this because some mechs have no concept of a realm.
+ * Ie. auth_pam and friends. The login buffer must be
+ * MAX_LOGIN_REALM_LEN bytes.
+ **************************************************************/
+char *auth_login(const char *_login, const char *realm, char *login_buff) {
+
+	if ((flags & CONCAT_LOGIN_REALM) && realm && realm[0] != '\0') {
+	    strlcpy(login_buff, _login, MAX_LOGIN_REALM_LEN);
+	    strlcat(login_buff, "@", MAX_LOGIN_REALM_LEN);
+	    strlcat(login_buff, realm, MAX_LOGIN_REALM_LEN);
+
+	    return login_buff;
+	}
+
+	return (char *)_login;
+}
+
+
+/*************************************************************
+ * Call into the mechanism. The response is never NULL, the
+ * caller is responsible for freeing it. The time spent in
+ * the mechanism (not counting waits for the mechanism lock)
+ * goes into the statistics.
+ **************************************************************/
+char *auth_authenticate(const char *login, const char *password, const char *service, const char *realm) {
+
+	char			*response;
+	struct timeval		start;
+
+
+#ifdef USE_UNIX_EPOLL
+	/***********************************************************
+	 * Worker threads may only call into the mechanism one at
+	 * a time, unless it says it can cope with more.
+	 ***********************************************************/
+	if ((flags & USE_THREAD_MODEL) && !(auth_mech->flags & MECH_THREADSAFE)) {
+		pthread_mutex_lock(&mech_lock);
+		gettimeofday(&start, NULL);
+		response = auth_mech->authenticate(login, password, service, realm);
+		stats_record(&server_stats->mech_usec, &start);
+		pthread_mutex_unlock(&mech_lock);
+	} else
+#endif
+	{
+		gettimeofday(&start, NULL);
+		response = auth_mech->authenticate(login, password, service, realm);
+		stats_record(&server_stats->mech_usec, &start);
+	}
+
+	STATS_ADD(server_stats->mech_calls, 1);
+
+	if (response == NULL) {
+		logger(L_ERR, L_FUNC, "internal mechanism failure: %s", auth_mech->name);
+		response = strdup("NO internal mechanism failure");
+		STATS_ADD(server_stats->mech_errors, 1);
+	} else if (strncmp(response, "OK", 2) == 0) {
+		STATS_ADD(server_stats->mech_ok, 1);
+	} else if (strncmp(response, "NO", 2) != 0 || strstr(response, "[ALERT]") != NULL ||
+		   strstr(response, "internal") != NULL) {
+		STATS_ADD(server_stats->mech_errors, 1);
+	} else {
+		STATS_ADD(server_stats->mech_no, 1);
+	}
+
+	return response;
+}
+
+
+/*************************************************************
+ * Ask the mechanism, unless the same credentials are being
+ * checked by another worker thread right now, in which case
+ * wait for that call and share its answer. Mail clients like
+ * to open several connections with the same credentials at
+ * once; this turns such a burst into a single mechanism call
+ * even without the cache. The preforked processes don't share
+ * calls, though with -c the cache claims (see cache_lookup())
+ * do much the same across them. The caller is responsible for
+ * freeing the response.
+ **************************************************************/
+char *auth_coalesce(const char *login, const char *password, const char *service, const char *realm) {
+
+#ifdef USE_UNIX_EPOLL
+	struct inflight		me;
+	struct inflight		*call;
+	struct inflight		**prev;
+	MD5_CTX			md5_context;
+	char			*response;
+
+
+	if (!(flags & USE_THREAD_MODEL))
+		return auth_limit(login, password, service, realm);
+
+	_saslauthd_MD5Init(&md5_context);
+	_saslauthd_MD5Update(&md5_context, (unsigned char *)password, strlen(password));
+	_saslauthd_MD5Final(me.pwd_digest, &md5_context);
+
+	pthread_mutex_lock(&inflight_lock);
+
+	for (call = inflight; call != NULL; call = call->next) {
+		if (strcmp(call->login, login) == 0 && strcmp(call->realm, realm) == 0 &&
+		    strcmp(call->service, service) == 0 &&
+		    memcmp(call->pwd_digest, me.pwd_digest, sizeof(me.pwd_digest)) == 0)
+			break;
+	}
+
+	if (call != NULL) {
+		call->waiters++;
+
+		while (call->response == NULL)
+			pthread_cond_wait(&inflight_cond, &inflight_lock);
+
+		response = strdup(call->response);
+
+		call->waiters--;
+		pthread_cond_broadcast(&inflight_cond);
+		pthread_mutex_unlock(&inflight_lock);
+
+		STATS_ADD(server_stats->coalesced, 1);
+
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "shared a concurrent mechanism call: [user=%s] [service=%s] [realm=%s]", \
+				login, service, realm);
+
+		return response ? response : strdup("NO internal memory failure");
+	}
+
+	me.login = login;
+	me.service = service;
+	me.realm = realm;
+	me.response = NULL;
+	me.waiters = 0;
+	me.next = inflight;
+	inflight = &me;
+
+	pthread_mutex_unlock(&inflight_lock);
+
+	response = auth_limit(login, password, service, realm);
+
+	/***********************************************************
+	 * Hand the answer over, and stay until everybody waiting
+	 * for it has made a copy, as it all lives on our stack.
+	 ***********************************************************/
+	pthread_mutex_lock(&inflight_lock);
+
+	for (prev = &inflight; *prev != &me; prev = &(*prev)->next)
+		;
+	*prev = me.next;
+
+	me.response = response;
+	pthread_cond_broadcast(&inflight_cond);
+
+	while (me.waiters > 0)
+		pthread_cond_wait(&inflight_cond, &inflight_lock);
+
+	pthread_mutex_unlock(&inflight_lock);
+
+	return response;
+#else
+	return auth_limit(login, password, service, realm);
+#endif
+}
+
+
+/*************************************************************
+ * Ask the mechanism, if the user has not run out of attempts
+ * (-L). Being turned away is an [ALERT], so it neither goes
+ * into the failed credentials cache nor counts as a verdict.
+ * The caller is responsible for freeing the response.
+ **************************************************************/
+char *auth_limit(const char *login, const char *password, const char *service, const char *realm) {
+
+	if (!rate_allow(login, realm)) {
+		STATS_ADD(server_stats->rate_limited, 1);
+
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "rate limited: [user=%s] [service=%s] [realm=%s]", \
+				login, service, realm);
+
+		return strdup(RATE_LIMITED);
+	}
+
+	return auth_authenticate(login, password, service, realm);
+}
+
+
+/*************************************************************
+ * Lock a set of -L buckets. The lock holds the pid of its
+ * holder, so one left behind by a process that died holding
+ * it is taken over rather than waited on forever. Return 0 if
+ * the set is locked, -1 if it stayed busy.
+ **************************************************************/
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+static int rate_lock(struct rate_set *set) {
+
+	pid_t		me = getpid();
+	pid_t		holder;
+	unsigned int	spins;
+
+
+	for (spins = 0; spins < RATE_LOCK_MAX_SPINS; spins++) {
+		if ((holder = set->lock) == 0) {
+			if (__sync_bool_compare_and_swap(&set->lock, 0, me))
+				return 0;
+		} else if (spins >= RATE_LOCK_SPINS) {
+			if (holder != me && kill(holder, 0) != 0 && errno == ESRCH &&
+			    __sync_bool_compare_and_swap(&set->lock, holder, me)) {
+				logger(L_ERR, L_FUNC, "rate limit lock of dead process %d taken over",
+				       (int)holder);
+				return 0;
+			}
+
+			sched_yield();
+		}
+	}
+
+	return -1;
+}
+
+static void rate_unlock(struct rate_set *set) {
+
+	__sync_lock_release(&set->lock);
+}
+#else
+static int rate_lock(struct rate_set *set __attribute__((unused))) {
+
+	return 0;
+}
+
+static void rate_unlock(struct rate_set *set __attribute__((unused))) {
+}
+#endif
+
+
+/*************************************************************
+ * Take a token from the user's bucket, refilling it at
+ * rate_limit per second up to rate_burst first. A user
+ * without a bucket gets an unused or a full one of the set,
+ * else takes over the fullest bucket with the tokens in it:
+ * logins hashing to the same set can push each other out,
+ * but never get a bucket fuller than the one they replace.
+ * If the set stays locked, the request goes on, as the
+ * mechanism still checks the password. Returns 1 if the
+ * request may go on, 0 if not.
+ **************************************************************/
+int rate_allow(const char *login, const char *realm) {
+
+	struct rate_set		*set;
+	struct rate_bucket	*bucket;
+	struct rate_bucket	*fullest;
+	struct timeval		now;
+	unsigned int		key;
+	unsigned int		stamp;
+	unsigned long long	tokens;
+	unsigned long long	most;
+	unsigned long long	burst;
+	char			creds[MAX_LOGIN_REALM_LEN + MAX_REQ_LEN + 2];
+	int			len;
+	int			allow;
+	int			i;
+
+
+	if (rate_table == NULL)
+		return 1;
+
+	len = snprintf(creds, sizeof(creds), "%s%c%s", login, '\0', realm);
+	if (len < 0 || len >= (int)sizeof(creds))
+		len = sizeof(creds) - 1;
+
+	if ((key = cache_hash(creds, len)) == 0)
+		key = 1;
+
+	set = &rate_table[key % (RATE_TABLE_SIZE / RATE_WAYS)];
+	burst = (unsigned long long)rate_burst * RATE_TOKEN;
+
+	gettimeofday(&now, NULL);
+	stamp = (unsigned int)(now.tv_sec * 1000 + now.tv_usec / 1000);
+
+	if (rate_lock(set) != 0) {
+		logger(L_ERR, L_FUNC, "rate limit set %u stayed locked",
+		       (unsigned int)(set - rate_table));
+		return 1;
+	}
+
+	bucket = NULL;
+	fullest = NULL;
+	most = 0;
+
+	for (i = 0; i < RATE_WAYS; i++) {
+		if (set->buckets[i].key == key) {
+			bucket = &set->buckets[i];
+			break;
+		}
+
+		if (set->buckets[i].key == 0) {
+			tokens = burst;
+		} else {
+			tokens = set->buckets[i].tokens + (unsigned long long)(stamp - set->buckets[i].stamp) * (unsigned long long)(rate_limit * 1000);
+			if (tokens > burst)
+				tokens = burst;
+		}
+
+		if (fullest == NULL || tokens > most) {
+			fullest = &set->buckets[i];
+			most = tokens;
+		}
+	}
+
+	if (bucket != NULL) {
+		tokens = bucket->tokens + (unsigned long long)(stamp - bucket->stamp) * (unsigned long long)(rate_limit * 1000);
+		if (tokens > burst)
+			tokens = burst;
+	} else {
+		bucket = fullest;
+		bucket->key = key;
+		tokens = most;
+	}
+
+	if ((allow = (tokens >= RATE_TOKEN)))
+		tokens -= RATE_TOKEN;
+
+	bucket->tokens = (unsigned int)tokens;
+	bucket->stamp = stamp;
+
+	rate_unlock(set);
+
+	return allow;
+}
+
+
+/*************************************************************
+ * Set up the -L token buckets in a shared anonymous memory
+ * region, like the statistics. Return 0 if everything went
+ * ok, -1 otherwise.
+ **************************************************************/
+int rate_init() {
+	void		*base;
+	size_t		bytes = (RATE_TABLE_SIZE / RATE_WAYS) * sizeof(struct rate_set);
+	int		rc;
+
+	if (rate_limit <= 0)
+		return 0;
+
+	if ((base = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not mmap the rate limit table");
+		logger(L_ERR, L_FUNC, "mmap: %s", strerror(rc));
+		return -1;
+	}
+
+	memset(base, 0, bytes);
+	rate_table = base;
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Set up the server statistics in a shared anonymous memory
+ * region, so the worker processes forked later on all count
+ * into the same place. Return 0 if everything went ok, -1
+ * otherwise.
+ **************************************************************/
+int stats_init() {
+	void		*base;
+	int		rc;
+
+	if ((base = mmap(NULL, sizeof(struct server_stats), PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not mmap the statistics");
+		logger(L_ERR, L_FUNC, "mmap: %s", strerror(rc));
+		return -1;
+	}
+
+	server_stats = base;
+	memset(base, 0, sizeof(struct server_stats));
+	server_stats->started = time(NULL);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Count the time elapsed since start into a histogram. The
+ * first 16 buckets are a microsecond wide, after that every
+ * doubling of the time is split into four buckets, which
+ * keeps the percentiles within 25%.
+ **************************************************************/
+void stats_record(struct stats_hist *hist, struct timeval *start) {
+	struct timeval	now;
+	long		usec;
+	unsigned int	bucket;
+	unsigned int	doublings;
+
+	gettimeofday(&now, NULL);
+
+	usec = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_usec - start->tv_usec);
+
+	if (usec < 16) {
+		bucket = usec < 0 ? 0 : usec;
+	} else {
+		for (doublings = 0; usec >= 8; usec >>= 1)
+			doublings++;
+
+		bucket = 16 + (doublings - 2) * 4 + (usec - 4);
+
+		if (bucket >= STATS_HIST_BUCKETS)
+			bucket = STATS_HIST_BUCKETS - 1;
+	}
+
+	STATS_ADD(hist->count[bucket], 1);
+}
+
+
+/*************************************************************
+ * The largest time (in microseconds) counted into a bucket
+ * by stats_record().
+ **************************************************************/
+unsigned long stats_bucket_max(unsigned int bucket) {
+	unsigned int	doublings;
+
+	if (bucket < 16)
+		return bucket;
+
+	doublings = (bucket - 16) / 4 + 2;
+
+	return ((unsigned long)(4 + (bucket - 16) % 4) << doublings) + (1UL << doublings) - 1;
+}
+
+
+/*************************************************************
+ * The time (in microseconds) within which permille out of a
+ * thousand of the times counted into a histogram fall. Other
+ * processes may keep counting into it meanwhile, hence the
+ * total is passed in.
+ **************************************************************/
+unsigned long stats_percentile(struct stats_hist *hist, unsigned int count, unsigned int permille) {
+	unsigned long	rank;
+	unsigned long	seen = 0;
+	unsigned int	x;
+
+	if (count == 0)
+		return 0;
+
+	rank = ((unsigned long)count * permille + 999) / 1000;
+
+	for (x = 0; x < STATS_HIST_BUCKETS; x++) {
+		seen += hist->count[x];
+
+		if (seen >= rank)
+			return stats_bucket_max(x);
+	}
+
+	return stats_bucket_max(STATS_HIST_BUCKETS - 1);
+}
+
+
+/*************************************************************
+ * Write up the statistics as the answer to a STATS_REQUEST,
+ * one "name value ..." line per subject. The caller is
+ * responsible for freeing the pointer.
+ **************************************************************/
+char *stats_report() {
+	char			*report;
+	size_t			len = 0;
+	unsigned int		lookups;
+	unsigned int		count[2];
+	struct stats_hist	*hist[2];
+	static const char	*names[2] = { "auth_usec", "mech_usec" };
+	int			x;
+	int			y;
+
+	if ((report = malloc(1024)) == NULL)
+		return NULL;
+
+	len += snprintf(report + len, 1024 - len,
+			"OK\nuptime %ld\nmech %s\n"
+			"requests %u ok %u no %u busy %u\n",
+			(long)(time(NULL) - server_stats->started), auth_mech->name,
+			server_stats->requests, server_stats->ok, server_stats->no,
+			server_stats->busy);
+
+	if (flags & CACHE_ENABLED) {
+		lookups = server_stats->cache_hits + server_stats->cache_denied + server_stats->cache_misses;
+
+		len += snprintf(report + len, 1024 - len,
+				"cache hits %u denied %u misses %u hit_ratio %.2f\n",
+				server_stats->cache_hits, server_stats->cache_denied,
+				server_stats->cache_misses,
+				lookups ? (server_stats->cache_hits + server_stats->cache_denied) * 100.0 / lookups : 0.0);
+	}
+
+	if (flags & USE_THREAD_MODEL)
+		len += snprintf(report + len, 1024 - len, "queue depth %u max %u\n",
+				server_stats->queue_depth, server_stats->queue_max);
+
+	len += snprintf(report + len, 1024 - len,
+			"mech_calls %u ok %u no %u errors %u\n",
+			server_stats->mech_calls, server_stats->mech_ok,
+			server_stats->mech_no, server_stats->mech_errors);
+
+	if ((flags & USE_THREAD_MODEL) || rate_limit > 0)
+		len += snprintf(report + len, 1024 - len, "coalesced %u rate_limited %u\n",
+				server_stats->coalesced, server_stats->rate_limited);
+
+	hist[0] = &server_stats->auth_usec;
+	hist[1] = &server_stats->mech_usec;
+
+	for (x = 0; x < 2; x++) {
+		for (count[x] = 0, y = 0; y < STATS_HIST_BUCKETS; y++)
+			count[x] += hist[x]->count[y];
+
+		len += snprintf(report + len, 1024 - len,
+				"%s count %u p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n",
+				names[x], count[x],
+				stats_percentile(hist[x], count[x], 500),
+				stats_percentile(hist[x], count[x], 900),
+				stats_percentile(hist[x], count[x], 990),
+				stats_percentile(hist[x], count[x], 999),
+				stats_percentile(hist[x], count[x], 1000));
+	}
+
+	return report;
+}
+
+
 /*************************************************************
  * Allow someone to set the auth mech to use
  **************************************************************/
@@ -484,6 +1178,67 @@ void set_max_procs(const char *procs) {
 }
 
 
+/*************************************************************
+ * Allow someone to set the number of worker threads fed by
+ * the event loop. Only applicable to unix ipc with epoll().
+ **************************************************************/
+void set_max_threads(const char *threads) {
+#ifdef USE_UNIX_EPOLL
+	num_threads = atoi(threads);
+
+	if (num_threads <= 0) {
+		logger(L_ERR, L_FUNC, "invalid number of worker threads defined");
+		exit(1);
+	}
+
+	flags |= USE_THREAD_MODEL;
+
+	return;
+#else
+	logger(L_ERR, L_FUNC, "worker threads are not supported on this platform");
+	exit(1);
+#endif
+}
+
+
+/*************************************************************
+ * Allow someone to set the number of requests that may wait
+ * for a worker thread before we stop accepting connections.
+ **************************************************************/
+void set_queue_len(const char *len) {
+	queue_len = atoi(len);
+
+	if (queue_len <= 0) {
+		logger(L_ERR, L_FUNC, "invalid request queue length defined");
+		exit(1);
+	}
+
+	return;
+}
+
+
+/*************************************************************
+ * Allow someone to limit the mechanism calls per user, as
+ * "rate[:burst]": rate calls a second, in bursts of up to
+ * burst calls.
+ **************************************************************/
+void set_rate_limit(const char *limit) {
+	const char	*burst;
+
+	rate_limit = atof(limit);
+
+	if ((burst = strchr(limit, ':')) != NULL)
+		rate_burst = atoi(burst + 1);
+
+	if (rate_limit <= 0 || rate_burst < 1 || rate_burst > RATE_MAX_BURST) {
+		logger(L_ERR, L_FUNC, "invalid rate limit defined");
+		exit(1);
+	}
+
+	return;
+}
+
+
 /*************************************************************
  * Allow someone to set the mechanism specific option
  **************************************************************/
@@ -985,9 +1740,15 @@ void show_usage() {
     fprintf(stderr, "  -a <authmech>  Selects the authentication mechanism to use.\n");
     fprintf(stderr, "  -c             Enable credential caching.\n");
     fprintf(stderr, "  -d             Debugging (don't detach from tty, implies -V)\n");
+    fprintf(stderr, "  -e             Have the worker processes wait for connections with\n");
+    fprintf(stderr, "                 exclusive epoll wakeups instead of the accept() lock.\n");
+    fprintf(stderr, "  -f <seconds>   Cache failed credentials for this long (requires -c)\n");
+    fprintf(stderr, "  -F <kilobytes> Size of the failed credentials cache (requires -c)\n");
     fprintf(stderr, "  -r             Combine the realm with the login before passing to authentication mechanism\n");
     fprintf(stderr, "                 Ex. login: \"foo\" realm: \"bar\" will get passed as login: \"foo@bar\"\n");
     fprintf(stderr, "                 The realm name is passed untouched.\n");
+    fprintf(stderr, "  -L <rate[:burst]> Mechanism calls allowed per user and second, and in a\n");
+    fprintf(stderr, "                 burst (default %d)\n", RATE_DEFAULT_BURST);
     fprintf(stderr, "  -O <option>    Optional argument to pass to the authentication\n");
     fprintf(stderr, "                 mechanism.\n");
     fprintf(stderr, "  -l             Disable accept() locking. Increases performance, but\n");
@@ -995,10 +1756,14 @@ void show_usage() {
     fprintf(stderr, "  -m <path>      Alternate path for the saslauthd working directory,\n");
     fprintf(stderr, "                 must be absolute.\n"); 
     fprintf(stderr, "  -n <procs>     Number of worker processes to create.\n");
+    fprintf(stderr, "  -p             Keep the credential cache across restarts (requires -c)\n");
+    fprintf(stderr, "  -q <requests>  Number of requests that may wait for a worker thread.\n");
     fprintf(stderr, "  -s <kilobytes> Size of the credential cache (in kilobytes)\n");
     fprintf(stderr, "  -t <seconds>   Timeout for items in the credential cache (in seconds)\n");
     fprintf(stderr, "  -v             Display version information and available mechs\n");
     fprintf(stderr, "  -V             Enable verbose logging\n");
+    fprintf(stderr, "  -w <threads>   Serve requests from an event loop with a pool of\n");
+    fprintf(stderr, "                 worker threads in a single process (overrides -n).\n");
     fprintf(stderr, "  -h             Display this message.\n\n");
 
     show_version();
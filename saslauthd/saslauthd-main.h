@@ -46,6 +46,7 @@
 #define _SASLAUTHDMAIN_H
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include "saslauthd.h"
 
 /****************************************************************
@@ -58,6 +59,13 @@
 # define USE_UNIX_IPC
 #endif
 
+/* The unix IPC can serve requests from an epoll() event loop
+ * feeding a pool of worker threads (-w). */
+#if defined(USE_UNIX_IPC) && defined(HAVE_LIBPTHREAD) && \
+    defined(HAVE_PTHREAD_H) && defined(HAVE_SYS_EPOLL_H)
+# define USE_UNIX_EPOLL
+#endif
+
 /* AIX uses a slight variant of this */
 #ifdef _AIX
 # define SALEN_TYPE size_t
@@ -86,11 +94,104 @@
 /* socket backlog when supported */
 #define SOCKET_BACKLOG  	32
 
+/* default length of the request queue feeding the worker threads */
+#define DEFAULT_QUEUE_LEN	1024
+
+/* max number of events handled per epoll_wait() */
+#define MAX_EPOLL_EVENTS		64
+
+/* seconds a worker thread waits for a client to take in a reply */
+#define CONN_SEND_TIMEOUT	10
+
+/* seconds the event loop stops accepting after accept() failed, e.g.
+ * for want of descriptors */
+#define ACCEPT_RETRY_DELAY	1
+
+/* password sent with an empty login to ask for the pipelined protocol,
+ * and the reply when the server agrees to it (see README.ipc) */
+#define PIPELINE_HELLO		"PIPELINE"
+#define PIPELINE_OK		"OK PIPELINE"
+
+/* password sent with an empty login to ask for the server statistics
+ * (see README.ipc) */
+#define STATS_REQUEST		"STATS"
+
+/* latency histogram buckets: one per microsecond up to 16, then four
+ * per doubling, the last one ending a bit over an hour */
+#define STATS_HIST_BUCKETS	128
+
+/* counters are bumped with atomic adds where the compiler has them,
+ * else they may drift a little */
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+# define STATS_ADD(counter, n)	__sync_fetch_and_add(&(counter), (n))
+#else
+# define STATS_ADD(counter, n)	((counter) += (n))
+#endif
+
+/* per user rate limit (-L): token buckets in memory shared by all of the
+ * processes, in sets of RATE_WAYS picked by a hash of login and realm.
+ * Tokens are kept in millionths of a request. */
+#define RATE_TABLE_SIZE		4096
+#define RATE_WAYS		4
+#define RATE_DEFAULT_BURST	10
+#define RATE_MAX_BURST		4000
+#define RATE_TOKEN		1000000U
+#define RATE_LIMITED		"NO [ALERT] Too many authentication attempts, try again later"
+#define RATE_LOCK_SPINS		64     /* spins before yielding              */
+#define RATE_LOCK_MAX_SPINS	100000 /* before giving up on a set          */
+
+struct rate_bucket {
+	unsigned int		key;          /* hash of login and realm, 0 unused  */
+	unsigned int		tokens;
+	unsigned int		stamp;        /* milliseconds of the last refill    */
+};
+
+struct rate_set {
+	volatile pid_t		lock;         /* pid of the holder, 0 if free       */
+	struct rate_bucket	buckets[RATE_WAYS];
+};
+
+struct stats_hist {
+	volatile unsigned int	count[STATS_HIST_BUCKETS];
+};
+
+/* server statistics, in memory shared by all of the processes */
+struct server_stats {
+	time_t			started;
+	volatile unsigned int	requests;     /* do_auth() calls                    */
+	volatile unsigned int	ok;
+	volatile unsigned int	no;
+	volatile unsigned int	busy;         /* requests being answered            */
+	volatile unsigned int	cache_hits;
+	volatile unsigned int	cache_denied; /* failed credentials cache hits      */
+	volatile unsigned int	cache_misses;
+	volatile unsigned int	queue_depth;  /* connections waiting for a thread   */
+	volatile unsigned int	queue_max;
+	volatile unsigned int	mech_calls;
+	volatile unsigned int	mech_ok;
+	volatile unsigned int	mech_no;
+	volatile unsigned int	mech_errors;  /* no response, [ALERT] or internal   */
+	volatile unsigned int	coalesced;    /* answered by a concurrent mech call */
+	volatile unsigned int	rate_limited; /* turned away by the -L rate limit   */
+	struct stats_hist	auth_usec;    /* do_auth()                          */
+	struct stats_hist	mech_usec;    /* auth_mech->authenticate()          */
+};
+
 /* saslauthd-main.c */
+struct cache_result;
 extern char	*do_auth(const char *, const char *,
-			 const char *, const char *);
+			 const char *, const char *, struct cache_result *);
+extern void	do_refresh(const char *, const char *,
+			   const char *, const char *, struct cache_result *);
+extern int	stats_init();
+extern int	rate_init();
+extern void	stats_record(struct stats_hist *, struct timeval *);
+extern char	*stats_report();
 extern void	set_auth_mech(const char *);
 extern void	set_max_procs(const char *);
+extern void	set_max_threads(const char *);
+extern void	set_queue_len(const char *);
+extern void	set_rate_limit(const char *);
 extern void	set_mech_option(const char *);
 extern void	set_run_path(const char *);
 extern void	signal_setup();
@@ -99,6 +200,8 @@ extern void	handle_sigchld();
 extern void	server_exit();
 extern pid_t	have_baby();
 
+extern struct server_stats *server_stats;
+
 /* ipc api delcarations */
 extern void	ipc_init();
 extern void	ipc_loop();
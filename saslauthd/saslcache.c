@@ -64,8 +64,9 @@ char	*make_time(time_t);
 * * module globals
 *****************************************/
 static  void            *shm_base = NULL;
-static  struct bucket   *table = NULL;
+static  struct slot     *table = NULL;
 static  struct stats    *table_stats = NULL;
+static  struct shard_stats *shard_stats = NULL;
 
 /****************************************
 *****************************************/
@@ -137,7 +138,8 @@ int main(int argc, char **argv) {
 	}
 
 	table_stats = shm_base + 64;
-	(char *)table = (char *)table_stats + 128;
+	shard_stats = (struct shard_stats *)((char *)table_stats + 128);
+	table = (struct slot *)(shard_stats + table_stats->shards);
 
 	if (dump_stat_info == 0 && dump_user_info == 0)
 		dump_stat_info = 1;
@@ -158,22 +160,34 @@ int main(int argc, char **argv) {
 ****************************************************/
 void dump_cache_users(void) {
 
-	unsigned int		x;
+	unsigned int		x, y;
 	struct bucket		*ref_bucket;
+	char			*creds;
         time_t			epoch_to;
 
 	epoch_to = time(NULL) - table_stats->timeout;
 
 	fprintf(stdout, "\"user\",\"realm\",\"service\",\"created\",\"created_localtime\"\n");
 
-	for (x = 0; x < (table_stats->table_size * table_stats->max_buckets_per); x++) {
+	for (x = 0; x < table_stats->table_size; x++) {
+		for (y = 0; y < table_stats->max_buckets_per; y++) {
+
+			ref_bucket = table[x].buckets + y;
+
+			if (ref_bucket->hash == 0 || ref_bucket->created <= epoch_to)
+				continue;
 
-		ref_bucket = table + x;
+			if (ref_bucket->creds_offt + ref_bucket->user_length + ref_bucket->realm_length + \
+			    ref_bucket->service_length > CACHE_SLOT_ARENA)
+				continue;
 
-		if (ref_bucket->created > epoch_to && *(ref_bucket->creds) != '\0') {
-			fprintf(stderr, "\"%s\",", ref_bucket->creds + ref_bucket->user_offt);
-			fprintf(stderr, "\"%s\",", ref_bucket->creds + ref_bucket->realm_offt);
-			fprintf(stderr, "\"%s\",", ref_bucket->creds + ref_bucket->service_offt);
+			creds = table[x].arena + ref_bucket->creds_offt;
+
+			fprintf(stderr, "\"%.*s\",", ref_bucket->user_length, creds);
+			creds += ref_bucket->user_length;
+			fprintf(stderr, "\"%.*s\",", ref_bucket->realm_length, creds);
+			creds += ref_bucket->realm_length;
+			fprintf(stderr, "\"%.*s\",", ref_bucket->service_length, creds);
 			fprintf(stderr, "\"%lu\",", ref_bucket->created);
 			fprintf(stderr, "\"%s\"\n", make_time(ref_bucket->created));
 		}
@@ -195,7 +209,22 @@ void dump_cache_stats(void) {
         unsigned int		slots_max_chain = 0;
         unsigned int		slots_min_chain = 0;
         time_t			epoch_to;
+        struct shard_stats	sum;
+
 
+	/* add up the counters of the shards */
+	memset(&sum, 0, sizeof(sum));
+
+	for (x = 0; x < table_stats->shards; x++) {
+		sum.hits += shard_stats[x].hits;
+		sum.misses += shard_stats[x].misses;
+		sum.lock_failures += shard_stats[x].lock_failures;
+		sum.attempts += shard_stats[x].attempts;
+		sum.neg_hits += shard_stats[x].neg_hits;
+		sum.neg_commits += shard_stats[x].neg_commits;
+		sum.refreshes += shard_stats[x].refreshes;
+		sum.waits += shard_stats[x].waits;
+	}
 
 	min_chain_length = table_stats->max_buckets_per;
 	epoch_to = time(NULL) - table_stats->timeout;
@@ -204,8 +233,8 @@ void dump_cache_stats(void) {
 
 		z = 0;
 
-		for (y = (x * table_stats->max_buckets_per); y < ((x + 1) * table_stats->max_buckets_per); y++) { 
-			if (table[y].created > epoch_to) {
+		for (y = 0; y < table_stats->max_buckets_per; y++) { 
+			if (table[x].buckets[y].hash != 0 && table[x].buckets[y].created > epoch_to) {
 				buckets_in_use++;
 				z++;
 			}
@@ -239,6 +268,7 @@ void dump_cache_stats(void) {
 	fprintf(stdout, "  slots in use                :  %d\n", slots_in_use);
 	fprintf(stdout, "  total buckets               :  %d\n", (table_stats->max_buckets_per * table_stats->table_size));
 	fprintf(stdout, "  buckets per slot            :  %d\n", table_stats->max_buckets_per);
+	fprintf(stdout, "  shards (slots each)         :  %d (%d)\n", table_stats->shards, table_stats->shard_slots);
 	fprintf(stdout, "  buckets in use              :  %d\n", buckets_in_use);
 	fprintf(stdout, "  hash table size (bytes)     :  %d\n", table_stats->bytes);
 	fprintf(stdout, "  bucket size (bytes)         :  %d\n", table_stats->sizeof_bucket);
@@ -254,17 +284,28 @@ void dump_cache_stats(void) {
 
 	fprintf(stdout, "  overall hash table load     :  %0.2f\n", a);
 	fprintf(stdout, "\n");
-	fprintf(stdout, "  hits*                       :  %d\n", table_stats->hits);
-	fprintf(stdout, "  misses*                     :  %d\n", table_stats->misses);
-	fprintf(stdout, "  total lookup attempts*      :  %d\n", table_stats->attempts);
+	fprintf(stdout, "  hits*                       :  %d\n", sum.hits);
+	fprintf(stdout, "  misses*                     :  %d\n", sum.misses);
+	fprintf(stdout, "  total lookup attempts*      :  %d\n", sum.attempts);
 
-	if (table_stats->attempts == 0)
+	if (sum.attempts == 0)
 		a = 0;
 	else
-		a = (table_stats->hits / (float)table_stats->attempts) * 100;
+		a = (sum.hits / (float)sum.attempts) * 100;
 
 	fprintf(stdout, "  hit ratio*                  :  %0.2f\n", a);
-	fprintf(stdout, "  flock failures*             :  %d\n", table_stats->lock_failures);
+	fprintf(stdout, "  flock failures*             :  %d\n", sum.lock_failures);
+	fprintf(stdout, "  refreshes ahead*            :  %d\n", sum.refreshes);
+	fprintf(stdout, "  waits on pending lookups*   :  %d\n", sum.waits);
+
+	if (table_stats->neg_table_size != 0) {
+		fprintf(stdout, "\n");
+		fprintf(stdout, "  failed creds timeout (sec)  :  %d\n", table_stats->neg_timeout);
+		fprintf(stdout, "  failed creds slots          :  %d\n", table_stats->neg_table_size);
+		fprintf(stdout, "  failed creds hits*          :  %d\n", sum.neg_hits);
+		fprintf(stdout, "  failed creds stored*        :  %d\n", sum.neg_commits);
+	}
+
 	fprintf(stdout, "----------------------------------------\n");
 	fprintf(stdout, "* May not be completely accurate\n");
 	fprintf(stdout, "----------------------------------------\n\n");
@@ -44,11 +44,16 @@
 #include <saslauthd.h>
 #include <stdio.h>
 
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
@@ -63,6 +68,17 @@
 /* make utils.c happy */
 int flags = LOG_USE_STDERR;
 
+/* print saslauthd's response as is (-S) */
+static int print_response = 0;
+
+/* sent as the password with an empty login to get the server
+ * statistics, see STATS_REQUEST in saslauthd-main.h */
+#define STATS_REQUEST "STATS"
+
+/* the pipelining handshake, see README.ipc */
+#define PIPELINE_HELLO "PIPELINE"
+#define PIPELINE_OK "OK PIPELINE"
+
 /*
  * Keep calling the read() system call with 'fd', 'buf', and 'nbyte'
  * until all the data is read in or an error occurs.
@@ -91,6 +107,38 @@ int retry_read(int fd, void *inbuf, unsigned nbyte)
     }
 }
 
+/*
+ * Build a request of the form:
+ *
+ * count authid count password count service count realm
+ */
+static int build_query(char *query, size_t size,
+		       const char *userid, const char *passwd,
+		       const char *service, const char *user_realm)
+{
+    const char *field[4];
+    unsigned short len;
+    size_t n, pos = 0;
+    int i;
+
+    field[0] = userid;
+    field[1] = passwd;
+    field[2] = service;
+    field[3] = user_realm;
+
+    for (i = 0; i < 4; i++) {
+	n = strlen(field[i]);
+	if (n > 0xffff || pos + sizeof(len) + n > size)
+	    return -1;
+	len = htons(n);
+	memcpy(query + pos, &len, sizeof(len));
+	pos += sizeof(len);
+	memcpy(query + pos, field[i], n);
+	pos += n;
+    }
+    return pos;
+}
+
 /* saslauthd-authenticated login */
 static int saslauthd_verify_password(const char *saslauthd_path,
 				   const char *userid, 
@@ -100,7 +148,7 @@ static int saslauthd_verify_password(const char *saslauthd_path,
 {
     char response[1024];
     char query[8192];
-    char *query_end = query;
+    int query_len;
     int s;
     struct sockaddr_un srvaddr;
     int r;
@@ -126,35 +174,11 @@ static int saslauthd_verify_password(const char *saslauthd_path,
 	strcat(pwpath, "/mux");
     }
 
-    /*
-     * build request of the form:
-     *
-     * count authid count password count service count realm
-     */
-    {
- 	unsigned short u_len, p_len, s_len, r_len;
- 	struct iovec iov[8];
- 
- 	u_len = htons(strlen(userid));
- 	p_len = htons(strlen(passwd));
-	s_len = htons(strlen(service));
-	r_len = htons((user_realm ? strlen(user_realm) : 0));
-
-	memcpy(query_end, &u_len, sizeof(unsigned short));
-	query_end += sizeof(unsigned short);
-	while (*userid) *query_end++ = *userid++;
-
-	memcpy(query_end, &p_len, sizeof(unsigned short));
-	query_end += sizeof(unsigned short);
-	while (*passwd) *query_end++ = *passwd++;
-
-	memcpy(query_end, &s_len, sizeof(unsigned short));
-	query_end += sizeof(unsigned short);
-	while (*service) *query_end++ = *service++;
-
-	memcpy(query_end, &r_len, sizeof(unsigned short));
-	query_end += sizeof(unsigned short);
-	if (user_realm) while (*user_realm) *query_end++ = *user_realm++;
+    query_len = build_query(query, sizeof(query), userid, passwd,
+			    service, user_realm);
+    if (query_len == -1) {
+	fprintf(stderr, "request too long\n");
+	return -1;
     }
 
 #ifdef USE_DOORS
@@ -165,7 +189,7 @@ static int saslauthd_verify_password(const char *saslauthd_path,
     }
 
     arg.data_ptr = query;
-    arg.data_size = query_end - query;
+    arg.data_size = query_len;
     arg.desc_ptr = NULL;
     arg.desc_num = 0;
     arg.rbuf = response;
@@ -200,7 +224,7 @@ static int saslauthd_verify_password(const char *saslauthd_path,
     {
  	struct iovec iov[8];
  
-	iov[0].iov_len = query_end - query;
+	iov[0].iov_len = query_len;
 	iov[0].iov_base = query;
 
 	if (retry_writev(s, iov, 1) == -1) {
@@ -226,7 +250,7 @@ static int saslauthd_verify_password(const char *saslauthd_path,
 	return -1;
     }
   
-    count = (int)sizeof(response) < count ? sizeof(response) : count;
+    count = (int)sizeof(response) - 1 < count ? sizeof(response) - 1 : count;
     if (retry_read(s, response, count) < count) {
 	close(s);
         fprintf(stderr,"read failed\n");
@@ -236,6 +260,11 @@ static int saslauthd_verify_password(const char *saslauthd_path,
   
     close(s);
 #endif /* USE_DOORS */
+
+    if (print_response) {
+	printf("%s", response);
+	return strncmp(response, "OK", 2) ? -1 : 0;
+    }
   
     if (!strncmp(response, "OK", 2)) {
 	printf("OK \"Success.\"\n");
@@ -246,6 +275,396 @@ static int saslauthd_verify_password(const char *saslauthd_path,
     return -1;
 }
 
+/*
+ * Benchmark mode (-B clients): fork that many clients, each sending
+ * requests back to back, and report throughput and latency percentiles.
+ * Credentials come from -u/-p or a corpus file (-c) of "user password"
+ * lines; with -m a percentage of the requests is sent with a password
+ * never used before, which neither authenticates nor hits a cache.
+ */
+
+#define BENCH_DEFAULT_REQUESTS 1000
+#define BENCH_LINE_LEN 512
+
+typedef struct {
+    char *user;
+    char *password;
+} bench_cred;
+
+/* what a client reports back to the parent, followed by its latencies */
+typedef struct {
+    unsigned long requests, ok, no, errors;
+    double start, end;			/* seconds */
+} bench_result;
+
+static bench_cred *corpus = NULL;
+static int ncorpus = 0;
+
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* read "user password" lines, skipping empty ones and comments */
+static int bench_load_corpus(const char *file)
+{
+    FILE *f;
+    char line[BENCH_LINE_LEN];
+    char *user, *password;
+    int alloc = 0;
+
+    f = fopen(file, "r");
+    if (f == NULL) {
+	perror(file);
+	return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+	user = strtok(line, " \t\r\n");
+	if (user == NULL || *user == '#')
+	    continue;
+	password = strtok(NULL, "\r\n");
+	if (password == NULL)
+	    password = "";
+	while (*password == ' ' || *password == '\t')
+	    password++;
+	if (ncorpus == alloc) {
+	    alloc = alloc ? 2 * alloc : 64;
+	    corpus = realloc(corpus, alloc * sizeof(*corpus));
+	    if (corpus == NULL) {
+		fprintf(stderr, "out of memory\n");
+		fclose(f);
+		return -1;
+	    }
+	}
+	corpus[ncorpus].user = strdup(user);
+	corpus[ncorpus].password = strdup(password);
+	if (!corpus[ncorpus].user || !corpus[ncorpus].password) {
+	    fprintf(stderr, "out of memory\n");
+	    fclose(f);
+	    return -1;
+	}
+	ncorpus++;
+    }
+    fclose(f);
+    if (ncorpus == 0) {
+	fprintf(stderr, "%s: no credentials\n", file);
+	return -1;
+    }
+    return 0;
+}
+
+#ifndef USE_DOORS
+static int bench_connect(const char *pwpath)
+{
+    struct sockaddr_un srvaddr;
+    int s;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1)
+	return -1;
+    memset((char *)&srvaddr, 0, sizeof(srvaddr));
+    srvaddr.sun_family = AF_UNIX;
+    strncpy(srvaddr.sun_path, pwpath, sizeof(srvaddr.sun_path) - 1);
+    if (connect(s, (struct sockaddr *) &srvaddr, sizeof(srvaddr)) == -1) {
+	close(s);
+	return -1;
+    }
+    return s;
+}
+
+/* read a counted length reply */
+static int bench_reply(int s, char *response, size_t rsize)
+{
+    unsigned short count;
+    char discard[256];
+    unsigned n;
+
+    if (retry_read(s, &count, sizeof(count)) < (int) sizeof(count))
+	return -1;
+    count = ntohs(count);
+    n = count < rsize - 1 ? count : rsize - 1;
+    if (retry_read(s, response, n) < (int) n)
+	return -1;
+    response[n] = '\0';
+    for (count -= n; count > 0; count -= n) {
+	n = count < sizeof(discard) ? count : sizeof(discard);
+	if (retry_read(s, discard, n) < (int) n)
+	    return -1;
+    }
+    return 0;
+}
+
+/* switch a connection to pipelined requests, see README.ipc */
+static int bench_pipeline(const char *pwpath)
+{
+    char query[64], response[64];
+    struct iovec iov[1];
+    int qlen, s;
+
+    s = bench_connect(pwpath);
+    if (s == -1)
+	return -1;
+    qlen = build_query(query, sizeof(query), "", PIPELINE_HELLO, "", "");
+    iov[0].iov_base = query;
+    iov[0].iov_len = qlen;
+    if (retry_writev(s, iov, 1) == -1 ||
+	bench_reply(s, response, sizeof(response)) == -1 ||
+	strcmp(response, PIPELINE_OK)) {
+	close(s);
+	return -1;
+    }
+    return s;
+}
+#endif /* !USE_DOORS */
+
+/* one request; on a pipelined connection if *sock is open */
+static int bench_request(const char *pwpath, int *sock, unsigned tag,
+			 char *query, int qlen, char *response, size_t rsize)
+{
+#ifdef USE_DOORS
+    door_arg_t arg;
+    int s;
+
+    s = open(pwpath, O_RDONLY);
+    if (s < 0)
+	return -1;
+    arg.data_ptr = query;
+    arg.data_size = qlen;
+    arg.desc_ptr = NULL;
+    arg.desc_num = 0;
+    arg.rbuf = response;
+    arg.rsize = rsize - 1;
+    if (door_call(s, &arg) != 0 || arg.data_size >= rsize) {
+	close(s);
+	return -1;
+    }
+    if (arg.rbuf != response) {
+	memcpy(response, arg.rbuf, arg.data_size);
+	munmap(arg.rbuf, arg.rsize);
+    }
+    response[arg.data_size] = '\0';
+    close(s);
+    return 0;
+#else
+    struct iovec iov[2];
+    unsigned int ntag, rtag;
+    int s, rc;
+
+    if (*sock == -1) {
+	s = bench_connect(pwpath);
+	if (s == -1)
+	    return -1;
+	iov[0].iov_base = query;
+	iov[0].iov_len = qlen;
+	rc = retry_writev(s, iov, 1);
+	if (rc != -1)
+	    rc = bench_reply(s, response, rsize);
+	close(s);
+	return rc;
+    }
+
+    ntag = htonl(tag);
+    iov[0].iov_base = (void *) &ntag;
+    iov[0].iov_len = sizeof(ntag);
+    iov[1].iov_base = query;
+    iov[1].iov_len = qlen;
+    if (retry_writev(*sock, iov, 2) == -1 ||
+	retry_read(*sock, &rtag, sizeof(rtag)) < (int) sizeof(rtag) ||
+	rtag != ntag ||
+	bench_reply(*sock, response, rsize) == -1) {
+	close(*sock);
+	*sock = -1;
+	return -1;
+    }
+    return 0;
+#endif /* USE_DOORS */
+}
+
+/* a client: send requests until the count or the time is up */
+static void bench_client(int id, int out, const char *pwpath,
+			 const char *service, const char *realm,
+			 int clients, unsigned long requests, double duration,
+			 int miss, int keep)
+{
+    bench_result res;
+    unsigned *lat = NULL;
+    unsigned long alloc = 0, i;
+    char query[8192], response[1024], badpw[64];
+    const char *password;
+    bench_cred *cred;
+    unsigned seed;
+    double t0, t1, deadline;
+    int sock = -1, qlen;
+
+    memset(&res, 0, sizeof(res));
+    seed = (unsigned) getpid();
+    res.start = bench_now();
+    deadline = res.start + duration;
+
+#ifndef USE_DOORS
+    if (keep && (sock = bench_pipeline(pwpath)) == -1 && id == 0)
+	fprintf(stderr, "saslauthd doesn't pipeline, using a connection per request\n");
+#endif
+
+    for (i = 0; duration > 0 ? bench_now() < deadline : i < requests; i++) {
+	cred = &corpus[(id + i * clients) % ncorpus];
+	password = cred->password;
+	seed = seed * 1103515245 + 12345;
+	if (miss > 0 && (int) ((seed >> 16) % 100) < miss) {
+	    snprintf(badpw, sizeof(badpw), "bench-miss-%d-%lu", (int) getpid(), i);
+	    password = badpw;
+	}
+	qlen = build_query(query, sizeof(query), cred->user, password,
+			   service, realm);
+
+	t0 = bench_now();
+	if (qlen == -1 ||
+	    bench_request(pwpath, &sock, i, query, qlen,
+			  response, sizeof(response)) == -1) {
+	    res.errors++;
+#ifndef USE_DOORS
+	    if (keep && sock == -1)
+		sock = bench_pipeline(pwpath);
+#endif
+	} else if (!strncmp(response, "OK", 2)) {
+	    res.ok++;
+	} else {
+	    res.no++;
+	}
+	t1 = bench_now();
+
+	if (res.requests == alloc) {
+	    alloc = alloc ? 2 * alloc : 1024;
+	    lat = realloc(lat, alloc * sizeof(*lat));
+	    if (lat == NULL)
+		_exit(1);
+	}
+	lat[res.requests++] = (unsigned) ((t1 - t0) * 1e6);
+    }
+    res.end = bench_now();
+    if (sock != -1)
+	close(sock);
+
+    if (write(out, &res, sizeof(res)) != sizeof(res) ||
+	(res.requests &&
+	 write(out, lat, res.requests * sizeof(*lat)) !=
+	 (ssize_t) (res.requests * sizeof(*lat))))
+	_exit(1);
+    _exit(0);
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(unsigned *lat, unsigned long n, double p)
+{
+    unsigned long i = (unsigned long) (p / 100 * n);
+
+    return lat[i < n ? i : n - 1] / 1000.0;
+}
+
+static int bench(const char *path, const char *service, const char *realm,
+		 int clients, unsigned long requests, double duration,
+		 int miss, int keep)
+{
+    char pwpath[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int *fds;
+    pid_t pid;
+    bench_result res, total;
+    unsigned *lat = NULL;
+    unsigned long n = 0, got;
+    double start = 0, end = 0, sum = 0;
+    int i, p[2];
+
+    if (path) {
+	strncpy(pwpath, path, sizeof(pwpath) - 1);
+	pwpath[sizeof(pwpath) - 1] = '\0';
+    } else {
+	snprintf(pwpath, sizeof(pwpath), "%s/mux", PATH_SASLAUTHD_RUNDIR);
+    }
+    if (!service) service = "imap";
+    if (!realm) realm = "";
+
+    fds = calloc(clients, sizeof(*fds));
+    if (fds == NULL) {
+	fprintf(stderr, "out of memory\n");
+	return -1;
+    }
+
+    for (i = 0; i < clients; i++) {
+	if (pipe(p) == -1 || (pid = fork()) == -1) {
+	    perror("fork");
+	    return -1;
+	}
+	if (pid == 0) {
+	    close(p[0]);
+	    bench_client(i, p[1], pwpath, service, realm, clients,
+			 requests / clients + (i < (int) (requests % clients)),
+			 duration, miss, keep);
+	}
+	close(p[1]);
+	fds[i] = p[0];
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < clients; i++) {
+	if (retry_read(fds[i], &res, sizeof(res)) < (int) sizeof(res)) {
+	    fprintf(stderr, "client %d failed\n", i);
+	    close(fds[i]);
+	    continue;
+	}
+	lat = realloc(lat, (n + res.requests + 1) * sizeof(*lat));
+	if (lat == NULL) {
+	    fprintf(stderr, "out of memory\n");
+	    return -1;
+	}
+	got = res.requests * sizeof(*lat);
+	if (got && retry_read(fds[i], lat + n, got) < (int) got) {
+	    fprintf(stderr, "client %d failed\n", i);
+	    close(fds[i]);
+	    continue;
+	}
+	close(fds[i]);
+	n += res.requests;
+	total.ok += res.ok;
+	total.no += res.no;
+	total.errors += res.errors;
+	if (start == 0 || res.start < start) start = res.start;
+	if (res.end > end) end = res.end;
+    }
+    while (wait(NULL) > 0)
+	;
+
+    if (n == 0) {
+	fprintf(stderr, "no requests completed\n");
+	return -1;
+    }
+
+    qsort(lat, n, sizeof(*lat), bench_compare);
+    for (got = 0; got < n; got++)
+	sum += lat[got];
+
+    printf("%d clients, %lu requests (%lu OK, %lu NO, %lu errors) in %.3f s: %.0f requests/s\n",
+	   clients, n, total.ok, total.no, total.errors, end - start,
+	   n / (end - start));
+    printf("latency ms: min %.3f avg %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+	   lat[0] / 1000.0, sum / n / 1000.0,
+	   bench_percentile(lat, n, 50), bench_percentile(lat, n, 90),
+	   bench_percentile(lat, n, 99), bench_percentile(lat, n, 99.9),
+	   lat[n - 1] / 1000.0);
+
+    free(lat);
+    free(fds);
+    return total.errors ? -1 : 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -258,9 +677,31 @@ main(int argc, char *argv[])
   int result;
   char *user_domain = NULL;
   int repeat = 0;
+  int clients = 0, miss = 0, keep = 0;
+  unsigned long requests = BENCH_DEFAULT_REQUESTS;
+  double duration = 0;
+  const char *corpus_file = NULL;
 
-  while ((c = getopt(argc, argv, "p:u:r:s:f:R:")) != EOF)
+  while ((c = getopt(argc, argv, "p:u:r:s:f:R:SB:n:t:c:m:k")) != EOF)
       switch (c) {
+      case 'B':
+	  clients = atoi(optarg);
+	  break;
+      case 'n':
+	  requests = strtoul(optarg, NULL, 10);
+	  break;
+      case 't':
+	  duration = atof(optarg);
+	  break;
+      case 'c':
+	  corpus_file = optarg;
+	  break;
+      case 'm':
+	  miss = atoi(optarg);
+	  break;
+      case 'k':
+	  keep = 1;
+	  break;
       case 'R':
 	  repeat = atoi(optarg);
 	  break;
@@ -279,27 +720,55 @@ main(int argc, char *argv[])
       case 'p':
 	  password = optarg;
 	  break;
+      case 'S':
+	  user = "";
+	  password = STATS_REQUEST;
+	  print_response = 1;
+	  break;
       default:
 	  flag_error = 1;
 	  break;
     }
 
-  if (!user || !password)
+  if ((!user || !password) && !(clients > 0 && corpus_file))
+    flag_error = 1;
+  if (clients < 0 || miss < 0 || miss > 100)
     flag_error = 1;
 
   if (flag_error) {
     (void)fprintf(stderr,
 		  "%s: usage: %s -u username -p password\n"
 		  "              [-r realm] [-s servicename]\n"
-		  "              [-f socket path] [-R repeatnum]\n",
-		  argv[0], argv[0]);
+		  "              [-f socket path] [-R repeatnum]\n"
+		  "       %s -S [-f socket path]\n"
+		  "       %s -B clients {-u username -p password | -c corpus}\n"
+		  "              [-n requests | -t seconds] [-m miss%%] [-k]\n"
+		  "              [-r realm] [-s servicename] [-f socket path]\n",
+		  argv[0], argv[0], argv[0], argv[0]);
     exit(1);
   }
 
+  if (clients > 0) {
+      if (corpus_file) {
+	  if (bench_load_corpus(corpus_file) == -1)
+	      exit(1);
+      } else {
+	  corpus = malloc(sizeof(*corpus));
+	  if (corpus == NULL)
+	      exit(1);
+	  corpus[0].user = (char *) user;
+	  corpus[0].password = (char *) password;
+	  ncorpus = 1;
+      }
+      return bench(path, service, realm, clients, requests, duration,
+		   miss, keep) ? 1 : 0;
+  }
+
   if (!repeat) repeat = 1;
   for (c = 0; c < repeat; c++) {
       /* saslauthd-authenticated login */
-      printf("%d: ", c);
+      if (!print_response)
+	  printf("%d: ", c);
       result = saslauthd_verify_password(path, user, password, service, realm);
   }
   return result;
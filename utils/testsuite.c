@@ -79,6 +79,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/file.h>
+#include <sys/time.h>
 #endif
 
 #ifdef WIN32
@@ -108,6 +109,9 @@ int proxyflag = 0;
 
 static const char *gssapi_service = "host";
 
+/* server_conn_pool option, for the connection pool test and benchmark */
+static const char *conn_pool = NULL;
+
 /* our types of failures */
 typedef enum {
     NOTHING = 0,
@@ -471,6 +475,11 @@ int good_getopt(void *context __attribute__((unused)),
 	if (len)
 	    *len = (unsigned) strlen(*result);
 	return SASL_OK;
+    } else if (!strcmp(option, "server_conn_pool") && conn_pool) {
+	*result = conn_pool;
+	if (len)
+	    *len = (unsigned) strlen(*result);
+	return SASL_OK;
     }
 
     return SASL_FAIL;
@@ -886,6 +895,207 @@ void test_listmech(void)
 
 }
 
+/*
+ * A do-nothing mechanism, for checking that sasl_server_add_plugin()
+ * shows up in sasl_listmech()
+ */
+
+static int listmech_test_mech_new(void *glob_context __attribute__((unused)),
+				  sasl_server_params_t *sparams __attribute__((unused)),
+				  const char *challenge __attribute__((unused)),
+				  unsigned challen __attribute__((unused)),
+				  void **conn_context __attribute__((unused)))
+{
+    return SASL_FAIL;
+}
+
+static int listmech_test_mech_step(void *conn_context __attribute__((unused)),
+				   sasl_server_params_t *sparams __attribute__((unused)),
+				   const char *clientin __attribute__((unused)),
+				   unsigned clientinlen __attribute__((unused)),
+				   const char **serverout __attribute__((unused)),
+				   unsigned *serveroutlen __attribute__((unused)),
+				   sasl_out_params_t *oparams __attribute__((unused)))
+{
+    return SASL_FAIL;
+}
+
+static sasl_server_plug_t listmech_test_plugins[] = 
+{
+    {
+	"LISTMECH-TEST",		/* mech_name */
+	0,				/* max_ssf */
+	0,				/* security_flags */
+	0,				/* features */
+	NULL,				/* glob_context */
+	&listmech_test_mech_new,	/* mech_new */
+	&listmech_test_mech_step,	/* mech_step */
+	NULL,				/* mech_dispose */
+	NULL,				/* mech_free */
+	NULL,				/* setpass */
+	NULL,				/* user_query */
+	NULL,				/* idle */
+	NULL,				/* mech_avail */
+	NULL				/* spare */
+    }
+};
+
+static int listmech_test_plug_init(const sasl_utils_t *utils __attribute__((unused)),
+				   int maxversion,
+				   int *out_version,
+				   sasl_server_plug_t **pluglist,
+				   int *plugcount)
+{
+    if (maxversion < SASL_SERVER_PLUG_VERSION) return SASL_BADVERS;
+
+    *out_version = SASL_SERVER_PLUG_VERSION;
+    *pluglist = listmech_test_plugins;
+    *plugcount = 1;
+
+    return SASL_OK;
+}
+
+/* the list a new server connection offers with the given min_ssf and
+ * security_flags, as " MECH1 MECH2 ", in a buffer the caller frees */
+static char *listmech_with_props(sasl_ssf_t min_ssf,
+				 unsigned security_flags,
+				 int *count)
+{
+    sasl_conn_t *saslconn;
+    sasl_security_properties_t props;
+    const char *str;
+    unsigned len;
+    char *ret;
+    int again;
+
+    memset(&props, 0, sizeof(props));
+    props.min_ssf = min_ssf;
+    props.max_ssf = 256;
+    props.maxbufsize = 8192;
+    props.security_flags = security_flags;
+
+    if (sasl_server_new("rcmd", myhostname,
+			NULL, NULL, NULL, NULL, 0, 
+			&saslconn) != SASL_OK)
+	fatal("can't sasl_server_new");
+
+    if (sasl_setprop(saslconn, SASL_SEC_PROPS, &props) != SASL_OK)
+	fatal("sasl_setprop(SASL_SEC_PROPS) failed");
+
+    if (sasl_listmech(saslconn, NULL, " ", " ", " ",
+		      &str, &len, count) != SASL_OK)
+	fatal("Failed sasl_listmech()");
+
+    if (strlen(str) != len)
+	fatal("Length of string doesn't match what we were told");
+
+    ret = malloc(len + 1);
+    if (!ret) fatal("no memory for the mechanism list");
+    strcpy(ret, str);
+
+    /* asking again on the same connection gives the same answer */
+    if (sasl_listmech(saslconn, NULL, " ", " ", " ",
+		      &str, &len, &again) != SASL_OK)
+	fatal("Failed sasl_listmech() the second time");
+
+    if (strcmp(str, ret) || strlen(str) != len || again != *count) {
+	printf("first: %s\nsecond: %s\n", ret, str);
+	fatal("sasl_listmech() changed its mind with the same policy");
+    }
+
+    sasl_dispose(&saslconn);
+
+    return ret;
+}
+
+/*
+ * Tests that sasl_listmech() answers follow the security properties
+ * and the plugins on offer, even though they are kept around
+ */
+
+void test_listmech_cache(void)
+{
+    char *deflist, *samelist, *pluglist, *noplainlist, *stronglist;
+    char *fresh;
+    int defcount, count, plugcount, noplaincount, strongcount;
+
+    if (sasl_server_init(emptysasl_cb,"TestSuite")!=SASL_OK)
+	fatal("can't sasl_server_init");
+
+    deflist = listmech_with_props(0, 0, &defcount);
+    printf(" default:%s(%d)\n", deflist, defcount);
+
+    /* a second connection with the same policy gets the same answer */
+    samelist = listmech_with_props(0, 0, &count);
+    if (strcmp(samelist, deflist) || count != defcount)
+	fatal("sasl_listmech() differs between connections with the same policy");
+    free(samelist);
+
+    /* a new plugin is offered right away */
+    if (sasl_server_add_plugin("LISTMECH-TEST",
+			       &listmech_test_plug_init) != SASL_OK)
+	fatal("sasl_server_add_plugin() failed");
+
+    pluglist = listmech_with_props(0, 0, &plugcount);
+    printf(" with LISTMECH-TEST:%s(%d)\n", pluglist, plugcount);
+    if (strstr(deflist, " LISTMECH-TEST ")
+	|| !strstr(pluglist, " LISTMECH-TEST ")
+	|| plugcount != defcount + 1)
+	fatal("sasl_listmech() doesn't offer a newly added plugin");
+
+    /* no plaintext mechanisms, which LISTMECH-TEST counts as */
+    noplainlist = listmech_with_props(0, SASL_SEC_NOPLAINTEXT, &noplaincount);
+    printf(" noplaintext:%s(%d)\n", noplainlist, noplaincount);
+    if (strstr(noplainlist, " LISTMECH-TEST ")
+	|| strstr(noplainlist, " PLAIN ") || strstr(noplainlist, " LOGIN ")
+	|| noplaincount >= plugcount)
+	fatal("sasl_listmech() ignored SASL_SEC_NOPLAINTEXT");
+
+    /* only mechanisms with a strong enough security layer */
+    stronglist = listmech_with_props(56, 0, &strongcount);
+    printf(" min_ssf 56:%s(%d)\n", stronglist, strongcount);
+    if (strstr(stronglist, " LISTMECH-TEST ")
+	|| strstr(stronglist, " PLAIN ") || strstr(stronglist, " ANONYMOUS ")
+	|| strongcount >= plugcount)
+	fatal("sasl_listmech() ignored min_ssf");
+
+    /* the answers match the ones worked out from scratch */
+    sasl_done();
+    if (sasl_server_init(emptysasl_cb,"TestSuite")!=SASL_OK)
+	fatal("can't sasl_server_init");
+
+    fresh = listmech_with_props(0, 0, &count);
+    if (strcmp(fresh, deflist) || count != defcount)
+	fatal("sasl_listmech() differs from a fresh start");
+    free(fresh);
+
+    if (sasl_server_add_plugin("LISTMECH-TEST",
+			       &listmech_test_plug_init) != SASL_OK)
+	fatal("sasl_server_add_plugin() failed");
+
+    fresh = listmech_with_props(56, 0, &count);
+    if (strcmp(fresh, stronglist) || count != strongcount)
+	fatal("sasl_listmech() with min_ssf 56 differs from a fresh start");
+    free(fresh);
+
+    fresh = listmech_with_props(0, SASL_SEC_NOPLAINTEXT, &count);
+    if (strcmp(fresh, noplainlist) || count != noplaincount)
+	fatal("sasl_listmech() with SASL_SEC_NOPLAINTEXT differs from a fresh start");
+    free(fresh);
+
+    fresh = listmech_with_props(0, 0, &count);
+    if (strcmp(fresh, pluglist) || count != plugcount)
+	fatal("sasl_listmech() with LISTMECH-TEST differs from a fresh start");
+    free(fresh);
+
+    sasl_done();
+
+    free(deflist);
+    free(pluglist);
+    free(noplainlist);
+    free(stronglist);
+}
+
 /*
  * Perform tests on the random utilities
  */
@@ -2298,6 +2508,11 @@ void testseclayer(char *mech, void *rock __attribute__((unused)))
     unsigned i;
     const sasl_ssf_t *this_ssf;
     unsigned outlen = 0, outlen2 = 0, totlen = 0;
+    const unsigned *maxoutbuf;
+    struct iovec invec[2];
+    const struct iovec *outvec;
+    unsigned outnum, biglen, j;
+    char *big, *bigout;
     
     printf("%s --> security layer start\n", mech);
 
@@ -2504,6 +2719,59 @@ void testseclayer(char *mech, void *rock __attribute__((unused)))
 	fatal("did not get correct string back (2 blocks, 1 split)");
     }
 
+    cleanup_auth(&sconn, &cconn);
+
+    /* Several packets, kept apart by sasl_encodev_iov */
+    if(doauth(mech, &sconn, &cconn, test_props[i], NULL, 0) != SASL_OK) {
+	fatal("doauth failed in testseclayer");
+    }
+
+    if(sasl_getprop(cconn, SASL_MAXOUTBUF,
+		    (const void **)&maxoutbuf) != SASL_OK) {
+	fatal("sasl_getprop(SASL_MAXOUTBUF) in testseclayer");
+    }
+
+    biglen = 3 * *maxoutbuf + 100;
+    big = malloc(biglen);
+    bigout = malloc(biglen);
+    if(!big || !bigout) fatal("no memory in testseclayer");
+    for(j = 0; j < biglen; j++) big[j] = 'a' + (j % 26);
+
+    invec[0].iov_base = big;
+    invec[0].iov_len = 7;
+    invec[1].iov_base = big + 7;
+    invec[1].iov_len = biglen - 7;
+
+    result = sasl_encodev_iov(cconn, invec, 2, &outvec, &outnum);
+    if(result != SASL_OK) {
+	fatal("sasl_encodev_iov failure");
+    }
+    if(*this_ssf != 0 && outnum < 4) {
+	fatal("sasl_encodev_iov did not split at maxoutbuf");
+    }
+
+    totlen = 0;
+    for(j = 0; j < outnum; j++) {
+	result = sasl_decode(sconn, outvec[j].iov_base,
+			     (unsigned) outvec[j].iov_len, &out, &outlen);
+	if(result != SASL_OK) {
+	    printf("Failed with: %s\n", sasl_errstring(result, NULL, NULL));
+	    fatal("sasl_decode failure (sasl_encodev_iov)");
+	}
+	if(totlen + outlen > biglen) {
+	    fatal("too much data back (sasl_encodev_iov)");
+	}
+	memcpy(bigout + totlen, out, outlen);
+	totlen += outlen;
+    }
+
+    if(totlen != biglen || memcmp(big, bigout, biglen)) {
+	fatal("did not get correct data back (sasl_encodev_iov)");
+    }
+
+    free(big);
+    free(bigout);
+
     cleanup_auth(&sconn, &cconn);
     
     } /* for each properties type we want to test */
@@ -2677,6 +2945,94 @@ void test_proxypolicy()
     foreach_mechanism((foreach_t *) &do_proxypolicy_test,NULL);
 }
 
+/* a recycled connection must not remember anything of its previous user */
+void check_conn_clean(sasl_conn_t *conn)
+{
+    const char *str;
+    const sasl_ssf_t *ssf;
+    struct propctx *ctx;
+    const struct propval *pv;
+
+    if(sasl_getprop(conn, SASL_USERNAME, (const void **)&str) != SASL_NOTDONE)
+	fatal("recycled connection still has a SASL_USERNAME");
+    if(sasl_getprop(conn, SASL_AUTHUSER, (const void **)&str) != SASL_NOTDONE)
+	fatal("recycled connection still has a SASL_AUTHUSER");
+    if(sasl_getprop(conn, SASL_MECHNAME, (const void **)&str) != SASL_NOTDONE)
+	fatal("recycled connection still has a SASL_MECHNAME");
+    if(sasl_getprop(conn, SASL_SSF, (const void **)&ssf) != SASL_OK
+       || *ssf != 0)
+	fatal("recycled connection still has a SASL_SSF");
+    if(sasl_getprop(conn, SASL_AUTH_EXTERNAL, (const void **)&str) != SASL_OK
+       || str != NULL)
+	fatal("recycled connection still has a SASL_AUTH_EXTERNAL");
+
+    ctx = sasl_auxprop_getctx(conn);
+    if(!ctx) fatal("recycled connection has no auxprop context");
+    for(pv = prop_get(ctx); pv && pv->name; pv++) {
+	if(pv->values || pv->nvalues || pv->valsize)
+	    fatal("recycled connection still has auxprop values");
+    }
+}
+
+void do_conn_pool_test(char *mech, void *rock __attribute__((unused)))
+{
+    sasl_conn_t *sconn, *cconn, *recycled;
+    const char *user;
+    struct propctx *ctx;
+    const char *pool_props[] = { "poolTestProp", NULL };
+
+    printf("%s --> start\n", mech);
+
+    /* hold the server open across the doauth()/cleanup_auth() pairs,
+     * which would otherwise drop the pool in sasl_done() */
+    conn_pool = "4";
+    if(sasl_server_init(goodsaslproxy_cb, "TestSuite") != SASL_OK)
+	fatal("sasl_server_init failed in do_conn_pool_test");
+
+    /* user A authorizes as proxyasname */
+    proxyflag = 1;
+    if(doauth(mech, &sconn, &cconn, &security_props, NULL, 0) != SASL_OK)
+	fatal("doauth failed in do_conn_pool_test (user A)");
+    proxyflag = 0;
+
+    /* set_properties() gave it a SASL_AUTH_EXTERNAL as well */
+    ctx = sasl_auxprop_getctx(sconn);
+    if(!ctx || prop_request(ctx, pool_props) != SASL_OK
+       || prop_set(ctx, pool_props[0], "A", 1) != SASL_OK)
+	fatal("can't set an auxprop value in do_conn_pool_test");
+    recycled = sconn;
+    cleanup_auth(&cconn, &sconn);
+
+    if(sasl_server_new("rcmd", myhostname, NULL, NULL, NULL, NULL, 0,
+		       &sconn) != SASL_OK)
+	fatal("sasl_server_new failed in do_conn_pool_test");
+    if(sconn != recycled)
+	fatal("server_conn_pool did not recycle the connection");
+    check_conn_clean(sconn);
+    sasl_dispose(&sconn);
+
+    /* user B authenticates on the same connection, as itself */
+    if(doauth(mech, &sconn, &cconn, &security_props, NULL, 0) != SASL_OK)
+	fatal("doauth failed in do_conn_pool_test (user B)");
+    if(sconn != recycled)
+	fatal("server_conn_pool did not recycle the connection (user B)");
+    if(sasl_getprop(sconn, SASL_USERNAME, (const void **)&user) != SASL_OK)
+	fatal("getprop failed in do_conn_pool_test");
+    if(!strcmp(user, proxyasname))
+	fatal("user B got the authorization name of user A");
+    cleanup_auth(&cconn, &sconn);
+
+    sasl_done();
+    conn_pool = NULL;
+
+    printf("%s --> successful result\n", mech);
+}
+
+void test_conn_pool()
+{
+    foreach_mechanism((foreach_t *) &do_conn_pool_test, NULL);
+}
+
 void test_all_corrupt() 
 {
     tosend_t tosend;
@@ -2908,6 +3264,82 @@ void test_checkpass(void)
 
 
 
+/*
+ * Connection benchmark: allocations and time per sasl_server_new() and
+ * sasl_dispose(), without and with the connection pool
+ */
+
+unsigned long bench_allocs = 0;
+
+void *bench_malloc(size_t size)
+{
+    bench_allocs++;
+    return malloc(size);
+}
+
+void *bench_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return calloc(nmemb, size);
+}
+
+void *bench_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return realloc(ptr, size);
+}
+
+void bench_conns(unsigned count)
+{
+    const char *pools[] = { NULL, "16" };
+    sasl_conn_t *conn;
+    struct timeval start, end;
+    unsigned long allocs;
+    double usec;
+    unsigned lup, i;
+
+    sasl_set_mutex((sasl_mutex_alloc_t *) &my_mutex_new,
+		   (sasl_mutex_lock_t *) &my_mutex_lock,
+		   (sasl_mutex_unlock_t *) &my_mutex_unlock,
+		   (sasl_mutex_free_t *) &my_mutex_dispose);
+    sasl_set_alloc((sasl_malloc_t *) bench_malloc,
+		   (sasl_calloc_t *) bench_calloc,
+		   (sasl_realloc_t *) bench_realloc,
+		   (sasl_free_t *) free);
+
+    for (i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+	conn_pool = pools[i];
+
+	if (sasl_server_init(goodsasl_cb, "TestSuite") != SASL_OK)
+	    fatal("can't sasl_server_init");
+
+	/* the first connection fills the pool */
+	if (sasl_server_new("rcmd", NULL, NULL, NULL, NULL, NULL, 0,
+			    &conn) != SASL_OK)
+	    fatal("sasl_server_new failed");
+	sasl_dispose(&conn);
+
+	allocs = bench_allocs;
+	gettimeofday(&start, NULL);
+	for (lup = 0; lup < count; lup++) {
+	    if (sasl_server_new("rcmd", NULL, NULL, NULL, NULL, NULL, 0,
+				&conn) != SASL_OK)
+		fatal("sasl_server_new failed");
+	    sasl_dispose(&conn);
+	}
+	gettimeofday(&end, NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1e6
+	    + (end.tv_usec - start.tv_usec);
+	printf("server_conn_pool %-2s: %.1f allocations, %.0f ns per connection\n",
+	       conn_pool ? conn_pool : "0",
+	       (double) (bench_allocs - allocs) / count,
+	       usec * 1000 / count);
+
+	sasl_done();
+    }
+}
+
 void notes(void)
 {
     printf("NOTE:\n");
@@ -2924,7 +3356,7 @@ void notes(void)
 void usage(void)
 {
     printf("Usage:\n" \
-           " testsuite [-g name] [-s seed] [-r tests] -a -M\n" \
+           " testsuite [-g name] [-s seed] [-r tests] [-B count] -a -M\n" \
            "    g -- gssapi service name to use (default: host)\n" \
 	   "    r -- # of random tests to do (default: 25)\n" \
 	   "    a -- do all corruption tests (and ignores random ones unless -r specified)\n" \
@@ -2932,6 +3364,7 @@ void usage(void)
 	   "    h -- show this screen\n" \
            "    s -- random seed to use\n" \
 	   "    M -- detailed memory debugging ON\n" \
+	   "    B -- only benchmark count server connections\n" \
            );
 }
 
@@ -2941,6 +3374,7 @@ int main(int argc, char **argv)
     int random_tests = -1;
     int do_all = 0;
     int skip_do_correct = 0;
+    unsigned bench = 0;
     unsigned int seed = (unsigned int) time(NULL);
 #ifdef WIN32
   /* initialize winsock */
@@ -2953,7 +3387,7 @@ int main(int argc, char **argv)
     }
 #endif
 
-    while ((c = getopt(argc, argv, "Ms:g:r:han")) != EOF)
+    while ((c = getopt(argc, argv, "Ms:g:r:hanB:")) != EOF)
 	switch (c) {
 	case 'M':
 	    DETAILED_MEMORY_DEBUGGING = 1;
@@ -2974,6 +3408,9 @@ int main(int argc, char **argv)
 	case 'n':
 	    skip_do_correct = 1;
 	    break;
+	case 'B':
+	    bench = atoi(optarg);
+	    break;
 	case 'h':
 	    usage();
 	    exit(0);
@@ -2984,6 +3421,11 @@ int main(int argc, char **argv)
 	    break;
     }
 
+    if (bench) {
+	bench_conns(bench);
+	exit(0);
+    }
+
     g_secret = malloc(sizeof(sasl_secret_t) + strlen(password));
     g_secret->len = (unsigned) strlen(password);
     strcpy(g_secret->data, password);
@@ -3031,6 +3473,11 @@ int main(int argc, char **argv)
     if(mem_stat() != SASL_OK) fatal("memory error");
     printf("Testing sasl_listmech()... ok\n");
 
+    printf("Testing sasl_listmech() policy changes...\n");
+    test_listmech_cache();
+    if(mem_stat() != SASL_OK) fatal("memory error");
+    printf("Testing sasl_listmech() policy changes... ok\n");
+
     printf("Testing serverstart...");
     test_serverstart();
     if(mem_stat() != SASL_OK) fatal("memory error");
@@ -3115,6 +3562,10 @@ int main(int argc, char **argv)
     test_proxypolicy();
     printf("Tests of Proxy Policy...ok\n");
 
+    printf("Testing server connection pool...\n");
+    test_conn_pool();
+    printf("Tests of server connection pool...ok\n");
+
     printf("Testing security layer...\n");
     test_seclayer();
     printf("Tests of security layer... ok\n");